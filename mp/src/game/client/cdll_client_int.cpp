@@ -1095,7 +1095,13 @@ int CHLClient::Init( CreateInterfaceFn appSystemFactory, CreateInterfaceFn physi
 
 #ifdef STEAMNETWORKINGSOCKETS_OPENSOURCE
 	SteamDatagramErrMsg errMsg;
-	if (!GameNetworkingSockets_Init(nullptr, errMsg))
+
+	// Identify ourselves by Steam ID, the matchmaking server keeps ratings under it
+	SteamNetworkingIdentity identity;
+	identity.Clear();
+	if (steamapicontext && steamapicontext->SteamUser())
+		identity.SetSteamID(steamapicontext->SteamUser()->GetSteamID());
+	if (!GameNetworkingSockets_Init(identity.IsInvalid() ? nullptr : &identity, errMsg))
 		Warning("GameNetworkingSockets_Init failed.  %s", errMsg);
 #else
 	// Disable authentication when running with Steam, for this
@@ -7,12 +7,14 @@
 #include "cbase.h"
 #include <steam/steamnetworkingsockets.h>
 #include <steam/isteamnetworkingutils.h>
+#include <steam/isteammatchmaking.h>
 #include <convar.h>
-#include "tier0/valve_minmax_off.h"
-#include <queue>
-#include "tier0/valve_minmax_on.h"
+#include "igamesystem.h"
+#include "tier0/tslist.h"
 #include <cctype>
+#include "tier0/valve_minmax_off.h"
 #include <algorithm>
+#include "tier0/valve_minmax_on.h"
 #include "../../mm_server/mm_shared.h"
 
 #define STEAMNETWORKINGSOCKETS_OPENSOURCE
@@ -25,6 +27,23 @@ const uint16 DEFAULT_SERVER_PORT = 27055;
 
 ConVar mm_auto_start_game("mm_auto_start_game", "1", FCVAR_CLIENTDLL | FCVAR_ARCHIVE);
 
+// Longest the chat thread sleeps when there is nothing to do.  While we are
+// waiting on the server for a match it checks more often, so we hear about
+// it right away, otherwise it mostly stays out of the game's way.
+const uint32 k_nMaxIdleWaitMS = 100;
+const uint32 k_nMaxIdleWaitBusyMS = 5;
+
+// How long we wait for game servers to answer a ping, and how old pings can get
+// before searching for a match measures them again
+const float k_flPingTimeout = 2.0f;
+const float k_flPingMaxAge = 300.0f;
+
+// When we lose the matchmaking server we try to get back in, right away at
+// first and then backing off, for as long as it keeps our lobby or queue place
+const float k_flReconnectDelayMin = 0.25f;
+const float k_flReconnectDelayMax = 4.0f;
+const float k_flResumeWindow = 30.0f;
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // Common stuff
@@ -53,12 +72,77 @@ static void InitSteamDatagramConnectionSockets()
 
 /////////////////////////////////////////////////////////////////////////////
 //
-// Non-blocking console user input.  Sort of.
-// Why is this so hard?
+// Queues between the game's main thread and the chat thread
+//
+// Console commands run on the main thread and are handed to the chat thread
+// as text, network events that need the engine go the other way and are run
+// from CMatchmakingClientSystem::Update once per frame.  Game server pings
+// are run by Steam on the main thread too, so the chat thread asks for them
+// as events and gets the results back in a queue of their own.  The queues
+// are lock free, so neither thread ever waits on the other.  Items are
+// copied in and out of the queue nodes, so they have to be plain old data.
 //
 /////////////////////////////////////////////////////////////////////////////
 
-std::queue< std::string > queueUserInput;
+struct MMCommand
+{
+	char m_szCommand[256];
+};
+
+enum MMEventType
+{
+	mm_event_start_game,	// m_szData is the game server address
+	mm_event_ping_server,	// m_server is to be pinged as part of round m_nPingRound
+	mm_event_cancel_pings,	// every ping of round m_nPingRound or before can go
+};
+
+struct MMEvent
+{
+	MMEventType m_eType;
+	char m_szData[64];
+	GameServerPing m_server;
+	uint32 m_nPingRound;
+};
+
+struct MMPingResult
+{
+	GameServerPing m_server;	// m_nPingMS is k_nPingUnknown if it didn't answer
+	uint32 m_nPingRound;
+};
+
+static CTSQueue< MMCommand > s_queueCommands;
+static CTSQueue< MMEvent > s_queueEvents;
+static CTSQueue< MMPingResult > s_queuePingResults;
+
+// Wakes up the chat thread when it has something to do
+static CThreadEvent s_eventWakeup;
+
+void MM_QueueCommand(const char *pszCommand)
+{
+	MMCommand command;
+	V_strncpy(command.m_szCommand, pszCommand, sizeof(command.m_szCommand));
+	s_queueCommands.PushItem(command);
+	s_eventWakeup.Set();
+}
+
+static void MM_PostEvent(MMEventType eType, const char *pszData)
+{
+	MMEvent event;
+	V_memset(&event, 0, sizeof(event));
+	event.m_eType = eType;
+	V_strncpy(event.m_szData, pszData, sizeof(event.m_szData));
+	s_queueEvents.PushItem(event);
+}
+
+static void MM_PostPingEvent(MMEventType eType, const GameServerPing &server, uint32 nPingRound)
+{
+	MMEvent event;
+	V_memset(&event, 0, sizeof(event));
+	event.m_eType = eType;
+	event.m_server = server;
+	event.m_nPingRound = nPingRound;
+	s_queueEvents.PushItem(event);
+}
 
 // You really gotta wonder what kind of pedantic garbage was
 // going through the minds of people who designed std::string
@@ -80,14 +164,14 @@ static inline void rtrim(std::string &s) {
 }
 
 
-// Read the next line of input from stdin, if anything is available.
+// Fetch the next console command, if anything is available.
 bool LocalUserInput_GetNext(std::string &result)
 {
 	bool got_input = false;
-	while (!queueUserInput.empty() && !got_input)
+	MMCommand command;
+	while (!got_input && s_queueCommands.PopItem(&command))
 	{
-		result = queueUserInput.front();
-		queueUserInput.pop();
+		result = command.m_szCommand;
 		ltrim(result);
 		rtrim(result);
 		got_input = !result.empty(); // ignore blank lines
@@ -95,6 +179,85 @@ bool LocalUserInput_GetNext(std::string &result)
 	return got_input;
 }
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// GameServerPinger
+//
+// Measures the ping to one game server.  Steam sends the server an A2S_INFO
+// query and times the answer for us.  ISteamMatchmakingServers isn't thread
+// safe and answers from RunCallbacks, so pingers are only ever created,
+// started, polled and deleted on the main thread, by CMatchmakingClientSystem.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class CGameServerPinger : public ISteamMatchmakingPingResponse
+{
+public:
+	CGameServerPinger(const GameServerPing &server, uint32 nPingRound)
+	{
+		m_server = server;
+		m_server.m_nPingMS = k_nPingUnknown;
+		m_nPingRound = nPingRound;
+		m_hQuery = HSERVERQUERY_INVALID;
+		m_bDone = true;
+	}
+
+	~CGameServerPinger()
+	{
+		Cancel();
+	}
+
+	void Start()
+	{
+		Cancel();
+		m_server.m_nPingMS = k_nPingUnknown;
+
+		// Steam can only ping IPv4 servers
+		SteamNetworkingIPAddr addr;
+		addr.Clear();
+		memcpy(addr.m_ipv6, m_server.m_ipv6, sizeof(addr.m_ipv6));
+		ISteamMatchmakingServers *pServers = steamapicontext ? steamapicontext->SteamMatchmakingServers() : nullptr;
+		if (!pServers || !addr.IsIPv4())
+			return;
+
+		m_bDone = false;
+		m_hQuery = pServers->PingServer(addr.GetIPv4(), m_server.m_nPort, this);
+		if (m_hQuery == HSERVERQUERY_INVALID)
+			m_bDone = true;
+	}
+
+	void Cancel()
+	{
+		if (!m_bDone && m_hQuery != HSERVERQUERY_INVALID && steamapicontext && steamapicontext->SteamMatchmakingServers())
+			steamapicontext->SteamMatchmakingServers()->CancelServerQuery(m_hQuery);
+		m_hQuery = HSERVERQUERY_INVALID;
+		m_bDone = true;
+	}
+
+	bool IsDone() const { return m_bDone; }
+	const GameServerPing &GetResult() const { return m_server; }
+	uint32 GetPingRound() const { return m_nPingRound; }
+
+	virtual void ServerResponded(gameserveritem_t &server)
+	{
+		m_server.m_nPingMS = (uint16)clamp(server.m_nPing, 0, k_nPingUnknown - 1);
+		m_hQuery = HSERVERQUERY_INVALID;
+		m_bDone = true;
+	}
+
+	virtual void ServerFailedToRespond()
+	{
+		m_hQuery = HSERVERQUERY_INVALID;
+		m_bDone = true;
+	}
+
+private:
+	GameServerPing m_server;
+	uint32 m_nPingRound;
+	HServerQuery m_hQuery;
+	bool m_bDone;
+};
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // ChatClient
@@ -109,13 +272,21 @@ public:
 	{
 		SetName("ChatClientThread");
         m_hCurrentLobby = invalid_lobby;
+        m_bSearching = false;
         m_bQuit = false;
 		m_mapToSearch = dm_lockdown;
 		m_bTeamDMSearch = 0;
-	}
-
-	~ChatClientThread()
-	{
+		m_flPingsStarted = 0.0;
+		m_flPingsMeasured = 0.0;
+		m_bFindAfterPings = false;
+		m_nPingRound = 0;
+		m_nPingsPending = 0;
+		m_nServerVersion = 0;
+		m_nResumeToken = 0;
+		m_flConnectionLost = 0.0;
+		m_flReconnectAt = 0.0;
+		m_flReconnectDelay = k_flReconnectDelayMin;
+		m_bResuming = false;
 	}
 
 	bool CallThreadFunction(SteamNetworkingIPAddr serverAddr)
@@ -135,11 +306,8 @@ public:
 		return 0;
 	}
 
-	void RunClient(const SteamNetworkingIPAddr &serverAddr)
+	bool Connect(const SteamNetworkingIPAddr &serverAddr)
 	{
-		// Select instance to use.  For now we'll always use the default.
-		m_pInterface = SteamNetworkingSockets();
-
 		// Start connecting
 		char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
 		serverAddr.ToString(szAddr, sizeof(szAddr), true);
@@ -149,13 +317,28 @@ public:
 		//opt.SetInt32(k_ESteamNetworkingConfig_IP_AllowWithoutAuth, 1);
 		//opt.SetInt32(k_ESteamNetworkingConfig_Unencrypted, 3);
 		
-		m_hConnection = SteamNetworkingSockets()->ConnectByIPAddress(serverAddr, 1, &opt);
+		m_hConnection = m_pInterface->ConnectByIPAddress(serverAddr, 1, &opt);
 		if (m_hConnection == k_HSteamNetConnection_Invalid)
 		{
 			Warning("Failed to create connection\n");
-			return;
+			return false;
 		}
+		return true;
+	}
+
+	void RunClient(const SteamNetworkingIPAddr &serverAddr)
+	{
+		// Select instance to use.  For now we'll always use the default.
+		m_pInterface = SteamNetworkingSockets();
+		if (!Connect(serverAddr))
+			return;
 
+		// GameNetworkingSockets does its socket I/O on its own thread and has no
+		// handle we could block on, so when there is nothing to do we sleep on
+		// s_eventWakeup instead.  Console commands cut the sleep short, network
+		// traffic is picked up when it ends.  The sleep starts at a millisecond
+		// and doubles while we stay idle.
+		uint32 nIdleWaitMS = 1;
 		while (!m_bQuit)
 		{
 			// We renew the pointer to the interface at the start of every loop to catch
@@ -168,75 +351,218 @@ public:
 				m_bQuit = true;
 				break;
 			}
-			ClientUpdate();
-			PollIncomingMessages();
+
+			// Lost the server, or got sent to another one, and it's time to get in
+			if (m_hConnection == k_HSteamNetConnection_Invalid && m_flReconnectAt != 0.0 && Plat_FloatTime() >= m_flReconnectAt)
+			{
+				m_flReconnectAt = 0.0;
+				if (!Connect(m_pServerAddr))
+					m_bQuit = true;
+			}
+
+			bool bDidWork = m_hConnection != k_HSteamNetConnection_Invalid && PollIncomingMessages();
 			RunCallBacks();
-			PollLocalUserInput();
-			Sleep(10);
+			bDidWork |= PollLocalUserInput();
+			UpdatePings();
+			if (bDidWork)
+			{
+				nIdleWaitMS = 1;
+				continue;
+			}
+
+			bool bWaitingOnServer = m_bSearching || m_hCurrentLobby != invalid_lobby || m_flPingsStarted != 0.0 || m_flReconnectAt != 0.0;
+			uint32 nMaxWaitMS = bWaitingOnServer ? k_nMaxIdleWaitBusyMS : k_nMaxIdleWaitMS;
+			if (s_eventWakeup.Wait(Min(nIdleWaitMS, nMaxWaitMS)))
+				nIdleWaitMS = 1;
+			else
+				nIdleWaitMS = Min(nIdleWaitMS * 2, nMaxWaitMS);
 		}
 	}
 private:
 
-	std::queue<HLobbyID> m_LobbyIDs;
 	HSteamNetConnection m_hConnection;
 	ISteamNetworkingSockets *m_pInterface;
 	SteamNetworkingIPAddr m_pServerAddr;
 	HLobbyID m_hCurrentLobby;
-	std::string s_GameServerIP;
+
+	// Waiting in the matchmaking queue, we get a lobby once there are players to play with
+	bool m_bSearching;
 	bool m_bQuit;
 
 	HL2DM_Map m_mapToSearch;
 	char m_bTeamDMSearch;
 
-	void LeaveLobby(HSteamNetConnection hConnection)
+	// Protocol version we talk to the server in.  Until it answers our hello we
+	// don't know, so we send what every version understands.
+	uint16 m_nServerVersion;
+
+	// Token the server gave us to get our lobby or queue place back after
+	// losing the connection, 0 if it didn't give us one
+	uint64 m_nResumeToken;
+	double m_flConnectionLost;	// 0 unless we're trying to get back in
+	double m_flReconnectAt;		// 0 unless a reconnect is scheduled
+	float m_flReconnectDelay;
+	bool m_bResuming;			// sent request_resume, waiting for the result
+
+	// Game servers the matchmaking server can put us on, and how far away they are.
+	// Pings are measured when the list arrives and again before searching if they
+	// got old.  A search asked for while measuring waits until we're done.
+	// The pinging itself happens on the main thread, results of any round but
+	// the current one are stale.
+	CUtlVector< GameServerPing > m_vecGameServers;
+	double m_flPingsStarted;	// 0 if not measuring
+	double m_flPingsMeasured;	// 0 if never measured
+	bool m_bFindAfterPings;
+	uint32 m_nPingRound;
+	int m_nPingsPending;
+
+	void StartPings()
+	{
+		++m_nPingRound;
+		for (int i = 0; i < m_vecGameServers.Count(); ++i)
+		{
+			m_vecGameServers[i].m_nPingMS = k_nPingUnknown;
+			MM_PostPingEvent(mm_event_ping_server, m_vecGameServers[i], m_nPingRound);
+		}
+		m_nPingsPending = m_vecGameServers.Count();
+		m_flPingsStarted = Plat_FloatTime();
+	}
+
+	// Lets the main thread drop whatever it's still pinging for us
+	void CancelPings()
+	{
+		GameServerPing none;
+		V_memset(&none, 0, sizeof(none));
+		MM_PostPingEvent(mm_event_cancel_pings, none, m_nPingRound);
+		++m_nPingRound;
+		m_nPingsPending = 0;
+	}
+
+	// Tells the server how far we are from its game servers once every one of
+	// them answered or k_flPingTimeout ran out
+	void UpdatePings()
+	{
+		MMPingResult result;
+		while (s_queuePingResults.PopItem(&result))
+		{
+			if (result.m_nPingRound != m_nPingRound || m_flPingsStarted == 0.0)
+				continue;
+			for (int i = 0; i < m_vecGameServers.Count(); ++i)
+			{
+				GameServerPing &server = m_vecGameServers[i];
+				if (server.m_nPort != result.m_server.m_nPort || V_memcmp(server.m_ipv6, result.m_server.m_ipv6, sizeof(server.m_ipv6)) != 0)
+					continue;
+				server.m_nPingMS = result.m_server.m_nPingMS;
+				--m_nPingsPending;
+				break;
+			}
+		}
+		if (m_flPingsStarted == 0.0)
+			return;
+
+		double flNow = Plat_FloatTime();
+		if (m_nPingsPending > 0)
+		{
+			if (flNow - m_flPingsStarted <= k_flPingTimeout)
+				return;
+			CancelPings();
+		}
+		m_flPingsStarted = 0.0;
+		m_flPingsMeasured = flNow;
+
+		for (int i = 0; i < m_vecGameServers.Count(); ++i)
+		{
+			SteamNetworkingIPAddr addr;
+			addr.SetIPv6(m_vecGameServers[i].m_ipv6, m_vecGameServers[i].m_nPort);
+			char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+			addr.ToString(szAddr, sizeof(szAddr), true);
+			if (m_vecGameServers[i].m_nPingMS == k_nPingUnknown)
+				DevMsg("Game server %s didn't answer\n", szAddr);
+			else
+				DevMsg("Game server %s ping: %i ms\n", szAddr, (int)m_vecGameServers[i].m_nPingMS);
+		}
+		if (m_vecGameServers.Count())
+			SendWireArray(m_hConnection, m_vecGameServers.Base(), (uint32)m_vecGameServers.Count(), k_nSteamNetworkingSend_Reliable, game_server_pings, m_pInterface);
+
+		if (m_bFindAfterPings)
+		{
+			m_bFindAfterPings = false;
+			SendFindMatch();
+		}
+	}
+
+	void SendFindMatch()
+	{
+		// The server queues us up and puts us in a lobby once it has found players near our skill level
+		FindMatchData find_data;
+		find_data.m_map = m_mapToSearch;
+		find_data.m_bTeamDM = m_bTeamDMSearch;
+		SendWireMessage(m_hConnection, find_data, k_nSteamNetworkingSend_Reliable, request_find_match, m_pInterface, m_nServerVersion);
+	}
+
+	// The server couldn't give us back what we had, so ask for it again
+	void OnResumeLost()
 	{
 		if (m_hCurrentLobby != invalid_lobby)
 		{
-			SendOnlyMessageType(hConnection, k_nSteamNetworkingSend_Reliable, nullptr, request_leave_lobby, m_pInterface);
-			Msg("Left lobby: %u\n", m_hCurrentLobby);
+			Msg("Lobby %u is gone\n", m_hCurrentLobby);
 			m_hCurrentLobby = invalid_lobby;
 		}
-		else
+		if (m_bSearching)
 		{
-			Msg("Can't leave lobby, currently not in one!\n");
+			Msg("Searching for a match again...\n");
+			SendFindMatch();
 		}
 	}
 
-	void ClientUpdate()
+	void ForgetGameServers()
 	{
-		while (!m_bQuit)
+		if (m_flPingsStarted != 0.0)
+			CancelPings();
+		m_vecGameServers.RemoveAll();
+		m_flPingsStarted = 0.0;
+		m_flPingsMeasured = 0.0;
+		m_bFindAfterPings = false;
+	}
+
+	void LeaveLobby(HSteamNetConnection hConnection)
+	{
+		if (m_bSearching && m_bFindAfterPings)
 		{
-			if (mm_auto_start_game.GetBool() && !s_GameServerIP.empty())
-			{
-				std::string connect_commad = "connect ";
-				connect_commad.append(s_GameServerIP);
-				engine->ClientCmd(connect_commad.c_str());
-				if (m_hCurrentLobby != invalid_lobby)
-				{
-					Msg("Left lobby: %u\n", m_hCurrentLobby);
-					m_hCurrentLobby = invalid_lobby;
-				}
-				else
-				{
-					Msg("Can't leave lobby, currently not in one!\n");
-				}
-				s_GameServerIP.clear();
-			}
-			else
-			{
-				break;
-			}
+			// The server never heard about this search
+			m_bFindAfterPings = false;
+			Msg("Stopped searching for a match\n");
+			m_bSearching = false;
+		}
+		else if (m_bSearching)
+		{
+			SendOnlyMessageType(hConnection, k_nSteamNetworkingSend_Reliable, nullptr, request_leave_lobby, m_pInterface);
+			Msg("Stopped searching for a match\n");
+			m_bSearching = false;
+		}
+		else if (m_hCurrentLobby != invalid_lobby)
+		{
+			SendOnlyMessageType(hConnection, k_nSteamNetworkingSend_Reliable, nullptr, request_leave_lobby, m_pInterface);
+			Msg("Left lobby: %u\n", m_hCurrentLobby);
+			m_hCurrentLobby = invalid_lobby;
+		}
+		else
+		{
+			Msg("Can't leave lobby, currently not in one!\n");
 		}
 	}
 
-	void PollIncomingMessages()
+	// Returns true if there was anything to read
+	bool PollIncomingMessages()
 	{
+		bool bGotMessages = false;
 		while (!m_bQuit)
 		{
 			ISteamNetworkingMessage *pIncomingMsg = nullptr;
 			int numMsgs = m_pInterface->ReceiveMessagesOnConnection(m_hConnection, &pIncomingMsg, 1);
 			if (numMsgs == 0 || !pIncomingMsg)
 				break;
+			bGotMessages = true;
 			if (numMsgs < 0)
 			{
 				Warning("Error checking for messages\n");
@@ -244,97 +570,160 @@ private:
 				break;
 			}
 
-			if (DetermineMessageType(pIncomingMsg) == chat_message)
+			// Everything below reads the payload in place, the view is only good until Release()
+			MessageView msg(pIncomingMsg);
+			if (!msg.IsValid())
 			{
-				Msg("%s", ReceiveString(pIncomingMsg->m_pData, pIncomingMsg->m_cbSize).c_str());
-				Msg("\n");
+				pIncomingMsg->Release();
+				continue;
 			}
-			if (DetermineMessageType(pIncomingMsg) == lobby_list)
+
+			if (msg.m_eType == message_batch)
 			{
-				void* temp_array_LobbyIDs;
-				RemoveFirstByte(&temp_array_LobbyIDs, pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-				HLobbyID* array_LobbyIDs = (HLobbyID*)temp_array_LobbyIDs;
-				int array_LobbyIDs_size = (pIncomingMsg->m_cbSize - 1) / sizeof(HLobbyID);
-				for (int i = 1; i < array_LobbyIDs_size; i++)
-				{
-					m_LobbyIDs.push(array_LobbyIDs[i]);
-				}
-				SendTypedMessage(m_hConnection, &array_LobbyIDs[0], sizeof(HLobbyID), k_nSteamNetworkingSend_Reliable, nullptr, request_lobby_data, m_pInterface);
-				delete temp_array_LobbyIDs;
+				// Several small messages the server sent at once
+				uint32 nOffset = 0;
+				const uint8 *pData;
+				uint32 cbData;
+				while (ReadBatchedMessage(msg, nOffset, pData, cbData))
+					OnMessage(MessageView(msg.m_hConn, pData, cbData));
 			}
-			if (DetermineMessageType(pIncomingMsg) == message_no_suitable_lobbies)
+			else
 			{
-				SendOnlyMessageType(m_hConnection, k_nSteamNetworkingSend_Reliable, nullptr, request_create_lobby, m_pInterface);
+				OnMessage(msg);
 			}
-			if (DetermineMessageType(pIncomingMsg) == message_save_lobby_id)
+
+			// We don't need this anymore.
+			pIncomingMsg->Release();
+		}
+		return bGotMessages;
+	}
+
+	void OnMessage(const MessageView &msg)
+	{
+		if (msg.m_eType == chat_message)
+		{
+			Msg("%.*s\n", msg.GetStringLength(), msg.GetString());
+		}
+		if (msg.m_eType == message_no_suitable_lobbies)
+		{
+			m_bSearching = false;
+			Warning("Matchmaking server can't search for this map and gamemode\n");
+		}
+		if (msg.m_eType == message_save_lobby_id)
+		{
+			if (msg.Read(m_hCurrentLobby))
 			{
-				void* temp_lobbyid;
-				RemoveFirstByte(&temp_lobbyid, pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-				m_hCurrentLobby = *(HLobbyID*)temp_lobbyid;
-				delete temp_lobbyid;
+				m_bSearching = false;
 				Msg("Joined lobby: %u\n", m_hCurrentLobby);
 			}
-			if (DetermineMessageType(pIncomingMsg) == message_save_lobby_id_on_create)
+		}
+		if (msg.m_eType == message_echo)
+		{
+			HLobbyID lobby_to_echo;
+			if (msg.Read(lobby_to_echo))
+				Msg("Echoed: %u\n", lobby_to_echo);
+		}
+		if (msg.m_eType == message_start_game)
+		{
+			// The lobby is done with once its players are sent off, connecting
+			// to the game server is up to the main thread
+			char szAddress[64];
+			V_strncpy(szAddress, msg.GetString(), Min((int)sizeof(szAddress), msg.GetStringLength() + 1));
+			MM_PostEvent(mm_event_start_game, szAddress);
+			if (m_hCurrentLobby != invalid_lobby)
 			{
-				void* temp_lobbyid;
-				RemoveFirstByte(&temp_lobbyid, pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-				m_hCurrentLobby = *(HLobbyID*)temp_lobbyid;
-				delete temp_lobbyid;
-				Msg("Joined lobby: %u\n", m_hCurrentLobby);
-				LobbyData l_lobby_data;
-				l_lobby_data.m_bTeamDM = m_bTeamDMSearch;
-				l_lobby_data.m_hLobbyID = m_hCurrentLobby;
-				l_lobby_data.m_map = m_mapToSearch;
-				SendTypedMessage(pIncomingMsg->m_conn, &l_lobby_data, sizeof(l_lobby_data), k_nSteamNetworkingSend_Reliable, nullptr, lobby_data, m_pInterface);
+				Msg("Left lobby: %u\n", m_hCurrentLobby);
+				m_hCurrentLobby = invalid_lobby;
 			}
-			if (DetermineMessageType(pIncomingMsg) == message_echo)
+			else if (m_bSearching)
 			{
-				void* temp_lobbyid;
-				RemoveFirstByte(&temp_lobbyid, pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-				HLobbyID lobby_to_echo = *(HLobbyID*)temp_lobbyid;
-				delete temp_lobbyid;
-				Msg("Echoed: %u\n", lobby_to_echo);
+				// Straight from the queue into a free slot of a match that's already on
+				m_bSearching = false;
+				Msg("Joining a match in progress\n");
 			}
-			if (DetermineMessageType(pIncomingMsg) == message_start_game)
+			Msg("Ready to start the match!\n");
+		}
+		if (msg.m_eType == message_hello)
+		{
+			HelloData hello;
+			if (!msg.Read(hello))
+				return;
+			if (hello.m_nVersion < k_nMinProtocolVersion || hello.m_nMinVersion > k_nProtocolVersion)
 			{
-				s_GameServerIP = ReceiveString(pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-				Msg("Ready to start the match!\n");
+				Warning("Matchmaking server speaks protocol version %u, we need %u to %u.  Update the game or pick another server.\n", hello.m_nVersion, k_nMinProtocolVersion, k_nProtocolVersion);
+				MM_QueueCommand("/quit");
+				return;
 			}
-			if (DetermineMessageType(pIncomingMsg) == lobby_data)
+			m_nServerVersion = Min(hello.m_nVersion, k_nProtocolVersion);
+
+			// Servers from before resume tokens drop request_resume without an answer
+			if (m_bResuming && m_nServerVersion < 2)
 			{
-				void* temp_lobby_data;
-				RemoveFirstByte(&temp_lobby_data, pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-				LobbyData l_lobby_data = *(LobbyData*)temp_lobby_data;
-				delete temp_lobby_data;
-				if ((l_lobby_data.m_bTeamDM	== m_bTeamDMSearch) && 
-					(l_lobby_data.m_map		== m_mapToSearch))
-				{
-					SendTypedMessage(pIncomingMsg->m_conn, &l_lobby_data.m_hLobbyID, sizeof(l_lobby_data.m_hLobbyID), k_nSteamNetworkingSend_Reliable, nullptr, request_join_lobby, m_pInterface);
-				}
-				else
-				{
-					if (!m_LobbyIDs.empty())
-					{
-						SendTypedMessage(m_hConnection, &m_LobbyIDs.front(), sizeof(HLobbyID), k_nSteamNetworkingSend_Reliable, nullptr, request_lobby_data, m_pInterface);
-						m_LobbyIDs.pop();
-					}
-					else
-					{
-						SendOnlyMessageType(pIncomingMsg->m_conn, k_nSteamNetworkingSend_Reliable, nullptr, request_create_lobby, m_pInterface);
-					}
-				}
+				m_bResuming = false;
+				OnResumeLost();
 			}
-
-			// We don't need this anymore.
-			pIncomingMsg->Release();
+		}
+		if (msg.m_eType == message_resume_token)
+		{
+			msg.Read(m_nResumeToken);
+		}
+		if (msg.m_eType == message_redirect)
+		{
+			// Another matchmaking server of the cluster took our lobby or queue
+			// place, we pick it up there with the token it came with
+			RedirectData redirect;
+			if (!msg.Read(redirect))
+				return;
+			m_pServerAddr.SetIPv6(redirect.m_ipv6, redirect.m_nPort);
+			m_nResumeToken = redirect.m_nResumeToken;
+			char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+			m_pServerAddr.ToString(szAddr, sizeof(szAddr), true);
+			Msg("Moving to matchmaking server %s\n", szAddr);
+
+			// Closing it ourselves doesn't call us back
+			m_pInterface->CloseConnection(m_hConnection, 0, "Redirected", true);
+			m_hConnection = k_HSteamNetConnection_Invalid;
+			ForgetGameServers();
+			m_bResuming = false;
+			m_flConnectionLost = Plat_FloatTime();
+			m_flReconnectAt = m_flConnectionLost;
+			m_flReconnectDelay = k_flReconnectDelayMin;
+		}
+		if (msg.m_eType == message_resume_result)
+		{
+			uint32 nResult;
+			if (!msg.Read(nResult))
+				return;
+			m_bResuming = false;
+			if (nResult == resume_lobby)
+				Msg("Back in lobby %u\n", m_hCurrentLobby);
+			else if (nResult == resume_queued)
+				Msg("Back in the queue, still searching for a match...\n");
+			else
+				OnResumeLost();
+		}
+		if (msg.m_eType == game_server_list)
+		{
+			// Start over with the new list, a search waiting on the old one waits on this one instead
+			bool bFindAfterPings = m_bFindAfterPings;
+			ForgetGameServers();
+			m_bFindAfterPings = bFindAfterPings;
+
+			GameServerPing server;
+			for (uint32 i = 0; msg.ReadElement(i, server); ++i)
+				m_vecGameServers.AddToTail(server);
+			StartPings();
 		}
 	}
 
-	void PollLocalUserInput()
+	// Returns true if there were any commands
+	bool PollLocalUserInput()
 	{
 		std::string cmd;
+		bool bGotInput = false;
 		while (!m_bQuit && LocalUserInput_GetNext(cmd))
 		{
+			bGotInput = true;
 
 			// Check for known commands
 			if (strcmp(cmd.c_str(), "/quit") == 0)
@@ -352,8 +741,20 @@ private:
 			}
 			if (strcmp(cmd.c_str(), "/find_game") == 0)
 			{
-				if (m_hCurrentLobby == invalid_lobby)
-					SendOnlyMessageType(m_hConnection, k_nSteamNetworkingSend_Reliable, nullptr, request_lobby_list, m_pInterface);
+				if (m_bSearching)
+					Warning("Already searching for a match!\n");
+				else if (m_hCurrentLobby == invalid_lobby)
+				{
+					// Let the server know where we are first, so it can put us on a game server close by
+					if (m_flPingsStarted == 0.0 && m_vecGameServers.Count() && Plat_FloatTime() - m_flPingsMeasured > k_flPingMaxAge)
+						StartPings();
+					if (m_flPingsStarted != 0.0)
+						m_bFindAfterPings = true;
+					else
+						SendFindMatch();
+					m_bSearching = true;
+					Msg("Searching for a match...\n");
+				}
 				else
 					Warning("Already in a lobby! LobbyID: %u\n", m_hCurrentLobby);
 				break;
@@ -361,7 +762,7 @@ private:
 			if (strcmp(cmd.c_str(), "/echo") == 0)
 			{
 				HLobbyID test = 432000;
-				SendTypedMessage(m_hConnection, &test, sizeof(test), k_nSteamNetworkingSend_Reliable, nullptr, request_echo, m_pInterface);
+				SendWireMessage(m_hConnection, test, k_nSteamNetworkingSend_Reliable, request_echo, m_pInterface);
 				break;
 			}
 			if (strcmp(cmd.c_str(), "/leave_lobby") == 0)
@@ -369,30 +770,6 @@ private:
 				LeaveLobby(m_hConnection);
 				break;
 			}
-			if (strcmp(cmd.c_str(), "/start_game") == 0)
-			{
-				if (!s_GameServerIP.empty())
-				{
-					std::string connect_commad = "connect ";
-					connect_commad.append(s_GameServerIP);
-					engine->ClientCmd(connect_commad.c_str());
-					if (m_hCurrentLobby != invalid_lobby)
-					{
-						Msg("Left lobby: %u\n", m_hCurrentLobby);
-						m_hCurrentLobby = invalid_lobby;
-					}
-					else
-					{
-						Msg("Can't leave lobby, currently not in one!\n");
-					}
-					s_GameServerIP.clear();
-				}
-				else
-				{
-					Warning("Can't start the game! Haven't received game server IP from mm server\n");
-				}
-				break;
-			}
 			if (strncmp(cmd.c_str(), "/set_map", 8) == 0)
 			{
 				const char *temp_map = cmd.c_str() + 8;
@@ -428,6 +805,7 @@ private:
 			// Anything else, just send it to the server and let them parse it
 			SendTypedMessage(m_hConnection, cmd.c_str(), (uint32)cmd.length(), k_nSteamNetworkingSend_Reliable, nullptr, chat_message, m_pInterface);
 		}
+		return bGotInput;
 	}
 
 	void OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
@@ -442,15 +820,8 @@ private:
 			break;
 
 		case k_ESteamNetworkingConnectionState_ClosedByPeer:
-		{
-			LeaveLobby(pInfo->m_hConn);
-			m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
-			break;
-		}
 		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
 		{
-			m_bQuit = true;
-
 			// Print an appropriate message
 			if (pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connecting)
 			{
@@ -468,7 +839,6 @@ private:
 				Msg("The host hath bidden us farewell.  (%s)\n", pInfo->m_info.m_szEndDebug);
 			}
 
-			LeaveLobby(pInfo->m_hConn);
 			// Clean up the connection.  This is important!
 			// The connection is "closed" in the network sense, but
 			// it has not been destroyed.  We must close it on our end, too
@@ -477,6 +847,31 @@ private:
 			// so we just pass 0's.
 			m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
 			m_hConnection = k_HSteamNetConnection_Invalid;
+			ForgetGameServers();
+
+			// The server keeps our lobby or queue place for a while after a
+			// restart, so keep our own idea of it and try to get back in
+			double flNow = Plat_FloatTime();
+			if (m_nResumeToken && (m_flConnectionLost == 0.0 || flNow - m_flConnectionLost < k_flResumeWindow))
+			{
+				if (m_flConnectionLost == 0.0)
+				{
+					m_flConnectionLost = flNow;
+					m_flReconnectDelay = k_flReconnectDelayMin;
+					Msg("Trying to get back in to the matchmaking server...\n");
+				}
+				else
+				{
+					m_flReconnectDelay = Min(m_flReconnectDelay * 2.0f, k_flReconnectDelayMax);
+				}
+				m_flReconnectAt = flNow + m_flReconnectDelay;
+				m_bResuming = false;
+				break;
+			}
+
+			m_bQuit = true;
+			LeaveLobby(pInfo->m_hConn);
+			m_bSearching = false;
 			break;
 		}
 
@@ -486,8 +881,24 @@ private:
 			break;
 
 		case k_ESteamNetworkingConnectionState_Connected:
+		{
 			Msg("Connected to server OK\n");
+
+			// Tell the server which protocol versions we speak
+			HelloData hello;
+			hello.m_nVersion = k_nProtocolVersion;
+			hello.m_nMinVersion = k_nMinProtocolVersion;
+			SendWireMessage(pInfo->m_hConn, hello, k_nSteamNetworkingSend_Reliable, message_hello, m_pInterface);
+
+			// Back after losing the server, ask for what we had
+			if (m_flConnectionLost != 0.0)
+			{
+				SendWireMessage(pInfo->m_hConn, m_nResumeToken, k_nSteamNetworkingSend_Reliable, request_resume, m_pInterface);
+				m_bResuming = true;
+				m_flConnectionLost = 0.0;
+			}
 			break;
+		}
 
 		default:
 			// Silences -Wswitch
@@ -503,12 +914,19 @@ private:
 	void OnExit() //reset all our globals and member variables
 	{
 		m_bQuit = false;
-		while (!queueUserInput.empty())
+		MMCommand command;
+		while (s_queueCommands.PopItem(&command))
 		{
-			queueUserInput.pop();
 		}
 
 		m_hConnection = k_HSteamNetConnection_Invalid;
+		m_bSearching = false;
+		ForgetGameServers();
+		m_nServerVersion = 0;
+		m_nResumeToken = 0;
+		m_flConnectionLost = 0.0;
+		m_flReconnectAt = 0.0;
+		m_bResuming = false;
 		m_pInterface = nullptr;
 		m_pServerAddr.Clear();
 
@@ -525,6 +943,101 @@ void SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCall
 	g_ChatClientThread.OnSteamNetConnectionStatusChanged(pInfo);
 }
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// CMatchmakingClientSystem
+//
+// Runs whatever the chat thread needs the engine or Steam for, on the main
+// thread once per frame.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// Game server the matchmaking server sent us to, until we connect.  Main thread only.
+static char s_szGameServerAddress[64];
+
+static void MM_ConnectToGameServer()
+{
+	char szCommand[96];
+	V_snprintf(szCommand, sizeof(szCommand), "connect %s\n", s_szGameServerAddress);
+	engine->ClientCmd(szCommand);
+	s_szGameServerAddress[0] = '\0';
+}
+
+class CMatchmakingClientSystem : public CAutoGameSystemPerFrame
+{
+public:
+	CMatchmakingClientSystem() : CAutoGameSystemPerFrame("CMatchmakingClientSystem")
+	{
+	}
+
+	virtual void Shutdown()
+	{
+		m_vecPingers.PurgeAndDeleteElements();
+	}
+
+	virtual void Update(float frametime)
+	{
+		MMEvent event;
+		while (s_queueEvents.PopItem(&event))
+		{
+			switch (event.m_eType)
+			{
+			case mm_event_ping_server:
+			{
+				CGameServerPinger *pPinger = new CGameServerPinger(event.m_server, event.m_nPingRound);
+				m_vecPingers.AddToTail(pPinger);
+				pPinger->Start();
+				break;
+			}
+			case mm_event_cancel_pings:
+				for (int i = m_vecPingers.Count() - 1; i >= 0; --i)
+				{
+					// Rounds only go up, wrapping around after a few billion
+					if ((int32)(m_vecPingers[i]->GetPingRound() - event.m_nPingRound) > 0)
+						continue;
+					delete m_vecPingers[i];
+					m_vecPingers.Remove(i);
+				}
+				break;
+			case mm_event_start_game:
+				// It goes straight into a console command, so don't let it sneak another one in
+				if (strpbrk(event.m_szData, ";\"\r\n"))
+				{
+					Warning("Matchmaking server sent a bad game server address\n");
+					break;
+				}
+				V_strncpy(s_szGameServerAddress, event.m_szData, sizeof(s_szGameServerAddress));
+				if (mm_auto_start_game.GetBool())
+					MM_ConnectToGameServer();
+				break;
+			}
+		}
+
+		// Steam answered these from RunCallbacks, on this thread
+		bool bAnswered = false;
+		for (int i = m_vecPingers.Count() - 1; i >= 0; --i)
+		{
+			if (!m_vecPingers[i]->IsDone())
+				continue;
+			MMPingResult result;
+			result.m_server = m_vecPingers[i]->GetResult();
+			result.m_nPingRound = m_vecPingers[i]->GetPingRound();
+			s_queuePingResults.PushItem(result);
+			delete m_vecPingers[i];
+			m_vecPingers.Remove(i);
+			bAnswered = true;
+		}
+		if (bAnswered)
+			s_eventWakeup.Set();
+	}
+
+private:
+	// Main thread only
+	CUtlVector< CGameServerPinger * > m_vecPingers;
+};
+
+static CMatchmakingClientSystem s_MatchmakingClientSystem;
+
 void MM_Connect(const CCommand &args)
 {
 	if (!SteamNetworkingSockets())
@@ -591,39 +1104,42 @@ void MM_ThreadStop()
 
 void MM_ChatSay(const CCommand &args)
 {
-	queueUserInput.push(args.ArgS());
+	MM_QueueCommand(args.ArgS());
 }
 
 void MM_FindGame()
 {
-	queueUserInput.push("/find_game");
+	MM_QueueCommand("/find_game");
 }
 
 void MM_Echo()
 {
-	queueUserInput.push("/echo");
+	MM_QueueCommand("/echo");
 }
 
 void MM_LeaveLobby()
 {
-	queueUserInput.push("/leave_lobby");
+	MM_QueueCommand("/leave_lobby");
 }
 
 void MM_StartGame()
 {
-	queueUserInput.push("/start_game");
+	if (s_szGameServerAddress[0])
+		MM_ConnectToGameServer();
+	else
+		Warning("Can't start the game! Haven't received game server IP from mm server\n");
 }
 
 void MM_Disconnect()
 {
-	queueUserInput.push("/quit");
+	MM_QueueCommand("/quit");
 }
 
 void MM_SetMap(const CCommand &args)
 {
 	std::string res = "/set_map ";
 	res.append(args.ArgS());
-	queueUserInput.push(res);
+	MM_QueueCommand(res.c_str());
 }
 
 void MM_SetGameMode(const CCommand &args)
@@ -636,7 +1152,7 @@ void MM_SetGameMode(const CCommand &args)
 	{
 		std::string res = "/set_gamemode ";
 		res.append(args.ArgS());
-		queueUserInput.push(res);
+		MM_QueueCommand(res.c_str());
 	}
 }
 
@@ -0,0 +1,324 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Game server heartbeats to the matchmaking server
+//
+//=============================================================================
+
+#include "cbase.h"
+#include <steam/steamnetworkingsockets.h>
+#include <steam/isteamnetworkingutils.h>
+#include "igamesystem.h"
+#include "hl2mp_gamerules.h"
+#include "tier0/valve_minmax_off.h"
+#include "../../mm_server/mm_shared.h"
+#include "tier0/valve_minmax_on.h"
+
+const uint16 DEFAULT_GAME_SERVER_PORT = 27056;
+
+ConVar mm_heartbeat_address("mm_heartbeat_address", "", FCVAR_GAMEDLL, "Matchmaking server to send heartbeats to, IP[:PORT].  Empty turns them off.");
+ConVar mm_heartbeat_interval("mm_heartbeat_interval", "2", FCVAR_GAMEDLL, "Seconds between heartbeats to the matchmaking server", true, 0.5f, true, 5.0f);
+ConVar mm_backfill("mm_backfill", "1", FCVAR_GAMEDLL, "Let the matchmaking server send searching players into free slots while a match is on");
+ConVar mm_backfill_cutoff("mm_backfill_cutoff", "180", FCVAR_GAMEDLL, "Seconds before the time limit after which no more players are sent in", true, 0.0f, false, 0.0f);
+
+// How long we wait before trying again when the matchmaking server can't be reached
+const double k_flReconnectInterval = 10.0;
+
+static void HeartbeatConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo);
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// CMatchmakingHeartbeatSystem
+//
+// Dedicated servers keep a connection to the matchmaking server and tell it
+// every mm_heartbeat_interval seconds who is on, which map is up, where the
+// match is at and how long game frames take.  The matchmaking server goes by
+// that to hand out and free up servers, and to notice one has died.  It can
+// also ask us to switch to a lobby's map, which saves it doing that over RCON.
+// Everything runs on the main thread: the library does its socket I/O on a
+// thread of its own, so all we do per frame is pick up what came in.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class CMatchmakingHeartbeatSystem : public CAutoGameSystemPerFrame
+{
+public:
+	CMatchmakingHeartbeatSystem() : CAutoGameSystemPerFrame("CMatchmakingHeartbeatSystem")
+	{
+		m_bNetworkingReady = false;
+		m_hConnection = k_HSteamNetConnection_Invalid;
+		m_bConnected = false;
+		m_szAddress[0] = '\0';
+		m_flNextConnect = 0.0;
+		m_flNextHeartbeat = 0.0;
+		m_hPendingLobby = invalid_lobby;
+		m_hLoadedLobby = invalid_lobby;
+		m_flFrameStart = 0.0;
+		ResetFrameTimes();
+	}
+
+	virtual bool Init()
+	{
+		// On a listen server the client owns the library, and nobody matchmakes onto those anyway
+		if (!engine->IsDedicatedServer())
+			return true;
+
+		SteamNetworkingErrMsg errMsg;
+		if (!GameNetworkingSockets_Init(nullptr, errMsg))
+		{
+			Warning("GameNetworkingSockets_Init failed, no matchmaking heartbeats.  %s\n", errMsg);
+			return true;
+		}
+		m_bNetworkingReady = true;
+		return true;
+	}
+
+	virtual void Shutdown()
+	{
+		if (!m_bNetworkingReady)
+			return;
+		Disconnect("Game server shutting down");
+		GameNetworkingSockets_Kill();
+		m_bNetworkingReady = false;
+	}
+
+	virtual void LevelInitPostEntity()
+	{
+		// The lobby we changed level for is ready once its entities are in.
+		// Any other level change means we're not set up for anybody.
+		m_hLoadedLobby = m_hPendingLobby;
+		m_hPendingLobby = invalid_lobby;
+
+		// Don't keep the matchmaking server waiting for the next one
+		m_flNextHeartbeat = 0.0;
+	}
+
+	virtual void FrameUpdatePreEntityThink()
+	{
+		m_flFrameStart = Plat_FloatTime();
+	}
+
+	virtual void FrameUpdatePostEntityThink()
+	{
+		if (!m_bNetworkingReady)
+			return;
+
+		double flFrameTime = Plat_FloatTime() - m_flFrameStart;
+		m_flFrameTimeTotal += flFrameTime;
+		m_flFrameTimeMax = Max(m_flFrameTimeMax, flFrameTime);
+		++m_nFrames;
+
+		UpdateConnection();
+		SteamNetworkingSockets()->RunCallbacks();
+		PollIncomingMessages();
+		if (m_bConnected && Plat_FloatTime() >= m_flNextHeartbeat)
+			SendHeartbeat();
+	}
+
+	void OnConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	{
+		if (pInfo->m_hConn != m_hConnection)
+			return;
+
+		switch (pInfo->m_info.m_eState)
+		{
+		case k_ESteamNetworkingConnectionState_ClosedByPeer:
+		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+			Warning("Lost the matchmaking server at %s.  (%s)\n", m_szAddress, pInfo->m_info.m_szEndDebug);
+			SteamNetworkingSockets()->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+			m_hConnection = k_HSteamNetConnection_Invalid;
+			m_bConnected = false;
+			break;
+
+		case k_ESteamNetworkingConnectionState_Connected:
+		{
+			Msg("Sending heartbeats to the matchmaking server at %s\n", m_szAddress);
+			m_bConnected = true;
+			m_flNextHeartbeat = 0.0;
+
+			HelloData hello;
+			hello.m_nVersion = k_nProtocolVersion;
+			hello.m_nMinVersion = k_nMinProtocolVersion;
+			SendWireMessage(m_hConnection, hello, k_nSteamNetworkingSend_Reliable, message_hello, SteamNetworkingSockets());
+			break;
+		}
+
+		default:
+			break;
+		}
+	}
+
+private:
+	// Connects to mm_heartbeat_address, and moves over whenever it changes
+	void UpdateConnection()
+	{
+		if (V_strcmp(m_szAddress, mm_heartbeat_address.GetString()) != 0)
+		{
+			Disconnect("Matchmaking server address changed");
+			V_strncpy(m_szAddress, mm_heartbeat_address.GetString(), sizeof(m_szAddress));
+			m_flNextConnect = 0.0;
+		}
+		if (m_hConnection != k_HSteamNetConnection_Invalid || !m_szAddress[0] || Plat_FloatTime() < m_flNextConnect)
+			return;
+		m_flNextConnect = Plat_FloatTime() + k_flReconnectInterval;
+
+		SteamNetworkingIPAddr addr;
+		if (!addr.ParseString(m_szAddress))
+		{
+			// Don't try again until somebody fixes it
+			Warning("Invalid mm_heartbeat_address '%s'\n", m_szAddress);
+			m_flNextConnect = 1e30;
+			return;
+		}
+		if (addr.m_port == 0)
+			addr.m_port = DEFAULT_GAME_SERVER_PORT;
+
+		SteamNetworkingConfigValue_t opt;
+		opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (FnSteamNetConnectionStatusChanged)HeartbeatConnectionStatusChanged);
+		m_hConnection = SteamNetworkingSockets()->ConnectByIPAddress(addr, 1, &opt);
+		if (m_hConnection == k_HSteamNetConnection_Invalid)
+			Warning("Failed to connect to the matchmaking server at %s\n", m_szAddress);
+	}
+
+	void Disconnect(const char *pszReason)
+	{
+		if (m_hConnection == k_HSteamNetConnection_Invalid)
+			return;
+		SteamNetworkingSockets()->CloseConnection(m_hConnection, 0, pszReason, true);
+		m_hConnection = k_HSteamNetConnection_Invalid;
+		m_bConnected = false;
+	}
+
+	void PollIncomingMessages()
+	{
+		while (m_hConnection != k_HSteamNetConnection_Invalid)
+		{
+			ISteamNetworkingMessage *pIncomingMsg = nullptr;
+			int numMsgs = SteamNetworkingSockets()->ReceiveMessagesOnConnection(m_hConnection, &pIncomingMsg, 1);
+			if (numMsgs <= 0)
+				break;
+
+			MessageView msg(pIncomingMsg);
+			if (msg.IsValid() && msg.m_eType == game_server_setup)
+			{
+				LobbyData setup;
+				if (msg.Read(setup))
+					OnSetup(setup);
+			}
+			else if (msg.IsValid() && msg.m_eType == message_hello)
+			{
+				HelloData hello;
+				if (msg.Read(hello) && (hello.m_nVersion < k_nMinProtocolVersion || hello.m_nMinVersion > k_nProtocolVersion))
+				{
+					Warning("Matchmaking server speaks protocol version %u, we need %u to %u\n", hello.m_nVersion, k_nMinProtocolVersion, k_nProtocolVersion);
+					Disconnect("Incompatible protocol version");
+				}
+			}
+			pIncomingMsg->Release();
+		}
+	}
+
+	// Switches to the lobby's map and gamemode.  The heartbeat after the level
+	// has loaded carries the lobby, that's when players get sent over.
+	void OnSetup(const LobbyData &setup)
+	{
+		if (GetLobbyBucket(setup.m_map, setup.m_bTeamDM) < 0)
+			return;
+		Msg("Matchmaking server wants %s, team deathmatch %d, for lobby %u\n", ConvertMapToString(setup.m_map).c_str(), (int)setup.m_bTeamDM, setup.m_hLobbyID);
+
+		CHL2MPRules *pRules = HL2MPRules();
+		if (pRules && !pRules->IsIntermission() && pRules->IsTeamplay() == (setup.m_bTeamDM != 0) && ConvertStringToMap(STRING(gpGlobals->mapname)) == setup.m_map)
+		{
+			m_hLoadedLobby = setup.m_hLobbyID;
+			m_flNextHeartbeat = 0.0;
+			return;
+		}
+
+		m_hPendingLobby = setup.m_hLobbyID;
+		engine->ServerCommand(UTIL_VarArgs("mp_teamplay %d\n", (int)setup.m_bTeamDM));
+		engine->ServerCommand(UTIL_VarArgs("changelevel %s\n", ConvertMapToString(setup.m_map).c_str()));
+	}
+
+	void SendHeartbeat()
+	{
+		static ConVarRef hostport("hostport");
+
+		int nPlayers = 0, nSlotsTaken = 0;
+		for (int i = 1; i <= gpGlobals->maxClients; ++i)
+		{
+			CBasePlayer *pPlayer = UTIL_PlayerByIndex(i);
+			if (!pPlayer || !pPlayer->IsConnected())
+				continue;
+			++nSlotsTaken;
+			if (!pPlayer->IsFakeClient())
+				++nPlayers;
+		}
+
+		GameServerHeartbeat heartbeat;
+		heartbeat.m_nPort = (uint16)hostport.GetInt();
+		heartbeat.m_nPlayers = (uint8)Min(nPlayers, 255);
+		heartbeat.m_nMaxPlayers = (uint8)Min(gpGlobals->maxClients, 255);
+		heartbeat.m_map = ConvertStringToMap(STRING(gpGlobals->mapname));
+
+		CHL2MPRules *pRules = HL2MPRules();
+		heartbeat.m_bTeamDM = pRules ? (pRules->IsTeamplay() ? 1 : 0) : -1;
+		if (pRules && pRules->IsIntermission())
+			heartbeat.m_ePhase = game_phase_intermission;
+		else if (nPlayers == 0)
+			heartbeat.m_ePhase = game_phase_waiting;
+		else
+			heartbeat.m_ePhase = game_phase_playing;
+		heartbeat.m_hLobby = m_hLoadedLobby;
+
+		// Free slots are only worth filling while there's enough of the match left to play
+		heartbeat.m_nOpenSlots = 0;
+		if (mm_backfill.GetBool() && pRules && heartbeat.m_ePhase == game_phase_playing)
+		{
+			float flTimeLeft = pRules->GetMapRemainingTime();
+			if (flTimeLeft <= 0.0f && mp_timelimit.GetInt() <= 0)
+				flTimeLeft = FLT_MAX;
+			if (flTimeLeft > mm_backfill_cutoff.GetFloat())
+				heartbeat.m_nOpenSlots = (uint8)Clamp(gpGlobals->maxClients - nSlotsTaken, 0, 255);
+		}
+
+		// In hundredths of a millisecond
+		heartbeat.m_nFrameTimeAvg = (uint16)Min((m_nFrames ? m_flFrameTimeTotal / m_nFrames : 0.0) * 1e5, 65535.0);
+		heartbeat.m_nFrameTimeMax = (uint16)Min(m_flFrameTimeMax * 1e5, 65535.0);
+		ResetFrameTimes();
+
+		SendWireMessage(m_hConnection, heartbeat, k_nSteamNetworkingSend_Reliable, game_server_heartbeat, SteamNetworkingSockets());
+		m_flNextHeartbeat = Plat_FloatTime() + mm_heartbeat_interval.GetFloat();
+	}
+
+	void ResetFrameTimes()
+	{
+		m_flFrameTimeTotal = 0.0;
+		m_flFrameTimeMax = 0.0;
+		m_nFrames = 0;
+	}
+
+	bool m_bNetworkingReady;
+	HSteamNetConnection m_hConnection;
+	bool m_bConnected;
+
+	// Address we are connected or connecting to, as mm_heartbeat_address had it
+	char m_szAddress[64];
+	double m_flNextConnect;
+	double m_flNextHeartbeat;
+
+	// Lobby we are changing level for, and the one the current level was loaded for
+	HLobbyID m_hPendingLobby;
+	HLobbyID m_hLoadedLobby;
+
+	// Time spent in game frames since the last heartbeat
+	double m_flFrameStart;
+	double m_flFrameTimeTotal;
+	double m_flFrameTimeMax;
+	int m_nFrames;
+};
+
+static CMatchmakingHeartbeatSystem g_MatchmakingHeartbeatSystem;
+
+static void HeartbeatConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
+{
+	g_MatchmakingHeartbeatSystem.OnConnectionStatusChanged(pInfo);
+}
@@ -0,0 +1,53 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Connected clients, stored in slots that lobbies can point at
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_clients.h"
+#include <assert.h>
+
+int ClientTable::Add( HSteamNetConnection hConn )
+{
+	assert( Find( hConn ) == -1 );
+
+	int iClient;
+	if ( !m_vecFreeSlots.empty() )
+	{
+		iClient = m_vecFreeSlots.back();
+		m_vecFreeSlots.pop_back();
+		m_vecClients[ iClient ] = Client_t();
+	}
+	else
+	{
+		iClient = (int)m_vecClients.size();
+		m_vecClients.push_back( Client_t() );
+	}
+
+	m_vecClients[ iClient ].m_hConn = hConn;
+	m_mapIndices.Insert( hConn, iClient );
+	return iClient;
+}
+
+int ClientTable::Find( HSteamNetConnection hConn ) const
+{
+	const int *piClient = m_mapIndices.Find( hConn );
+	return piClient ? *piClient : -1;
+}
+
+void ClientTable::Remove( int iClient )
+{
+	if ( !IsValid( iClient ) )
+		return;
+	m_mapIndices.Remove( m_vecClients[ iClient ].m_hConn );
+	m_vecClients[ iClient ].m_hConn = k_HSteamNetConnection_Invalid;
+	m_vecFreeSlots.push_back( iClient );
+}
+
+void ClientTable::Clear()
+{
+	m_vecClients.clear();
+	m_vecFreeSlots.clear();
+	m_mapIndices.Clear();
+}
@@ -0,0 +1,56 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Connected clients, stored in slots that lobbies can point at
+//
+//=============================================================================
+
+#ifndef MM_CLIENTS_H
+#define MM_CLIENTS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <vector>
+#include "mm_shared.h"
+#include "mm_flat_map.h"
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// ClientTable
+//
+// Every client gets a slot that stays the same for as long as they are
+// connected, so lobbies can list their players as slot indices instead of
+// copies of the client.  Freed slots are handed out again to the next
+// client that connects.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class ClientTable
+{
+public:
+	/// Returns the new client's index
+	int Add( HSteamNetConnection hConn );
+
+	/// Returns -1 if there is no such client
+	int Find( HSteamNetConnection hConn ) const;
+
+	void Remove( int iClient );
+	void Clear();
+
+	/// Slots run from 0 to GetSlotCount() - 1, check IsValid before using one
+	int GetSlotCount() const { return (int)m_vecClients.size(); }
+	bool IsValid( int iClient ) const { return iClient >= 0 && iClient < GetSlotCount() && m_vecClients[ iClient ].m_hConn != k_HSteamNetConnection_Invalid; }
+
+	Client_t &Get( int iClient ) { return m_vecClients[ iClient ]; }
+	const Client_t &Get( int iClient ) const { return m_vecClients[ iClient ]; }
+
+	int Count() const { return (int)m_mapIndices.Count(); }
+	bool Empty() const { return m_mapIndices.Empty(); }
+
+private:
+	std::vector< Client_t > m_vecClients;
+	std::vector< int > m_vecFreeSlots;
+	FlatHashMap< int > m_mapIndices;
+};
+
+#endif
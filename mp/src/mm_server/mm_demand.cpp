@@ -0,0 +1,56 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		How many players start searching on each map and gamemode
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_demand.h"
+#include <string.h>
+
+DemandTracker::DemandTracker()
+{
+	memset( m_nCounts, 0, sizeof(m_nCounts) );
+	memset( m_nTotals, 0, sizeof(m_nTotals) );
+	m_nCurrentSec = -1;
+}
+
+void DemandTracker::RecordSearches( int iBucket, int nSearches, SteamNetworkingMicroseconds usecNow )
+{
+	if ( iBucket < 0 || iBucket >= k_nNumLobbyBuckets || nSearches <= 0 )
+		return;
+	Advance( usecNow );
+	m_nCounts[ iBucket ][ m_nCurrentSec % k_nWindowSecs ] += nSearches;
+	m_nTotals[ iBucket ] += nSearches;
+}
+
+float DemandTracker::GetRate( int iBucket, SteamNetworkingMicroseconds usecNow )
+{
+	if ( iBucket < 0 || iBucket >= k_nNumLobbyBuckets )
+		return 0.0f;
+	Advance( usecNow );
+	return m_nTotals[ iBucket ] / (float)k_nWindowSecs;
+}
+
+void DemandTracker::Advance( SteamNetworkingMicroseconds usecNow )
+{
+	int64 nSec = usecNow / 1000000;
+	if ( m_nCurrentSec < 0 || nSec - m_nCurrentSec >= k_nWindowSecs )
+	{
+		// Nothing in the window is recent enough to keep
+		memset( m_nCounts, 0, sizeof(m_nCounts) );
+		memset( m_nTotals, 0, sizeof(m_nTotals) );
+		m_nCurrentSec = nSec;
+		return;
+	}
+	while ( m_nCurrentSec < nSec )
+	{
+		++m_nCurrentSec;
+		int iSlot = (int)( m_nCurrentSec % k_nWindowSecs );
+		for ( int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket )
+		{
+			m_nTotals[ iBucket ] -= m_nCounts[ iBucket ][ iSlot ];
+			m_nCounts[ iBucket ][ iSlot ] = 0;
+		}
+	}
+}
@@ -0,0 +1,50 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		How many players start searching on each map and gamemode
+//
+//=============================================================================
+
+#ifndef MM_DEMAND_H
+#define MM_DEMAND_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <steam/steamnetworkingtypes.h>
+#include "mm_shared.h"
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// DemandTracker
+//
+// Searches started in every lobby bucket over the last k_nWindowSecs
+// seconds, one counter per second in a ring.  The rate is an average over
+// the whole window, so a burst raises it for a minute and then drops out
+// again.  Main thread only.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class DemandTracker
+{
+public:
+	DemandTracker();
+
+	void RecordSearches( int iBucket, int nSearches, SteamNetworkingMicroseconds usecNow );
+
+	/// Searches per second that started in the bucket recently
+	float GetRate( int iBucket, SteamNetworkingMicroseconds usecNow );
+
+	static const int k_nWindowSecs = 60;
+
+private:
+	/// Empties the counters of every second that went by since the last call
+	void Advance( SteamNetworkingMicroseconds usecNow );
+
+	uint32 m_nCounts[ k_nNumLobbyBuckets ][ k_nWindowSecs ];
+	uint32 m_nTotals[ k_nNumLobbyBuckets ];
+
+	// Second the newest counters are for, negative before the first search
+	int64 m_nCurrentSec;
+};
+
+#endif
@@ -0,0 +1,509 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Links between the matchmaking servers of a cluster
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_federation.h"
+#include "mm_log.h"
+#include <steam/isteamnetworkingutils.h>
+#include <stdarg.h>
+
+// How long to wait before dialing a node we lost again
+static const SteamNetworkingMicroseconds k_usecRedialInterval = 3 * 1000000;
+
+// Why we closed a link.  A node whose link was closed as a duplicate stops
+// dialing, the other one keeps its own connection up.
+static const int k_nEndDuplicateLink = k_ESteamNetConnectionEnd_App_Min + 1;
+static const int k_nEndCantLink = k_ESteamNetConnectionEnd_App_Min + 2;
+static const int k_nEndNotAPeer = k_ESteamNetConnectionEnd_App_Min + 3;
+
+// Most players one handoff can carry
+static const int k_nMaxHandoffPlayers = 255;
+
+static void FederationLog( LogLevel eLevel, const char *fmt, ... )
+{
+	va_list ap;
+	va_start( ap, fmt );
+	g_Log.Write( eLevel, fmt, ap );
+	va_end( ap );
+}
+
+static bool ReadMapAndMode( WireReader &reader, HL2DM_Map &map, char &bTeamDM )
+{
+	uint32 nMap;
+	uint8 nTeamDM;
+	if ( !reader.ReadUint32( nMap ) || nMap > (uint32)invalid_map || !reader.ReadUint8( nTeamDM ) )
+		return false;
+	map = (HL2DM_Map)nMap;
+	bTeamDM = (char)(int8)nTeamDM;
+	return bTeamDM >= -1 && bTeamDM <= 1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Peer messages.  Like everything else on the wire they are written field
+// by field, but they vary in length, so they have no WireFormat of their own.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+static void WriteSummary( const PeerSummary &summary, std::vector< uint8 > &vecOut )
+{
+	// version, node ID, client port, clients, bucket count, waiting per bucket, ready lobbies, server count
+	vecOut.resize( 2 + 2 + 2 + 4 + 1 + 2 * k_nNumLobbyBuckets + 2 + 2 + summary.m_vecGameServers.size() * 25 );
+	WireWriter writer( vecOut.data(), (uint32)vecOut.size() );
+	writer.WriteUint16( summary.m_nVersion );
+	writer.WriteUint16( summary.m_nNodeID );
+	writer.WriteUint16( summary.m_nClientPort );
+	writer.WriteUint32( summary.m_nClients );
+	writer.WriteUint8( (uint8)k_nNumLobbyBuckets );
+	for ( int i = 0; i < k_nNumLobbyBuckets; ++i )
+		writer.WriteUint16( summary.m_nWaiting[ i ] );
+	writer.WriteUint16( summary.m_nReadyLobbies );
+	writer.WriteUint16( (uint16)summary.m_vecGameServers.size() );
+	for ( const PeerGameServer &server: summary.m_vecGameServers )
+	{
+		writer.WriteBytes( server.m_ipv6, sizeof(server.m_ipv6) );
+		writer.WriteUint16( server.m_nPort );
+		writer.WriteUint8( server.m_nCapacity );
+		writer.WriteUint8( (uint8)server.m_eState );
+		writer.WriteUint32( (uint32)server.m_map );
+		writer.WriteUint8( (uint8)server.m_bTeamDM );
+	}
+}
+
+static bool ReadSummary( const MessageView &msg, PeerSummary &summary )
+{
+	WireReader reader( msg.m_pPayload, msg.m_cbPayload );
+	uint8 nBuckets;
+	uint16 nServers;
+	if ( !reader.ReadUint16( summary.m_nVersion ) || !reader.ReadUint16( summary.m_nNodeID ) || !reader.ReadUint16( summary.m_nClientPort ) ||
+		!reader.ReadUint32( summary.m_nClients ) || !reader.ReadUint8( nBuckets ) || nBuckets != k_nNumLobbyBuckets )
+		return false;
+	for ( int i = 0; i < k_nNumLobbyBuckets; ++i )
+	{
+		if ( !reader.ReadUint16( summary.m_nWaiting[ i ] ) )
+			return false;
+	}
+	if ( !reader.ReadUint16( summary.m_nReadyLobbies ) || !reader.ReadUint16( nServers ) )
+		return false;
+
+	summary.m_vecGameServers.resize( nServers );
+	for ( PeerGameServer &server: summary.m_vecGameServers )
+	{
+		uint8 nState;
+		if ( !reader.ReadBytes( server.m_ipv6, sizeof(server.m_ipv6) ) || !reader.ReadUint16( server.m_nPort ) || !reader.ReadUint8( server.m_nCapacity ) ||
+			!reader.ReadUint8( nState ) || nState > game_server_draining || !ReadMapAndMode( reader, server.m_map, server.m_bTeamDM ) )
+			return false;
+		server.m_eState = (GameServerState)nState;
+	}
+	return true;
+}
+
+static void WriteHandoff( const PeerHandoff &handoff, std::vector< uint8 > &vecOut )
+{
+	// ID, bucket, lobby or not, filled age, player count, then every player:
+	// token, Steam ID, nick, rating, search age
+	vecOut.resize( 4 + 1 + 1 + 4 + 1 + handoff.m_vecPlayers.size() * ( 8 + 8 + k_cchMaxNick + 4 + 4 ) );
+	WireWriter writer( vecOut.data(), (uint32)vecOut.size() );
+	writer.WriteUint32( handoff.m_nHandoffID );
+	writer.WriteUint8( (uint8)handoff.m_iBucket );
+	writer.WriteUint8( handoff.m_bLobby ? 1 : 0 );
+	writer.WriteUint32( handoff.m_nFilledAgeMS );
+	writer.WriteUint8( (uint8)handoff.m_vecPlayers.size() );
+	for ( const PeerPlayer &player: handoff.m_vecPlayers )
+	{
+		uint32 nRatingBits;
+		memcpy( &nRatingBits, &player.m_flRating, sizeof(nRatingBits) );
+		writer.WriteUint64( player.m_nResumeToken );
+		writer.WriteUint64( player.m_steamID );
+		writer.WriteBytes( player.m_szNick, k_cchMaxNick );
+		writer.WriteUint32( nRatingBits );
+		writer.WriteUint32( player.m_nSearchAgeMS );
+	}
+}
+
+static bool ReadHandoff( const MessageView &msg, PeerHandoff &handoff )
+{
+	WireReader reader( msg.m_pPayload, msg.m_cbPayload );
+	uint8 nBucket, nLobby, nPlayers;
+	if ( !reader.ReadUint32( handoff.m_nHandoffID ) || !reader.ReadUint8( nBucket ) || nBucket >= k_nNumLobbyBuckets ||
+		!reader.ReadUint8( nLobby ) || !reader.ReadUint32( handoff.m_nFilledAgeMS ) || !reader.ReadUint8( nPlayers ) )
+		return false;
+	handoff.m_iBucket = nBucket;
+	handoff.m_bLobby = nLobby != 0;
+
+	handoff.m_vecPlayers.resize( nPlayers );
+	for ( PeerPlayer &player: handoff.m_vecPlayers )
+	{
+		uint32 nRatingBits;
+		if ( !reader.ReadUint64( player.m_nResumeToken ) || !player.m_nResumeToken || !reader.ReadUint64( player.m_steamID ) ||
+			!reader.ReadBytes( player.m_szNick, k_cchMaxNick ) || !reader.ReadUint32( nRatingBits ) || !reader.ReadUint32( player.m_nSearchAgeMS ) )
+			return false;
+		player.m_szNick[ k_cchMaxNick - 1 ] = '\0';
+		memcpy( &player.m_flRating, &nRatingBits, sizeof(player.m_flRating) );
+	}
+	return true;
+}
+
+Federation::Federation()
+{
+	m_pInterface = nullptr;
+	m_hListenSock = k_HSteamListenSocket_Invalid;
+	m_hPollGroup = k_HSteamNetPollGroup_Invalid;
+	m_fnCallback = nullptr;
+	m_nNodeID = 0;
+	m_nPort = 0;
+	m_nSummariesReceived = 0;
+	m_nBytesReceived = 0;
+	m_nBytesSent = 0;
+}
+
+bool Federation::Start( ISteamNetworkingSockets *pInterface, uint16 nNodeID, uint16 nPort, const std::vector< SteamNetworkingIPAddr > &vecPeers, FnSteamNetConnectionStatusChanged fnCallback, std::string &sError )
+{
+	m_pInterface = pInterface;
+	m_nNodeID = nNodeID;
+	m_nPort = nPort;
+	m_fnCallback = fnCallback;
+
+	SteamNetworkingIPAddr addrLocal;
+	addrLocal.Clear();
+	addrLocal.m_port = nPort;
+	SteamNetworkingConfigValue_t opt;
+	opt.SetPtr( k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)fnCallback );
+	m_hListenSock = m_pInterface->CreateListenSocketIP( addrLocal, 1, &opt );
+	if ( m_hListenSock == k_HSteamListenSocket_Invalid )
+	{
+		sError = "can't listen on port " + std::to_string( nPort );
+		return false;
+	}
+	m_hPollGroup = m_pInterface->CreatePollGroup();
+	if ( m_hPollGroup == k_HSteamNetPollGroup_Invalid )
+	{
+		m_pInterface->CloseListenSocket( m_hListenSock );
+		m_hListenSock = k_HSteamListenSocket_Invalid;
+		sError = "can't create poll group";
+		return false;
+	}
+
+	for ( const SteamNetworkingIPAddr &addr: vecPeers )
+	{
+		DialedPeer peer;
+		peer.m_addr = addr;
+		peer.m_bConnected = false;
+		peer.m_bGivenUp = false;
+		peer.m_usecRetry = 0;
+		m_vecDialed.push_back( peer );
+		Dial( (int)m_vecDialed.size() - 1 );
+	}
+	return true;
+}
+
+void Federation::Stop()
+{
+	if ( !m_pInterface )
+		return;
+	for ( const PeerNode &node: m_vecNodes )
+		m_pInterface->CloseConnection( node.m_hConn, 0, "Server Shutdown", true );
+	m_vecNodes.clear();
+	m_vecDialed.clear();
+	if ( m_hListenSock != k_HSteamListenSocket_Invalid )
+		m_pInterface->CloseListenSocket( m_hListenSock );
+	m_hListenSock = k_HSteamListenSocket_Invalid;
+	if ( m_hPollGroup != k_HSteamNetPollGroup_Invalid )
+		m_pInterface->DestroyPollGroup( m_hPollGroup );
+	m_hPollGroup = k_HSteamNetPollGroup_Invalid;
+}
+
+void Federation::Dial( int iDialed )
+{
+	DialedPeer &peer = m_vecDialed[ iDialed ];
+	SteamNetworkingConfigValue_t opt;
+	opt.SetPtr( k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)m_fnCallback );
+	HSteamNetConnection hConn = m_pInterface->ConnectByIPAddress( peer.m_addr, 1, &opt );
+	if ( hConn == k_HSteamNetConnection_Invalid || !m_pInterface->SetConnectionPollGroup( hConn, m_hPollGroup ) )
+	{
+		if ( hConn != k_HSteamNetConnection_Invalid )
+			m_pInterface->CloseConnection( hConn, 0, nullptr, false );
+		peer.m_usecRetry = SteamNetworkingUtils()->GetLocalTimestamp() + k_usecRedialInterval;
+		return;
+	}
+
+	PeerNode node;
+	node.m_hConn = hConn;
+	node.m_iDialed = iDialed;
+	m_vecNodes.push_back( node );
+	peer.m_bConnected = true;
+}
+
+// Only the hosts in the --peer list get to link up with us.  Whatever port
+// they dial from is fine, a node's outgoing port isn't the one it listens on.
+bool Federation::IsPeerAddress( const SteamNetworkingIPAddr &addr ) const
+{
+	for ( const DialedPeer &peer: m_vecDialed )
+	{
+		if ( memcmp( peer.m_addr.m_ipv6, addr.m_ipv6, sizeof(addr.m_ipv6) ) == 0 )
+			return true;
+	}
+	return false;
+}
+
+int Federation::FindConn( HSteamNetConnection hConn ) const
+{
+	for ( size_t i = 0; i < m_vecNodes.size(); ++i )
+	{
+		if ( m_vecNodes[ i ].m_hConn == hConn )
+			return (int)i;
+	}
+	return -1;
+}
+
+const PeerNode *Federation::FindNode( uint16 nNodeID ) const
+{
+	for ( const PeerNode &node: m_vecNodes )
+	{
+		if ( node.m_bLinked && node.m_summary.m_nNodeID == nNodeID )
+			return &node;
+	}
+	return nullptr;
+}
+
+// Closing a connection ourselves doesn't call us back, so the node is forgotten right here
+void Federation::CloseNode( int iNode, int nReason, const char *pszReason )
+{
+	PeerNode node = m_vecNodes[ iNode ];
+	m_vecNodes.erase( m_vecNodes.begin() + iNode );
+	m_pInterface->CloseConnection( node.m_hConn, nReason, pszReason, false );
+	if ( node.m_iDialed < 0 )
+		return;
+	DialedPeer &peer = m_vecDialed[ node.m_iDialed ];
+	peer.m_bConnected = false;
+	peer.m_usecRetry = SteamNetworkingUtils()->GetLocalTimestamp() + k_usecRedialInterval;
+	if ( nReason == k_nEndDuplicateLink || nReason == k_nEndCantLink )
+		peer.m_bGivenUp = true;
+}
+
+bool Federation::OnConnectionStatusChanged( SteamNetConnectionStatusChangedCallback_t *pInfo )
+{
+	int iNode = FindConn( pInfo->m_hConn );
+	bool bOurListenSock = m_hListenSock != k_HSteamListenSocket_Invalid && pInfo->m_info.m_hListenSocket == m_hListenSock;
+	if ( iNode < 0 && !bOurListenSock )
+		return false;
+
+	switch ( pInfo->m_info.m_eState )
+	{
+		case k_ESteamNetworkingConnectionState_ClosedByPeer:
+		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+		{
+			if ( iNode < 0 )
+			{
+				m_pInterface->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
+				break;
+			}
+			const PeerNode &node = m_vecNodes[ iNode ];
+			if ( node.m_bLinked )
+				FederationLog( log_warning, "CLUSTER: LOST NODE %u, REASON %d: %s\n", node.m_summary.m_nNodeID, pInfo->m_info.m_eEndReason, pInfo->m_info.m_szEndDebug );
+			else
+				FederationLog( log_debug, "CLUSTER: CONNECTION %s CLOSED BEFORE IT LINKED UP, REASON %d: %s\n", pInfo->m_info.m_szConnectionDescription, pInfo->m_info.m_eEndReason, pInfo->m_info.m_szEndDebug );
+
+			// They already closed it as a duplicate or a node they can't link with, so don't dial them again
+			int nReason = pInfo->m_info.m_eEndReason == k_nEndDuplicateLink || pInfo->m_info.m_eEndReason == k_nEndCantLink ? pInfo->m_info.m_eEndReason : 0;
+			CloseNode( iNode, nReason, nullptr );
+			break;
+		}
+
+		case k_ESteamNetworkingConnectionState_Connecting:
+		{
+			if ( !bOurListenSock || iNode >= 0 )
+				break;
+			if ( !IsPeerAddress( pInfo->m_info.m_addrRemote ) )
+			{
+				FederationLog( log_warning, "CLUSTER: REFUSED CONNECTION FROM %s, IT ISN'T ONE OF OUR PEERS\n", SteamNetworkingIPAddrRender( pInfo->m_info.m_addrRemote, false ).c_str() );
+				m_pInterface->CloseConnection( pInfo->m_hConn, k_nEndNotAPeer, "Not a peer", false );
+				break;
+			}
+			if ( m_pInterface->AcceptConnection( pInfo->m_hConn ) != k_EResultOK || !m_pInterface->SetConnectionPollGroup( pInfo->m_hConn, m_hPollGroup ) )
+			{
+				m_pInterface->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
+				break;
+			}
+			PeerNode node;
+			node.m_hConn = pInfo->m_hConn;
+			m_vecNodes.push_back( node );
+			break;
+		}
+
+		default:
+			break;
+	}
+	return true;
+}
+
+bool Federation::Update( SteamNetworkingMicroseconds usecNow )
+{
+	bool bDidWork = false;
+	for ( size_t i = 0; i < m_vecDialed.size(); ++i )
+	{
+		DialedPeer &peer = m_vecDialed[ i ];
+		if ( peer.m_bConnected || peer.m_bGivenUp || usecNow < peer.m_usecRetry )
+			continue;
+		Dial( (int)i );
+		bDidWork = true;
+	}
+	return bDidWork;
+}
+
+void Federation::OnSummary( int iNode, const PeerSummary &summary, SteamNetworkingMicroseconds usecNow )
+{
+	PeerNode &node = m_vecNodes[ iNode ];
+	if ( node.m_bLinked )
+	{
+		// Node IDs don't change under a link
+		if ( summary.m_nNodeID == node.m_summary.m_nNodeID )
+		{
+			node.m_summary = summary;
+			node.m_usecSummary = usecNow;
+		}
+		return;
+	}
+
+	if ( summary.m_nVersion != k_nPeerProtocolVersion || summary.m_nNodeID == m_nNodeID )
+	{
+		FederationLog( log_error, "CLUSTER: CAN'T LINK WITH NODE %u SPEAKING VERSION %u, WE ARE NODE %u SPEAKING VERSION %u\n",
+			summary.m_nNodeID, summary.m_nVersion, m_nNodeID, k_nPeerProtocolVersion );
+		CloseNode( iNode, k_nEndCantLink, "Can't link" );
+		return;
+	}
+
+	// Both of us dialed the other.  Whichever connection the lower node ID
+	// dialed is kept, both ends come to the same answer.  A node that dialed
+	// us again after restarting replaces its old connection.
+	for ( size_t i = 0; i < m_vecNodes.size(); ++i )
+	{
+		const PeerNode &other = m_vecNodes[ i ];
+		if ( (int)i == iNode || !other.m_bLinked || other.m_summary.m_nNodeID != summary.m_nNodeID )
+			continue;
+		bool bOtherDialedByUs = other.m_iDialed >= 0;
+		bool bNewDialedByUs = node.m_iDialed >= 0;
+		bool bKeepOther = bOtherDialedByUs != bNewDialedByUs && bOtherDialedByUs == ( m_nNodeID < summary.m_nNodeID );
+		if ( bKeepOther )
+		{
+			CloseNode( iNode, k_nEndDuplicateLink, "Duplicate link" );
+			return;
+		}
+		CloseNode( (int)i, k_nEndDuplicateLink, "Duplicate link" );
+		if ( (int)i < iNode )
+			--iNode;
+		break;
+	}
+
+	PeerNode &linked = m_vecNodes[ iNode ];
+	SteamNetConnectionInfo_t info;
+	if ( m_pInterface->GetConnectionInfo( linked.m_hConn, &info ) )
+		linked.m_addrClients = info.m_addrRemote;
+	linked.m_addrClients.m_port = summary.m_nClientPort;
+	linked.m_bLinked = true;
+	linked.m_summary = summary;
+	linked.m_usecSummary = usecNow;
+	FederationLog( log_info, "CLUSTER: LINKED WITH NODE %u, ITS PLAYERS CONNECT TO %s\n", summary.m_nNodeID, SteamNetworkingIPAddrRender( linked.m_addrClients ).c_str() );
+}
+
+bool Federation::ReceiveMessages( SteamNetworkingMicroseconds usecNow, std::vector< PeerHandoff > &vecHandoffs, std::vector< PeerHandoffResult > &vecResults )
+{
+	if ( m_hPollGroup == k_HSteamNetPollGroup_Invalid )
+		return false;
+
+	ISteamNetworkingMessage *pIncomingMsgs[ 64 ];
+	bool bGotMessages = false;
+	while ( true )
+	{
+		int numMsgs = m_pInterface->ReceiveMessagesOnPollGroup( m_hPollGroup, pIncomingMsgs, 64 );
+		if ( numMsgs <= 0 )
+			break;
+		bGotMessages = true;
+
+		for ( int i = 0; i < numMsgs; ++i )
+		{
+			MessageView msg( pIncomingMsgs[ i ] );
+			m_nBytesReceived += pIncomingMsgs[ i ]->m_cbSize;
+			int iNode = FindConn( msg.m_hConn );
+			if ( iNode < 0 || !msg.IsValid() )
+			{
+				pIncomingMsgs[ i ]->Release();
+				continue;
+			}
+
+			if ( msg.m_eType == peer_summary )
+			{
+				PeerSummary summary;
+				if ( ReadSummary( msg, summary ) )
+				{
+					++m_nSummariesReceived;
+					OnSummary( iNode, summary, usecNow );
+				}
+			}
+			else if ( m_vecNodes[ iNode ].m_bLinked && msg.m_eType == peer_handoff )
+			{
+				PeerHandoff handoff;
+				handoff.m_nFromNode = m_vecNodes[ iNode ].m_summary.m_nNodeID;
+				if ( ReadHandoff( msg, handoff ) )
+					vecHandoffs.push_back( handoff );
+			}
+			else if ( m_vecNodes[ iNode ].m_bLinked && msg.m_eType == peer_handoff_result )
+			{
+				WireReader reader( msg.m_pPayload, msg.m_cbPayload );
+				PeerHandoffResult result;
+				uint8 nAccepted;
+				result.m_nFromNode = m_vecNodes[ iNode ].m_summary.m_nNodeID;
+				if ( reader.ReadUint32( result.m_nHandoffID ) && reader.ReadUint8( nAccepted ) )
+				{
+					result.m_bAccepted = nAccepted != 0;
+					vecResults.push_back( result );
+				}
+			}
+			pIncomingMsgs[ i ]->Release();
+		}
+	}
+	return bGotMessages;
+}
+
+bool Federation::Send( HSteamNetConnection hConn, const std::vector< uint8 > &vecPayload, MessageType eType )
+{
+	if ( SendTypedMessage( hConn, vecPayload.data(), (uint32)vecPayload.size(), k_nSteamNetworkingSend_Reliable, nullptr, eType, m_pInterface ) != k_EResultOK )
+		return false;
+	m_nBytesSent += vecPayload.size() + 1;
+	return true;
+}
+
+void Federation::BroadcastSummary( PeerSummary &summary )
+{
+	summary.m_nVersion = k_nPeerProtocolVersion;
+	summary.m_nNodeID = m_nNodeID;
+	WriteSummary( summary, m_vecScratch );
+
+	// Connections that haven't linked up yet get it too, it's how they learn who we are
+	for ( const PeerNode &node: m_vecNodes )
+		Send( node.m_hConn, m_vecScratch, peer_summary );
+}
+
+bool Federation::SendHandoff( uint16 nNodeID, const PeerHandoff &handoff )
+{
+	const PeerNode *pNode = FindNode( nNodeID );
+	if ( !pNode || handoff.m_vecPlayers.empty() || handoff.m_vecPlayers.size() > (size_t)k_nMaxHandoffPlayers )
+		return false;
+	WriteHandoff( handoff, m_vecScratch );
+	return Send( pNode->m_hConn, m_vecScratch, peer_handoff );
+}
+
+void Federation::SendHandoffResult( uint16 nNodeID, uint32 nHandoffID, bool bAccepted )
+{
+	const PeerNode *pNode = FindNode( nNodeID );
+	if ( !pNode )
+		return;
+	m_vecScratch.resize( 5 );
+	WireWriter writer( m_vecScratch.data(), (uint32)m_vecScratch.size() );
+	writer.WriteUint32( nHandoffID );
+	writer.WriteUint8( bAccepted ? 1 : 0 );
+	Send( pNode->m_hConn, m_vecScratch, peer_handoff_result );
+}
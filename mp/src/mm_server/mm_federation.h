@@ -0,0 +1,206 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Links between the matchmaking servers of a cluster
+//
+//=============================================================================
+
+#ifndef MM_FEDERATION_H
+#define MM_FEDERATION_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <steam/steamnetworkingsockets.h>
+#include <string>
+#include <vector>
+#include "mm_shared.h"
+#include "mm_gameservers.h"
+
+/// Bumped whenever the peer messages change.  Nodes only link up with nodes
+/// of the same version, a cluster is upgraded all at once.
+const uint16 k_nPeerProtocolVersion = 1;
+
+/// A game server as the node that hands it out tells the rest of the cluster
+struct PeerGameServer
+{
+	PeerGameServer()
+	{
+		memset( m_ipv6, 0, sizeof(m_ipv6) );
+		m_nPort = 0;
+		m_nCapacity = 0;
+		m_eState = game_server_idle;
+		m_map = invalid_map;
+		m_bTeamDM = -1;
+	}
+
+	uint8 m_ipv6[16];
+	uint16 m_nPort;
+	uint8 m_nCapacity;
+	GameServerState m_eState;
+	HL2DM_Map m_map;
+	char m_bTeamDM;
+};
+
+/// What every node tells the others as peer_summary a few times a second.
+/// The first one on a link doubles as its hello.
+struct PeerSummary
+{
+	PeerSummary()
+	{
+		m_nVersion = 0;
+		m_nNodeID = 0;
+		m_nClientPort = 0;
+		m_nClients = 0;
+		memset( m_nWaiting, 0, sizeof(m_nWaiting) );
+		m_nReadyLobbies = 0;
+	}
+
+	uint16 m_nVersion;
+	uint16 m_nNodeID;
+	uint16 m_nClientPort;		// where its players connect
+	uint32 m_nClients;
+	uint16 m_nWaiting[ k_nNumLobbyBuckets ];	// players searching, by lobby bucket
+	uint16 m_nReadyLobbies;		// full lobbies waiting for a game server
+	std::vector< PeerGameServer > m_vecGameServers;
+};
+
+/// A player moving to another node
+struct PeerPlayer
+{
+	uint64 m_nResumeToken;
+	uint64 m_steamID;
+	char m_szNick[ k_cchMaxNick ];
+	float m_flRating;
+	uint32 m_nSearchAgeMS;		// how long they have been searching so far
+};
+
+/// Searching players, or a full lobby, that a node offers another as
+/// peer_handoff.  The other node keeps a place for them and answers with
+/// peer_handoff_result, and if it took them, the players are redirected.
+/// Ages rather than timestamps, the nodes' clocks have nothing to do with
+/// each other.
+struct PeerHandoff
+{
+	uint32 m_nHandoffID;
+	uint16 m_nFromNode;			// filled in when it's received
+	int m_iBucket;
+	bool m_bLobby;
+	uint32 m_nFilledAgeMS;		// how long ago the lobby filled up
+	std::vector< PeerPlayer > m_vecPlayers;
+};
+
+struct PeerHandoffResult
+{
+	uint32 m_nHandoffID;
+	uint16 m_nFromNode;
+	bool m_bAccepted;
+};
+
+/// Another node, or a connection that may turn out to be one
+struct PeerNode
+{
+	PeerNode()
+	{
+		m_hConn = k_HSteamNetConnection_Invalid;
+		m_iDialed = -1;
+		m_bLinked = false;
+		m_addrClients.Clear();
+		m_usecSummary = 0;
+	}
+
+	HSteamNetConnection m_hConn;
+	int m_iDialed;				// in the --peer list if we dialed it, -1 if it dialed us
+	bool m_bLinked;				// sent its first summary
+	SteamNetworkingIPAddr m_addrClients;
+	PeerSummary m_summary;
+	SteamNetworkingMicroseconds m_usecSummary;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Federation
+//
+// Several matchmaking servers can run as one cluster.  Each one owns its
+// players, lobbies and game servers like a lone server would, and they keep
+// each other up to date over GameNetworkingSockets connections on a port of
+// their own: how many players are searching in every bucket, and which game
+// servers they have and what those are doing.  What to make of that is up
+// to the caller, this only keeps the links up and carries the messages.
+//
+// Every node has every other one in its peer list, connections from any
+// other host are refused.  A link only needs one of its two nodes to dial
+// the other.  If both do, the connection dialed by the node with the lower
+// ID is kept.  Nodes that drop
+// are dialed again every few seconds.  Main thread only.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class Federation
+{
+public:
+	Federation();
+
+	/// Listens for other nodes on nPort and starts dialing the ones in vecPeers
+	bool Start( ISteamNetworkingSockets *pInterface, uint16 nNodeID, uint16 nPort, const std::vector< SteamNetworkingIPAddr > &vecPeers, FnSteamNetConnectionStatusChanged fnCallback, std::string &sError );
+	void Stop();
+
+	/// Returns false if the callback is about a connection that isn't ours
+	bool OnConnectionStatusChanged( SteamNetConnectionStatusChangedCallback_t *pInfo );
+
+	/// Dials nodes we lost again.  Returns true if it did.
+	bool Update( SteamNetworkingMicroseconds usecNow );
+
+	/// Takes in everything the other nodes sent.  Summaries go into the node
+	/// list, handoffs and answers to ours are added to the vectors.  Returns
+	/// true if anything came in.
+	bool ReceiveMessages( SteamNetworkingMicroseconds usecNow, std::vector< PeerHandoff > &vecHandoffs, std::vector< PeerHandoffResult > &vecResults );
+
+	/// Sends our summary to every node, version and node ID are filled in here
+	void BroadcastSummary( PeerSummary &summary );
+	bool SendHandoff( uint16 nNodeID, const PeerHandoff &handoff );
+	void SendHandoffResult( uint16 nNodeID, uint32 nHandoffID, bool bAccepted );
+
+	/// Includes connections that haven't linked up yet, check m_bLinked
+	const std::vector< PeerNode > &GetNodes() const { return m_vecNodes; }
+	const PeerNode *FindNode( uint16 nNodeID ) const;
+	uint16 GetNodeID() const { return m_nNodeID; }
+	uint16 GetPort() const { return m_nPort; }
+	bool IsRunning() const { return m_hListenSock != k_HSteamListenSocket_Invalid; }
+
+	uint64 GetNumSummariesReceived() const { return m_nSummariesReceived; }
+	uint64 GetNumBytesReceived() const { return m_nBytesReceived; }
+	uint64 GetNumBytesSent() const { return m_nBytesSent; }
+
+private:
+	struct DialedPeer
+	{
+		SteamNetworkingIPAddr m_addr;
+		bool m_bConnected;
+		bool m_bGivenUp;		// the other node dials us instead
+		SteamNetworkingMicroseconds m_usecRetry;
+	};
+
+	void Dial( int iDialed );
+	bool IsPeerAddress( const SteamNetworkingIPAddr &addr ) const;
+	int FindConn( HSteamNetConnection hConn ) const;
+	void CloseNode( int iNode, int nReason, const char *pszReason );
+	void OnSummary( int iNode, const PeerSummary &summary, SteamNetworkingMicroseconds usecNow );
+	bool Send( HSteamNetConnection hConn, const std::vector< uint8 > &vecPayload, MessageType eType );
+
+	ISteamNetworkingSockets *m_pInterface;
+	HSteamListenSocket m_hListenSock;
+	HSteamNetPollGroup m_hPollGroup;
+	FnSteamNetConnectionStatusChanged m_fnCallback;
+	uint16 m_nNodeID;
+	uint16 m_nPort;
+
+	std::vector< DialedPeer > m_vecDialed;
+	std::vector< PeerNode > m_vecNodes;
+	std::vector< uint8 > m_vecScratch;
+
+	uint64 m_nSummariesReceived;
+	uint64 m_nBytesReceived;
+	uint64 m_nBytesSent;
+};
+
+#endif
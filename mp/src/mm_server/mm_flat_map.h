@@ -0,0 +1,168 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Open addressing hash map for integer handles
+//
+//=============================================================================
+
+#ifndef MM_FLAT_MAP_H
+#define MM_FLAT_MAP_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <vector>
+#include <stddef.h>
+#include <steam/steamtypes.h>
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// FlatHashMap
+//
+// Maps 32 bit handles (connections, lobby IDs) to small values.  Everything
+// lives in one array with linear probing, so a lookup is usually a single
+// cache miss and adding or removing entries doesn't touch the heap unless
+// the table has to grow.  Removal shifts the following entries back instead
+// of leaving tombstones, so the table never needs cleaning up.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+template< typename V >
+class FlatHashMap
+{
+public:
+	FlatHashMap()
+	{
+		m_nCount = 0;
+		m_nMask = 0;
+	}
+
+	/// Makes room for nCount entries without growing
+	void Reserve( size_t nCount )
+	{
+		// Keep the load factor at 1/2 or below
+		size_t nSize = 16;
+		while ( nSize < nCount * 2 )
+			nSize <<= 1;
+		if ( nSize > m_vecSlots.size() )
+			Rehash( nSize );
+	}
+
+	V *Find( uint32 key )
+	{
+		if ( m_vecSlots.empty() )
+			return nullptr;
+		for ( size_t i = Hash( key );; i = ( i + 1 ) & m_nMask )
+		{
+			Slot &slot = m_vecSlots[ i ];
+			if ( !slot.m_bUsed )
+				return nullptr;
+			if ( slot.m_key == key )
+				return &slot.m_value;
+		}
+	}
+
+	const V *Find( uint32 key ) const
+	{
+		return const_cast< FlatHashMap * >( this )->Find( key );
+	}
+
+	/// Adds the key, or overwrites its value if it's already there
+	V &Insert( uint32 key, const V &value )
+	{
+		if ( ( m_nCount + 1 ) * 2 > m_vecSlots.size() )
+			Rehash( m_vecSlots.empty() ? 16 : m_vecSlots.size() * 2 );
+
+		size_t i = Hash( key );
+		while ( m_vecSlots[ i ].m_bUsed && m_vecSlots[ i ].m_key != key )
+			i = ( i + 1 ) & m_nMask;
+
+		Slot &slot = m_vecSlots[ i ];
+		if ( !slot.m_bUsed )
+		{
+			slot.m_bUsed = true;
+			slot.m_key = key;
+			++m_nCount;
+		}
+		slot.m_value = value;
+		return slot.m_value;
+	}
+
+	/// Returns false if the key wasn't there
+	bool Remove( uint32 key )
+	{
+		if ( m_vecSlots.empty() )
+			return false;
+
+		size_t i = Hash( key );
+		while ( m_vecSlots[ i ].m_key != key || !m_vecSlots[ i ].m_bUsed )
+		{
+			if ( !m_vecSlots[ i ].m_bUsed )
+				return false;
+			i = ( i + 1 ) & m_nMask;
+		}
+
+		// Pull back every entry after the hole that would be
+		// unreachable from its home slot once the hole is empty
+		size_t j = i;
+		while ( true )
+		{
+			j = ( j + 1 ) & m_nMask;
+			if ( !m_vecSlots[ j ].m_bUsed )
+				break;
+			size_t home = Hash( m_vecSlots[ j ].m_key );
+			if ( ( ( j - home ) & m_nMask ) >= ( ( j - i ) & m_nMask ) )
+			{
+				m_vecSlots[ i ] = m_vecSlots[ j ];
+				i = j;
+			}
+		}
+		m_vecSlots[ i ].m_bUsed = false;
+		--m_nCount;
+		return true;
+	}
+
+	void Clear()
+	{
+		for ( size_t i = 0; i < m_vecSlots.size(); ++i )
+			m_vecSlots[ i ].m_bUsed = false;
+		m_nCount = 0;
+	}
+
+	size_t Count() const { return m_nCount; }
+	bool Empty() const { return m_nCount == 0; }
+
+private:
+	struct Slot
+	{
+		Slot() : m_key( 0 ), m_bUsed( false ) {}
+		uint32 m_key;
+		bool m_bUsed;
+		V m_value;
+	};
+
+	size_t Hash( uint32 key ) const
+	{
+		// Handles tend to be sequential, spread them out over the table
+		return (size_t)( ( key * 2654435769u ) >> 7 ) & m_nMask;
+	}
+
+	void Rehash( size_t nSize )
+	{
+		std::vector< Slot > vecOld;
+		vecOld.swap( m_vecSlots );
+		m_vecSlots.resize( nSize );
+		m_nMask = nSize - 1;
+		m_nCount = 0;
+		for ( size_t i = 0; i < vecOld.size(); ++i )
+		{
+			if ( vecOld[ i ].m_bUsed )
+				Insert( vecOld[ i ].m_key, vecOld[ i ].m_value );
+		}
+	}
+
+	std::vector< Slot > m_vecSlots;
+	size_t m_nCount;
+	size_t m_nMask;
+};
+
+#endif
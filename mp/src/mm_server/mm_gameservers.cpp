@@ -0,0 +1,435 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Registry of the game servers matches are played on
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_gameservers.h"
+#include <algorithm>
+
+// How long a server that failed to set up sits out, doubled for every failure in a row
+const SteamNetworkingMicroseconds k_usecFailureBackoff = 5 * 1000000;
+const SteamNetworkingMicroseconds k_usecMaxFailureBackoff = 5 * 60 * 1000000LL;
+
+// How much more ping a server on the right map is worth than one that needs a changelevel
+const int k_nChangelevelCostMS = 20;
+
+// A server that sends heartbeats is dead once it has been quiet this long
+const SteamNetworkingMicroseconds k_usecHeartbeatTimeout = 10 * 1000000;
+
+// How long after a match starts its server's heartbeats can end it.  Players
+// take a while to connect, and the heartbeat that was already on its way when
+// the match started still shows how the last one ended.
+const SteamNetworkingMicroseconds k_usecMatchGrace = 90 * 1000000;
+
+// How long a slot is held for a backfilled player who hasn't shown up yet
+const SteamNetworkingMicroseconds k_usecBackfillHold = 45 * 1000000;
+
+GameServerRegistry::GameServerRegistry()
+{
+	// Without anything telling us when a match is over, assume a regular
+	// HL2DM timelimit plus a little time for everybody to connect.
+	m_usecMatchLength = 20 * 60 * 1000000LL;
+}
+
+int GameServerRegistry::AddServer( const srcon_addr &addr, int nCapacity )
+{
+	int iServer = FindServer( addr.addr, addr.port );
+	if ( iServer < 0 )
+	{
+		iServer = (int)m_vecServers.size();
+		m_vecServers.push_back( GameServer() );
+	}
+
+	GameServer &server = m_vecServers[ iServer ];
+	server.m_addr = addr;
+	server.m_nCapacity = nCapacity;
+	server.m_usecRetryAfter = 0;
+	server.m_nFailures = 0;
+
+	// A server that is draining is fine to use again.  Anything busy keeps going.
+	if ( server.m_eState == game_server_draining && server.m_hLobby == invalid_lobby )
+		server.m_eState = game_server_idle;
+	return iServer;
+}
+
+int GameServerRegistry::FindServer( const std::string &sAddr, int nPort ) const
+{
+	for ( int i = 0; i < (int)m_vecServers.size(); ++i )
+	{
+		if ( m_vecServers[ i ].m_addr.port == nPort && m_vecServers[ i ].m_addr.addr == sAddr )
+			return i;
+	}
+	return -1;
+}
+
+int GameServerRegistry::Allocate( HLobbyID hLobby, HL2DM_Map map, char bTeamDM, int nPlayers, const int *pPingScores, SteamNetworkingMicroseconds usecNow, bool &bNeedsChangelevel )
+{
+	int iBest = -1;
+	bool bBestWarm = false;
+	int nBestCost = 0;
+	for ( int i = 0; i < (int)m_vecServers.size(); ++i )
+	{
+		const GameServer &server = m_vecServers[ i ];
+		if ( server.m_eState != game_server_idle || server.m_nCapacity < nPlayers || server.m_usecRetryAfter > usecNow || server.m_bDead )
+			continue;
+
+		// Whoever is still on it from the last match takes up room, and a server at
+		// intermission is about to move on to the next map by itself
+		bool bIntermission = false;
+		int nFrameCost = 0;
+		if ( server.m_bSendsHeartbeats )
+		{
+			const GameServerHeartbeat &heartbeat = server.m_heartbeat;
+			int nFree = std::min( server.m_nCapacity, (int)heartbeat.m_nMaxPlayers ) - heartbeat.m_nPlayers;
+			if ( nFree < nPlayers )
+				continue;
+			bIntermission = heartbeat.m_ePhase == game_phase_intermission;
+
+			// A server that struggles to keep up costs as much as its average frame time
+			nFrameCost = heartbeat.m_nFrameTimeAvg / 100;
+		}
+
+		// Without pings, already on the right map beats everything.  Among equals
+		// take whichever has been idle the longest to spread the load.
+		// A server still loading the map it was prewarmed for is nearly as good,
+		// whatever is left of its load is shorter than a changelevel.
+		bool bWarm = server.m_map == map && server.m_bTeamDM == bTeamDM && !bIntermission;
+		bool bPrewarming = server.m_prewarmMap == map && server.m_bPrewarmTeamDM == bTeamDM;
+		int nCost = ( pPingScores ? pPingScores[ i ] : 0 ) + ( bWarm || bPrewarming ? 0 : k_nChangelevelCostMS ) + nFrameCost;
+		if ( iBest >= 0 )
+		{
+			if ( nCost > nBestCost )
+				continue;
+			if ( nCost == nBestCost && server.m_usecStateChanged >= m_vecServers[ iBest ].m_usecStateChanged )
+				continue;
+		}
+		iBest = i;
+		bBestWarm = bWarm;
+		nBestCost = nCost;
+	}
+
+	if ( iBest < 0 )
+		return -1;
+
+	GameServer &server = m_vecServers[ iBest ];
+	server.m_hLobby = hLobby;
+	server.m_map = map;
+	server.m_bTeamDM = bTeamDM;
+	SetState( server, game_server_warming, usecNow );
+	bNeedsChangelevel = !bBestWarm;
+	return iBest;
+}
+
+bool GameServerRegistry::OnWarmedUp( int iServer, SteamNetworkingMicroseconds usecNow )
+{
+	GameServer &server = m_vecServers[ iServer ];
+	server.m_usecLastHeartbeat = usecNow;
+	server.m_nFailures = 0;
+	if ( server.m_bEndRequested )
+	{
+		server.m_bEndRequested = false;
+		EndMatch( iServer, usecNow );
+		return false;
+	}
+	server.m_usecMatchStarted = usecNow;
+	if ( server.m_eState != game_server_draining )
+		SetState( server, game_server_in_match, usecNow );
+	return true;
+}
+
+void GameServerRegistry::OnWarmUpFailed( int iServer, SteamNetworkingMicroseconds usecNow )
+{
+	GameServer &server = m_vecServers[ iServer ];
+	server.m_bEndRequested = false;
+	++server.m_nFailures;
+	SteamNetworkingMicroseconds usecBackoff = k_usecFailureBackoff << std::min( server.m_nFailures - 1, 16 );
+	server.m_usecRetryAfter = usecNow + std::min( usecBackoff, k_usecMaxFailureBackoff );
+
+	// We don't know what state the server was left in
+	server.m_map = invalid_map;
+	server.m_bTeamDM = -1;
+	EndMatch( iServer, usecNow );
+}
+
+void GameServerRegistry::SetPlayers( int iServer, const std::vector< uint64 > &vecPlayers, float flRating )
+{
+	GameServer &server = m_vecServers[ iServer ];
+	server.m_vecPlayers = vecPlayers;
+	server.m_flRating = flRating;
+}
+
+int GameServerRegistry::GetBackfillSlots( int iServer, SteamNetworkingMicroseconds usecNow ) const
+{
+	const GameServer &server = m_vecServers[ iServer ];
+	if ( server.m_eState != game_server_in_match || !server.m_bSendsHeartbeats || server.m_bDead )
+		return 0;
+	if ( server.m_usecMatchStarted == 0 || usecNow - server.m_usecMatchStarted < k_usecMatchGrace )
+		return 0;
+	const GameServerHeartbeat &heartbeat = server.m_heartbeat;
+	if ( heartbeat.m_ePhase != game_phase_playing || heartbeat.m_map != server.m_map || heartbeat.m_bTeamDM != server.m_bTeamDM )
+		return 0;
+
+	int nHeld = 0;
+	for ( SteamNetworkingMicroseconds usecHeldUntil: server.m_vecBackfillHeld )
+	{
+		if ( usecHeldUntil > usecNow )
+			++nHeld;
+	}
+	int nFree = std::min( (int)heartbeat.m_nOpenSlots, server.m_nCapacity - (int)heartbeat.m_nPlayers );
+	return std::max( 0, nFree - nHeld );
+}
+
+void GameServerRegistry::HoldBackfillSlots( int iServer, int nSlots, SteamNetworkingMicroseconds usecNow )
+{
+	std::vector< SteamNetworkingMicroseconds > &vecHeld = m_vecServers[ iServer ].m_vecBackfillHeld;
+	vecHeld.insert( vecHeld.end(), nSlots, usecNow + k_usecBackfillHold );
+}
+
+void GameServerRegistry::ReleaseBackfillSlots( int iServer, int nSlots )
+{
+	// Newest first, those are the ones being given back
+	std::vector< SteamNetworkingMicroseconds > &vecHeld = m_vecServers[ iServer ].m_vecBackfillHeld;
+	vecHeld.resize( vecHeld.size() - std::min( (size_t)nSlots, vecHeld.size() ) );
+}
+
+bool GameServerRegistry::CanPrewarm( int iServer, SteamNetworkingMicroseconds usecNow ) const
+{
+	const GameServer &server = m_vecServers[ iServer ];
+	if ( server.m_eState != game_server_idle || server.m_usecRetryAfter > usecNow || server.m_bDead )
+		return false;
+	return !server.m_bSendsHeartbeats || server.m_heartbeat.m_nPlayers == 0;
+}
+
+void GameServerRegistry::Prewarm( int iServer, HL2DM_Map map, char bTeamDM, SteamNetworkingMicroseconds usecNow )
+{
+	GameServer &server = m_vecServers[ iServer ];
+	server.m_prewarmMap = map;
+	server.m_bPrewarmTeamDM = bTeamDM;
+	server.m_usecPrewarmed = usecNow;
+}
+
+void GameServerRegistry::OnPrewarmed( int iServer )
+{
+	// Heartbeats tell us the map anyway
+	GameServer &server = m_vecServers[ iServer ];
+	if ( server.m_eState != game_server_idle || server.m_prewarmMap == invalid_map || server.m_bSendsHeartbeats )
+		return;
+	server.m_map = server.m_prewarmMap;
+	server.m_bTeamDM = server.m_bPrewarmTeamDM;
+}
+
+void GameServerRegistry::ClearPrewarm( int iServer )
+{
+	GameServer &server = m_vecServers[ iServer ];
+	server.m_prewarmMap = invalid_map;
+	server.m_bPrewarmTeamDM = -1;
+	server.m_usecPrewarmed = 0;
+}
+
+int GameServerRegistry::GetWarmBucket( int iServer ) const
+{
+	const GameServer &server = m_vecServers[ iServer ];
+	if ( server.m_prewarmMap != invalid_map )
+		return GetLobbyBucket( server.m_prewarmMap, server.m_bPrewarmTeamDM );
+	return GetLobbyBucket( server.m_map, server.m_bTeamDM );
+}
+
+void GameServerRegistry::EndMatch( int iServer, SteamNetworkingMicroseconds usecNow )
+{
+	GameServer &server = m_vecServers[ iServer ];
+	server.m_hLobby = invalid_lobby;
+	server.m_usecMatchStarted = 0;
+	server.m_vecBackfillHeld.clear();
+	if ( server.m_eState != game_server_draining )
+		SetState( server, game_server_idle, usecNow );
+}
+
+bool GameServerRegistry::RequestEndMatch( int iServer, SteamNetworkingMicroseconds usecNow )
+{
+	// Making it idle now would let another lobby have it while the setup for
+	// this one is still on its way
+	GameServer &server = m_vecServers[ iServer ];
+	if ( server.m_eState == game_server_warming )
+	{
+		server.m_bEndRequested = true;
+		return false;
+	}
+	EndMatch( iServer, usecNow );
+	return true;
+}
+
+void GameServerRegistry::Drain( int iServer, SteamNetworkingMicroseconds usecNow )
+{
+	SetState( m_vecServers[ iServer ], game_server_draining, usecNow );
+}
+
+void GameServerRegistry::Restore( int iServer, GameServerState eState, HL2DM_Map map, char bTeamDM, HLobbyID hLobby, SteamNetworkingMicroseconds usecMatchStarted, SteamNetworkingMicroseconds usecNow )
+{
+	GameServer &server = m_vecServers[ iServer ];
+	server.m_map = map;
+	server.m_bTeamDM = bTeamDM;
+	if ( eState == game_server_warming || !usecMatchStarted )
+	{
+		server.m_hLobby = invalid_lobby;
+		server.m_usecMatchStarted = 0;
+		SetState( server, eState == game_server_draining ? game_server_draining : game_server_idle, usecNow );
+		return;
+	}
+	server.m_hLobby = hLobby;
+	server.m_usecMatchStarted = usecMatchStarted;
+	server.m_usecLastHeartbeat = usecNow;
+	SetState( server, eState, usecNow );
+}
+
+int GameServerRegistry::Update( SteamNetworkingMicroseconds usecNow )
+{
+	int nEnded = 0;
+	for ( int i = 0; i < (int)m_vecServers.size(); ++i )
+	{
+		GameServer &server = m_vecServers[ i ];
+		if ( server.m_hLobby == invalid_lobby || server.m_usecMatchStarted == 0 || server.m_bSendsHeartbeats )
+			continue;
+		if ( usecNow - server.m_usecMatchStarted < m_usecMatchLength )
+			continue;
+		EndMatch( i, usecNow );
+		++nEnded;
+	}
+	return nEnded;
+}
+
+HeartbeatResult GameServerRegistry::OnHeartbeat( int iServer, HSteamNetConnection hConn, const GameServerHeartbeat &heartbeat, SteamNetworkingMicroseconds usecNow )
+{
+	GameServer &server = m_vecServers[ iServer ];
+
+	// Backfilled players who have arrived don't need their slot held any more,
+	// oldest first, and neither do the ones who never came
+	std::vector< SteamNetworkingMicroseconds > &vecHeld = server.m_vecBackfillHeld;
+	if ( !vecHeld.empty() )
+	{
+		size_t nArrived = heartbeat.m_nPlayers > server.m_heartbeat.m_nPlayers ? heartbeat.m_nPlayers - server.m_heartbeat.m_nPlayers : 0;
+		vecHeld.erase( vecHeld.begin(), vecHeld.begin() + std::min( nArrived, vecHeld.size() ) );
+		vecHeld.erase( std::remove_if( vecHeld.begin(), vecHeld.end(), [usecNow]( SteamNetworkingMicroseconds usecHeldUntil ) { return usecHeldUntil <= usecNow; } ), vecHeld.end() );
+	}
+
+	server.m_hHeartbeatConn = hConn;
+	server.m_bSendsHeartbeats = true;
+	server.m_bDead = false;
+	server.m_heartbeat = heartbeat;
+	server.m_usecLastHeartbeat = usecNow;
+
+	switch ( server.m_eState )
+	{
+	case game_server_idle:
+		// Nobody else changes its map while it's idle, so it's on whatever it says
+		server.m_map = heartbeat.m_map;
+		server.m_bTeamDM = heartbeat.m_bTeamDM;
+		return heartbeat_ok;
+
+	case game_server_warming:
+		if ( heartbeat.m_hLobby == server.m_hLobby && heartbeat.m_map == server.m_map && heartbeat.m_bTeamDM == server.m_bTeamDM )
+			return heartbeat_set_up;
+		return heartbeat_ok;
+
+	default:
+		break;
+	}
+
+	// In a match, or draining while one finishes
+	if ( server.m_usecMatchStarted == 0 || usecNow - server.m_usecMatchStarted < k_usecMatchGrace )
+		return heartbeat_ok;
+	if ( heartbeat.m_ePhase != game_phase_intermission && heartbeat.m_nPlayers > 0 )
+		return heartbeat_ok;
+	EndMatch( iServer, usecNow );
+	return heartbeat_match_over;
+}
+
+int GameServerRegistry::FindServerByHeartbeatConn( HSteamNetConnection hConn ) const
+{
+	for ( int i = 0; i < (int)m_vecServers.size(); ++i )
+	{
+		if ( m_vecServers[ i ].m_hHeartbeatConn == hConn )
+			return i;
+	}
+	return -1;
+}
+
+int GameServerRegistry::OnHeartbeatConnClosed( HSteamNetConnection hConn )
+{
+	int iServer = FindServerByHeartbeatConn( hConn );
+	if ( iServer < 0 )
+		return -1;
+	GameServer &server = m_vecServers[ iServer ];
+	server.m_hHeartbeatConn = k_HSteamNetConnection_Invalid;
+	if ( server.m_bDead )
+		return -1;
+	server.m_bDead = true;
+	return iServer;
+}
+
+void GameServerRegistry::FindDeadServers( SteamNetworkingMicroseconds usecNow, std::vector< int > &vecDead )
+{
+	for ( int i = 0; i < (int)m_vecServers.size(); ++i )
+	{
+		GameServer &server = m_vecServers[ i ];
+		if ( !server.m_bSendsHeartbeats || server.m_bDead || usecNow - server.m_usecLastHeartbeat < k_usecHeartbeatTimeout )
+			continue;
+		server.m_bDead = true;
+		vecDead.push_back( i );
+	}
+}
+
+int GameServerRegistry::CountInState( GameServerState eState ) const
+{
+	int nCount = 0;
+	for ( const GameServer &server: m_vecServers )
+	{
+		if ( server.m_eState == eState )
+			++nCount;
+	}
+	return nCount;
+}
+
+std::string GameServerRegistry::FormatAddress( const srcon_addr &addr )
+{
+	return addr.addr + ":" + std::to_string( addr.port );
+}
+
+void GameServerRegistry::SetState( GameServer &server, GameServerState eState, SteamNetworkingMicroseconds usecNow )
+{
+	server.m_eState = eState;
+	server.m_usecStateChanged = usecNow;
+}
+
+std::string ConvertGameServerStateToString( GameServerState eState )
+{
+	switch ( eState )
+	{
+	case game_server_idle:
+		return "idle";
+	case game_server_warming:
+		return "warming";
+	case game_server_in_match:
+		return "in match";
+	case game_server_draining:
+		return "draining";
+	default:
+		return "";
+	}
+}
+
+std::string ConvertGameServerPhaseToString( GameServerPhase ePhase )
+{
+	switch ( ePhase )
+	{
+	case game_phase_waiting:
+		return "waiting for players";
+	case game_phase_playing:
+		return "playing";
+	case game_phase_intermission:
+		return "intermission";
+	default:
+		return "";
+	}
+}
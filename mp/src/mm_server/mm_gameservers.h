@@ -0,0 +1,220 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Registry of the game servers matches are played on
+//
+//=============================================================================
+
+#ifndef MM_GAMESERVERS_H
+#define MM_GAMESERVERS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <steam/steamnetworkingtypes.h>
+#include <srcon.h>
+#include <string>
+#include <vector>
+#include "mm_shared.h"
+
+enum GameServerState
+{
+	game_server_idle,		// free to take a match
+	game_server_warming,	// being switched to a lobby's map and gamemode
+	game_server_in_match,	// a match is being played on it
+	game_server_draining	// finishes its current match, but gets no new ones
+};
+
+struct GameServer
+{
+	GameServer()
+	{
+		m_eState = game_server_idle;
+		m_nCapacity = 0;
+		m_map = invalid_map;
+		m_bTeamDM = -1;
+		m_usecLastHeartbeat = 0;
+		m_usecStateChanged = 0;
+		m_usecMatchStarted = 0;
+		m_usecRetryAfter = 0;
+		m_nFailures = 0;
+		m_hLobby = invalid_lobby;
+		m_flRating = -1.0f;
+		m_prewarmMap = invalid_map;
+		m_bPrewarmTeamDM = -1;
+		m_usecPrewarmed = 0;
+		m_hHeartbeatConn = k_HSteamNetConnection_Invalid;
+		m_bEndRequested = false;
+		m_bSendsHeartbeats = false;
+		m_bDead = false;
+		memset( &m_heartbeat, 0, sizeof(m_heartbeat) );
+	}
+
+	srcon_addr m_addr;
+	GameServerState m_eState;
+	int m_nCapacity;
+
+	// What we last set the server to.  invalid_map if we don't know.
+	HL2DM_Map m_map;
+	char m_bTeamDM;
+
+	// Last time we heard from the server at all (heartbeats and successful RCON count)
+	SteamNetworkingMicroseconds m_usecLastHeartbeat;
+	SteamNetworkingMicroseconds m_usecStateChanged;
+	SteamNetworkingMicroseconds m_usecMatchStarted;
+
+	// Don't hand out a server that just failed to set up until this time
+	SteamNetworkingMicroseconds m_usecRetryAfter;
+	int m_nFailures;
+
+	// Lobby the server is warming up or playing a match for
+	HLobbyID m_hLobby;
+
+	// Steam IDs of the players sent to its last match, 0 for guests.  Cleared
+	// once the match result is in.
+	std::vector< uint64 > m_vecPlayers;
+
+	// Average rating of the players its match started with, negative if we don't know
+	float m_flRating;
+
+	// When slots we sent backfilled players to stop being held for them.  They
+	// are let go as the players show up in heartbeats.
+	std::vector< SteamNetworkingMicroseconds > m_vecBackfillHeld;
+
+	// Map and gamemode the idle server was switched to ahead of a lobby that
+	// looked about to fill up, and when.  invalid_map if it wasn't.
+	HL2DM_Map m_prewarmMap;
+	char m_bPrewarmTeamDM;
+	SteamNetworkingMicroseconds m_usecPrewarmed;
+
+	// Connection the server's heartbeats come in on, k_HSteamNetConnection_Invalid if none
+	HSteamNetConnection m_hHeartbeatConn;
+
+	// Somebody ended its match while it was still warming up, it's free
+	// again as soon as the warm up is over
+	bool m_bEndRequested;
+
+	// Once a server has sent a heartbeat we go by what they say, and it's
+	// dead when they stop.  Servers that never sent one are assumed to be up.
+	bool m_bSendsHeartbeats;
+	bool m_bDead;
+	GameServerHeartbeat m_heartbeat;
+};
+
+/// What a heartbeat told us about the server's match
+enum HeartbeatResult
+{
+	heartbeat_ok,
+	heartbeat_set_up,		// the map of the lobby it's warming up for has loaded
+	heartbeat_match_over	// its match ended, it's free again
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// GameServerRegistry
+//
+// Tracks what every game server is doing so that each match gets a server
+// of its own.  Servers are referred to by their index, which never changes.
+// Only used from the main thread.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class GameServerRegistry
+{
+public:
+	GameServerRegistry();
+
+	/// Adds a server, or brings an existing one with the same address back into
+	/// rotation with the new settings.  Returns its index.
+	int AddServer( const srcon_addr &addr, int nCapacity );
+	int FindServer( const std::string &sAddr, int nPort ) const;
+
+	/// Picks an idle server with room for nPlayers and marks it as warming up for
+	/// the lobby.  pPingScores has the lobby's ping in ms to every server, or is
+	/// nullptr if nobody measured any.  The server with the lowest ping wins, but
+	/// one that is already on the right map and gamemode gets a head start of
+	/// k_nChangelevelCostMS since it can take the players right away, and so
+	/// does one that is still being prewarmed for it.  bNeedsChangelevel tells
+	/// whether the server isn't on the map yet.  Returns -1 if every server is
+	/// busy.
+	int Allocate( HLobbyID hLobby, HL2DM_Map map, char bTeamDM, int nPlayers, const int *pPingScores, SteamNetworkingMicroseconds usecNow, bool &bNeedsChangelevel );
+
+	/// Returns false if the match was ended while the server was warming up,
+	/// the server is idle again then and the lobby needs another one
+	bool OnWarmedUp( int iServer, SteamNetworkingMicroseconds usecNow );
+	void OnWarmUpFailed( int iServer, SteamNetworkingMicroseconds usecNow );
+	void EndMatch( int iServer, SteamNetworkingMicroseconds usecNow );
+
+	/// Ends the match like EndMatch, except that a server still warming up
+	/// finishes that first.  Returns false if the end has to wait for it.
+	bool RequestEndMatch( int iServer, SteamNetworkingMicroseconds usecNow );
+	void Drain( int iServer, SteamNetworkingMicroseconds usecNow );
+	void SetPlayers( int iServer, const std::vector< uint64 > &vecPlayers, float flRating );
+
+	/// Free slots in the match on a server that we can send searching players
+	/// to, as its heartbeats report them, less the ones already promised.
+	/// Only servers that send heartbeats, in a match that's been going for at
+	/// least k_usecMatchGrace so its own players have all arrived.
+	int GetBackfillSlots( int iServer, SteamNetworkingMicroseconds usecNow ) const;
+
+	/// Holds slots for players on their way to the server, until they show up
+	/// in a heartbeat or k_usecBackfillHold has passed
+	void HoldBackfillSlots( int iServer, int nSlots, SteamNetworkingMicroseconds usecNow );
+	void ReleaseBackfillSlots( int iServer, int nSlots );
+	void AddBackfilledPlayer( int iServer, uint64 steamID ) { m_vecServers[ iServer ].m_vecPlayers.push_back( steamID ); }
+
+	/// Whether an idle server can be switched to another map before any lobby
+	/// asks for it: nothing is holding it up, and nobody is left playing on it
+	bool CanPrewarm( int iServer, SteamNetworkingMicroseconds usecNow ) const;
+
+	/// Notes that the server is being switched ahead of time.  Servers that
+	/// send heartbeats are on the map once they report it, the others once
+	/// OnPrewarmed says their RCON commands went through.
+	void Prewarm( int iServer, HL2DM_Map map, char bTeamDM, SteamNetworkingMicroseconds usecNow );
+	void OnPrewarmed( int iServer );
+	void ClearPrewarm( int iServer );
+
+	/// Lobby bucket an idle server is on or being prewarmed for, -1 if we don't know
+	int GetWarmBucket( int iServer ) const;
+
+	/// Puts back what a server was doing before the matchmaking server
+	/// restarted.  One that was warming up lost its setup and is idle again.
+	void Restore( int iServer, GameServerState eState, HL2DM_Map map, char bTeamDM, HLobbyID hLobby, SteamNetworkingMicroseconds usecMatchStarted, SteamNetworkingMicroseconds usecNow );
+
+	/// Ends matches that have run longer than the match length.  Returns how
+	/// many.  Servers that send heartbeats say when their match is over instead.
+	int Update( SteamNetworkingMicroseconds usecNow );
+
+	/// Takes in a heartbeat that came in on hConn.  Idle servers are taken to be
+	/// on whatever map they report, and a match ends once the server is at
+	/// intermission or everybody has left, as long as it's past k_usecMatchGrace.
+	HeartbeatResult OnHeartbeat( int iServer, HSteamNetConnection hConn, const GameServerHeartbeat &heartbeat, SteamNetworkingMicroseconds usecNow );
+	int FindServerByHeartbeatConn( HSteamNetConnection hConn ) const;
+
+	/// The server's heartbeat connection closed, it counts as dead right away.
+	/// Returns its index, or -1 if no server was using the connection.
+	int OnHeartbeatConnClosed( HSteamNetConnection hConn );
+
+	/// Appends servers whose heartbeats stopped since the last call to vecDead
+	void FindDeadServers( SteamNetworkingMicroseconds usecNow, std::vector< int > &vecDead );
+	bool IsDead( int iServer ) const { return m_vecServers[ iServer ].m_bDead; }
+
+	void SetMatchLength( SteamNetworkingMicroseconds usecMatchLength ) { m_usecMatchLength = usecMatchLength; }
+	SteamNetworkingMicroseconds GetMatchLength() const { return m_usecMatchLength; }
+
+	int Count() const { return (int)m_vecServers.size(); }
+	int CountInState( GameServerState eState ) const;
+	const GameServer &Get( int iServer ) const { return m_vecServers[ iServer ]; }
+
+	static std::string FormatAddress( const srcon_addr &addr );
+
+private:
+	void SetState( GameServer &server, GameServerState eState, SteamNetworkingMicroseconds usecNow );
+
+	std::vector< GameServer > m_vecServers;
+	SteamNetworkingMicroseconds m_usecMatchLength;
+};
+
+std::string ConvertGameServerStateToString( GameServerState eState );
+std::string ConvertGameServerPhaseToString( GameServerPhase ePhase );
+
+#endif
@@ -0,0 +1,152 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Lobby storage with an index of lobbies that still have room
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_lobbies.h"
+#include <assert.h>
+
+LobbyTable::LobbyTable()
+{
+	m_nPlayersToStart = 2;
+	m_nIDSpace = 0;
+	m_nNumIDSpaces = 1;
+	m_IDGenerator.seed( std::random_device()() );
+}
+
+void LobbyTable::SetIDSpace( uint32 nSpace, uint32 nNumSpaces )
+{
+	assert( nSpace < nNumSpaces );
+	m_nIDSpace = nSpace;
+	m_nNumIDSpaces = nNumSpaces;
+}
+
+Lobby *LobbyTable::Find( HLobbyID lobbyID )
+{
+	int *piPosition = m_mapPositions.Find( lobbyID );
+	if ( !piPosition )
+		return nullptr;
+	return &m_vecLobbies[ *piPosition ];
+}
+
+Lobby &LobbyTable::FindOrCreate( HLobbyID lobbyID )
+{
+	Lobby *pLobby = Find( lobbyID );
+	if ( pLobby )
+		return *pLobby;
+	return Insert( lobbyID, Lobby() );
+}
+
+HLobbyID LobbyTable::Create( HL2DM_Map map, char bTeamDM )
+{
+	HLobbyID lobbyID = GenerateID();
+	Lobby &lobby = Insert( lobbyID, Lobby() );
+	lobby.m_map = map;
+	lobby.m_bTeamDM = bTeamDM;
+	return lobbyID;
+}
+
+Lobby &LobbyTable::Insert( HLobbyID lobbyID, const Lobby &lobby )
+{
+	Lobby *pLobby = Find( lobbyID );
+	if ( pLobby )
+	{
+		RemoveFromIndex( *pLobby );
+	}
+	else
+	{
+		m_mapPositions.Insert( lobbyID, (int)m_vecLobbies.size() );
+		m_vecLobbies.push_back( Lobby() );
+		pLobby = &m_vecLobbies.back();
+	}
+	*pLobby = lobby;
+	pLobby->m_hLobbyID = lobbyID;
+
+	// Its place in the other table's index means nothing here
+	pLobby->m_iBucket = -1;
+	pLobby->m_iOpenSlot = -1;
+	UpdateIndex( lobbyID, *pLobby );
+	return *pLobby;
+}
+
+void LobbyTable::Destroy( HLobbyID lobbyID )
+{
+	int *piPosition = m_mapPositions.Find( lobbyID );
+	if ( !piPosition )
+		return;
+	int iPosition = *piPosition;
+	RemoveFromIndex( m_vecLobbies[ iPosition ] );
+	m_mapPositions.Remove( lobbyID );
+
+	// Fill the hole with the last lobby
+	if ( iPosition != (int)m_vecLobbies.size() - 1 )
+	{
+		m_vecLobbies[ iPosition ] = m_vecLobbies.back();
+		m_mapPositions.Insert( m_vecLobbies[ iPosition ].m_hLobbyID, iPosition );
+	}
+	m_vecLobbies.pop_back();
+}
+
+void LobbyTable::Clear()
+{
+	m_vecLobbies.clear();
+	m_mapPositions.Clear();
+	for ( int i = 0; i < k_nNumLobbyBuckets; ++i )
+		m_vecOpenLobbies[ i ].clear();
+}
+
+void LobbyTable::UpdateIndex( HLobbyID lobbyID, Lobby &lobby )
+{
+	int iBucket = GetLobbyBucket( lobby.m_map, lobby.m_bTeamDM );
+	bool bOpen = iBucket >= 0 && !lobby.m_bStarting && lobby.m_nPlayers < m_nPlayersToStart;
+	if ( lobby.m_iOpenSlot != -1 && ( !bOpen || lobby.m_iBucket != iBucket ) )
+		RemoveFromIndex( lobby );
+	if ( bOpen && lobby.m_iOpenSlot == -1 )
+		AddToIndex( lobbyID, lobby );
+}
+
+HLobbyID LobbyTable::FindOpenLobby( int iBucket ) const
+{
+	if ( iBucket < 0 || m_vecOpenLobbies[ iBucket ].empty() )
+		return invalid_lobby;
+	return m_vecOpenLobbies[ iBucket ].back();
+}
+
+void LobbyTable::AddToIndex( HLobbyID lobbyID, Lobby &lobby )
+{
+	int iBucket = GetLobbyBucket( lobby.m_map, lobby.m_bTeamDM );
+	assert( lobby.m_iOpenSlot == -1 && iBucket >= 0 );
+	lobby.m_iBucket = iBucket;
+	lobby.m_iOpenSlot = (int)m_vecOpenLobbies[ iBucket ].size();
+	m_vecOpenLobbies[ iBucket ].push_back( lobbyID );
+}
+
+void LobbyTable::RemoveFromIndex( Lobby &lobby )
+{
+	if ( lobby.m_iOpenSlot == -1 )
+		return;
+
+	// Swap the last lobby of the bucket into our slot
+	std::vector< HLobbyID > &vecBucket = m_vecOpenLobbies[ lobby.m_iBucket ];
+	HLobbyID hLast = vecBucket.back();
+	vecBucket[ lobby.m_iOpenSlot ] = hLast;
+	Find( hLast )->m_iOpenSlot = lobby.m_iOpenSlot;
+	vecBucket.pop_back();
+
+	lobby.m_iBucket = -1;
+	lobby.m_iOpenSlot = -1;
+}
+
+HLobbyID LobbyTable::GenerateID()
+{
+	HLobbyID id;
+	do
+	{
+		id = (HLobbyID)m_IDGenerator();
+		id -= id % m_nNumIDSpaces;
+		id += m_nIDSpace;
+	} while ( id == invalid_lobby || m_mapPositions.Find( id ) );
+	return id;
+}
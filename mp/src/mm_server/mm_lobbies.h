@@ -0,0 +1,91 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Lobby storage with an index of lobbies that still have room
+//
+//=============================================================================
+
+#ifndef MM_LOBBIES_H
+#define MM_LOBBIES_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <vector>
+#include <random>
+#include "mm_shared.h"
+#include "mm_flat_map.h"
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// LobbyTable
+//
+// Owns a set of lobbies and keeps the ones that still have room in buckets
+// keyed by map and gamemode (see GetLobbyBucket), so a search only has to
+// look at lobbies it could actually join.  Lobbies are packed into one
+// array, destroying one moves the last lobby into its place, so pointers
+// and references to lobbies are only good until the next Create, Insert or
+// Destroy.  Not thread safe, every table belongs to exactly one thread.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class LobbyTable
+{
+public:
+	typedef std::vector< Lobby >::iterator iterator;
+
+	LobbyTable();
+
+	/// Lobby IDs made by this table all satisfy id % nNumSpaces == nSpace, so
+	/// tables on different threads never hand out the same ID.
+	void SetIDSpace( uint32 nSpace, uint32 nNumSpaces );
+
+	/// Lobbies with this many players are full and drop out of the index
+	void SetPlayersToStart( int nPlayersToStart ) { m_nPlayersToStart = nPlayersToStart; }
+
+	Lobby *Find( HLobbyID lobbyID );
+
+	/// Returns the lobby, creating an empty one if there is no such lobby
+	Lobby &FindOrCreate( HLobbyID lobbyID );
+
+	/// Makes a new empty lobby with a fresh ID
+	HLobbyID Create( HL2DM_Map map, char bTeamDM );
+
+	/// Takes over a lobby that was made somewhere else, keeping its ID
+	Lobby &Insert( HLobbyID lobbyID, const Lobby &lobby );
+
+	void Destroy( HLobbyID lobbyID );
+	void Clear();
+
+	/// Call whenever a lobby's players, map, gamemode or starting state change
+	void UpdateIndex( HLobbyID lobbyID, Lobby &lobby );
+
+	/// Returns an open lobby in the bucket, or invalid_lobby if there isn't one
+	HLobbyID FindOpenLobby( int iBucket ) const;
+	int CountOpenLobbies( int iBucket ) const { return (int)m_vecOpenLobbies[ iBucket ].size(); }
+
+	iterator begin() { return m_vecLobbies.begin(); }
+	iterator end() { return m_vecLobbies.end(); }
+	bool empty() const { return m_vecLobbies.empty(); }
+	size_t size() const { return m_vecLobbies.size(); }
+
+private:
+	void AddToIndex( HLobbyID lobbyID, Lobby &lobby );
+	void RemoveFromIndex( Lobby &lobby );
+	HLobbyID GenerateID();
+
+	std::vector< Lobby > m_vecLobbies;
+
+	// Where each lobby sits in m_vecLobbies
+	FlatHashMap< int > m_mapPositions;
+
+	// Lobbies that still have room, by bucket.  Each lobby remembers its own
+	// position so it can be taken out in constant time.
+	std::vector< HLobbyID > m_vecOpenLobbies[ k_nNumLobbyBuckets ];
+
+	int m_nPlayersToStart;
+	uint32 m_nIDSpace;
+	uint32 m_nNumIDSpaces;
+	std::mt19937 m_IDGenerator;
+};
+
+#endif
@@ -0,0 +1,301 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Asynchronous logging for the matchmaking server
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_log.h"
+#include <steam/isteamnetworkingutils.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+
+// Slots in the ring
+static const size_t k_nLogRingSize = 8192;
+
+// The writer checks for new lines this often.  Producers only wake it up
+// early once every half ring's worth of lines, so a normal log call never has to.
+static const int k_nLogWriterIntervalMS = 5;
+
+// How many old log files to keep around when rotating
+static const int k_nLogFilesKept = 4;
+
+AsyncLog g_Log;
+
+static const char *s_pszLogLevels[ num_log_levels ] =
+{
+	"debug",
+	"info",
+	"warning",
+	"error"
+};
+
+static const char *GetLogLevelName( LogLevel eLevel )
+{
+	if ( eLevel < 0 || eLevel >= num_log_levels )
+		return "unknown";
+	return s_pszLogLevels[ eLevel ];
+}
+
+AsyncLog::AsyncLog() : m_vecRing( k_nLogRingSize )
+{
+	m_nMask = k_nLogRingSize - 1;
+	for ( size_t i = 0; i < k_nLogRingSize; ++i )
+		m_vecRing[ i ].m_nSequence.store( i, std::memory_order_relaxed );
+	m_nEnqueuePos.store( 0, std::memory_order_relaxed );
+	m_nDequeuePos = 0;
+	m_eLevel = log_info;
+	m_nDropped = 0;
+	m_nDroppedReported = 0;
+	m_usecTimeZero = 0;
+	m_bRunning = false;
+	m_nActiveProducers = 0;
+	m_bStop = false;
+	m_pFile = nullptr;
+	m_cbMaxFile = 0;
+	m_cbFile = 0;
+}
+
+AsyncLog::~AsyncLog()
+{
+	Stop();
+	if ( m_pFile )
+		fclose( m_pFile );
+}
+
+void AsyncLog::Start( SteamNetworkingMicroseconds usecTimeZero )
+{
+	m_usecTimeZero = usecTimeZero;
+	m_bStop = false;
+	m_thread = std::thread( &AsyncLog::WriterThread, this );
+	m_bRunning = true;
+}
+
+void AsyncLog::Stop()
+{
+	if ( !m_bRunning )
+		return;
+
+	// Anything logged from here on goes straight out.  Lines that already
+	// claimed a slot are waited for, the writer's last pass picks them up.
+	m_bRunning = false;
+	while ( m_nActiveProducers > 0 )
+		std::this_thread::yield();
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		m_bStop = true;
+	}
+	m_cv.notify_one();
+	m_thread.join();
+}
+
+bool AsyncLog::SetFile( const char *pszPath, size_t cbMaxFile )
+{
+	// Only before the writer starts, it owns the file after that
+	if ( m_bRunning )
+		return false;
+	FILE *pFile = fopen( pszPath, "a" );
+	if ( !pFile )
+		return false;
+	if ( m_pFile )
+		fclose( m_pFile );
+	m_pFile = pFile;
+	m_sFilePath = pszPath;
+	m_cbMaxFile = cbMaxFile;
+	fseek( m_pFile, 0, SEEK_END );
+	m_cbFile = (size_t)ftell( m_pFile );
+	return true;
+}
+
+void AsyncLog::Write( LogLevel eLevel, const char *fmt, va_list ap )
+{
+	if ( !IsEnabled( eLevel ) )
+		return;
+
+	SteamNetworkingMicroseconds usecTime = SteamNetworkingUtils()->GetLocalTimestamp();
+	char text[ 2048 ];
+	vsnprintf( text, sizeof(text), fmt, ap );
+
+	// Every line gets its own entry and timestamp
+	const char *pszLine = text;
+	while ( true )
+	{
+		const char *pszEnd = strchr( pszLine, '\n' );
+		size_t cchLine = pszEnd ? (size_t)( pszEnd - pszLine ) : strlen( pszLine );
+		if ( cchLine || !pszEnd )
+		{
+			if ( !Push( eLevel, usecTime, pszLine, cchLine ) )
+				++m_nDropped;
+		}
+		if ( !pszEnd || !pszEnd[1] )
+			break;
+		pszLine = pszEnd + 1;
+	}
+}
+
+bool AsyncLog::Push( LogLevel eLevel, SteamNetworkingMicroseconds usecTime, const char *pszText, size_t cchText )
+{
+	if ( cchText >= k_cchLine )
+		cchText = k_cchLine - 1;
+
+	++m_nActiveProducers;
+	if ( !m_bRunning )
+	{
+		--m_nActiveProducers;
+		std::lock_guard< std::mutex > lock( m_mutex );
+		char szPrefix[ 32 ];
+		int cchPrefix = sprintf( szPrefix, "%10.6f ", ( usecTime - m_usecTimeZero )*1e-6 );
+		Output( szPrefix, cchPrefix );
+		Output( pszText, cchText );
+		Output( "\n", 1 );
+		FlushOutput();
+		return true;
+	}
+
+	// Claim a slot.  The slot's sequence number tells whether the writer is
+	// done with it and whether another producer got to it first.
+	size_t nPos = m_nEnqueuePos.load( std::memory_order_relaxed );
+	Entry *pEntry;
+	while ( true )
+	{
+		pEntry = &m_vecRing[ nPos & m_nMask ];
+		size_t nSequence = pEntry->m_nSequence.load( std::memory_order_acquire );
+		intptr_t nDiff = (intptr_t)nSequence - (intptr_t)nPos;
+		if ( nDiff == 0 )
+		{
+			if ( m_nEnqueuePos.compare_exchange_weak( nPos, nPos + 1, std::memory_order_relaxed ) )
+				break;
+		}
+		else if ( nDiff < 0 )
+		{
+			// Full
+			--m_nActiveProducers;
+			return false;
+		}
+		else
+		{
+			nPos = m_nEnqueuePos.load( std::memory_order_relaxed );
+		}
+	}
+
+	pEntry->m_usecTime = usecTime;
+	pEntry->m_eLevel = eLevel;
+	memcpy( pEntry->m_szText, pszText, cchText );
+	pEntry->m_szText[ cchText ] = '\0';
+	pEntry->m_nSequence.store( nPos + 1, std::memory_order_release );
+	--m_nActiveProducers;
+
+	// Don't wait for the writer's next pass if we are running out of room
+	if ( ( nPos & ( m_nMask >> 1 ) ) == 0 && nPos )
+		m_cv.notify_one();
+	return true;
+}
+
+bool AsyncLog::Pop( std::string &sOut )
+{
+	Entry &entry = m_vecRing[ m_nDequeuePos & m_nMask ];
+	if ( entry.m_nSequence.load( std::memory_order_acquire ) != m_nDequeuePos + 1 )
+		return false;
+
+	char szPrefix[ 48 ];
+	if ( entry.m_eLevel == log_info )
+		sprintf( szPrefix, "%10.6f ", ( entry.m_usecTime - m_usecTimeZero )*1e-6 );
+	else
+		sprintf( szPrefix, "%10.6f [%s] ", ( entry.m_usecTime - m_usecTimeZero )*1e-6, GetLogLevelName( entry.m_eLevel ) );
+	sOut.append( szPrefix );
+	sOut.append( entry.m_szText );
+	sOut.push_back( '\n' );
+
+	entry.m_nSequence.store( m_nDequeuePos + m_nMask + 1, std::memory_order_release );
+	++m_nDequeuePos;
+	return true;
+}
+
+void AsyncLog::WriterThread()
+{
+	std::string sBatch;
+	while ( true )
+	{
+		// Keep going without a break while lines are coming in
+		bool bStop;
+		{
+			std::unique_lock< std::mutex > lock( m_mutex );
+			if ( !m_bStop && sBatch.empty() )
+				m_cv.wait_for( lock, std::chrono::milliseconds( k_nLogWriterIntervalMS ) );
+			bStop = m_bStop;
+		}
+
+		sBatch.clear();
+		while ( Pop( sBatch ) )
+		{
+		}
+
+		uint64 nDropped = m_nDropped;
+		if ( nDropped != m_nDroppedReported )
+		{
+			char szDropped[ 64 ];
+			sprintf( szDropped, "%llu LOG LINES DROPPED, THE LOG CAN'T KEEP UP\n", (unsigned long long)( nDropped - m_nDroppedReported ) );
+			sBatch.append( szDropped );
+			m_nDroppedReported = nDropped;
+		}
+
+		if ( !sBatch.empty() )
+		{
+			// Lines logged while stopping go straight out, not in between
+			std::lock_guard< std::mutex > lock( m_mutex );
+			Output( sBatch.c_str(), sBatch.length() );
+			FlushOutput();
+		}
+
+		if ( bStop )
+			return;
+	}
+}
+
+void AsyncLog::Output( const char *pszText, size_t cchText )
+{
+	fwrite( pszText, 1, cchText, stdout );
+	if ( !m_pFile )
+		return;
+	fwrite( pszText, 1, cchText, m_pFile );
+	m_cbFile += cchText;
+	if ( m_cbMaxFile && m_cbFile >= m_cbMaxFile )
+		RotateFile();
+}
+
+void AsyncLog::FlushOutput()
+{
+	fflush( stdout );
+	if ( m_pFile )
+		fflush( m_pFile );
+}
+
+void AsyncLog::RotateFile()
+{
+	fclose( m_pFile );
+	for ( int i = k_nLogFilesKept - 1; i >= 0; --i )
+	{
+		std::string sFrom = i ? m_sFilePath + "." + std::to_string( i ) : m_sFilePath;
+		std::string sTo = m_sFilePath + "." + std::to_string( i + 1 );
+		remove( sTo.c_str() );
+		rename( sFrom.c_str(), sTo.c_str() );
+	}
+	m_pFile = fopen( m_sFilePath.c_str(), "w" );
+	m_cbFile = 0;
+}
+
+LogLevel ConvertStringToLogLevel( const char *pszLevel )
+{
+	for ( int i = 0; i < num_log_levels; ++i )
+	{
+		if ( !strcmp( pszLevel, s_pszLogLevels[ i ] ) )
+			return (LogLevel)i;
+	}
+	return num_log_levels;
+}
+
+std::string ConvertLogLevelToString( LogLevel eLevel )
+{
+	return GetLogLevelName( eLevel );
+}
@@ -0,0 +1,122 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Asynchronous logging for the matchmaking server
+//
+//=============================================================================
+
+#ifndef MM_LOG_H
+#define MM_LOG_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <steam/steamnetworkingtypes.h>
+
+enum LogLevel
+{
+	log_debug,
+	log_info,
+	log_warning,
+	log_error,
+	num_log_levels
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// AsyncLog
+//
+// Any thread can log without taking a lock or making a system call.  Lines
+// are formatted into slots of a fixed ring, and a background thread writes
+// them out in batches.  The timestamp and level are stored as they are and
+// only turned into text by the writer.  When the ring is full lines are
+// dropped and counted rather than making the caller wait.
+//
+// Before Start() and after Stop() lines are written out straight away.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class AsyncLog
+{
+public:
+	AsyncLog();
+	~AsyncLog();
+
+	void Start( SteamNetworkingMicroseconds usecTimeZero );
+
+	/// Writes out everything that's still queued and stops the writer thread
+	void Stop();
+
+	/// Also write to this file, starting a new one once it gets bigger than
+	/// cbMaxFile.  Older files are kept as PATH.1, PATH.2 and so on.
+	bool SetFile( const char *pszPath, size_t cbMaxFile );
+
+	void SetLevel( LogLevel eLevel ) { m_eLevel = eLevel; }
+	LogLevel GetLevel() const { return m_eLevel; }
+	bool IsEnabled( LogLevel eLevel ) const { return eLevel >= m_eLevel; }
+
+	void Write( LogLevel eLevel, const char *fmt, va_list ap );
+
+	uint64 GetNumDropped() const { return m_nDropped; }
+
+private:
+	// Longest line we keep, anything longer is cut off
+	static const int k_cchLine = 512;
+
+	struct Entry
+	{
+		std::atomic< size_t > m_nSequence;
+		SteamNetworkingMicroseconds m_usecTime;
+		LogLevel m_eLevel;
+		char m_szText[ k_cchLine ];
+	};
+
+	bool Push( LogLevel eLevel, SteamNetworkingMicroseconds usecTime, const char *pszText, size_t cchText );
+	bool Pop( std::string &sOut );
+	void WriterThread();
+	void Output( const char *pszText, size_t cchText );
+	void FlushOutput();
+	void RotateFile();
+
+	std::vector< Entry > m_vecRing;
+	size_t m_nMask;
+	char m_pad0[ 64 ];
+	std::atomic< size_t > m_nEnqueuePos;
+	char m_pad1[ 64 ];
+	size_t m_nDequeuePos;
+
+	std::atomic< LogLevel > m_eLevel;
+	std::atomic< uint64 > m_nDropped;
+	uint64 m_nDroppedReported;
+	SteamNetworkingMicroseconds m_usecTimeZero;
+
+	std::thread m_thread;
+	std::atomic< bool > m_bRunning;
+
+	// Producers between checking m_bRunning and publishing their line, Stop
+	// waits for them so their lines make it into the last batch
+	std::atomic< int > m_nActiveProducers;
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_bStop;
+
+	// Only touched under m_mutex once the writer is running
+	FILE *m_pFile;
+	std::string m_sFilePath;
+	size_t m_cbMaxFile;
+	size_t m_cbFile;
+};
+
+extern AsyncLog g_Log;
+
+LogLevel ConvertStringToLogLevel( const char *pszLevel );
+std::string ConvertLogLevelToString( LogLevel eLevel );
+
+#endif
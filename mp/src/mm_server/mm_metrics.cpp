@@ -0,0 +1,413 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Counters, latency histograms and the stats endpoint
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_metrics.h"
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <algorithm>
+
+#ifdef _WIN32
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+#else
+	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <arpa/inet.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+	#define MSG_NOSIGNAL 0
+#endif
+
+// Scrapers that take longer than this to ask or to read the answer are dropped
+static const SteamNetworkingMicroseconds k_usecScrapeTimeout = 5 * 1000000;
+
+// Requests are never looked at, only waited for, so anything past this is junk
+static const size_t k_cbMaxRequest = 8192;
+
+// At most this many scrapers are answered at once, the rest wait in the backlog
+static const size_t k_nMaxScrapes = 16;
+
+static std::atomic< uint64 > s_nSendFailuresByResult[ k_nMaxSendFailureResult ];
+static std::atomic< uint64 > s_nSendFailuresByType[ num_message_types + 1 ];
+
+static int HighestBit( uint64 n )
+{
+#if defined( __GNUC__ )
+	return 63 - __builtin_clzll( n );
+#else
+	int iBit = 0;
+	while ( n >>= 1 )
+		++iBit;
+	return iBit;
+#endif
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+	Clear();
+}
+
+void LatencyHistogram::Clear()
+{
+	for ( int i = 0; i < k_nNumBuckets; ++i )
+		m_nBuckets[ i ] = 0;
+	m_nCount = 0;
+	m_usecSum = 0;
+	m_usecMax = 0;
+}
+
+int LatencyHistogram::GetBucket( SteamNetworkingMicroseconds usec )
+{
+	// The first k_nSubBuckets values are exact, after that each magnitude
+	// has its top k_nSubBucketBits + 1 bits kept
+	uint64 n = (uint64)usec;
+	if ( n < (uint64)k_nSubBuckets )
+		return (int)n;
+	int nShift = HighestBit( n ) - k_nSubBucketBits;
+	int nMagnitude = nShift + 1;
+	if ( nMagnitude > k_nMagnitudes )
+		return k_nNumBuckets - 1;
+	return nMagnitude * k_nSubBuckets + (int)( ( n >> nShift ) - k_nSubBuckets );
+}
+
+SteamNetworkingMicroseconds LatencyHistogram::GetBucketTop( int iBucket )
+{
+	int nMagnitude = iBucket / k_nSubBuckets;
+	int iSub = iBucket % k_nSubBuckets;
+	if ( nMagnitude == 0 )
+		return iSub;
+	return ( (SteamNetworkingMicroseconds)( k_nSubBuckets + iSub + 1 ) << ( nMagnitude - 1 ) ) - 1;
+}
+
+void LatencyHistogram::Record( SteamNetworkingMicroseconds usec )
+{
+	usec = std::max( usec, (SteamNetworkingMicroseconds)0 );
+
+	// Only the owning thread writes, readers just need to see whole values
+	std::atomic< uint32 > &nBucket = m_nBuckets[ GetBucket( usec ) ];
+	nBucket.store( nBucket.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+	m_nCount.store( m_nCount.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+	m_usecSum.store( m_usecSum.load( std::memory_order_relaxed ) + usec, std::memory_order_relaxed );
+	if ( usec > m_usecMax.load( std::memory_order_relaxed ) )
+		m_usecMax.store( usec, std::memory_order_relaxed );
+}
+
+SteamNetworkingMicroseconds LatencyHistogram::GetAverage() const
+{
+	uint64 nCount = GetCount();
+	return nCount ? GetSum() / (SteamNetworkingMicroseconds)nCount : 0;
+}
+
+SteamNetworkingMicroseconds LatencyHistogram::GetPercentile( float flFraction ) const
+{
+	uint64 nCount = GetCount();
+	if ( !nCount )
+		return 0;
+	uint64 nWanted = std::max( (uint64)1, (uint64)ceil( (double)flFraction * nCount ) );
+	uint64 nSeen = 0;
+	for ( int i = 0; i < k_nNumBuckets; ++i )
+	{
+		nSeen += m_nBuckets[ i ].load( std::memory_order_relaxed );
+		if ( nSeen >= nWanted )
+			return std::min( GetBucketTop( i ), GetMax() );
+	}
+	return GetMax();
+}
+
+void StatsText::Clear()
+{
+	m_sText.clear();
+	m_sLastName.clear();
+}
+
+void StatsText::Type( const char *pszName, const char *pszType )
+{
+	if ( m_sLastName == pszName )
+		return;
+	m_sLastName = pszName;
+	m_sText += "# TYPE ";
+	m_sText += pszName;
+	m_sText += ' ';
+	m_sText += pszType;
+	m_sText += '\n';
+}
+
+void StatsText::Line( const char *pszName, const char *pszSuffix, const char *pszLabels, const char *pszExtraLabel, const char *pszValue )
+{
+	m_sText += pszName;
+	m_sText += pszSuffix;
+	bool bLabels = pszLabels && *pszLabels;
+	if ( bLabels || pszExtraLabel )
+	{
+		m_sText += '{';
+		if ( bLabels )
+			m_sText += pszLabels;
+		if ( bLabels && pszExtraLabel )
+			m_sText += ',';
+		if ( pszExtraLabel )
+			m_sText += pszExtraLabel;
+		m_sText += '}';
+	}
+	m_sText += ' ';
+	m_sText += pszValue;
+	m_sText += '\n';
+}
+
+void StatsText::Counter( const char *pszName, const char *pszLabels, uint64 nValue )
+{
+	char szValue[ 32 ];
+	snprintf( szValue, sizeof(szValue), "%llu", (unsigned long long)nValue );
+	Type( pszName, "counter" );
+	Line( pszName, "", pszLabels, nullptr, szValue );
+}
+
+void StatsText::Gauge( const char *pszName, const char *pszLabels, double flValue )
+{
+	char szValue[ 32 ];
+	snprintf( szValue, sizeof(szValue), "%.9g", flValue );
+	Type( pszName, "gauge" );
+	Line( pszName, "", pszLabels, nullptr, szValue );
+}
+
+void StatsText::Summary( const char *pszName, const char *pszLabels, const LatencyHistogram &histogram )
+{
+	// The last one is the exact max, the one number everybody looks at first
+	static const char *s_pszQuantiles[] = { "0.5", "0.9", "0.99", "0.999", "1" };
+	static const float s_flQuantiles[] = { 0.5f, 0.9f, 0.99f, 0.999f, 1.0f };
+
+	char szValue[ 32 ];
+	char szQuantile[ 32 ];
+	Type( pszName, "summary" );
+	for ( int i = 0; i < (int)( sizeof(s_flQuantiles) / sizeof(s_flQuantiles[0]) ); ++i )
+	{
+		snprintf( szQuantile, sizeof(szQuantile), "quantile=\"%s\"", s_pszQuantiles[ i ] );
+		snprintf( szValue, sizeof(szValue), "%.9g", histogram.GetPercentile( s_flQuantiles[ i ] ) * 1e-6 );
+		Line( pszName, "", pszLabels, szQuantile, szValue );
+	}
+	snprintf( szValue, sizeof(szValue), "%.9g", histogram.GetSum() * 1e-6 );
+	Line( pszName, "_sum", pszLabels, nullptr, szValue );
+	snprintf( szValue, sizeof(szValue), "%llu", (unsigned long long)histogram.GetCount() );
+	Line( pszName, "_count", pszLabels, nullptr, szValue );
+}
+
+static bool WouldBlock()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static bool SetNonBlocking( intptr_t hSocket )
+{
+#ifdef _WIN32
+	u_long nNonBlocking = 1;
+	return ioctlsocket( (SOCKET)hSocket, FIONBIO, &nNonBlocking ) == 0;
+#else
+	int nFlags = fcntl( (int)hSocket, F_GETFL, 0 );
+	return nFlags >= 0 && fcntl( (int)hSocket, F_SETFL, nFlags | O_NONBLOCK ) == 0;
+#endif
+}
+
+StatsEndpoint::StatsEndpoint()
+{
+	m_hListenSocket = -1;
+	m_nScrapes = 0;
+}
+
+StatsEndpoint::~StatsEndpoint()
+{
+	Stop();
+}
+
+void StatsEndpoint::CloseSocket( intptr_t hSocket )
+{
+#ifdef _WIN32
+	closesocket( (SOCKET)hSocket );
+#else
+	close( (int)hSocket );
+#endif
+}
+
+bool StatsEndpoint::IsRunning() const
+{
+	return m_hListenSocket != -1;
+}
+
+bool StatsEndpoint::Start( uint16 nPort, std::function< void( std::string &sPage ) > fnBuildPage, std::string &sError )
+{
+#ifdef _WIN32
+	WSADATA wsaData;
+	if ( WSAStartup( MAKEWORD( 2, 2 ), &wsaData ) != 0 )
+	{
+		sError = "Can't initialize Winsock";
+		return false;
+	}
+#endif
+
+	// Loopback only, the page tells anybody who can read it a lot about the server
+	intptr_t hSocket = (intptr_t)socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+	if ( hSocket == -1 )
+	{
+		sError = "Can't create socket";
+		return false;
+	}
+	int nReuse = 1;
+	setsockopt( hSocket, SOL_SOCKET, SO_REUSEADDR, (const char *)&nReuse, sizeof(nReuse) );
+
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( nPort );
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	if ( bind( hSocket, (const sockaddr *)&addr, sizeof(addr) ) != 0 )
+	{
+		sError = "Can't bind to port " + std::to_string( nPort );
+		CloseSocket( hSocket );
+		return false;
+	}
+	if ( listen( hSocket, 8 ) != 0 || !SetNonBlocking( hSocket ) )
+	{
+		sError = "Can't listen on port " + std::to_string( nPort );
+		CloseSocket( hSocket );
+		return false;
+	}
+
+	m_hListenSocket = hSocket;
+	m_fnBuildPage = fnBuildPage;
+	return true;
+}
+
+void StatsEndpoint::Stop()
+{
+	if ( m_hListenSocket == -1 )
+		return;
+	for ( Scrape &scrape: m_vecScrapes )
+		CloseSocket( scrape.m_hSocket );
+	m_vecScrapes.clear();
+	CloseSocket( m_hListenSocket );
+	m_hListenSocket = -1;
+	m_fnBuildPage = nullptr;
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+bool StatsEndpoint::Poll( SteamNetworkingMicroseconds usecNow )
+{
+	if ( m_hListenSocket == -1 )
+		return false;
+
+	bool bDidWork = false;
+	while ( m_vecScrapes.size() < k_nMaxScrapes )
+	{
+		intptr_t hSocket = (intptr_t)accept( m_hListenSocket, nullptr, nullptr );
+		if ( hSocket == -1 )
+			break;
+		if ( !SetNonBlocking( hSocket ) )
+		{
+			CloseSocket( hSocket );
+			continue;
+		}
+		Scrape scrape;
+		scrape.m_hSocket = hSocket;
+		scrape.m_nSent = 0;
+		scrape.m_usecStarted = usecNow;
+		m_vecScrapes.push_back( scrape );
+		bDidWork = true;
+	}
+
+	// The page is built at most once per poll, however many scrapers there are
+	m_sPage.clear();
+	for ( size_t i = 0; i < m_vecScrapes.size(); )
+	{
+		Scrape &scrape = m_vecScrapes[ i ];
+		size_t nSentBefore = scrape.m_nSent;
+		size_t cbRequestBefore = scrape.m_sRequest.size();
+		bool bDone = Service( scrape ) || usecNow - scrape.m_usecStarted > k_usecScrapeTimeout;
+		bDidWork |= bDone || scrape.m_nSent != nSentBefore || scrape.m_sRequest.size() != cbRequestBefore;
+		if ( !bDone )
+		{
+			++i;
+			continue;
+		}
+		CloseSocket( scrape.m_hSocket );
+		m_vecScrapes[ i ] = m_vecScrapes.back();
+		m_vecScrapes.pop_back();
+	}
+	return bDidWork;
+}
+
+// Returns true once the scraper has its answer, or has gone away
+bool StatsEndpoint::Service( Scrape &scrape )
+{
+	if ( scrape.m_sResponse.empty() )
+	{
+		char buf[ 1024 ];
+		for ( ;; )
+		{
+			int cbRead = (int)recv( scrape.m_hSocket, buf, sizeof(buf), 0 );
+			if ( cbRead == 0 )
+				return true;
+			if ( cbRead < 0 )
+			{
+				if ( WouldBlock() )
+					break;
+				return true;
+			}
+			scrape.m_sRequest.append( buf, cbRead );
+			if ( scrape.m_sRequest.size() > k_cbMaxRequest )
+				break;
+		}
+
+		// Answer once the request is complete, whatever it was
+		bool bComplete = scrape.m_sRequest.find( "\r\n\r\n" ) != std::string::npos || scrape.m_sRequest.find( "\n\n" ) != std::string::npos || scrape.m_sRequest.size() > k_cbMaxRequest;
+		if ( !bComplete )
+			return false;
+		if ( m_sPage.empty() )
+			m_fnBuildPage( m_sPage );
+		scrape.m_sResponse = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\nContent-Length: " + std::to_string( m_sPage.size() ) + "\r\n\r\n";
+		scrape.m_sResponse += m_sPage;
+		++m_nScrapes;
+	}
+
+	while ( scrape.m_nSent < scrape.m_sResponse.size() )
+	{
+		int cbSent = (int)send( scrape.m_hSocket, scrape.m_sResponse.data() + scrape.m_nSent, (int)( scrape.m_sResponse.size() - scrape.m_nSent ), MSG_NOSIGNAL );
+		if ( cbSent < 0 )
+			return !WouldBlock();
+		scrape.m_nSent += cbSent;
+	}
+	return true;
+}
+
+void RecordSendFailure( HSteamNetConnection hConn, MessageType eType, EResult eResult )
+{
+	(void)hConn;
+	int iResult = std::max( 0, std::min( (int)eResult, k_nMaxSendFailureResult - 1 ) );
+	int iType = std::max( 0, std::min( (int)eType, (int)num_message_types ) );
+	s_nSendFailuresByResult[ iResult ].fetch_add( 1, std::memory_order_relaxed );
+	s_nSendFailuresByType[ iType ].fetch_add( 1, std::memory_order_relaxed );
+}
+
+uint64 GetNumSendFailures( EResult eResult )
+{
+	int iResult = std::max( 0, std::min( (int)eResult, k_nMaxSendFailureResult - 1 ) );
+	return s_nSendFailuresByResult[ iResult ].load( std::memory_order_relaxed );
+}
+
+uint64 GetNumSendFailures( MessageType eType )
+{
+	int iType = std::max( 0, std::min( (int)eType, (int)num_message_types ) );
+	return s_nSendFailuresByType[ iType ].load( std::memory_order_relaxed );
+}
@@ -0,0 +1,154 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Counters, latency histograms and the stats endpoint
+//
+//=============================================================================
+
+#ifndef MM_METRICS_H
+#define MM_METRICS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <steam/steamnetworkingtypes.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <functional>
+#include "mm_shared.h"
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// LatencyHistogram
+//
+// Durations in microseconds, HDR style: every power of two is split into
+// k_nSubBuckets equal steps, so anything from a microsecond to days is
+// recorded to within about 6% of itself in a fixed 3 KB of counters.
+// Recording is a handful of instructions and never allocates.  Written by
+// one thread only, and safe to read from any other thread.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+
+	void Record( SteamNetworkingMicroseconds usec );
+
+	uint64 GetCount() const { return m_nCount.load( std::memory_order_relaxed ); }
+	SteamNetworkingMicroseconds GetSum() const { return m_usecSum.load( std::memory_order_relaxed ); }
+	SteamNetworkingMicroseconds GetMax() const { return m_usecMax.load( std::memory_order_relaxed ); }
+	SteamNetworkingMicroseconds GetAverage() const;
+
+	/// Upper bound on the value the given fraction of samples are at or below
+	SteamNetworkingMicroseconds GetPercentile( float flFraction ) const;
+
+	/// Only while nobody is recording
+	void Clear();
+
+private:
+	static const int k_nSubBucketBits = 4;
+	static const int k_nSubBuckets = 1 << k_nSubBucketBits;
+	static const int k_nMagnitudes = 40;		// up to 2^44 us, about 200 days
+	static const int k_nNumBuckets = ( k_nMagnitudes + 1 ) * k_nSubBuckets;
+
+	static int GetBucket( SteamNetworkingMicroseconds usec );
+	static SteamNetworkingMicroseconds GetBucketTop( int iBucket );
+
+	std::atomic< uint32 > m_nBuckets[ k_nNumBuckets ];
+	std::atomic< uint64 > m_nCount;
+	std::atomic< SteamNetworkingMicroseconds > m_usecSum;
+	std::atomic< SteamNetworkingMicroseconds > m_usecMax;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// StatsText
+//
+// Builds the stats page in the Prometheus text format, one value per line:
+//
+//     mm_messages_received_total{type="chat_message"} 1234
+//
+// Histograms come out as summaries, with a line per quantile.  Metrics of
+// the same name have to be written one after another.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class StatsText
+{
+public:
+	void Clear();
+
+	/// pszLabels is the inside of the braces, like type="chat_message", or nullptr
+	void Counter( const char *pszName, const char *pszLabels, uint64 nValue );
+	void Gauge( const char *pszName, const char *pszLabels, double flValue );
+
+	/// In seconds, like everything else with a time in it
+	void Summary( const char *pszName, const char *pszLabels, const LatencyHistogram &histogram );
+
+	const std::string &Get() const { return m_sText; }
+
+private:
+	void Type( const char *pszName, const char *pszType );
+	void Line( const char *pszName, const char *pszSuffix, const char *pszLabels, const char *pszExtraLabel, const char *pszValue );
+
+	std::string m_sText;
+	std::string m_sLastName;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// StatsEndpoint
+//
+// Plain HTTP on a loopback TCP port, for a scraper to poll.  Whatever is
+// asked for, the answer is the stats page, built by the callback only when
+// somebody asks.  Non-blocking, Poll is called from the main loop and never
+// waits on a slow scraper.  Main thread only.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class StatsEndpoint
+{
+public:
+	StatsEndpoint();
+	~StatsEndpoint();
+
+	bool Start( uint16 nPort, std::function< void( std::string &sPage ) > fnBuildPage, std::string &sError );
+	void Stop();
+	bool IsRunning() const;
+
+	/// Accepts scrapers and answers them.  Returns true if anything happened.
+	bool Poll( SteamNetworkingMicroseconds usecNow );
+
+	uint64 GetNumScrapes() const { return m_nScrapes; }
+
+private:
+	struct Scrape
+	{
+		intptr_t m_hSocket;
+		std::string m_sRequest;
+		std::string m_sResponse;
+		size_t m_nSent;
+		SteamNetworkingMicroseconds m_usecStarted;
+	};
+
+	bool Service( Scrape &scrape );
+	static void CloseSocket( intptr_t hSocket );
+
+	intptr_t m_hListenSocket;
+	std::function< void( std::string &sPage ) > m_fnBuildPage;
+	std::vector< Scrape > m_vecScrapes;
+	std::string m_sPage;
+	uint64 m_nScrapes;
+};
+
+/// Counts messages the library refused to send, by EResult and by message
+/// type.  Installed as the send failure hook of mm_shared, so it's called
+/// from whatever thread was sending.
+void RecordSendFailure( HSteamNetConnection hConn, MessageType eType, EResult eResult );
+uint64 GetNumSendFailures( EResult eResult );
+uint64 GetNumSendFailures( MessageType eType );
+const int k_nMaxSendFailureResult = 128;
+
+#endif
@@ -0,0 +1,96 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Limits on how many messages each client may send
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_ratelimit.h"
+#include <algorithm>
+
+// Strikes a client may have before they are disconnected, and how fast they wear off
+static const float k_flMaxStrikes = 100.0f;
+static const float k_flStrikeDecayPerSec = 5.0f;
+
+RateLimiter::RateLimiter()
+{
+	// Anything a client has no business sending often, unless it's listed below
+	RateLimit limit = { 5.0f, 10.0f };
+	for ( int i = 0; i < num_message_types; ++i )
+	{
+		m_limits[ i ] = limit;
+		m_nDropped[ i ] = 0;
+	}
+	m_nKicked = 0;
+
+	// Chat goes out to everybody, and a lobby list has every lobby in it
+	RateLimit chat = { 2.0f, 5.0f };
+	m_limits[ chat_message ] = chat;
+	RateLimit lobbyList = { 1.0f, 3.0f };
+	m_limits[ request_lobby_list ] = lobbyList;
+	RateLimit createLobby = { 1.0f, 3.0f };
+	m_limits[ request_create_lobby ] = createLobby;
+	RateLimit pings = { 1.0f, 3.0f };
+	m_limits[ game_server_pings ] = pings;
+	RateLimit hello = { 1.0f, 2.0f };
+	m_limits[ message_hello ] = hello;
+	RateLimit resume = { 1.0f, 2.0f };
+	m_limits[ request_resume ] = resume;
+
+	RateLimit total = { 20.0f, 40.0f };
+	m_totalLimit = total;
+}
+
+void RateLimiter::Reset( int iClient, SteamNetworkingMicroseconds usecNow )
+{
+	if ( iClient >= (int)m_vecClients.size() )
+		m_vecClients.resize( iClient + 1 );
+	ClientBuckets &client = m_vecClients[ iClient ];
+	for ( int i = 0; i < num_message_types; ++i )
+		Fill( client.m_types[ i ], m_limits[ i ], usecNow );
+	Fill( client.m_total, m_totalLimit, usecNow );
+	client.m_flStrikes = 0.0f;
+	client.m_usecStruck = usecNow;
+}
+
+RateLimitResult RateLimiter::Allow( int iClient, MessageType eType, SteamNetworkingMicroseconds usecNow )
+{
+	if ( iClient >= (int)m_vecClients.size() )
+		Reset( iClient, usecNow );
+	ClientBuckets &client = m_vecClients[ iClient ];
+
+	// Only take the tokens once we know both buckets have one
+	Bucket &type = client.m_types[ eType ];
+	Refill( type, m_limits[ eType ], usecNow );
+	Refill( client.m_total, m_totalLimit, usecNow );
+	if ( type.m_flTokens >= 1.0f && client.m_total.m_flTokens >= 1.0f )
+	{
+		type.m_flTokens -= 1.0f;
+		client.m_total.m_flTokens -= 1.0f;
+		return rate_limit_ok;
+	}
+
+	++m_nDropped[ eType ];
+	client.m_flStrikes = std::max( 0.0f, client.m_flStrikes - ( usecNow - client.m_usecStruck ) * 1e-6f * k_flStrikeDecayPerSec );
+	client.m_usecStruck = usecNow;
+	bool bFirstStrike = client.m_flStrikes <= 0.0f;
+	client.m_flStrikes += 1.0f;
+	if ( client.m_flStrikes > k_flMaxStrikes )
+	{
+		++m_nKicked;
+		return rate_limit_kick;
+	}
+	return bFirstStrike ? rate_limit_slow_down : rate_limit_dropped;
+}
+
+void RateLimiter::Refill( Bucket &bucket, const RateLimit &limit, SteamNetworkingMicroseconds usecNow )
+{
+	bucket.m_flTokens = std::min( limit.m_flBurst, bucket.m_flTokens + ( usecNow - bucket.m_usecRefilled ) * 1e-6f * limit.m_flPerSec );
+	bucket.m_usecRefilled = usecNow;
+}
+
+void RateLimiter::Fill( Bucket &bucket, const RateLimit &limit, SteamNetworkingMicroseconds usecNow )
+{
+	bucket.m_flTokens = limit.m_flBurst;
+	bucket.m_usecRefilled = usecNow;
+}
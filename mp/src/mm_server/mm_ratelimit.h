@@ -0,0 +1,91 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Limits on how many messages each client may send
+//
+//=============================================================================
+
+#ifndef MM_RATELIMIT_H
+#define MM_RATELIMIT_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <vector>
+#include "mm_shared.h"
+
+/// Messages per second a client may send on average, and how many at once
+struct RateLimit
+{
+	float m_flPerSec;
+	float m_flBurst;
+};
+
+/// What to do with a message, as RateLimiter::Allow sees it
+enum RateLimitResult
+{
+	rate_limit_ok,
+	rate_limit_dropped,		// over the limit, ignore the message
+	rate_limit_slow_down,	// same, and the first one in a while, so tell them
+	rate_limit_kick			// over the limit so often they should be disconnected
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// RateLimiter
+//
+// Token buckets for every client slot, one per message type and one for
+// everything the client sends taken together.  A message gets through when
+// both of its buckets have a token to spare.  Every message that doesn't is
+// a strike, strikes wear off at k_flStrikeDecayPerSec, and a client that
+// piles up more than k_flMaxStrikes isn't just chatty but flooding us, and
+// gets disconnected.  Checking a message costs a couple of multiplies, so it
+// happens before anything else is done with it.  Main thread only.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class RateLimiter
+{
+public:
+	RateLimiter();
+
+	void SetLimit( MessageType eType, const RateLimit &limit ) { m_limits[ eType ] = limit; }
+	const RateLimit &GetLimit( MessageType eType ) const { return m_limits[ eType ]; }
+	void SetTotalLimit( const RateLimit &limit ) { m_totalLimit = limit; }
+	const RateLimit &GetTotalLimit() const { return m_totalLimit; }
+
+	/// Starts the slot over with full buckets, for a client that just connected
+	void Reset( int iClient, SteamNetworkingMicroseconds usecNow );
+
+	/// Takes a token for a message of eType from the client, if there is one
+	RateLimitResult Allow( int iClient, MessageType eType, SteamNetworkingMicroseconds usecNow );
+
+	uint64 GetNumDropped( MessageType eType ) const { return m_nDropped[ eType ]; }
+	uint64 GetNumKicked() const { return m_nKicked; }
+
+private:
+	struct Bucket
+	{
+		float m_flTokens;
+		SteamNetworkingMicroseconds m_usecRefilled;
+	};
+
+	struct ClientBuckets
+	{
+		Bucket m_types[ num_message_types ];
+		Bucket m_total;
+		float m_flStrikes;
+		SteamNetworkingMicroseconds m_usecStruck;
+	};
+
+	static void Refill( Bucket &bucket, const RateLimit &limit, SteamNetworkingMicroseconds usecNow );
+	static void Fill( Bucket &bucket, const RateLimit &limit, SteamNetworkingMicroseconds usecNow );
+
+	RateLimit m_limits[ num_message_types ];
+	RateLimit m_totalLimit;
+	std::vector< ClientBuckets > m_vecClients;
+
+	uint64 m_nDropped[ num_message_types ];
+	uint64 m_nKicked;
+};
+
+#endif
@@ -0,0 +1,402 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Player profiles and skill ratings, kept in SQLite
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_ratings.h"
+#include "mm_log.h"
+#include <sqlite3.h>
+#include <chrono>
+#include <cmath>
+#include <stdarg.h>
+
+// How often changed profiles are written out.  Everything that changed in
+// between goes into the same transaction.
+static const int k_nFlushIntervalMS = 500;
+
+// Write early if this many profiles are waiting, e.g. right after a lot of
+// matches ended at once
+static const size_t k_nMaxPendingWrites = 4096;
+
+// How far one match can move a rating
+static const float k_flRatingK = 32.0f;
+
+static void StoreLog( LogLevel eLevel, const char *fmt, ... )
+{
+	va_list ap;
+	va_start( ap, fmt );
+	g_Log.Write( eLevel, fmt, ap );
+	va_end( ap );
+}
+
+RatingStore::RatingStore()
+{
+	m_nMaxCached = 100000;
+	m_pDB = nullptr;
+	m_pSelect = nullptr;
+	m_pUpsert = nullptr;
+	m_bStop = false;
+	m_nLoaded = 0;
+	m_nWritten = 0;
+	m_nTransactions = 0;
+	m_nErrors = 0;
+}
+
+RatingStore::~RatingStore()
+{
+	Close();
+}
+
+bool RatingStore::Open( const char *pszPath, std::function< void() > fnOnLoaded, std::string &sError )
+{
+	if ( sqlite3_open_v2( pszPath, &m_pDB, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, nullptr ) != SQLITE_OK )
+	{
+		sError = m_pDB ? sqlite3_errmsg( m_pDB ) : "out of memory";
+		Close();
+		return false;
+	}
+
+	// WAL lets the database be read, e.g. for backups, while we write to it, and
+	// NORMAL only syncs at checkpoints, which is plenty for ratings
+	sqlite3_busy_timeout( m_pDB, 5000 );
+	if ( !Exec( "PRAGMA journal_mode=WAL" )
+		|| !Exec( "PRAGMA synchronous=NORMAL" )
+		|| !Exec( "CREATE TABLE IF NOT EXISTS players ("
+			"steam_id INTEGER PRIMARY KEY, "
+			"rating REAL NOT NULL, "
+			"matches INTEGER NOT NULL, "
+			"last_played INTEGER NOT NULL)" )
+		|| sqlite3_prepare_v2( m_pDB, "SELECT rating, matches, last_played FROM players WHERE steam_id = ?", -1, &m_pSelect, nullptr ) != SQLITE_OK
+		|| sqlite3_prepare_v2( m_pDB, "INSERT OR REPLACE INTO players (steam_id, rating, matches, last_played) VALUES (?, ?, ?, ?)", -1, &m_pUpsert, nullptr ) != SQLITE_OK )
+	{
+		sError = sqlite3_errmsg( m_pDB );
+		Close();
+		return false;
+	}
+
+	m_fnOnLoaded = fnOnLoaded;
+	m_bStop = false;
+	m_thread = std::thread( &RatingStore::StoreThread, this );
+	return true;
+}
+
+void RatingStore::Close()
+{
+	if ( m_thread.joinable() )
+	{
+		{
+			std::lock_guard< std::mutex > lock( m_mutex );
+			m_bStop = true;
+		}
+		m_cvWork.notify_one();
+		m_thread.join();
+	}
+
+	sqlite3_finalize( m_pSelect );
+	sqlite3_finalize( m_pUpsert );
+	m_pSelect = nullptr;
+	m_pUpsert = nullptr;
+	if ( m_pDB )
+	{
+		sqlite3_close( m_pDB );
+		m_pDB = nullptr;
+	}
+}
+
+const PlayerProfile *RatingStore::Find( uint64 steamID )
+{
+	bool bAdded;
+	CachedProfile &cached = Touch( steamID, bAdded );
+	if ( !bAdded )
+		return cached.m_bLoading ? nullptr : &cached.m_profile;
+
+	cached.m_profile.m_steamID = steamID;
+	if ( !m_pDB )
+	{
+		// Nowhere to load from, so they're new
+		cached.m_bLoading = false;
+		return &cached.m_profile;
+	}
+
+	cached.m_bLoading = true;
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		m_vecLoadRequests.push_back( steamID );
+	}
+	m_cvWork.notify_one();
+	return nullptr;
+}
+
+void RatingStore::Update( const PlayerProfile &profile )
+{
+	bool bAdded;
+	CachedProfile &cached = Touch( profile.m_steamID, bAdded );
+	cached.m_profile = profile;
+	cached.m_bLoading = false;
+	if ( !m_pDB )
+		return;
+
+	bool bFlushNow;
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		m_mapPendingWrites[ profile.m_steamID ] = profile;
+		bFlushNow = m_mapPendingWrites.size() >= k_nMaxPendingWrites;
+	}
+	if ( bFlushNow )
+		m_cvWork.notify_one();
+}
+
+bool RatingStore::PopLoaded( PlayerProfile &profile )
+{
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		if ( m_vecLoaded.empty() )
+			return false;
+		profile = m_vecLoaded.back();
+		m_vecLoaded.pop_back();
+	}
+
+	// If it was changed while it was loading, what we have in memory is newer
+	bool bAdded;
+	CachedProfile &cached = Touch( profile.m_steamID, bAdded );
+	if ( bAdded || cached.m_bLoading )
+	{
+		cached.m_profile = profile;
+		cached.m_bLoading = false;
+	}
+	else
+	{
+		profile = cached.m_profile;
+	}
+	return true;
+}
+
+size_t RatingStore::GetNumPendingWrites()
+{
+	std::lock_guard< std::mutex > lock( m_mutex );
+	return m_mapPendingWrites.size();
+}
+
+RatingStore::CachedProfile &RatingStore::Touch( uint64 steamID, bool &bAdded )
+{
+	std::unordered_map< uint64, CachedProfile >::iterator it = m_mapCache.find( steamID );
+	if ( it != m_mapCache.end() )
+	{
+		bAdded = false;
+		m_listLRU.splice( m_listLRU.begin(), m_listLRU, it->second.m_itLRU );
+		return it->second;
+	}
+
+	bAdded = true;
+	while ( m_mapCache.size() >= m_nMaxCached && EvictOldest() )
+		;
+	m_listLRU.push_front( steamID );
+	CachedProfile &cached = m_mapCache[ steamID ];
+	cached.m_bLoading = false;
+	cached.m_nUsers = 0;
+	cached.m_itLRU = m_listLRU.begin();
+	return cached;
+}
+
+// Returns false if there's nothing that can go
+bool RatingStore::EvictOldest()
+{
+	// With a database, changes are already queued for writing, so nothing is
+	// lost.  Without one, players who left lose their rating, but those still
+	// connected keep theirs.
+	for ( std::list< uint64 >::iterator it = m_listLRU.end(); it != m_listLRU.begin(); )
+	{
+		--it;
+		std::unordered_map< uint64, CachedProfile >::iterator itCached = m_mapCache.find( *it );
+		if ( !m_pDB && itCached->second.m_nUsers > 0 )
+			continue;
+		m_mapCache.erase( itCached );
+		m_listLRU.erase( it );
+		return true;
+	}
+	return false;
+}
+
+void RatingStore::AddUser( uint64 steamID )
+{
+	std::unordered_map< uint64, CachedProfile >::iterator it = m_mapCache.find( steamID );
+	if ( it != m_mapCache.end() )
+		++it->second.m_nUsers;
+}
+
+void RatingStore::RemoveUser( uint64 steamID )
+{
+	std::unordered_map< uint64, CachedProfile >::iterator it = m_mapCache.find( steamID );
+	if ( it != m_mapCache.end() && it->second.m_nUsers > 0 )
+		--it->second.m_nUsers;
+}
+
+void RatingStore::StoreThread()
+{
+	std::vector< uint64 > vecLoads;
+	std::vector< PlayerProfile > vecWrites;
+	std::vector< PlayerProfile > vecLoaded;
+	std::chrono::steady_clock::time_point timeNextFlush = std::chrono::steady_clock::now() + std::chrono::milliseconds( k_nFlushIntervalMS );
+
+	while ( true )
+	{
+		bool bStop;
+		{
+			std::unique_lock< std::mutex > lock( m_mutex );
+			m_cvWork.wait_until( lock, timeNextFlush, [this]() {
+				return m_bStop || !m_vecLoadRequests.empty() || m_mapPendingWrites.size() >= k_nMaxPendingWrites;
+			} );
+			bStop = m_bStop;
+			vecLoads.swap( m_vecLoadRequests );
+
+			std::chrono::steady_clock::time_point timeNow = std::chrono::steady_clock::now();
+			if ( bStop || timeNow >= timeNextFlush || m_mapPendingWrites.size() >= k_nMaxPendingWrites )
+			{
+				for ( const std::pair< const uint64, PlayerProfile > &pending: m_mapPendingWrites )
+					vecWrites.push_back( pending.second );
+				m_mapPendingWrites.clear();
+				timeNextFlush = timeNow + std::chrono::milliseconds( k_nFlushIntervalMS );
+			}
+		}
+
+		if ( !vecWrites.empty() && !WriteProfiles( vecWrites ) )
+		{
+			// Try them again with the next batch, unless a newer version is waiting already
+			if ( !bStop )
+			{
+				std::lock_guard< std::mutex > lock( m_mutex );
+				for ( const PlayerProfile &profile: vecWrites )
+					m_mapPendingWrites.insert( std::make_pair( profile.m_steamID, profile ) );
+			}
+			else
+			{
+				StoreLog( log_error, "RATINGS DATABASE: %i PROFILE CHANGES WERE LOST ON SHUTDOWN\n", (int)vecWrites.size() );
+			}
+		}
+		vecWrites.clear();
+
+		if ( !vecLoads.empty() )
+		{
+			// One read transaction for the lot instead of one per lookup
+			Exec( "BEGIN" );
+			for ( uint64 steamID: vecLoads )
+			{
+				PlayerProfile profile;
+				profile.m_steamID = steamID;
+
+				// Anything waiting to be written is newer than what's on disk
+				bool bPending;
+				{
+					std::lock_guard< std::mutex > lock( m_mutex );
+					std::unordered_map< uint64, PlayerProfile >::iterator it = m_mapPendingWrites.find( steamID );
+					bPending = it != m_mapPendingWrites.end();
+					if ( bPending )
+						profile = it->second;
+				}
+				if ( !bPending )
+					LoadProfile( steamID, profile );
+				vecLoaded.push_back( profile );
+			}
+			Exec( "COMMIT" );
+			m_nLoaded += vecLoads.size();
+			vecLoads.clear();
+
+			{
+				std::lock_guard< std::mutex > lock( m_mutex );
+				m_vecLoaded.insert( m_vecLoaded.end(), vecLoaded.begin(), vecLoaded.end() );
+			}
+			vecLoaded.clear();
+			if ( m_fnOnLoaded )
+				m_fnOnLoaded();
+		}
+
+		if ( bStop )
+			break;
+	}
+}
+
+bool RatingStore::WriteProfiles( const std::vector< PlayerProfile > &vecProfiles )
+{
+	if ( !Exec( "BEGIN IMMEDIATE" ) )
+		return false;
+
+	for ( const PlayerProfile &profile: vecProfiles )
+	{
+		sqlite3_bind_int64( m_pUpsert, 1, (sqlite3_int64)profile.m_steamID );
+		sqlite3_bind_double( m_pUpsert, 2, profile.m_flRating );
+		sqlite3_bind_int( m_pUpsert, 3, profile.m_nMatches );
+		sqlite3_bind_int64( m_pUpsert, 4, profile.m_nLastPlayed );
+		int nResult = sqlite3_step( m_pUpsert );
+		sqlite3_reset( m_pUpsert );
+		if ( nResult != SQLITE_DONE )
+		{
+			++m_nErrors;
+			StoreLog( log_error, "RATINGS DATABASE: CAN'T WRITE PROFILE %llu: %s\n", (unsigned long long)profile.m_steamID, sqlite3_errmsg( m_pDB ) );
+			Exec( "ROLLBACK" );
+			return false;
+		}
+	}
+
+	if ( !Exec( "COMMIT" ) )
+	{
+		Exec( "ROLLBACK" );
+		return false;
+	}
+	++m_nTransactions;
+	m_nWritten += vecProfiles.size();
+	return true;
+}
+
+bool RatingStore::LoadProfile( uint64 steamID, PlayerProfile &profile )
+{
+	sqlite3_bind_int64( m_pSelect, 1, (sqlite3_int64)steamID );
+	int nResult = sqlite3_step( m_pSelect );
+	if ( nResult == SQLITE_ROW )
+	{
+		profile.m_flRating = (float)sqlite3_column_double( m_pSelect, 0 );
+		profile.m_nMatches = sqlite3_column_int( m_pSelect, 1 );
+		profile.m_nLastPlayed = sqlite3_column_int64( m_pSelect, 2 );
+	}
+	else if ( nResult != SQLITE_DONE )
+	{
+		++m_nErrors;
+		StoreLog( log_error, "RATINGS DATABASE: CAN'T LOAD PROFILE %llu: %s\n", (unsigned long long)steamID, sqlite3_errmsg( m_pDB ) );
+	}
+	sqlite3_reset( m_pSelect );
+	return nResult == SQLITE_ROW;
+}
+
+bool RatingStore::Exec( const char *pszSQL )
+{
+	char *pszError = nullptr;
+	if ( sqlite3_exec( m_pDB, pszSQL, nullptr, nullptr, &pszError ) == SQLITE_OK )
+		return true;
+	++m_nErrors;
+	StoreLog( log_error, "RATINGS DATABASE: '%s' FAILED: %s\n", pszSQL, pszError ? pszError : "unknown error" );
+	sqlite3_free( pszError );
+	return false;
+}
+
+void ApplyMatchResult( float *pRatings, int nPlayers )
+{
+	if ( nPlayers < 2 )
+		return;
+
+	// Work out every change from the ratings before the match, then apply them
+	std::vector< float > vecDelta( nPlayers, 0.0f );
+	float flK = k_flRatingK / ( nPlayers - 1 );
+	for ( int i = 0; i < nPlayers; ++i )
+	{
+		for ( int j = i + 1; j < nPlayers; ++j )
+		{
+			float flExpected = 1.0f / ( 1.0f + powf( 10.0f, ( pRatings[ j ] - pRatings[ i ] ) / 400.0f ) );
+			float flChange = flK * ( 1.0f - flExpected );
+			vecDelta[ i ] += flChange;
+			vecDelta[ j ] -= flChange;
+		}
+	}
+	for ( int i = 0; i < nPlayers; ++i )
+		pRatings[ i ] += vecDelta[ i ];
+}
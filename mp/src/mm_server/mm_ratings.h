@@ -0,0 +1,154 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Player profiles and skill ratings, kept in SQLite
+//
+//=============================================================================
+
+#ifndef MM_RATINGS_H
+#define MM_RATINGS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <steam/steamtypes.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+// Rating everybody starts out with
+const float k_flDefaultRating = 1500.0f;
+
+struct PlayerProfile
+{
+	PlayerProfile()
+	{
+		m_steamID = 0;
+		m_flRating = k_flDefaultRating;
+		m_nMatches = 0;
+		m_nLastPlayed = 0;
+	}
+
+	uint64 m_steamID;
+	float m_flRating;
+	int m_nMatches;
+
+	// Unix time of the last match they got a result for
+	int64 m_nLastPlayed;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// RatingStore
+//
+// Profiles of the players we have seen recently live in memory, everything
+// else is in an SQLite database.  The main thread only ever touches the
+// cache: a profile that isn't there yet is loaded by a background thread and
+// shows up in PopLoaded, and changes are handed to the same thread, which
+// writes them out in one transaction every k_nFlushIntervalMS.  A profile
+// that changes several times before it is written only gets written once.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class RatingStore
+{
+public:
+	RatingStore();
+	~RatingStore();
+
+	/// Opens or creates the database.  fnOnLoaded is called from the store's
+	/// thread whenever profiles finish loading, use it to wake up whoever is
+	/// going to call PopLoaded.  Without a database profiles only live in memory.
+	bool Open( const char *pszPath, std::function< void() > fnOnLoaded, std::string &sError );
+
+	/// Writes out everything that's still pending and closes the database
+	void Close();
+	bool IsOpen() const { return m_pDB != nullptr; }
+
+	/// Returns the profile if it's in memory.  Otherwise starts loading it and
+	/// returns nullptr, PopLoaded hands it over once it's there.  Main thread only.
+	const PlayerProfile *Find( uint64 steamID );
+
+	/// Changes the profile in memory and queues it to be written.  Main thread only.
+	void Update( const PlayerProfile &profile );
+
+	/// Fetches the next profile that finished loading.  It's in the cache
+	/// already by the time it's returned.  Main thread only.
+	bool PopLoaded( PlayerProfile &profile );
+
+	/// Counts the players connected with a profile, call AddUser after Find.
+	/// Without a database the
+	/// profiles of connected players are never evicted, it's the only place
+	/// their ratings are.  Main thread only.
+	void AddUser( uint64 steamID );
+	void RemoveUser( uint64 steamID );
+
+	/// Most profiles kept in memory, the least recently used ones go first
+	void SetMaxCached( size_t nMaxCached ) { m_nMaxCached = nMaxCached; }
+
+	size_t GetNumCached() const { return m_mapCache.size(); }
+	size_t GetNumPendingWrites();
+	uint64 GetNumLoaded() const { return m_nLoaded; }
+	uint64 GetNumWritten() const { return m_nWritten; }
+	uint64 GetNumTransactions() const { return m_nTransactions; }
+	uint64 GetNumErrors() const { return m_nErrors; }
+
+private:
+	struct CachedProfile
+	{
+		PlayerProfile m_profile;
+		bool m_bLoading;
+		int m_nUsers;
+		std::list< uint64 >::iterator m_itLRU;
+	};
+
+	CachedProfile &Touch( uint64 steamID, bool &bAdded );
+	bool EvictOldest();
+
+	void StoreThread();
+	bool WriteProfiles( const std::vector< PlayerProfile > &vecProfiles );
+	bool LoadProfile( uint64 steamID, PlayerProfile &profile );
+	bool Exec( const char *pszSQL );
+
+	// Main thread only.  Most recently used at the front of the list.
+	std::unordered_map< uint64, CachedProfile > m_mapCache;
+	std::list< uint64 > m_listLRU;
+	size_t m_nMaxCached;
+
+	// Only used by the store's thread once it's running
+	sqlite3 *m_pDB;
+	sqlite3_stmt *m_pSelect;
+	sqlite3_stmt *m_pUpsert;
+
+	std::thread m_thread;
+	std::function< void() > m_fnOnLoaded;
+
+	// Everything below is protected by m_mutex
+	std::mutex m_mutex;
+	std::condition_variable m_cvWork;
+	bool m_bStop;
+	std::vector< uint64 > m_vecLoadRequests;
+	std::vector< PlayerProfile > m_vecLoaded;
+
+	// Latest version of every profile that changed since the last transaction
+	std::unordered_map< uint64, PlayerProfile > m_mapPendingWrites;
+
+	std::atomic< uint64 > m_nLoaded;
+	std::atomic< uint64 > m_nWritten;
+	std::atomic< uint64 > m_nTransactions;
+	std::atomic< uint64 > m_nErrors;
+};
+
+/// Moves the ratings of one match's players, given best placed first.  Every
+/// pair of players counts as a game the higher placed one won.
+void ApplyMatchResult( float *pRatings, int nPlayers );
+
+#endif
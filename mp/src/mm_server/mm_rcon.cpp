@@ -0,0 +1,499 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Asynchronous RCON command dispatch to game servers
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_rcon.h"
+#include <steam/isteamnetworkingutils.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+#ifdef _WIN32
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+#else
+	#include <sys/socket.h>
+	#include <sys/select.h>
+	#include <netinet/in.h>
+	#include <netdb.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+	#define MSG_NOSIGNAL 0
+#endif
+
+// Packet types of the Source RCON protocol
+enum
+{
+	rcon_response_value = 0,
+	rcon_exec_command = 2,
+	rcon_auth_response = 2,
+	rcon_auth = 3
+};
+
+// Id, type and the two terminating zeros.  Servers never send more than
+// 4096 bytes of body in one packet, anything much bigger is garbage.
+static const int k_cbRconPacketOverhead = 10;
+static const int k_cbMaxRconPacket = 4096 + k_cbRconPacketOverhead;
+
+static bool WouldBlock()
+{
+#ifdef _WIN32
+	int nError = WSAGetLastError();
+	return nError == WSAEWOULDBLOCK || nError == WSAEINPROGRESS;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == EINPROGRESS;
+#endif
+}
+
+static bool SetNonBlocking( intptr_t hSocket )
+{
+#ifdef _WIN32
+	u_long nNonBlocking = 1;
+	return ioctlsocket( (SOCKET)hSocket, FIONBIO, &nNonBlocking ) == 0;
+#else
+	int nFlags = fcntl( (int)hSocket, F_GETFL, 0 );
+	return nFlags >= 0 && fcntl( (int)hSocket, F_SETFL, nFlags | O_NONBLOCK ) == 0;
+#endif
+}
+
+RconConnection::RconConnection()
+{
+	m_hSocket = -1;
+	m_nNextID = 1;
+}
+
+RconConnection::~RconConnection()
+{
+	Close();
+}
+
+void RconConnection::Close()
+{
+	if ( m_hSocket == -1 )
+		return;
+#ifdef _WIN32
+	closesocket( (SOCKET)m_hSocket );
+#else
+	close( (int)m_hSocket );
+#endif
+	m_hSocket = -1;
+}
+
+bool RconConnection::Connect( const srcon_addr &addr, int nTimeoutSec, std::string &sError )
+{
+	Close();
+	SteamNetworkingMicroseconds usecDeadline = SteamNetworkingUtils()->GetLocalTimestamp() + nTimeoutSec * (SteamNetworkingMicroseconds)1000000;
+
+	addrinfo hints;
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	addrinfo *pResults = nullptr;
+	if ( getaddrinfo( addr.addr.c_str(), std::to_string( addr.port ).c_str(), &hints, &pResults ) != 0 || !pResults )
+	{
+		sError = "Can't resolve " + addr.addr;
+		return false;
+	}
+
+	m_hSocket = (intptr_t)socket( pResults->ai_family, pResults->ai_socktype, pResults->ai_protocol );
+	bool bConnecting = m_hSocket != -1 && SetNonBlocking( m_hSocket );
+	if ( bConnecting && connect( m_hSocket, pResults->ai_addr, (int)pResults->ai_addrlen ) != 0 )
+		bConnecting = WouldBlock();
+	freeaddrinfo( pResults );
+	if ( !bConnecting )
+	{
+		sError = "Can't connect";
+		Close();
+		return false;
+	}
+
+	// Done once it's writable, and whether it worked is in SO_ERROR
+	if ( !WaitForSocket( true, usecDeadline ) )
+	{
+		sError = "Timed out connecting";
+		Close();
+		return false;
+	}
+	int nError = 0;
+	socklen_t cbError = sizeof(nError);
+	if ( getsockopt( m_hSocket, SOL_SOCKET, SO_ERROR, (char *)&nError, &cbError ) != 0 || nError != 0 )
+	{
+		sError = "Connection refused";
+		Close();
+		return false;
+	}
+
+	// The server answers a login with an empty response, then whether it
+	// worked, carrying our id or -1 if the password was wrong
+	usecDeadline = SteamNetworkingUtils()->GetLocalTimestamp() + k_usecRconResponseTimeout;
+	int32 nAuthID = m_nNextID++;
+	if ( !SendPacket( nAuthID, rcon_auth, addr.pass, usecDeadline, sError ) )
+		return false;
+	while ( true )
+	{
+		int32 nID, nType;
+		std::string sBody;
+		if ( !ReceivePacket( nID, nType, sBody, usecDeadline, sError ) )
+			return false;
+		if ( nType != rcon_auth_response )
+			continue;
+		if ( nID == nAuthID )
+			return true;
+		sError = "Failed to authenticate";
+		Close();
+		return false;
+	}
+}
+
+bool RconConnection::Execute( const std::string &sCommand, std::string &sResponse, std::string &sError )
+{
+	if ( m_hSocket == -1 )
+	{
+		sError = "Not connected";
+		return false;
+	}
+
+	// Long responses come in several packets.  The server answers in order,
+	// so the answer to an empty response sent right after the command marks
+	// the end of it.  Anything else is left over from earlier commands.
+	SteamNetworkingMicroseconds usecDeadline = SteamNetworkingUtils()->GetLocalTimestamp() + k_usecRconResponseTimeout;
+	int32 nCommandID = m_nNextID++;
+	int32 nEndID = m_nNextID++;
+	if ( !SendPacket( nCommandID, rcon_exec_command, sCommand, usecDeadline, sError ) || !SendPacket( nEndID, rcon_response_value, std::string(), usecDeadline, sError ) )
+		return false;
+
+	sResponse.clear();
+	while ( true )
+	{
+		int32 nID, nType;
+		std::string sBody;
+		if ( !ReceivePacket( nID, nType, sBody, usecDeadline, sError ) )
+			return false;
+		if ( nID == nEndID )
+			return true;
+		if ( nID == nCommandID && nType == rcon_response_value )
+			sResponse += sBody;
+	}
+}
+
+bool RconConnection::SendPacket( int32 nID, int32 nType, const std::string &sBody, SteamNetworkingMicroseconds usecDeadline, std::string &sError )
+{
+	if ( (int)sBody.length() + k_cbRconPacketOverhead > k_cbMaxRconPacket )
+	{
+		sError = "Command too long";
+		return false;
+	}
+
+	// Little endian size, id and type, then the body and two zeros
+	std::string sPacket;
+	int32 nFields[ 3 ] = { (int32)sBody.length() + k_cbRconPacketOverhead, nID, nType };
+	for ( int32 nField: nFields )
+	{
+		for ( int iByte = 0; iByte < 4; ++iByte )
+			sPacket.push_back( (char)( ( (uint32)nField >> ( iByte * 8 ) ) & 0xFF ) );
+	}
+	sPacket.append( sBody );
+	sPacket.append( 2, '\0' );
+
+	size_t nSent = 0;
+	while ( nSent < sPacket.length() )
+	{
+		int cbSent = (int)send( m_hSocket, sPacket.data() + nSent, (int)( sPacket.length() - nSent ), MSG_NOSIGNAL );
+		if ( cbSent > 0 )
+		{
+			nSent += cbSent;
+			continue;
+		}
+		if ( cbSent < 0 && WouldBlock() && WaitForSocket( true, usecDeadline ) )
+			continue;
+		sError = cbSent < 0 && WouldBlock() ? "Timed out sending" : "Sending failed";
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool RconConnection::ReceivePacket( int32 &nID, int32 &nType, std::string &sBody, SteamNetworkingMicroseconds usecDeadline, std::string &sError )
+{
+	// The size first, then that much more
+	std::string sPacket;
+	size_t cbWanted = 4;
+	while ( sPacket.length() < cbWanted )
+	{
+		char buf[ 4096 ];
+		int cbReceived = (int)recv( m_hSocket, buf, (int)std::min( sizeof(buf), cbWanted - sPacket.length() ), 0 );
+		if ( cbReceived > 0 )
+		{
+			sPacket.append( buf, cbReceived );
+			if ( cbWanted == 4 && sPacket.length() == 4 )
+			{
+				int32 cbSize = (int32)( (uint8)sPacket[ 0 ] | ( (uint8)sPacket[ 1 ] << 8 ) | ( (uint8)sPacket[ 2 ] << 16 ) | ( (uint32)(uint8)sPacket[ 3 ] << 24 ) );
+				if ( cbSize < k_cbRconPacketOverhead || cbSize > k_cbMaxRconPacket )
+				{
+					sError = "Malformed response";
+					Close();
+					return false;
+				}
+				cbWanted += cbSize;
+			}
+			continue;
+		}
+		if ( cbReceived < 0 && WouldBlock() && WaitForSocket( false, usecDeadline ) )
+			continue;
+		sError = cbReceived < 0 && WouldBlock() ? "Timed out waiting for a response" : "Connection closed";
+		Close();
+		return false;
+	}
+
+	const uint8 *pFields = (const uint8 *)sPacket.data() + 4;
+	nID = (int32)( pFields[ 0 ] | ( pFields[ 1 ] << 8 ) | ( pFields[ 2 ] << 16 ) | ( (uint32)pFields[ 3 ] << 24 ) );
+	nType = (int32)( pFields[ 4 ] | ( pFields[ 5 ] << 8 ) | ( pFields[ 6 ] << 16 ) | ( (uint32)pFields[ 7 ] << 24 ) );
+
+	// The body is null terminated, and there's one more zero after it
+	sBody.assign( sPacket.data() + 12, sPacket.length() - 12 - 2 );
+	return true;
+}
+
+bool RconConnection::WaitForSocket( bool bWrite, SteamNetworkingMicroseconds usecDeadline )
+{
+	while ( true )
+	{
+		SteamNetworkingMicroseconds usecLeft = usecDeadline - SteamNetworkingUtils()->GetLocalTimestamp();
+		if ( usecLeft <= 0 )
+			return false;
+		fd_set fds;
+		FD_ZERO( &fds );
+		FD_SET( m_hSocket, &fds );
+		timeval tv;
+		tv.tv_sec = (long)( usecLeft / 1000000 );
+		tv.tv_usec = (long)( usecLeft % 1000000 );
+		int nReady = select( (int)m_hSocket + 1, bWrite ? nullptr : &fds, bWrite ? &fds : nullptr, nullptr, &tv );
+		if ( nReady > 0 )
+			return true;
+		if ( nReady < 0 && errno != EINTR )
+			return false;
+	}
+}
+
+RconPool::RconPool()
+{
+	m_bStarted = false;
+	m_bShutdown = false;
+	m_nTimeoutSec = 4;
+	m_nMaxRetries = 2;
+	m_nNextJobID = 1;
+}
+
+RconPool::~RconPool()
+{
+	Stop();
+}
+
+void RconPool::Start( int nThreads, std::function< void() > fnOnCompleted )
+{
+	if ( m_bStarted )
+		return;
+	m_bStarted = true;
+#ifdef _WIN32
+	WSADATA wsaData;
+	WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+#endif
+	m_fnOnCompleted = fnOnCompleted;
+	m_bShutdown = false;
+	for ( int i = 0; i < nThreads; ++i )
+		m_vecThreads.push_back( std::thread( &RconPool::WorkerThread, this ) );
+}
+
+// Runs from the destructor too, after the owner already stopped us
+void RconPool::Stop()
+{
+	if ( !m_bStarted )
+		return;
+	m_bStarted = false;
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		m_bShutdown = true;
+	}
+	m_cvWork.notify_all();
+	for ( std::thread &t: m_vecThreads )
+		t.join();
+	m_vecThreads.clear();
+	m_mapConnections.clear();
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+uint32 RconPool::Submit( const srcon_addr &addr, const std::vector< std::string > &vecCommands )
+{
+	RconJob job;
+	job.m_addr = addr;
+	job.m_vecCommands = vecCommands;
+	job.m_usecSubmitted = SteamNetworkingUtils()->GetLocalTimestamp();
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		job.m_nJobID = m_nNextJobID++;
+		m_queuePending.push_back( job );
+	}
+	m_cvWork.notify_one();
+	return job.m_nJobID;
+}
+
+bool RconPool::PopCompleted( RconJob &job )
+{
+	std::lock_guard< std::mutex > lock( m_mutex );
+	if ( m_queueCompleted.empty() )
+		return false;
+	job = m_queueCompleted.front();
+	m_queueCompleted.pop_front();
+	return true;
+}
+
+void RconPool::ForgetServer( const srcon_addr &addr )
+{
+	std::unique_ptr< RconConnection > pConn;
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		std::map< std::string, std::unique_ptr< RconConnection > >::iterator it = m_mapConnections.find( GetServerKey( addr ) );
+		if ( it == m_mapConnections.end() )
+			return;
+		pConn = std::move( it->second );
+		m_mapConnections.erase( it );
+	}
+	// pConn closes the socket when it goes out of scope, outside the lock
+}
+
+std::string RconPool::GetServerKey( const srcon_addr &addr )
+{
+	return addr.addr + ":" + std::to_string( addr.port );
+}
+
+void RconPool::WorkerThread()
+{
+	while ( true )
+	{
+		RconJob job;
+		{
+			std::unique_lock< std::mutex > lock( m_mutex );
+
+			// Take the oldest job whose server nobody else is talking to
+			std::deque< RconJob >::iterator itJob;
+			while ( true )
+			{
+				if ( m_bShutdown )
+					return;
+				for ( itJob = m_queuePending.begin(); itJob != m_queuePending.end(); ++itJob )
+				{
+					if ( m_setBusyServers.find( GetServerKey( itJob->m_addr ) ) == m_setBusyServers.end() )
+						break;
+				}
+				if ( itJob != m_queuePending.end() )
+					break;
+				m_cvWork.wait( lock );
+			}
+
+			job = *itJob;
+			m_queuePending.erase( itJob );
+			m_setBusyServers.insert( GetServerKey( job.m_addr ) );
+		}
+
+		job.m_bSuccess = RunJob( job );
+		job.m_usecCompleted = SteamNetworkingUtils()->GetLocalTimestamp();
+
+		{
+			std::lock_guard< std::mutex > lock( m_mutex );
+			m_setBusyServers.erase( GetServerKey( job.m_addr ) );
+			m_queueCompleted.push_back( job );
+		}
+
+		// Another job for the same server may have been waiting on us
+		m_cvWork.notify_all();
+		if ( m_fnOnCompleted )
+			m_fnOnCompleted();
+	}
+}
+
+bool RconPool::RunJob( RconJob &job )
+{
+	std::string sKey = GetServerKey( job.m_addr );
+	int nMaxRetries = m_nMaxRetries;
+
+	for ( job.m_nAttempts = 1; job.m_nAttempts <= nMaxRetries + 1; ++job.m_nAttempts )
+	{
+		if ( job.m_nAttempts > 1 && !WaitToRetry( job.m_nAttempts - 1 ) )
+		{
+			--job.m_nAttempts;
+			return false;
+		}
+
+		std::unique_ptr< RconConnection > pConn = TakeConnection( sKey );
+		if ( !pConn || !pConn->IsConnected() )
+		{
+			pConn.reset( new RconConnection() );
+			if ( !pConn->Connect( job.m_addr, m_nTimeoutSec, job.m_sError ) )
+				continue;
+		}
+
+		// Run everything on this connection.  If it drops halfway we start the
+		// whole batch over on a new one, the commands we send are safe to repeat.
+		job.m_vecResponses.clear();
+		bool bFailed = false;
+		for ( const std::string &sCommand: job.m_vecCommands )
+		{
+			std::string sResponse;
+			if ( !pConn->Execute( sCommand, sResponse, job.m_sError ) )
+			{
+				bFailed = true;
+				break;
+			}
+			job.m_vecResponses.push_back( sResponse );
+		}
+
+		if ( bFailed )
+			continue;
+
+		ReturnConnection( sKey, std::move( pConn ) );
+		job.m_sError.clear();
+		return true;
+	}
+
+	job.m_nAttempts = nMaxRetries + 1;
+	return false;
+}
+
+// Gives a server that just refused us or timed out a moment before the next
+// attempt.  Returns false if the pool is shutting down instead.
+bool RconPool::WaitToRetry( int nAttempt )
+{
+	SteamNetworkingMicroseconds usecDelay = k_usecRconRetryDelay;
+	for ( int i = 1; i < nAttempt && usecDelay < k_usecRconMaxRetryDelay; ++i )
+		usecDelay *= 2;
+	usecDelay = std::min( usecDelay, k_usecRconMaxRetryDelay );
+
+	std::unique_lock< std::mutex > lock( m_mutex );
+	return !m_cvWork.wait_for( lock, std::chrono::microseconds( usecDelay ), [this]() { return m_bShutdown; } );
+}
+
+std::unique_ptr< RconConnection > RconPool::TakeConnection( const std::string &sKey )
+{
+	std::lock_guard< std::mutex > lock( m_mutex );
+	std::map< std::string, std::unique_ptr< RconConnection > >::iterator it = m_mapConnections.find( sKey );
+	if ( it == m_mapConnections.end() )
+		return std::unique_ptr< RconConnection >();
+	std::unique_ptr< RconConnection > pConn = std::move( it->second );
+	m_mapConnections.erase( it );
+	return pConn;
+}
+
+void RconPool::ReturnConnection( const std::string &sKey, std::unique_ptr< RconConnection > pConn )
+{
+	std::lock_guard< std::mutex > lock( m_mutex );
+	m_mapConnections[ sKey ] = std::move( pConn );
+}
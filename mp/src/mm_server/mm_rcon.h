@@ -0,0 +1,160 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Asynchronous RCON command dispatch to game servers
+//
+//=============================================================================
+
+#ifndef MM_RCON_H
+#define MM_RCON_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <steam/steamnetworkingtypes.h>
+#include <srcon.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <atomic>
+
+/// A batch of commands to run on one game server, in order, over one connection.
+struct RconJob
+{
+	RconJob()
+	{
+		m_nJobID = 0;
+		m_bSuccess = false;
+		m_nAttempts = 0;
+		m_usecSubmitted = 0;
+		m_usecCompleted = 0;
+	}
+
+	uint32 m_nJobID;
+	srcon_addr m_addr;
+	std::vector< std::string > m_vecCommands;
+
+	// Filled in by the worker
+	bool m_bSuccess;
+	int m_nAttempts;
+	std::vector< std::string > m_vecResponses;
+	std::string m_sError;
+	SteamNetworkingMicroseconds m_usecSubmitted;
+	SteamNetworkingMicroseconds m_usecCompleted;
+};
+
+/// How long a game server gets to take each command and answer it.  Long
+/// enough for a server that loads the new map before it answers changelevel.
+const SteamNetworkingMicroseconds k_usecRconResponseTimeout = 30 * 1000000;
+
+/// How long a worker waits before it tries a failed job again, doubled every
+/// attempt up to k_usecRconMaxRetryDelay
+const SteamNetworkingMicroseconds k_usecRconRetryDelay = 250 * 1000;
+const SteamNetworkingMicroseconds k_usecRconMaxRetryDelay = 2 * 1000000;
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// RconConnection
+//
+// One logged in connection to a game server's RCON port, speaking the Source
+// RCON protocol.  Connecting waits at most the timeout it's given, and every
+// send and every response at most k_usecRconResponseTimeout, so a server that
+// takes the connection and then never answers can't hold on to whoever is
+// talking to it.  Any failure closes the connection.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class RconConnection
+{
+public:
+	RconConnection();
+	~RconConnection();
+
+	/// Connects and logs in with the address' password
+	bool Connect( const srcon_addr &addr, int nTimeoutSec, std::string &sError );
+	bool IsConnected() const { return m_hSocket != -1; }
+
+	/// Runs the command and collects all of its response
+	bool Execute( const std::string &sCommand, std::string &sResponse, std::string &sError );
+
+private:
+	bool SendPacket( int32 nID, int32 nType, const std::string &sBody, SteamNetworkingMicroseconds usecDeadline, std::string &sError );
+	bool ReceivePacket( int32 &nID, int32 &nType, std::string &sBody, SteamNetworkingMicroseconds usecDeadline, std::string &sError );
+	bool WaitForSocket( bool bWrite, SteamNetworkingMicroseconds usecDeadline );
+	void Close();
+
+	intptr_t m_hSocket;
+	int32 m_nNextID;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// RconPool
+//
+// Worker threads that keep one authenticated connection open per game
+// server and run jobs on them.  Jobs for the same server never run at the
+// same time, since they share the connection, but a slow or dead server only
+// ties up the worker that is talking to it.  The main loop submits jobs and
+// collects the results with PopCompleted, so it never waits on a game server.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class RconPool
+{
+public:
+	RconPool();
+	~RconPool();
+
+	/// fnOnCompleted is called from a worker thread every time a job finishes,
+	/// use it to wake up whoever is going to call PopCompleted.
+	void Start( int nThreads, std::function< void() > fnOnCompleted );
+	void Stop();
+
+	/// Seconds to wait on connect, and how many more times to try a job on a fresh connection
+	void SetTimeout( int nTimeoutSec ) { m_nTimeoutSec = nTimeoutSec; }
+	void SetMaxRetries( int nMaxRetries ) { m_nMaxRetries = nMaxRetries; }
+
+	/// Returns the job ID the result will carry
+	uint32 Submit( const srcon_addr &addr, const std::vector< std::string > &vecCommands );
+
+	/// Fetches the next finished job, if there is one.  Main thread only.
+	bool PopCompleted( RconJob &job );
+
+	/// Drops the cached connection to a server, e.g. after it was removed
+	void ForgetServer( const srcon_addr &addr );
+
+private:
+	void WorkerThread();
+	bool RunJob( RconJob &job );
+	bool WaitToRetry( int nAttempt );
+	std::unique_ptr< RconConnection > TakeConnection( const std::string &sKey );
+	void ReturnConnection( const std::string &sKey, std::unique_ptr< RconConnection > pConn );
+
+	static std::string GetServerKey( const srcon_addr &addr );
+
+	std::vector< std::thread > m_vecThreads;
+	std::function< void() > m_fnOnCompleted;
+	bool m_bStarted;			// main thread only
+	bool m_bShutdown;
+	uint32 m_nNextJobID;
+
+	// Set from the main thread, read by the workers
+	std::atomic< int > m_nTimeoutSec;
+	std::atomic< int > m_nMaxRetries;
+
+	// Everything below is protected by m_mutex
+	std::mutex m_mutex;
+	std::condition_variable m_cvWork;
+	std::deque< RconJob > m_queuePending;
+	std::deque< RconJob > m_queueCompleted;
+	std::set< std::string > m_setBusyServers;
+	std::map< std::string, std::unique_ptr< RconConnection > > m_mapConnections;
+};
+
+#endif
@@ -0,0 +1,254 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Batched and coalesced sending of small server messages
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_sendqueue.h"
+#include <steam/isteamnetworkingutils.h>
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+#include <stdint.h>
+
+// Messages bigger than this always go out on their own
+static const uint32 k_cbMaxCoalesced = 1024;
+
+// Don't let a single message_batch grow past this
+static const uint32 k_cbMaxBatch = 64 * 1024;
+
+struct SendQueue::SharedPayload
+{
+	std::atomic< int > m_nRefs;
+	uint32 m_cbData;
+	uint8 m_data[1];
+};
+
+SendQueue::SendQueue()
+{
+	m_nPending = 0;
+	m_nQueued = 0;
+	m_nSent = 0;
+}
+
+SendQueue::~SendQueue()
+{
+	// Whatever is left never gets sent, give back the broadcasts it holds on to
+	for ( size_t i = 0; i < m_nPending; ++i )
+	{
+		for ( Item &item: m_vecPending[ i ].m_vecItems )
+		{
+			if ( item.m_pShared )
+				ReleaseShared( item.m_pShared );
+		}
+	}
+}
+
+void SendQueue::Send( HSteamNetConnection hConn, MessageType eType, const void *pData, uint32 cbData )
+{
+	PendingConnection &pending = GetPending( hConn );
+	Item item;
+	item.m_pShared = nullptr;
+	item.m_nOffset = (uint32)pending.m_vecBytes.size();
+	item.m_cbData = cbData + 1;
+	pending.m_vecBytes.push_back( (uint8)eType );
+	if ( cbData )
+		pending.m_vecBytes.insert( pending.m_vecBytes.end(), (const uint8 *)pData, (const uint8 *)pData + cbData );
+	pending.m_vecItems.push_back( item );
+	++m_nQueued;
+}
+
+void SendQueue::Broadcast( const HSteamNetConnection *pConns, int nConns, MessageType eType, const void *pData, uint32 cbData )
+{
+	if ( nConns <= 0 )
+		return;
+	SharedPayload *pShared = AllocateShared( eType, pData, cbData, nConns );
+	for ( int i = 0; i < nConns; ++i )
+	{
+		Item item;
+		item.m_pShared = pShared;
+		item.m_nOffset = 0;
+		item.m_cbData = pShared->m_cbData;
+		GetPending( pConns[ i ] ).m_vecItems.push_back( item );
+	}
+	m_nQueued += nConns;
+}
+
+void SendQueue::SetCanBatch( HSteamNetConnection hConn, bool bCanBatch )
+{
+	if ( bCanBatch )
+		m_mapCanBatch.Insert( hConn, true );
+	else
+		m_mapCanBatch.Remove( hConn );
+}
+
+bool SendQueue::Flush( ISteamNetworkingSockets *pInterface )
+{
+	if ( m_nPending == 0 )
+		return false;
+
+	m_vecOutgoing.clear();
+	for ( size_t i = 0; i < m_nPending; ++i )
+	{
+		FlushConnection( m_vecPending[ i ] );
+		m_vecPending[ i ].m_vecItems.clear();
+		m_vecPending[ i ].m_vecBytes.clear();
+	}
+	m_nPending = 0;
+	m_mapPending.Clear();
+
+	// The library takes ownership of every message, whether it could send it or not
+	if ( !m_vecOutgoing.empty() )
+	{
+		m_vecOutgoingInfo.resize( m_vecOutgoing.size() );
+		for ( size_t i = 0; i < m_vecOutgoing.size(); ++i )
+		{
+			m_vecOutgoingInfo[ i ].m_hConn = m_vecOutgoing[ i ]->m_conn;
+			m_vecOutgoingInfo[ i ].m_eType = GetOutgoingMessageType( m_vecOutgoing[ i ] );
+		}
+		m_vecResults.resize( m_vecOutgoing.size() );
+		pInterface->SendMessages( (int)m_vecOutgoing.size(), m_vecOutgoing.data(), m_vecResults.data() );
+		for ( size_t i = 0; i < m_vecResults.size(); ++i )
+		{
+			if ( m_vecResults[ i ] < 0 )
+				ReportSendFailure( m_vecOutgoingInfo[ i ].m_hConn, m_vecOutgoingInfo[ i ].m_eType, (EResult)-m_vecResults[ i ] );
+		}
+	}
+	m_nSent += m_vecOutgoing.size();
+	return true;
+}
+
+SendQueue::PendingConnection &SendQueue::GetPending( HSteamNetConnection hConn )
+{
+	int *piPending = m_mapPending.Find( hConn );
+	if ( piPending )
+		return m_vecPending[ *piPending ];
+
+	if ( m_nPending == m_vecPending.size() )
+		m_vecPending.push_back( PendingConnection() );
+	PendingConnection &pending = m_vecPending[ m_nPending ];
+	pending.m_hConn = hConn;
+	m_mapPending.Insert( hConn, (int)m_nPending );
+	++m_nPending;
+	return pending;
+}
+
+const uint8 *SendQueue::GetItemData( const PendingConnection &pending, const Item &item ) const
+{
+	if ( item.m_pShared )
+		return item.m_pShared->m_data;
+	return pending.m_vecBytes.data() + item.m_nOffset;
+}
+
+void SendQueue::FlushConnection( PendingConnection &pending )
+{
+	bool bCanBatch = m_mapCanBatch.Find( pending.m_hConn ) != nullptr;
+	size_t i = 0;
+	while ( i < pending.m_vecItems.size() )
+	{
+		const Item &item = pending.m_vecItems[ i ];
+		if ( !bCanBatch || item.m_cbData > k_cbMaxCoalesced )
+		{
+			AddBatch( pending, i, i + 1 );
+			++i;
+			continue;
+		}
+
+		// Run of small messages that fits in one batch
+		size_t iEnd = i;
+		uint32 cbBatch = 0;
+		while ( iEnd < pending.m_vecItems.size() && pending.m_vecItems[ iEnd ].m_cbData <= k_cbMaxCoalesced
+			&& cbBatch + pending.m_vecItems[ iEnd ].m_cbData + sizeof(uint16) <= k_cbMaxBatch )
+		{
+			cbBatch += pending.m_vecItems[ iEnd ].m_cbData + sizeof(uint16);
+			++iEnd;
+		}
+		AddBatch( pending, i, iEnd );
+		i = iEnd;
+	}
+}
+
+void SendQueue::AddBatch( PendingConnection &pending, size_t iFirst, size_t iEnd )
+{
+	SteamNetworkingMessage_t *pMessage;
+	if ( iEnd - iFirst == 1 )
+	{
+		Item &item = pending.m_vecItems[ iFirst ];
+		if ( item.m_pShared )
+		{
+			// Point straight at the shared copy, our reference goes with the message
+			pMessage = SteamNetworkingUtils()->AllocateMessage( 0 );
+			if ( !pMessage )
+			{
+				ReleaseShared( item.m_pShared );
+				return;
+			}
+			pMessage->m_pData = item.m_pShared->m_data;
+			pMessage->m_cbSize = item.m_cbData;
+			pMessage->m_nUserData = (int64)(intptr_t)item.m_pShared;
+			pMessage->m_pfnFreeData = FreeSharedMessageData;
+		}
+		else
+		{
+			pMessage = SteamNetworkingUtils()->AllocateMessage( item.m_cbData );
+			if ( !pMessage )
+				return;
+			memcpy( pMessage->m_pData, GetItemData( pending, item ), item.m_cbData );
+		}
+	}
+	else
+	{
+		uint32 cbBatch = 1;
+		for ( size_t i = iFirst; i < iEnd; ++i )
+			cbBatch += sizeof(uint16) + pending.m_vecItems[ i ].m_cbData;
+
+		pMessage = SteamNetworkingUtils()->AllocateMessage( cbBatch );
+		uint8 *pOut = pMessage ? (uint8 *)pMessage->m_pData : nullptr;
+		if ( pOut )
+			*pOut++ = (uint8)message_batch;
+		for ( size_t i = iFirst; i < iEnd; ++i )
+		{
+			Item &item = pending.m_vecItems[ i ];
+			if ( pOut )
+			{
+				uint16 cbItem = (uint16)item.m_cbData;
+				memcpy( pOut, &cbItem, sizeof(cbItem) );
+				pOut += sizeof(cbItem);
+				memcpy( pOut, GetItemData( pending, item ), item.m_cbData );
+				pOut += item.m_cbData;
+			}
+			if ( item.m_pShared )
+				ReleaseShared( item.m_pShared );
+		}
+		if ( !pMessage )
+			return;
+	}
+
+	pMessage->m_conn = pending.m_hConn;
+	pMessage->m_nFlags = k_nSteamNetworkingSend_Reliable;
+	m_vecOutgoing.push_back( pMessage );
+}
+
+SendQueue::SharedPayload *SendQueue::AllocateShared( MessageType eType, const void *pData, uint32 cbData, int nRefs )
+{
+	SharedPayload *pShared = (SharedPayload *)malloc( sizeof(SharedPayload) + cbData );
+	new ( &pShared->m_nRefs ) std::atomic< int >( nRefs );
+	pShared->m_cbData = cbData + 1;
+	pShared->m_data[0] = (uint8)eType;
+	if ( cbData )
+		memcpy( pShared->m_data + 1, pData, cbData );
+	return pShared;
+}
+
+void SendQueue::ReleaseShared( SharedPayload *pShared )
+{
+	// The library may release messages on its own thread
+	if ( pShared->m_nRefs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+		free( pShared );
+}
+
+void SendQueue::FreeSharedMessageData( SteamNetworkingMessage_t *pMessage )
+{
+	ReleaseShared( (SharedPayload *)(intptr_t)pMessage->m_nUserData );
+}
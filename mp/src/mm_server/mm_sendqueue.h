@@ -0,0 +1,109 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Batched and coalesced sending of small server messages
+//
+//=============================================================================
+
+#ifndef MM_SENDQUEUE_H
+#define MM_SENDQUEUE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <vector>
+#include "mm_shared.h"
+#include "mm_flat_map.h"
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// SendQueue
+//
+// Collects reliable messages during a tick and sends them all with a single
+// SendMessages call in Flush().  Several small messages to the same
+// connection go out as one message_batch, so a burst of chat or join and
+// leave notices costs one allocation per connection instead of one per
+// message.  Only connections that SetCanBatch was called for get batches,
+// clients from before message_batch get every message on its own.  A broadcast is copied once into a reference counted payload
+// that every recipient's message points at, unless it ends up coalesced
+// with other messages to the same connection.
+//
+// Messages to each connection arrive in the order they were queued.  Only
+// used from the main thread.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class SendQueue
+{
+public:
+	SendQueue();
+	~SendQueue();
+
+	void Send( HSteamNetConnection hConn, MessageType eType, const void *pData, uint32 cbData );
+	void Broadcast( const HSteamNetConnection *pConns, int nConns, MessageType eType, const void *pData, uint32 cbData );
+
+	/// Whether the peer understands message_batch.  Call with false once the
+	/// connection is gone so it's forgotten.
+	void SetCanBatch( HSteamNetConnection hConn, bool bCanBatch );
+
+	/// Sends everything queued so far.  Returns true if there was anything to send.
+	bool Flush( ISteamNetworkingSockets *pInterface );
+
+	/// Messages queued and messages actually handed to the library, since the start
+	uint64 GetNumQueued() const { return m_nQueued; }
+	uint64 GetNumSent() const { return m_nSent; }
+
+private:
+	// A message body, type byte included, shared by all recipients of a broadcast
+	struct SharedPayload;
+
+	// One queued message.  Either points at a shared payload or at a
+	// stretch of the connection's own buffer.
+	struct Item
+	{
+		SharedPayload *m_pShared;
+		uint32 m_nOffset;
+		uint32 m_cbData;
+	};
+
+	struct PendingConnection
+	{
+		HSteamNetConnection m_hConn;
+		std::vector< Item > m_vecItems;
+		std::vector< uint8 > m_vecBytes;
+	};
+
+	PendingConnection &GetPending( HSteamNetConnection hConn );
+	const uint8 *GetItemData( const PendingConnection &pending, const Item &item ) const;
+	void FlushConnection( PendingConnection &pending );
+	void AddBatch( PendingConnection &pending, size_t iFirst, size_t iEnd );
+
+	static SharedPayload *AllocateShared( MessageType eType, const void *pData, uint32 cbData, int nRefs );
+	static void ReleaseShared( SharedPayload *pShared );
+	static void FreeSharedMessageData( SteamNetworkingMessage_t *pMessage );
+
+	// Connections with something queued this tick, in the order they were first
+	// touched.  Entries past m_nPending are kept around so their buffers get reused.
+	std::vector< PendingConnection > m_vecPending;
+	size_t m_nPending;
+	FlatHashMap< int > m_mapPending;
+
+	// Connections that may be sent message_batch
+	FlatHashMap< bool > m_mapCanBatch;
+
+	std::vector< SteamNetworkingMessage_t * > m_vecOutgoing;
+
+	// Who each outgoing message was for and what it was, since the messages
+	// themselves belong to the library once they're handed over
+	struct OutgoingInfo
+	{
+		HSteamNetConnection m_hConn;
+		MessageType m_eType;
+	};
+	std::vector< OutgoingInfo > m_vecOutgoingInfo;
+	std::vector< int64 > m_vecResults;
+
+	uint64 m_nQueued;
+	uint64 m_nSent;
+};
+
+#endif
@@ -13,13 +13,33 @@
 #include <random>
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <condition_variable>
 #include <queue>
+#include <deque>
 #include <map>
 #include <cctype>
+#include <cmath>
+#include <ctime>
 #include <sqlite3.h>
 #include <srcon.h>
 #include "mm_shared.h"
+#include "mm_rcon.h"
+#include "mm_gameservers.h"
+#include "mm_lobbies.h"
+#include "mm_clients.h"
+#include "mm_log.h"
+#include "mm_sendqueue.h"
+#include "mm_ratings.h"
+#include "mm_skillqueue.h"
+#include "mm_ratelimit.h"
+#include "mm_spsc_queue.h"
+#include "mm_snapshot.h"
+#include "mm_federation.h"
+#include "mm_metrics.h"
+#include "mm_demand.h"
 
 #include <steam/steamnetworkingsockets.h>
 #include <steam/isteamnetworkingutils.h>
@@ -46,6 +66,99 @@ bool g_bQuit = false;
 
 SteamNetworkingMicroseconds g_logTimeZero;
 
+// How many threads talk to game servers over RCON
+const int k_nRconThreads = 4;
+
+// Player slots assumed for a game server added without a capacity
+const int k_nDefaultGameServerCapacity = 16;
+
+// How long a game server we sent game_server_setup gets to load the map
+const SteamNetworkingMicroseconds k_usecHeartbeatSetupTimeout = 60 * 1000000;
+
+// Upper bound on how long the main loop may sleep when there is nothing to do.
+// Can be changed with --max-tick or /max_tick.
+int g_nMaxTickMS = 10;
+
+// Number of matchmaking shard threads, 0 keeps all matchmaking on the main thread
+int g_nShards = 0;
+
+// How much to log.  At k_nDebugLobbyDump and above every lobby is printed
+// whenever a player leaves one, which gets very noisy on a busy server.
+// Can be changed with --debug or /debug.
+int g_nDebugLevel = 0;
+const int k_nDebugLobbyDump = 1;
+
+// Where player profiles and ratings are kept.  Can be changed with --db.
+const char *g_pszDatabase = "mm_ratings.db";
+
+// Whether the Steam IDs clients connect with can be believed.  Nothing here
+// checks them, so by default ratings aren't loaded from or saved to the
+// database and only last as long as the server runs.  Set with
+// --trust-steam-ids when something in front of the server vouches for them.
+bool g_bTrustSteamIDs = false;
+
+// Where queues, lobbies and game servers are snapshotted for restarts.  Can be
+// changed with --snapshot.
+const char *g_pszSnapshot = "mm_state.snapshot";
+
+// How often the snapshot is brought up to date
+const SteamNetworkingMicroseconds k_usecSnapshotInterval = 250 * 1000;
+
+// How often running matches with free slots are filled from the queue.  Game
+// servers only report their slots every couple of seconds anyway.
+const SteamNetworkingMicroseconds k_usecBackfillInterval = 1000000;
+
+// How often idle game servers are switched to the maps lobbies are about to
+// fill up on, and how far ahead we look for those.  The horizon is about as
+// long as a changelevel takes plus the time it takes to notice the demand.
+const SteamNetworkingMicroseconds k_usecPrewarmInterval = 1000000;
+const float k_flPrewarmHorizonSecs = 30.0f;
+
+// A prewarmed server that no lobby took by then was a miss.  One that was
+// just switched isn't switched again for a while, so a forecast that wobbles
+// doesn't keep it loading maps.
+const SteamNetworkingMicroseconds k_usecPrewarmExpiry = 5 * 60 * 1000000LL;
+const SteamNetworkingMicroseconds k_usecPrewarmHold = 60 * 1000000;
+
+// Most idle servers kept warm for any one map and gamemode
+const int k_nMaxPrewarmPerBucket = 2;
+
+// How long players of the last run have to reconnect after a restart before
+// their lobbies and queue places are given up on, and how old a snapshot may
+// be for them to get anything back at all
+const SteamNetworkingMicroseconds k_usecResumeWindow = 30 * 1000000;
+const SteamNetworkingMicroseconds k_usecMaxSnapshotAge = 120 * 1000000;
+
+// This server's ID in a cluster, every node needs its own.  Can be changed
+// with --node-id.
+uint16 g_nNodeID = 0;
+
+// Other matchmaking servers of the cluster to link up with, from --peer
+std::vector< SteamNetworkingIPAddr > g_vecPeers;
+
+// How often the other nodes of the cluster hear how many players are searching
+// here, and how old the last thing we heard from a node may be before no more
+// players are sent its way
+const SteamNetworkingMicroseconds k_usecPeerSummaryInterval = 250 * 1000;
+const SteamNetworkingMicroseconds k_usecPeerSummaryMaxAge = 2 * 1000000;
+
+// Searching players only move to another node once they have waited this long
+// here, and a bucket that was thinned out isn't looked at again for a while so
+// the summaries can catch up.  Full lobbies move once they have waited this
+// long for a game server.
+const SteamNetworkingMicroseconds k_usecHandoffMinWait = 3 * 1000000;
+const SteamNetworkingMicroseconds k_usecBucketHandoffCooldown = 2 * 1000000;
+const SteamNetworkingMicroseconds k_usecLobbyHandoffMinWait = 2 * 1000000;
+
+// How long a node has to answer a handoff, and how long the players it took
+// have to show up there
+const SteamNetworkingMicroseconds k_usecHandoffTimeout = 5 * 1000000;
+const SteamNetworkingMicroseconds k_usecHandoffArrivalWindow = 15 * 1000000;
+
+// Most players one node can have waiting to come over to us at a time.
+// Handoffs past that are refused until some show up or run out.
+const int k_nMaxPendingResumesPerNode = 1024;
+
 // We do this because I won't want to figure out how to cleanly shut
 // down the thread that is reading from stdin.
 static void NukeProcess( int rc )
@@ -58,14 +171,29 @@ static void NukeProcess( int rc )
 	#endif
 }
 
+static void Log( LogLevel eLevel, const char *fmt, ... )
+{
+	va_list ap;
+	va_start( ap, fmt );
+	g_Log.Write( eLevel, fmt, ap );
+	va_end(ap);
+}
+
 static void DebugOutput( ESteamNetworkingSocketsDebugOutputType eType, const char *pszMsg )
 {
-	SteamNetworkingMicroseconds time = SteamNetworkingUtils()->GetLocalTimestamp() - g_logTimeZero;
-	printf( "%10.6f %s\n", time*1e-6, pszMsg );
-	fflush(stdout);
+	LogLevel eLevel = log_debug;
+	if ( eType <= k_ESteamNetworkingSocketsDebugOutputType_Error )
+		eLevel = log_error;
+	else if ( eType == k_ESteamNetworkingSocketsDebugOutputType_Warning )
+		eLevel = log_warning;
+	else if ( eType <= k_ESteamNetworkingSocketsDebugOutputType_Msg )
+		eLevel = log_info;
+	Log( eLevel, "%s", pszMsg );
+
 	if ( eType == k_ESteamNetworkingSocketsDebugOutputType_Bug )
 	{
-		fflush(stdout);
+		// Make sure the reason we died makes it out
+		g_Log.Stop();
 		fflush(stderr);
 		NukeProcess(1);
 	}
@@ -73,28 +201,32 @@ static void DebugOutput( ESteamNetworkingSocketsDebugOutputType eType, const cha
 
 static void FatalError( const char *fmt, ... )
 {
-	char text[ 2048 ];
 	va_list ap;
 	va_start( ap, fmt );
-	vsprintf( text, fmt, ap );
+	g_Log.Write( log_error, fmt, ap );
 	va_end(ap);
-	char *nl = strchr( text, '\0' ) - 1;
-	if ( nl >= text && *nl == '\n' )
-		*nl = '\0';
-	DebugOutput( k_ESteamNetworkingSocketsDebugOutputType_Bug, text );
+	g_Log.Stop();
+	fflush(stderr);
+	NukeProcess(1);
 }
 
 static void Printf( const char *fmt, ... )
 {
-	char text[ 2048 ];
 	va_list ap;
 	va_start( ap, fmt );
-	vsprintf( text, fmt, ap );
+	g_Log.Write( log_info, fmt, ap );
+	va_end(ap);
+}
+
+// Only shows up with /log_level debug
+static void DPrintf( const char *fmt, ... )
+{
+	if ( !g_Log.IsEnabled( log_debug ) )
+		return;
+	va_list ap;
+	va_start( ap, fmt );
+	g_Log.Write( log_debug, fmt, ap );
 	va_end(ap);
-	char *nl = strchr( text, '\0' ) - 1;
-	if ( nl >= text && *nl == '\n' )
-		*nl = '\0';
-	DebugOutput( k_ESteamNetworkingSocketsDebugOutputType_Msg, text );
 }
 
 static void InitSteamDatagramConnectionSockets()
@@ -121,6 +253,7 @@ static void InitSteamDatagramConnectionSockets()
 	#endif
 
 	g_logTimeZero = SteamNetworkingUtils()->GetLocalTimestamp();
+	g_Log.Start( g_logTimeZero );
 
 	SteamNetworkingUtils()->SetDebugOutputFunction( k_ESteamNetworkingSocketsDebugOutputType_Msg, DebugOutput );
 }
@@ -141,6 +274,93 @@ static void ShutdownSteamDatagramConnectionSockets()
 	#endif
 }
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// Main loop wakeup
+//
+// GameNetworkingSockets does all of its socket I/O on its own service thread
+// and doesn't give us a handle we could block on, so the main loop drains the
+// poll group until it comes up empty and only then goes to sleep.  The sleep
+// starts out very short and backs off up to g_nMaxTickMS while we stay idle,
+// so a burst of traffic is handled without any added delay and an idle server
+// wakes up only a handful of times per second.  Anything else that produces
+// work for the main loop (console input, timers) calls Signal() to cut the
+// sleep short.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class LoopWakeup
+{
+public:
+	LoopWakeup()
+	{
+		m_bSignaled = false;
+	}
+
+	void Signal()
+	{
+		{
+			std::lock_guard< std::mutex > lock( m_mutex );
+			m_bSignaled = true;
+		}
+		m_cv.notify_one();
+	}
+
+	// Returns true if we were woken up by Signal() rather than the timeout
+	bool Wait( SteamNetworkingMicroseconds usecTimeout )
+	{
+		std::unique_lock< std::mutex > lock( m_mutex );
+		if ( !m_bSignaled )
+			m_cv.wait_for( lock, std::chrono::microseconds( usecTimeout ), [this]{ return m_bSignaled; } );
+		bool bSignaled = m_bSignaled;
+		m_bSignaled = false;
+		return bSignaled;
+	}
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_bSignaled;
+};
+
+LoopWakeup g_MainLoopWakeup;
+
+// Shortest sleep we take after going idle.  Doubles on every idle pass
+// until it reaches g_nMaxTickMS.
+const SteamNetworkingMicroseconds k_usecMinIdleWait = 250;
+
+class IdleBackoff
+{
+public:
+	explicit IdleBackoff( LoopWakeup &wakeup ) : m_wakeup( wakeup )
+	{
+		m_usecWait = k_usecMinIdleWait;
+	}
+
+	// Call once per loop iteration with whether anything got done
+	void Update( bool bDidWork )
+	{
+		if ( bDidWork )
+		{
+			m_usecWait = k_usecMinIdleWait;
+			return;
+		}
+
+		if ( m_wakeup.Wait( m_usecWait ) )
+		{
+			m_usecWait = k_usecMinIdleWait;
+			return;
+		}
+
+		SteamNetworkingMicroseconds usecMax = (SteamNetworkingMicroseconds)std::max( g_nMaxTickMS, 1 ) * 1000;
+		m_usecWait = std::min( m_usecWait * 2, usecMax );
+	}
+
+private:
+	LoopWakeup &m_wakeup;
+	SteamNetworkingMicroseconds m_usecWait;
+};
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // Non-blocking console user input.  Sort of.
@@ -174,6 +394,7 @@ void LocalUserInput_Init()
 			mutexUserInputQueue.lock();
 			queueUserInput.push( std::string( szLine ) );
 			mutexUserInputQueue.unlock();
+			g_MainLoopWakeup.Signal();
 		}
 	} );
 }
@@ -229,6 +450,328 @@ bool LocalUserInput_GetNext( std::string &result )
 	return got_input;
 }
 
+/////////////////////////////////////////////////////////////////////////////
+//
+// MatchmakingShard
+//
+// With --shards N the skill queues that request_find_match puts players in
+// are split across N threads by map and gamemode bucket, so one busy map
+// doesn't hold up matchmaking on the others.  The main thread still owns the
+// network connections, the game servers and every lobby.  It hands find match
+// and leave requests to the shard that owns the bucket, and once the shard
+// has matched up enough players it hands the full lobby back to the main
+// thread, which takes it from there exactly like a lobby it filled itself.
+// Free slots in running matches go the same way: the main thread asks for
+// players to fill them and gets back whoever the shard took out of its queue.
+//
+// Each direction is a single producer, single consumer queue, so apart from
+// the wakeups nothing here takes a lock.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+// Room in each direction before requests start waiting in the backlog
+const int k_nShardQueueSize = 4096;
+
+struct ShardRequest
+{
+	enum Type
+	{
+		find_match,
+		leave,
+		backfill		// players for m_nSlots free slots on game server m_iServer, in a match rated m_flRating
+	};
+	Type m_eType;
+	HSteamNetConnection m_hConn;
+	int m_iClient;
+	FindMatchData m_data;
+	float m_flRating;
+	SteamNetworkingMicroseconds m_usecQueued;	// when they started searching
+	int m_iServer;
+	int m_nSlots;
+};
+
+struct ShardEvent
+{
+	enum Type
+	{
+		lobby_full,		// m_pLobby is now owned by the main thread
+		player_left,	// answer to a leave request, m_bWasQueued is false if they had already been handed off
+		backfilled		// answer to a backfill request, m_pBackfill is now owned by the main thread
+	};
+	Type m_eType;
+	int m_iClient;
+	HLobbyID m_hLobby;
+	Lobby *m_pLobby;
+	bool m_bWasQueued;
+	SkillMatch *m_pBackfill;
+	int m_iServer;
+	int m_nSlots;
+};
+
+class MatchmakingShard
+{
+public:
+	MatchmakingShard() : m_Inbox( k_nShardQueueSize ), m_Outbox( k_nShardQueueSize )
+	{
+		m_iShard = 0;
+		m_pInterface = nullptr;
+		m_bStop = false;
+		m_nPlayersToStart = 2;
+		m_flInitialWindow = m_Queue.GetInitialWindow();
+		m_flWindowGrowth = m_Queue.GetWindowGrowth();
+		m_nRequests = 0;
+		m_nLobbiesHandedOff = 0;
+	}
+
+	void Start( int iShard, int nShards, ISteamNetworkingSockets *pInterface, int nPlayersToStart )
+	{
+		m_iShard = iShard;
+		m_pInterface = pInterface;
+		m_nPlayersToStart = nPlayersToStart;
+
+		// The main thread makes lobbies in ID space nShards
+		m_Lobbies.SetIDSpace( iShard, nShards + 1 );
+		m_bStop = false;
+		m_thread = std::thread( &MatchmakingShard::ThreadFunc, this );
+	}
+
+	void Stop()
+	{
+		m_bStop = true;
+		m_wakeup.Signal();
+		if ( m_thread.joinable() )
+			m_thread.join();
+
+		// Free lobbies that were handed off but never picked up
+		ShardEvent event;
+		while ( m_Outbox.Pop( event ) )
+		{
+			delete event.m_pLobby;
+			delete event.m_pBackfill;
+		}
+		for ( ShardEvent &pending: m_queuePendingEvents )
+		{
+			delete pending.m_pLobby;
+			delete pending.m_pBackfill;
+		}
+		m_queuePendingEvents.clear();
+		m_vecBackfills.clear();
+	}
+
+	void SetPlayersToStart( int nPlayersToStart )
+	{
+		m_nPlayersToStart = nPlayersToStart;
+	}
+
+	void SetSkillWindow( float flInitial, float flGrowthPerSec )
+	{
+		m_flInitialWindow = flInitial;
+		m_flWindowGrowth = flGrowthPerSec;
+	}
+
+	// Only the waiting counts and queue times may be read from the main thread
+	const SkillQueue &GetQueue() const { return m_Queue; }
+
+	// Main thread only
+	void Submit( const ShardRequest &request )
+	{
+		// Keep things in order, nothing skips ahead of the backlog
+		if ( !m_queueBacklog.empty() || !m_Inbox.Push( request ) )
+			m_queueBacklog.push_back( request );
+		m_wakeup.Signal();
+	}
+
+	// Main thread only.  Returns true if anything left the backlog.
+	bool FlushBacklog()
+	{
+		bool bDidWork = false;
+		while ( !m_queueBacklog.empty() && m_Inbox.Push( m_queueBacklog.front() ) )
+		{
+			m_queueBacklog.pop_front();
+			bDidWork = true;
+		}
+		if ( bDidWork )
+			m_wakeup.Signal();
+		return bDidWork;
+	}
+
+	// Main thread only
+	bool PopEvent( ShardEvent &event )
+	{
+		return m_Outbox.Pop( event );
+	}
+
+	int GetBacklog() const { return (int)m_queueBacklog.size(); }
+	uint64 GetNumRequests() const { return m_nRequests; }
+	uint64 GetNumLobbiesHandedOff() const { return m_nLobbiesHandedOff; }
+
+private:
+	void ThreadFunc()
+	{
+		IdleBackoff idle( m_wakeup );
+		while ( !m_bStop )
+		{
+			bool bDidWork = FlushEvents();
+			ShardRequest request;
+			while ( m_Inbox.Pop( request ) )
+			{
+				HandleRequest( request );
+				bDidWork = true;
+			}
+			bDidWork |= MatchQueue();
+			bDidWork |= Backfill();
+			idle.Update( bDidWork );
+		}
+	}
+
+	void HandleRequest( const ShardRequest &request )
+	{
+		++m_nRequests;
+		switch ( request.m_eType )
+		{
+			case ShardRequest::find_match:
+				m_Queue.Add( GetLobbyBucket( request.m_data.m_map, request.m_data.m_bTeamDM ), request.m_iClient, request.m_hConn, request.m_flRating, request.m_usecQueued );
+				DPrintf( "SHARD %i: CONNECTION %u QUEUED WITH RATING %.0f\n", m_iShard, request.m_hConn, request.m_flRating );
+				break;
+			case ShardRequest::leave:
+				Leave( request.m_iClient );
+				break;
+			case ShardRequest::backfill:
+				// Answered once the queue has been matched, new matches come first
+				m_vecBackfills.push_back( request );
+				break;
+		}
+	}
+
+	// Returns true if any match was made
+	bool MatchQueue()
+	{
+		m_Queue.SetPlayersPerMatch( m_nPlayersToStart );
+		m_Queue.SetWindow( m_flInitialWindow, m_flWindowGrowth );
+		m_vecMatches.clear();
+		if ( !m_Queue.Match( SteamNetworkingUtils()->GetLocalTimestamp(), m_vecMatches ) )
+			return false;
+
+		for ( const SkillMatch &match: m_vecMatches )
+		{
+			// The table only hands out IDs, the lobby is the main thread's problem from here on
+			HL2DM_Map map = (HL2DM_Map)( match.m_iBucket / 2 );
+			char bTeamDM = (char)( match.m_iBucket % 2 );
+			HLobbyID lobbyID = m_Lobbies.Create( map, bTeamDM );
+			ShardEvent event;
+			event.m_eType = ShardEvent::lobby_full;
+			event.m_iClient = -1;
+			event.m_hLobby = lobbyID;
+			event.m_pLobby = new Lobby( *m_Lobbies.Find( lobbyID ) );
+			event.m_bWasQueued = false;
+			event.m_pBackfill = nullptr;
+			event.m_iServer = -1;
+			event.m_nSlots = 0;
+			m_Lobbies.Destroy( lobbyID );
+
+			for ( int i = 0; i < match.m_nPlayers; ++i )
+			{
+				event.m_pLobby->AddPlayer( match.m_players[ i ].m_iClient );
+				SendWireMessage( match.m_players[ i ].m_hConn, lobbyID, k_nSteamNetworkingSend_Reliable, message_save_lobby_id, m_pInterface );
+			}
+			event.m_pLobby->m_usecFilled = SteamNetworkingUtils()->GetLocalTimestamp();
+			DPrintf( "SHARD %i: LOBBY %u MATCHED %i PLAYERS RATED %.0f TO %.0f\n", m_iShard, lobbyID, match.m_nPlayers, match.m_players[ 0 ].m_flRating, match.m_players[ match.m_nPlayers - 1 ].m_flRating );
+			++m_nLobbiesHandedOff;
+			PostEvent( event );
+		}
+		return true;
+	}
+
+	void Leave( int iClient )
+	{
+		// If they aren't queued their lobby was already handed off, the main thread has it now
+		ShardEvent event;
+		event.m_eType = ShardEvent::player_left;
+		event.m_iClient = iClient;
+		event.m_hLobby = invalid_lobby;
+		event.m_pLobby = nullptr;
+		event.m_bWasQueued = m_Queue.Remove( iClient );
+		event.m_pBackfill = nullptr;
+		event.m_iServer = -1;
+		event.m_nSlots = 0;
+		if ( event.m_bWasQueued )
+			DPrintf( "SHARD %i: CLIENT %i LEFT THE QUEUE\n", m_iShard, iClient );
+		PostEvent( event );
+	}
+
+	// Answers every backfill request, even with nobody, so the main thread
+	// lets go of the slots it held.  Returns true if there were any.
+	bool Backfill()
+	{
+		if ( m_vecBackfills.empty() )
+			return false;
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		for ( const ShardRequest &request: m_vecBackfills )
+		{
+			ShardEvent event;
+			event.m_eType = ShardEvent::backfilled;
+			event.m_iClient = -1;
+			event.m_hLobby = invalid_lobby;
+			event.m_pLobby = nullptr;
+			event.m_bWasQueued = false;
+			event.m_pBackfill = new SkillMatch;
+			event.m_iServer = request.m_iServer;
+			event.m_nSlots = request.m_nSlots;
+			m_Queue.SetWindow( m_flInitialWindow, m_flWindowGrowth );
+			if ( m_Queue.Backfill( GetLobbyBucket( request.m_data.m_map, request.m_data.m_bTeamDM ), request.m_flRating, request.m_nSlots, usecNow, *event.m_pBackfill ) )
+				DPrintf( "SHARD %i: %i PLAYERS TAKEN TO BACKFILL GAME SERVER %i\n", m_iShard, event.m_pBackfill->m_nPlayers, request.m_iServer );
+			PostEvent( event );
+		}
+		m_vecBackfills.clear();
+		return true;
+	}
+
+	void PostEvent( const ShardEvent &event )
+	{
+		if ( !m_queuePendingEvents.empty() || !m_Outbox.Push( event ) )
+			m_queuePendingEvents.push_back( event );
+		g_MainLoopWakeup.Signal();
+	}
+
+	// Retries events the outbox didn't have room for.  Returns true if any got through.
+	bool FlushEvents()
+	{
+		bool bDidWork = false;
+		while ( !m_queuePendingEvents.empty() && m_Outbox.Push( m_queuePendingEvents.front() ) )
+		{
+			m_queuePendingEvents.pop_front();
+			bDidWork = true;
+		}
+		if ( bDidWork )
+			g_MainLoopWakeup.Signal();
+		return bDidWork;
+	}
+
+	int m_iShard;
+	ISteamNetworkingSockets *m_pInterface;
+	std::thread m_thread;
+	std::atomic< bool > m_bStop;
+	std::atomic< int > m_nPlayersToStart;
+	std::atomic< float > m_flInitialWindow;
+	std::atomic< float > m_flWindowGrowth;
+	LoopWakeup m_wakeup;
+
+	SPSCQueue< ShardRequest > m_Inbox;
+	SPSCQueue< ShardEvent > m_Outbox;
+
+	// Main thread side, requests the inbox had no room for
+	std::deque< ShardRequest > m_queueBacklog;
+
+	// Shard thread side
+	SkillQueue m_Queue;
+	std::vector< SkillMatch > m_vecMatches;
+	std::vector< ShardRequest > m_vecBackfills;
+	LobbyTable m_Lobbies;
+	std::deque< ShardEvent > m_queuePendingEvents;
+	std::atomic< uint64 > m_nRequests;
+	std::atomic< uint64 > m_nLobbiesHandedOff;
+};
+
 /////////////////////////////////////////////////////////////////////////////
 //
 // ChatServer
@@ -239,14 +782,36 @@ class ChatServer
 public:
 	ChatServer()
 	{
-		m_hFullLobby = invalid_lobby;
+		m_Lobbies.SetPlayersToStart( iNumOfPlayersToStartGame );
+		m_SkillQueue.SetPlayersPerMatch( iNumOfPlayersToStartGame );
+		m_bPickServerByWorstPing = true;
+		m_bBackfill = true;
+		m_usecNextBackfill = 0;
+		m_nPlayersBackfilled = 0;
+		m_bPrewarm = true;
+		m_usecNextPrewarm = 0;
+		m_nPrewarms = 0;
+		m_nPrewarmHits = 0;
+		m_nPrewarmMisses = 0;
+		m_usecPrewarmSaved = 0;
+		m_usecNextSnapshot = 0;
+		m_usecResumeDeadline = 0;
+		m_bSnapshotFailed = false;
+		m_nClientPort = 0;
+		m_usecNextPeerSummary = 0;
+		m_nNextHandoffID = 1;
+		memset( m_usecBucketHandoffAllowed, 0, sizeof(m_usecBucketHandoffAllowed) );
+		m_nHandoffsSent = m_nHandoffsAccepted = m_nHandoffsRefused = m_nHandoffsTimedOut = m_nHandoffsReceived = 0;
+		m_nPlayersHandedOff = m_nLobbiesHandedOff = 0;
+		InitMessageHandlers();
 	}
 	
-	void Run( uint16 nPort )
+	void Run( uint16 nPort, uint16 nGameServerPort, uint16 nPeerPort, uint16 nStatsPort )
 	{
 		// Select instance to use.  For now we'll always use the default.
 		// But we could use SteamGameServerNetworkingSockets() on Steam.
 		m_pInterface = SteamNetworkingSockets();
+		SetSendFailedHook( RecordSendFailure );
 
 		// Start listening
 		SteamNetworkingIPAddr serverLocalAddr;
@@ -263,42 +828,145 @@ public:
 		if ( m_hPollGroup == k_HSteamNetPollGroup_Invalid )
 			FatalError( "Failed to listen on port %d", nPort );
 		Printf( "Server listening on port %d\n", nPort );
+		m_nClientPort = nPort;
+
+		// Game servers running the mod send their heartbeats to a port of their own
+		serverLocalAddr.m_port = nGameServerPort;
+		m_hGameServerListenSock = m_pInterface->CreateListenSocketIP( serverLocalAddr, 1, &opt );
+		if ( m_hGameServerListenSock == k_HSteamListenSocket_Invalid )
+			FatalError( "Failed to listen on port %d", nGameServerPort );
+		m_hGameServerPollGroup = m_pInterface->CreatePollGroup();
+		if ( m_hGameServerPollGroup == k_HSteamNetPollGroup_Invalid )
+			FatalError( "Failed to listen on port %d", nGameServerPort );
+		Printf( "Listening for game server heartbeats on port %d\n", nGameServerPort );
+
+		m_RconPool.Start( k_nRconThreads, []() { g_MainLoopWakeup.Signal(); } );
+
+		std::string sError;
+		if ( !g_bTrustSteamIDs )
+			Printf( "Steam IDs aren't verified, player ratings are only kept until the server stops\n" );
+		else if ( m_Ratings.Open( g_pszDatabase, []() { g_MainLoopWakeup.Signal(); }, sError ) )
+			Printf( "Player ratings are kept in %s\n", g_pszDatabase );
+		else
+			Log( log_warning, "Can't open ratings database %s: %s.  Ratings won't be saved.\n", g_pszDatabase, sError.c_str() );
+
+		if ( g_nShards > 0 )
+		{
+			// Shards take ID spaces 0..N-1, lobbies made here get the last one
+			m_Lobbies.SetIDSpace( g_nShards, g_nShards + 1 );
+			for ( int i = 0; i < g_nShards; ++i )
+			{
+				m_vecShards.push_back( std::unique_ptr< MatchmakingShard >( new MatchmakingShard ) );
+				m_vecShards.back()->Start( i, g_nShards, m_pInterface, iNumOfPlayersToStartGame );
+			}
+			Printf( "Matchmaking split across %d shard threads\n", g_nShards );
+		}
+
+		if ( m_Snapshot.Open( g_pszSnapshot, sError ) )
+		{
+			Printf( "Matchmaker state is snapshotted to %s\n", g_pszSnapshot );
+			RestoreSnapshot();
+		}
+		else
+		{
+			Log( log_warning, "Can't open snapshot file %s: %s.  Players will have to queue again after a restart.\n", g_pszSnapshot, sError.c_str() );
+		}
+
+		if ( m_Federation.Start( m_pInterface, g_nNodeID, nPeerPort, g_vecPeers, SteamNetConnectionStatusChangedCallback, sError ) )
+			Printf( "Node %u of the cluster, other nodes link up on port %d\n", g_nNodeID, nPeerPort );
+		else
+			Log( log_warning, "Can't listen for other nodes of the cluster: %s.  This server runs on its own.\n", sError.c_str() );
+
+		if ( nStatsPort != 0 )
+		{
+			if ( m_StatsEndpoint.Start( nStatsPort, [this]( std::string &sPage ) { BuildStatsPage( sPage ); }, sError ) )
+				Printf( "Stats can be scraped from http://127.0.0.1:%d/\n", nStatsPort );
+			else
+				Log( log_warning, "Can't serve stats: %s.  They are still printed by /stats.\n", sError.c_str() );
+		}
 
+		IdleBackoff idle( g_MainLoopWakeup );
 		while ( !g_bQuit )
 		{
-			ServerUpdate();
-			PollIncomingMessages();
+			bool bDidWork = ServerUpdate();
+			bDidWork |= PollIncomingMessages();
+			bDidWork |= PollGameServerMessages();
 			RunCallBacks();
-			PollLocalUserInput();
-			std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+			bDidWork |= PollLocalUserInput();
+			bDidWork |= m_StatsEndpoint.Poll( SteamNetworkingUtils()->GetLocalTimestamp() );
+
+			// Everything we had to say this tick goes out in one go
+			bDidWork |= m_SendQueue.Flush( m_pInterface );
+			idle.Update( bDidWork );
 		}
 
+		// Everybody gets their place back when we're up again
+		if ( m_Snapshot.IsOpen() )
+			WriteSnapshot( SteamNetworkingUtils()->GetLocalTimestamp() );
+
 		// Close all the connections
 		Printf( "Closing connections...\n" );
-		for ( auto it: m_mapClients )
+		for ( int iClient = 0; iClient < m_Clients.GetSlotCount(); ++iClient )
 		{
+			if ( !IsConnected( iClient ) )
+				continue;
+			HSteamNetConnection hConn = m_Clients.Get( iClient ).m_hConn;
+
 			// Send them one more goodbye message.  Note that we also have the
 			// connection close reason as a place to send final data.  However,
 			// that's usually best left for more diagnostic/debug text not actual
 			// protocol strings.
-			SendStringToClient( it.first, "Server is shutting down.  Goodbye." );
+			SendStringToClient( hConn, "Server is shutting down.  Goodbye." );
+		}
+		m_SendQueue.Flush( m_pInterface );
+		for ( int iClient = 0; iClient < m_Clients.GetSlotCount(); ++iClient )
+		{
+			if ( !IsConnected( iClient ) )
+				continue;
 
 			// Close the connection.  We use "linger mode" to ask SteamNetworkingSockets
 			// to flush this out and close gracefully.
-			m_pInterface->CloseConnection( it.first, 0, "Server Shutdown", true );
+			m_pInterface->CloseConnection( m_Clients.Get( iClient ).m_hConn, 0, "Server Shutdown", true );
 		}
-		for (std::map<HLobbyID, Lobby>::iterator it = m_mapLobbies.begin(); it != m_mapLobbies.end(); ++it)
-		{
-			it->second.m_mapPlayers.clear();
-		}
-		m_mapLobbies.clear();
-		m_mapClients.clear();
+		for ( std::unique_ptr< MatchmakingShard > &pShard: m_vecShards )
+			pShard->Stop();
+		m_vecShards.clear();
+		m_mapPendingShardLeaves.clear();
+		m_Lobbies.Clear();
+		m_Clients.Clear();
 
 		m_pInterface->CloseListenSocket( m_hListenSock );
 		m_hListenSock = k_HSteamListenSocket_Invalid;
 
 		m_pInterface->DestroyPollGroup( m_hPollGroup );
 		m_hPollGroup = k_HSteamNetPollGroup_Invalid;
+
+		// Game servers reconnect on their own once we're back
+		for ( HSteamNetConnection hConn: m_vecGameServerConns )
+			m_pInterface->CloseConnection( hConn, 0, "Server Shutdown", false );
+		m_vecGameServerConns.clear();
+		m_pInterface->CloseListenSocket( m_hGameServerListenSock );
+		m_hGameServerListenSock = k_HSteamListenSocket_Invalid;
+		m_pInterface->DestroyPollGroup( m_hGameServerPollGroup );
+		m_hGameServerPollGroup = k_HSteamNetPollGroup_Invalid;
+
+		// Players handed to us that haven't arrived yet are lost with the rest
+		m_Federation.Stop();
+		m_mapHandoffs.clear();
+		m_StatsEndpoint.Stop();
+
+		m_RconPool.Stop();
+		m_mapStartingLobbies.clear();
+		m_mapPrewarmJobs.clear();
+		m_vecHeartbeatSetups.clear();
+
+		// Whatever changed since the last write goes out now
+		m_Ratings.Close();
+		m_mapProfileClients.clear();
+		m_Snapshot.Close();
+		m_mapPendingResumes.clear();
+		m_mapNodeResumes.clear();
+		m_vecReservedLobbies.clear();
 	}
 private:
 
@@ -306,323 +974,3577 @@ private:
 	HSteamNetPollGroup m_hPollGroup;
 	ISteamNetworkingSockets *m_pInterface;
 
-	std::map< HSteamNetConnection, Client_t > m_mapClients;
-	std::map< HLobbyID, Lobby > m_mapLobbies;
-	std::vector< srcon_addr > m_vGameServers;
+	// Heartbeat connections from game servers, whether we know which server they are yet or not
+	HSteamListenSocket m_hGameServerListenSock;
+	HSteamNetPollGroup m_hGameServerPollGroup;
+	std::vector< HSteamNetConnection > m_vecGameServerConns;
+	std::vector< int > m_vecDeadServers;
+
+	ClientTable m_Clients;
+	LobbyTable m_Lobbies;
+
+	// Players searching for a match.  Unused with --shards, each shard has its own.
+	SkillQueue m_SkillQueue;
+	std::vector< SkillMatch > m_vecSkillMatches;
+
+	// Whether searching players are sent into free slots of running matches
+	bool m_bBackfill;
+	SteamNetworkingMicroseconds m_usecNextBackfill;
+	uint64 m_nPlayersBackfilled;
+	LatencyHistogram m_BackfillWaitTimes;
+
+	// Whether idle game servers are switched ahead of time to the maps lobbies
+	// are about to fill up on, going by how many players search on each and
+	// how fast new searches come in.  A hit is a lobby getting the server
+	// that was prewarmed for its map, a miss is a prewarm nobody used.
+	bool m_bPrewarm;
+	SteamNetworkingMicroseconds m_usecNextPrewarm;
+	DemandTracker m_Demand;
+	uint64 m_nPrewarms;
+	uint64 m_nPrewarmHits;
+	uint64 m_nPrewarmMisses;
+	SteamNetworkingMicroseconds m_usecPrewarmSaved;
+
+	// How long setups that needed a changelevel took, which is what a hit
+	// saves.  Partly prewarmed setups count too, so it errs on the low side.
+	LatencyHistogram m_ChangelevelTimes;
+
+	// Chat and notices to clients, sent at the end of every tick
+	SendQueue m_SendQueue;
+	std::vector< HSteamNetConnection > m_vecBroadcastConns;
+
+	// Empty unless running with --shards
+	std::vector< std::unique_ptr< MatchmakingShard > > m_vecShards;
+
+	// Leave requests each shard hasn't answered yet, by ShardClientKey.  A
+	// shard answers in order, so a lobby it hands over with somebody who has
+	// a leave on the way was matched before they left.
+	std::unordered_map< uint64, int > m_mapPendingShardLeaves;
+	GameServerRegistry m_GameServers;
+
+	// RCON jobs that are setting up a game server, and the lobby and server each one is for
+	struct StartingLobby
+	{
+		HLobbyID m_hLobby;
+		int m_iServer;
+		SteamNetworkingMicroseconds m_usecStarted;
+	};
+	RconPool m_RconPool;
+	std::map< uint32, StartingLobby > m_mapStartingLobbies;
+
+	// RCON jobs prewarming a game server, and the server each one is for
+	std::map< uint32, int > m_mapPrewarmJobs;
+
+	// Game servers we sent game_server_setup, waiting for a heartbeat that says the map has loaded
+	std::vector< StartingLobby > m_vecHeartbeatSetups;
 	
-	HLobbyID m_hFullLobby;
+	// Full lobbies waiting for a game server, oldest first
+	std::deque< HLobbyID > m_queueReadyLobbies;
 
-	void PrintLobbyList()
+	// Player profiles, and which client is logged in with each Steam ID
+	RatingStore m_Ratings;
+	std::unordered_map< uint64, int > m_mapProfileClients;
+
+	// Match results, best placed player first, waiting for profiles to load
+	std::vector< std::vector< uint64 > > m_vecPendingResults;
+
+	// Ping in ms from each client slot to each game server, as the clients
+	// reported it.  A client that never reported anything has no entries.
+	std::vector< std::vector< uint16 > > m_vecClientPings;
+
+	// State written to the snapshot file every k_usecSnapshotInterval, and
+	// scratch space to build it in
+	SnapshotFile m_Snapshot;
+	MatchmakerSnapshot m_SnapshotScratch;
+	SteamNetworkingMicroseconds m_usecNextSnapshot;
+	bool m_bSnapshotFailed;
+
+	// Players of the last run, or handed to us by another node, that haven't
+	// connected yet, by resume token, and the lobbies kept for them.  Each is
+	// given up on when it expires.  m_usecResumeDeadline is the first of those,
+	// 0 if there is nobody left to wait for.
+	struct PendingResume
 	{
-		Printf("Current lobby list:\n");
-		for (std::map<HLobbyID, Lobby>::iterator it = m_mapLobbies.begin(); it != m_mapLobbies.end(); ++it)
+		SnapshotClient m_record;
+		SteamNetworkingMicroseconds m_usecExpires;
+		int m_nFromNode;		// node that handed them to us, -1 if they're from the snapshot
+	};
+	struct ReservedLobby
+	{
+		HLobbyID m_hLobby;
+		SteamNetworkingMicroseconds m_usecExpires;
+	};
+	std::unordered_map< uint64, PendingResume > m_mapPendingResumes;
+	std::unordered_map< uint16, int > m_mapNodeResumes;	// pending resumes each node handed us
+	std::vector< ReservedLobby > m_vecReservedLobbies;
+	SteamNetworkingMicroseconds m_usecResumeDeadline;
+
+	// Resume tokens let whoever holds them take over a player's lobby or queue
+	// place, so every one comes straight from the OS's random number generator
+	// rather than a PRNG somebody could work out the state of from their own
+	std::random_device m_TokenSource;
+
+	// The other matchmaking servers of the cluster, and what we tell them
+	Federation m_Federation;
+
+	// Serves the stats page to a scraper on the local machine
+	StatsEndpoint m_StatsEndpoint;
+	PeerSummary m_PeerSummaryScratch;
+	uint16 m_nClientPort;
+	SteamNetworkingMicroseconds m_usecNextPeerSummary;
+	std::vector< PeerHandoff > m_vecPeerHandoffs;
+	std::vector< PeerHandoffResult > m_vecPeerResults;
+
+	// Players and lobbies we offered other nodes, by handoff ID.  Answered ones
+	// stay until they time out, so shards that answer the players' leaves late
+	// still find out where they went.
+	enum HandoffState
+	{
+		handoff_waiting,
+		handoff_accepted,
+		handoff_refused,
+	};
+	struct Handoff
+	{
+		uint16 m_nNodeID;
+		SteamNetworkingIPAddr m_addrNode;		// where the node's players connect
+		HLobbyID m_hLobby;						// invalid_lobby for searching players
+		int m_iBucket;
+		SteamNetworkingMicroseconds m_usecSent;
+		HandoffState m_eState;
+		std::vector< int > m_vecClients;
+	};
+	std::unordered_map< uint32, Handoff > m_mapHandoffs;
+	uint32 m_nNextHandoffID;
+	SteamNetworkingMicroseconds m_usecBucketHandoffAllowed[ k_nNumLobbyBuckets ];
+	std::vector< int > m_vecHandoffClients[ k_nNumLobbyBuckets ];
+	uint64 m_nHandoffsSent;
+	uint64 m_nHandoffsAccepted;
+	uint64 m_nHandoffsRefused;
+	uint64 m_nHandoffsTimedOut;
+	uint64 m_nHandoffsReceived;
+	uint64 m_nPlayersHandedOff;
+	uint64 m_nLobbiesHandedOff;
+
+	// Whether game servers are picked by the ping of the worst off player or by the average
+	bool m_bPickServerByWorstPing;
+	std::vector< int > m_vecPingScores;
+
+	// How long lobbies spent on each step between filling up and their players
+	// being told where to connect
+	enum StartStage
+	{
+		start_stage_wait_for_server,	// filled -> server allocated
+		start_stage_server_setup,		// server allocated -> RCON done
+		start_stage_notify,				// RCON done -> players notified
+		start_stage_total,				// filled -> players notified
+		num_start_stages
+	};
+	LatencyHistogram m_StartStageTimes[ num_start_stages ];
+
+	// How long game server setups over RCON took, from being handed to the
+	// pool to the last response, by whether they worked in the end
+	LatencyHistogram m_RconTimes[ 2 ];
+
+	// Puts the player into an existing lobby and tells them about it
+	void AddPlayerToLobby( int iClient, HLobbyID lobbyID )
+	{
+		Client_t &client = m_Clients.Get(iClient);
+
+		// Players are in one lobby at a time
+		if (client.m_hLobby != invalid_lobby && client.m_hLobby != lobbyID)
+			RemovePlayerFromLobby(iClient);
+
+		Lobby *pLobby = m_Lobbies.Find(lobbyID);
+		if (!pLobby)
 		{
-			Printf("LobbyID: %u\n", it->first);
-			for (std::map<HSteamNetConnection, Player>::iterator it2 = it->second.m_mapPlayers.begin(); it2 != it->second.m_mapPlayers.end(); ++it2)
-			{
-				Printf("Player: %u, %s\n", it2->first, it2->second.m_Client.m_sNick.c_str());
-			}
-			Printf("Current map: %s\n", ConvertMapToString(it->second.m_map).c_str());
-			Printf("Team deathmatch: %i\n", (int)it->second.m_bTeamDM);
+			Printf("PLAYER %s TRIED TO JOIN LOBBY %u, WHICH DOESN'T EXIST\n", client.m_szNick, lobbyID);
+			return;
+		}
+		Lobby &lobby = *pLobby;
+		if (!lobby.AddPlayer(iClient) && lobby.FindPlayer(iClient) < 0)
+		{
+			Printf("LOBBY %u IS FULL, PLAYER %s WAS NOT ADDED\n", lobbyID, client.m_szNick);
+			return;
 		}
+		client.m_hLobby = lobbyID;
+		SendWireMessage(client.m_hConn, lobbyID, k_nSteamNetworkingSend_Reliable, message_save_lobby_id, m_pInterface);
+		Printf("PLAYER %s JOINED LOBBY\n", client.m_szNick);
+		PrintLobby(lobbyID);
+		m_Lobbies.UpdateIndex(lobbyID, lobby);
+		if(lobby.m_nPlayers == iNumOfPlayersToStartGame)
+			OnLobbyFull(lobbyID, lobby);
 	}
 
-	void PrintLobby(HLobbyID lobbyID)
+	void OnLobbyFull(HLobbyID lobbyID, Lobby &lobby)
 	{
-		Printf("LobbyID: %u\n", lobbyID);
-		for (std::map<HSteamNetConnection, Player>::iterator it2 = m_mapLobbies[lobbyID].m_mapPlayers.begin(); it2 != m_mapLobbies[lobbyID].m_mapPlayers.end(); ++it2)
+		// Lobbies from old clients don't get a map until the host sends one
+		if (GetLobbyBucket(lobby.m_map, lobby.m_bTeamDM) < 0)
 		{
-			Printf("Player: %u, %s\n", it2->first, it2->second.m_Client.m_sNick.c_str());
+			Printf("LOBBY %u IS FULL BUT HAS NO MAP AND GAMEMODE, IT WILL START ONCE THE HOST PICKS THEM\n", lobbyID);
+			return;
 		}
-		Printf("Current map: %s\n", ConvertMapToString(m_mapLobbies[lobbyID].m_map).c_str());
-		Printf("Team deathmatch: %i\n", (int)m_mapLobbies[lobbyID].m_bTeamDM);
+		QueueReadyLobby(lobbyID, lobby);
+		if (m_GameServers.Count() == 0)
+			Printf("LOBBY %u IS FULL BUT THERE ARE NO GAME SERVERS, IT WILL START ONCE ONE IS ADDED WITH /game_sip\n", lobbyID);
+		else if (m_GameServers.CountInState(game_server_idle) == 0)
+			Printf("LOBBY %u IS FULL BUT ALL GAME SERVERS ARE BUSY, IT WILL START ONCE ONE IS FREE\n", lobbyID);
 	}
 
-	void RemovePlayerFromLobby(HSteamNetConnection conn)
+	// Sends the player's leave to whoever has their lobby
+	void LeaveLobby(int iClient)
 	{
-		for (std::map<HLobbyID, Lobby>::iterator it = m_mapLobbies.begin(); it != m_mapLobbies.end(); ++it)
+		// Whatever node they were being handed to gets nobody
+		Client_t &client = m_Clients.Get(iClient);
+		client.m_nHandoff = 0;
+		if (client.m_iShard < 0)
 		{
-			std::string temp_nick = it->second.m_mapPlayers[conn].m_Client.m_sNick;
-			if (it->second.m_mapPlayers.erase(conn))
-			{
-				Printf("PLAYER %s LEFT LOBBY: %u\n", temp_nick.c_str(), it->first);
-				if (it->second.m_mapPlayers.empty())
-				{
-					Printf("DESTROYED LOBBY %u SINCE IT WAS EMPTY\n", it->first);
-					m_mapLobbies.erase(it);
-				}
-				break;
-			}
+			m_SkillQueue.Remove(iClient);
+			RemovePlayerFromLobby(iClient);
+			return;
 		}
-		PrintLobbyList();
+		SubmitLeave(iClient);
 	}
 
-	void SendStringToClient( HSteamNetConnection conn, const char *str )
+	// Takes the player out of their shard's queue.  The shard answers with a
+	// player_left event.
+	void SubmitLeave(int iClient)
 	{
-		SendTypedMessage(conn, str, (uint32)strlen(str), k_nSteamNetworkingSend_Reliable, nullptr, chat_message, m_pInterface);
+		Client_t &client = m_Clients.Get(iClient);
+		ShardRequest request;
+		request.m_eType = ShardRequest::leave;
+		request.m_hConn = client.m_hConn;
+		request.m_iClient = iClient;
+		m_vecShards[client.m_iShard]->Submit(request);
+		++client.m_nPendingLeaves;
+		++m_mapPendingShardLeaves[ShardClientKey(client.m_iShard, iClient)];
+		client.m_iShard = -1;
 	}
 
-	void SendStringToAllClients( const char *str, HSteamNetConnection except = k_HSteamNetConnection_Invalid )
+	static uint64 ShardClientKey(int iShard, int iClient)
 	{
-		for ( auto &c: m_mapClients )
-		{
-			if ( c.first != except )
-				SendStringToClient( c.first, str );
-		}
-	}
-
-	void ServerUpdate()
-	{
-		if (m_hFullLobby != invalid_lobby)
-		{
-			Printf("ENOUTH PLAYERS TO START THE GAME IN A LOBBY: %u\n", m_hFullLobby);
-			
-			srcon rcon_game_s = srcon(m_vGameServers.front());
-			
-			std::string set_tdm = "mp_teamplay ";
-			set_tdm.append(std::to_string(m_mapLobbies[m_hFullLobby].m_bTeamDM));
-			std::string tdm_re = rcon_game_s.send(set_tdm);
-			Printf("SET TDM RESPONSE: %s\n", tdm_re.c_str());
-			
-			std::string change_level = "changelevel ";
-			change_level.append(ConvertMapToString(m_mapLobbies[m_hFullLobby].m_map));
-			std::string change_level_re = rcon_game_s.send(change_level);
-			Printf("CHANGE LEVEL RESPONSE: %s\n", change_level_re.c_str());
-			
-			std::string game_sip = m_vGameServers.front().addr;
-			game_sip.append(":");
-			game_sip.append(std::to_string(m_vGameServers.front().port));
-			
-			HSteamNetConnection temp_id = m_mapLobbies[m_hFullLobby].m_mapPlayers.begin()->first;
-			while (!m_mapLobbies[m_hFullLobby].m_mapPlayers.empty())
-			{
-				SendTypedMessage(temp_id, game_sip.c_str(), (uint32)strlen(game_sip.c_str()), k_nSteamNetworkingSend_Reliable, nullptr, message_start_game, m_pInterface);
-				Printf("PLAYER %s LEFT LOBBY: %u\n", m_mapLobbies[m_hFullLobby].m_mapPlayers[temp_id].m_Client.m_sNick.c_str(), m_hFullLobby);
-				m_mapLobbies[m_hFullLobby].m_mapPlayers.erase(temp_id);
-				temp_id = m_mapLobbies[m_hFullLobby].m_mapPlayers.begin()->first;
-			}
-			Printf("DESTROYED LOBBY %u SINCE IT WAS EMPTY\n", m_hFullLobby);
-			m_mapLobbies.erase(m_hFullLobby);
-			m_hFullLobby = invalid_lobby;
-			PrintLobbyList();
-		}
+		return ((uint64)(uint32)iShard << 32) | (uint32)iClient;
 	}
 
-	void PollIncomingMessages()
+	bool IsLeavingShard(int iShard, int iClient) const
 	{
-		char temp[ 1024 ];
+		return m_mapPendingShardLeaves.count(ShardClientKey(iShard, iClient)) > 0;
+	}
 
-		while ( !g_bQuit )
+	bool IsConnected(int iClient) const
+	{
+		return m_Clients.IsValid(iClient) && !m_Clients.Get(iClient).m_bDisconnected;
+	}
+
+	// Takes over lobbies the shards have filled up.  Returns true if there was anything to do.
+	bool PollShards()
+	{
+		bool bDidWork = false;
+		for (size_t i = 0; i < m_vecShards.size(); ++i)
+		{
+			MatchmakingShard &shard = *m_vecShards[i];
+			bDidWork |= shard.FlushBacklog();
+
+			ShardEvent event;
+			while (shard.PopEvent(event))
+			{
+				bDidWork = true;
+				if (event.m_eType == ShardEvent::player_left)
+				{
+					Client_t &client = m_Clients.Get(event.m_iClient);
+					--client.m_nPendingLeaves;
+					std::unordered_map< uint64, int >::iterator itLeave = m_mapPendingShardLeaves.find(ShardClientKey((int)i, event.m_iClient));
+					if (itLeave != m_mapPendingShardLeaves.end() && --itLeave->second <= 0)
+						m_mapPendingShardLeaves.erase(itLeave);
+
+					// If they weren't queued any more, they were already taken out
+					// of the lobby the shard handed over
+					if (client.m_nHandoff)
+						OnHandoffLeftQueue(event.m_iClient, event.m_bWasQueued);
+
+					// Nobody else can be holding on to a client that's gone once every leave is answered
+					if (client.m_nPendingLeaves == 0 && client.m_bDisconnected)
+						m_Clients.Remove(event.m_iClient);
+					continue;
+				}
+				if (event.m_eType == ShardEvent::backfilled)
+				{
+					SendBackfill(event.m_iServer, event.m_nSlots, *event.m_pBackfill, (int)i);
+					delete event.m_pBackfill;
+					continue;
+				}
+
+				Lobby &lobby = m_Lobbies.Insert(event.m_hLobby, *event.m_pLobby);
+				delete event.m_pLobby;
+				for (int iPlayer = 0; iPlayer < lobby.m_nPlayers;)
+				{
+					// Players who left the queue since, and weren't being handed
+					// to another node, may be searching again or in another lobby
+					int iClient = lobby.m_iPlayers[iPlayer];
+					Client_t &client = m_Clients.Get(iClient);
+					if (!client.m_nHandoff && IsLeavingShard((int)i, iClient))
+					{
+						lobby.RemovePlayer(iClient);
+						Printf("PLAYER %s LEFT LOBBY: %u\n", client.m_szNick, event.m_hLobby);
+						continue;
+					}
+					if (client.m_iShard == (int)i)
+						client.m_iShard = -1;
+					client.m_hLobby = event.m_hLobby;
+					++iPlayer;
+				}
+				if (lobby.m_nPlayers == 0)
+				{
+					Printf("DESTROYED LOBBY %u SINCE IT WAS EMPTY\n", event.m_hLobby);
+					m_Lobbies.Destroy(event.m_hLobby);
+					continue;
+				}
+				m_Lobbies.UpdateIndex(event.m_hLobby, lobby);
+				PrintLobby(event.m_hLobby);
+				if (lobby.m_nPlayers == iNumOfPlayersToStartGame)
+					OnLobbyFull(event.m_hLobby, lobby);
+			}
+		}
+		return bDidWork;
+	}
+
+	void PrintShards()
+	{
+		if (m_vecShards.empty())
+		{
+			Printf("Matchmaking is running on the main thread, start the server with --shards to split it up\n");
+			return;
+		}
+		for (size_t i = 0; i < m_vecShards.size(); ++i)
+		{
+			const MatchmakingShard &shard = *m_vecShards[i];
+			Printf("Shard %i: %llu requests, %llu full lobbies handed off, %i requests in backlog\n", (int)i, (unsigned long long)shard.GetNumRequests(), (unsigned long long)shard.GetNumLobbiesHandedOff(), shard.GetBacklog());
+		}
+	}
+
+	// Puts players the skill queue matched up into a lobby of their own.  Returns true if there were any.
+	bool MatchSkillQueue(SteamNetworkingMicroseconds usecNow)
+	{
+		m_vecSkillMatches.clear();
+		if (!m_SkillQueue.Match(usecNow, m_vecSkillMatches))
+			return false;
+
+		for (const SkillMatch &match: m_vecSkillMatches)
+		{
+			HLobbyID lobbyID = m_Lobbies.Create((HL2DM_Map)(match.m_iBucket / 2), (char)(match.m_iBucket % 2));
+			Lobby &lobby = *m_Lobbies.Find(lobbyID);
+			for (int i = 0; i < match.m_nPlayers; ++i)
+			{
+				int iClient = match.m_players[i].m_iClient;
+				lobby.AddPlayer(iClient);
+				m_Clients.Get(iClient).m_hLobby = lobbyID;
+				SendWireMessage(match.m_players[i].m_hConn, lobbyID, k_nSteamNetworkingSend_Reliable, message_save_lobby_id, m_pInterface);
+			}
+			Printf("LOBBY %u CREATED FOR %i PLAYERS RATED %.0f TO %.0f\n", lobbyID, match.m_nPlayers, match.m_players[0].m_flRating, match.m_players[match.m_nPlayers - 1].m_flRating);
+			PrintLobby(lobby);
+			m_Lobbies.UpdateIndex(lobbyID, lobby);
+			OnLobbyFull(lobbyID, lobby);
+		}
+		return true;
+	}
+
+	// Fills free slots in running matches with players from the queue for
+	// their map and gamemode.  With --shards the shard that owns the bucket
+	// picks them, the slots are held until it answers.  Returns true if
+	// anybody was sent.
+	bool BackfillGameServers(SteamNetworkingMicroseconds usecNow)
+	{
+		if (!m_bBackfill || usecNow < m_usecNextBackfill)
+			return false;
+		m_usecNextBackfill = usecNow + k_usecBackfillInterval;
+
+		bool bDidWork = false;
+		for (int iServer = 0; iServer < m_GameServers.Count(); ++iServer)
+		{
+			int nSlots = m_GameServers.GetBackfillSlots(iServer, usecNow);
+			if (nSlots <= 0)
+				continue;
+			const GameServer &server = m_GameServers.Get(iServer);
+			int iBucket = GetLobbyBucket(server.m_map, server.m_bTeamDM);
+			if (iBucket < 0 || GetNumWaiting(iBucket) == 0)
+				continue;
+
+			m_GameServers.HoldBackfillSlots(iServer, nSlots, usecNow);
+			if (!m_vecShards.empty())
+			{
+				ShardRequest request;
+				request.m_eType = ShardRequest::backfill;
+				request.m_hConn = k_HSteamNetConnection_Invalid;
+				request.m_iClient = -1;
+				request.m_data.m_map = server.m_map;
+				request.m_data.m_bTeamDM = server.m_bTeamDM;
+				request.m_flRating = server.m_flRating;
+				request.m_usecQueued = usecNow;
+				request.m_iServer = iServer;
+				request.m_nSlots = nSlots;
+				m_vecShards[iBucket % m_vecShards.size()]->Submit(request);
+				continue;
+			}
+
+			SkillMatch match;
+			m_SkillQueue.Backfill(iBucket, server.m_flRating, nSlots, usecNow, match);
+			bDidWork |= SendBackfill(iServer, nSlots, match, -1);
+		}
+		return bDidWork;
+	}
+
+	// Sends players taken out of the queue to the game server and lets go of
+	// the slots held for them that nobody was found for.  iShard is the shard
+	// that took them, -1 for the main thread's queue.
+	bool SendBackfill(int iServer, int nSlots, const SkillMatch &match, int iShard)
+	{
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		std::string game_sip = GameServerRegistry::FormatAddress(m_GameServers.Get(iServer).m_addr);
+		int nSent = 0;
+		for (int i = 0; i < match.m_nPlayers; ++i)
+		{
+			int iClient = match.m_players[i].m_iClient;
+			Client_t &client = m_Clients.Get(iClient);
+			if (iShard >= 0 && client.m_iShard == iShard)
+				client.m_iShard = -1;
+			if (!IsConnected(iClient))
+				continue;
+
+			// Their search is over, a restart doesn't put them back in the queue
+			client.m_iSearchBucket = -1;
+			client.m_usecSearchStarted = 0;
+			SendTypedMessage(client.m_hConn, game_sip.c_str(), (uint32)game_sip.length(), k_nSteamNetworkingSend_Reliable, nullptr, message_start_game, m_pInterface);
+			m_GameServers.AddBackfilledPlayer(iServer, client.m_steamID);
+			m_BackfillWaitTimes.Record(usecNow - match.m_players[i].m_usecQueued);
+			Printf("PLAYER %s SENT INTO THE MATCH ON %s AFTER WAITING %.1f s\n", client.m_szNick, game_sip.c_str(), (usecNow - match.m_players[i].m_usecQueued)*1e-6);
+			++nSent;
+		}
+		m_GameServers.ReleaseBackfillSlots(iServer, nSlots - nSent);
+		m_nPlayersBackfilled += nSent;
+		return nSent > 0;
+	}
+
+	// Switches idle game servers to the maps and gamemodes lobbies are about
+	// to fill up on, so a full lobby doesn't have to wait for a changelevel.
+	// A bucket is expected to fill as many lobbies as the players waiting in
+	// it and the ones starting to search over the next k_flPrewarmHorizonSecs
+	// make up.  Servers are only taken from buckets that have more idle
+	// servers than that.  Returns true if any server was switched.
+	bool PrewarmGameServers(SteamNetworkingMicroseconds usecNow)
+	{
+		if (!m_bPrewarm || usecNow < m_usecNextPrewarm)
+			return false;
+		m_usecNextPrewarm = usecNow + k_usecPrewarmInterval;
+
+		// Prewarms whose lobby never came, or whose server went away
+		for (int iServer = 0; iServer < m_GameServers.Count(); ++iServer)
+		{
+			const GameServer &server = m_GameServers.Get(iServer);
+			if (!server.m_usecPrewarmed)
+				continue;
+			if (server.m_eState == game_server_idle && !server.m_bDead && usecNow - server.m_usecPrewarmed < k_usecPrewarmExpiry)
+				continue;
+			Printf("GAME SERVER %s WAS PREWARMED FOR %s, TEAM DEATHMATCH %i, BUT NO LOBBY TOOK IT\n", GameServerRegistry::FormatAddress(server.m_addr).c_str(), ConvertMapToString(server.m_prewarmMap).c_str(), (int)server.m_bPrewarmTeamDM);
+			m_GameServers.ClearPrewarm(iServer);
+			++m_nPrewarmMisses;
+		}
+
+		float flExpected[k_nNumLobbyBuckets];
+		int nWanted[k_nNumLobbyBuckets];
+		int nWarm[k_nNumLobbyBuckets] = {};
+		for (int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket)
+		{
+			flExpected[iBucket] = GetNumWaiting(iBucket) + m_Demand.GetRate(iBucket, usecNow) * k_flPrewarmHorizonSecs;
+			nWanted[iBucket] = std::min((int)(flExpected[iBucket] / iNumOfPlayersToStartGame), k_nMaxPrewarmPerBucket);
+		}
+		for (int iServer = 0; iServer < m_GameServers.Count(); ++iServer)
+		{
+			const GameServer &server = m_GameServers.Get(iServer);
+			int iBucket = m_GameServers.GetWarmBucket(iServer);
+			if (server.m_eState == game_server_idle && !server.m_bDead && iBucket >= 0)
+				++nWarm[iBucket];
+		}
+
+		bool bDidWork = false;
+		for (;;)
+		{
+			// The bucket with the most players expected for every warm server it has
+			int iNeediest = -1;
+			for (int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket)
+			{
+				if (nWarm[iBucket] >= nWanted[iBucket])
+					continue;
+				if (iNeediest < 0 || flExpected[iBucket] / (nWarm[iBucket] + 1) > flExpected[iNeediest] / (nWarm[iNeediest] + 1))
+					iNeediest = iBucket;
+			}
+			if (iNeediest < 0)
+				break;
+
+			// Servers on a map nobody is about to play come first, then those of
+			// the bucket with the most to spare, then whichever idled the longest
+			int iDonor = -1;
+			int nDonorSpare = 0;
+			for (int iServer = 0; iServer < m_GameServers.Count(); ++iServer)
+			{
+				const GameServer &server = m_GameServers.Get(iServer);
+				if (!m_GameServers.CanPrewarm(iServer, usecNow))
+					continue;
+				if (server.m_usecPrewarmed && usecNow - server.m_usecPrewarmed < k_usecPrewarmHold)
+					continue;
+				int iBucket = m_GameServers.GetWarmBucket(iServer);
+				int nSpare = iBucket < 0 ? m_GameServers.Count() + 1 : nWarm[iBucket] - nWanted[iBucket];
+				if (nSpare <= 0)
+					continue;
+				if (iDonor >= 0 && (nSpare < nDonorSpare || (nSpare == nDonorSpare && server.m_usecStateChanged >= m_GameServers.Get(iDonor).m_usecStateChanged)))
+					continue;
+				iDonor = iServer;
+				nDonorSpare = nSpare;
+			}
+			if (iDonor < 0)
+				break;
+
+			int iFrom = m_GameServers.GetWarmBucket(iDonor);
+			if (iFrom >= 0)
+				--nWarm[iFrom];
+			++nWarm[iNeediest];
+			PrewarmGameServer(iDonor, iNeediest, usecNow);
+			bDidWork = true;
+		}
+		return bDidWork;
+	}
+
+	// Switches an idle game server to the bucket's map and gamemode the same
+	// way a lobby would, only nobody waits for it to finish
+	void PrewarmGameServer(int iServer, int iBucket, SteamNetworkingMicroseconds usecNow)
+	{
+		HL2DM_Map map = (HL2DM_Map)(iBucket / 2);
+		char bTeamDM = (char)(iBucket % 2);
+		const GameServer &server = m_GameServers.Get(iServer);
+		Printf("PREWARMING GAME SERVER %s FOR %s, TEAM DEATHMATCH %i\n", GameServerRegistry::FormatAddress(server.m_addr).c_str(), ConvertMapToString(map).c_str(), (int)bTeamDM);
+
+		// What it was prewarmed for before wasn't needed after all
+		if (server.m_usecPrewarmed)
+			++m_nPrewarmMisses;
+		m_GameServers.Prewarm(iServer, map, bTeamDM, usecNow);
+		++m_nPrewarms;
+
+		if (server.m_hHeartbeatConn != k_HSteamNetConnection_Invalid)
+		{
+			LobbyData setup;
+			setup.m_hLobbyID = invalid_lobby;
+			setup.m_map = map;
+			setup.m_bTeamDM = bTeamDM;
+			if (SendWireMessage(server.m_hHeartbeatConn, setup, k_nSteamNetworkingSend_Reliable, game_server_setup, m_pInterface) == k_EResultOK)
+				return;
+		}
+
+		std::vector< std::string > vecCommands;
+		GetSetupCommands(map, bTeamDM, vecCommands);
+		m_mapPrewarmJobs[m_RconPool.Submit(server.m_addr, vecCommands)] = iServer;
+	}
+
+	// RCON commands that prewarmed a game server are done.  A lobby that got
+	// the server in the meantime queued its own commands behind them, so
+	// only a server that is still waiting for a lobby cares.
+	void OnGameServerPrewarmed(int iServer, const RconJob &job)
+	{
+		const GameServer &server = m_GameServers.Get(iServer);
+		if (server.m_eState != game_server_idle || !server.m_usecPrewarmed || job.m_usecSubmitted < server.m_usecPrewarmed)
+			return;
+		if (!job.m_bSuccess)
+		{
+			Printf("FAILED TO PREWARM GAME SERVER %s AFTER %i ATTEMPTS: %s\n", GameServerRegistry::FormatAddress(job.m_addr).c_str(), job.m_nAttempts, job.m_sError.c_str());
+			m_GameServers.ClearPrewarm(iServer);
+			m_GameServers.OnWarmUpFailed(iServer, SteamNetworkingUtils()->GetLocalTimestamp());
+			++m_nPrewarmMisses;
+			return;
+		}
+		m_GameServers.OnPrewarmed(iServer);
+		Printf("GAME SERVER %s PREWARMED IN %.1f ms\n", GameServerRegistry::FormatAddress(job.m_addr).c_str(), (job.m_usecCompleted - job.m_usecSubmitted)*1e-3);
+	}
+
+	void PrintPrewarm()
+	{
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		uint64 nResolved = m_nPrewarmHits + m_nPrewarmMisses;
+		Printf("Prewarming is %s, %llu game servers prewarmed, %llu hits, %llu misses (%.0f%% hit rate), saved about %.1f s, a changelevel takes %.1f s on average\n",
+			m_bPrewarm ? "on" : "off",
+			(unsigned long long)m_nPrewarms,
+			(unsigned long long)m_nPrewarmHits,
+			(unsigned long long)m_nPrewarmMisses,
+			nResolved ? m_nPrewarmHits * 100.0 / nResolved : 0.0,
+			m_usecPrewarmSaved*1e-6,
+			m_ChangelevelTimes.GetAverage()*1e-6);
+		for (int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket)
+		{
+			int nWaiting = GetNumWaiting(iBucket);
+			float flRate = m_Demand.GetRate(iBucket, usecNow);
+			if (!nWaiting && flRate <= 0.0f)
+				continue;
+			Printf("%s, team deathmatch %i: %i waiting, %.1f searches per minute, %.1f lobbies expected in the next %.0f s\n",
+				ConvertMapToString((HL2DM_Map)(iBucket / 2)).c_str(),
+				iBucket % 2,
+				nWaiting,
+				flRate * 60.0f,
+				(nWaiting + flRate * k_flPrewarmHorizonSecs) / iNumOfPlayersToStartGame,
+				k_flPrewarmHorizonSecs);
+		}
+	}
+
+	// Players searching in the bucket, whichever queue they are in
+	int GetNumWaiting(int iBucket) const
+	{
+		const SkillQueue &queue = m_vecShards.empty() ? m_SkillQueue : m_vecShards[iBucket % m_vecShards.size()]->GetQueue();
+		return queue.GetNumWaiting(iBucket);
+	}
+
+	bool IsSearching(int iClient) const
+	{
+		const Client_t &client = m_Clients.Get(iClient);
+		return client.m_hLobby == invalid_lobby && (client.m_iShard >= 0 || m_SkillQueue.IsQueued(iClient));
+	}
+
+	void PrintQueueTimes()
+	{
+		Printf("Skill window: %.0f rating points, widening by %.0f per second of waiting\n", m_SkillQueue.GetInitialWindow(), m_SkillQueue.GetWindowGrowth());
+		for (int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket)
+		{
+			const SkillQueue &queue = m_vecShards.empty() ? m_SkillQueue : m_vecShards[iBucket % m_vecShards.size()]->GetQueue();
+			const QueueTimeHistogram &times = queue.GetQueueTimes(iBucket);
+			int nWaiting = queue.GetNumWaiting(iBucket);
+			if (!nWaiting && !times.GetCount())
+				continue;
+			Printf("%s, team deathmatch %i: %i waiting, %u matched, waited median %.1f s, 90%% %.1f s, 99%% %.1f s, max %.1f s, average rating spread %.0f\n",
+				ConvertMapToString((HL2DM_Map)(iBucket / 2)).c_str(),
+				iBucket % 2,
+				nWaiting,
+				times.GetCount(),
+				times.GetPercentile(0.5f)*1e-6,
+				times.GetPercentile(0.9f)*1e-6,
+				times.GetPercentile(0.99f)*1e-6,
+				times.GetMax()*1e-6,
+				times.GetAverageSpread());
+		}
+	}
+
+	void QueueReadyLobby(HLobbyID lobbyID, Lobby &lobby)
+	{
+		if (lobby.m_bReady)
+			return;
+		lobby.m_bReady = true;
+		if (!lobby.m_usecFilled)
+			lobby.m_usecFilled = SteamNetworkingUtils()->GetLocalTimestamp();
+		m_queueReadyLobbies.push_back(lobbyID);
+	}
+
+	// Hands out game servers to the lobbies in the ready queue, in the order they filled up.
+	// A lobby that no free server suits, because of its size, map or pings, keeps its place
+	// and the ones behind it get their turn.  Returns true if any lobby left the queue.
+	bool StartReadyLobbies(SteamNetworkingMicroseconds usecNow)
+	{
+		bool bDidWork = false;
+		size_t nKept = 0;
+		for (size_t i = 0; i < m_queueReadyLobbies.size(); ++i)
+		{
+			// Once every server is taken the rest only keep their places
+			HLobbyID lobbyID = m_queueReadyLobbies[i];
+			if (m_GameServers.CountInState(game_server_idle) == 0)
+			{
+				m_queueReadyLobbies[nKept++] = lobbyID;
+				continue;
+			}
+
+			Lobby *pLobby = m_Lobbies.Find(lobbyID);
+			if (pLobby && pLobby->m_nPlayers >= iNumOfPlayersToStartGame && GetLobbyBucket(pLobby->m_map, pLobby->m_bTeamDM) >= 0)
+			{
+				if (!StartLobby(lobbyID, usecNow))
+				{
+					m_queueReadyLobbies[nKept++] = lobbyID;
+					continue;
+				}
+			}
+			else if (pLobby)
+			{
+				// Somebody left while it was waiting, or its map was unset, it goes
+				// back to filling up
+				pLobby->m_bReady = false;
+				pLobby->m_usecFilled = 0;
+				m_Lobbies.UpdateIndex(lobbyID, *pLobby);
+			}
+			bDidWork = true;
+		}
+		m_queueReadyLobbies.resize(nKept);
+		return bDidWork;
+	}
+
+	void RecordStartStage(StartStage eStage, SteamNetworkingMicroseconds usecStart, SteamNetworkingMicroseconds usecEnd)
+	{
+		m_StartStageTimes[eStage].Record(usecEnd - usecStart);
+	}
+
+	void PrintStartStageTimes()
+	{
+		static const char *s_pszStageNames[ num_start_stages ] =
+		{
+			"Waiting for a game server",
+			"Setting up the game server",
+			"Notifying players",
+			"Total"
+		};
+		Printf("Time from a lobby filling up to its players being sent to the game server:\n");
+		for (int i = 0; i < num_start_stages; ++i)
+		{
+			const LatencyHistogram &times = m_StartStageTimes[i];
+			if (!times.GetCount())
+				continue;
+			Printf("%s: average %.1f ms, 99%% %.1f ms, max %.1f ms over %llu lobbies\n", s_pszStageNames[i], times.GetAverage()*1e-3, times.GetPercentile(0.99f)*1e-3, times.GetMax()*1e-3, (unsigned long long)times.GetCount());
+		}
+		Printf("Lobbies waiting for a game server: %i\n", (int)m_queueReadyLobbies.size());
+	}
+
+	void PrintLobbyList()
+	{
+		Printf("Current lobby list:\n");
+		for (LobbyTable::iterator it = m_Lobbies.begin(); it != m_Lobbies.end(); ++it)
+		{
+			PrintLobby(*it);
+		}
+	}
+
+	void PrintLobby(HLobbyID lobbyID)
+	{
+		const Lobby *pLobby = m_Lobbies.Find(lobbyID);
+		if (pLobby)
+			PrintLobby(*pLobby);
+	}
+
+	void PrintLobby(const Lobby &lobby)
+	{
+		Printf("LobbyID: %u\n", lobby.m_hLobbyID);
+		for (int i = 0; i < lobby.m_nPlayers; ++i)
+		{
+			const Client_t &client = m_Clients.Get(lobby.m_iPlayers[i]);
+			Printf("Player: %u, %s, rating %.0f\n", client.m_hConn, client.m_szNick, client.m_flRating);
+		}
+		Printf("Current map: %s\n", ConvertMapToString(lobby.m_map).c_str());
+		Printf("Team deathmatch: %i\n", (int)lobby.m_bTeamDM);
+	}
+
+	void RemovePlayerFromLobby(int iClient)
+	{
+		Client_t &client = m_Clients.Get(iClient);
+		HLobbyID lobbyID = client.m_hLobby;
+		if (lobbyID == invalid_lobby)
+			return;
+		client.m_hLobby = invalid_lobby;
+
+		Lobby *pLobby = m_Lobbies.Find(lobbyID);
+		if (!pLobby || !pLobby->RemovePlayer(iClient))
+			return;
+
+		Printf("PLAYER %s LEFT LOBBY: %u\n", client.m_szNick, lobbyID);
+		if (pLobby->m_nPlayers == 0)
+		{
+			Printf("DESTROYED LOBBY %u SINCE IT WAS EMPTY\n", lobbyID);
+			m_Lobbies.Destroy(lobbyID);
+		}
+		else
+		{
+			m_Lobbies.UpdateIndex(lobbyID, *pLobby);
+		}
+		if (g_nDebugLevel >= k_nDebugLobbyDump)
+			PrintLobbyList();
+	}
+
+	void SendStringToClient( HSteamNetConnection conn, const char *str )
+	{
+		m_SendQueue.Send(conn, chat_message, str, (uint32)strlen(str));
+	}
+
+	// Every game server that could take a match, for clients to measure their ping to
+	void BuildGameServerList( std::vector< uint8 > &vecList )
+	{
+		vecList.resize( m_GameServers.Count() * WireFormat< GameServerPing >::k_cbSize );
+		WireWriter writer( vecList.data(), (uint32)vecList.size() );
+		for ( int iServer = 0; iServer < m_GameServers.Count(); ++iServer )
+		{
+			const GameServer &server = m_GameServers.Get( iServer );
+			if ( server.m_eState == game_server_draining )
+				continue;
+
+			SteamNetworkingIPAddr addr;
+			if ( !addr.ParseString( server.m_addr.addr.c_str() ) )
+				continue;
+			GameServerPing ping;
+			memcpy( ping.m_ipv6, addr.m_ipv6, sizeof(ping.m_ipv6) );
+			ping.m_nPort = (uint16)server.m_addr.port;
+			ping.m_nPingMS = k_nPingUnknown;
+			WireFormat< GameServerPing >::Write( writer, ping );
+		}
+		vecList.resize( writer.GetBytesWritten() );
+	}
+
+	void SendGameServerList( HSteamNetConnection hConn )
+	{
+		std::vector< uint8 > vecList;
+		BuildGameServerList( vecList );
+		if ( !vecList.empty() )
+			m_SendQueue.Send( hConn, game_server_list, vecList.data(), (uint32)vecList.size() );
+	}
+
+	void SendGameServerListToAllClients()
+	{
+		std::vector< uint8 > vecList;
+		BuildGameServerList( vecList );
+		m_vecBroadcastConns.clear();
+		for ( int iClient = 0; iClient < m_Clients.GetSlotCount(); ++iClient )
+		{
+			if ( IsConnected( iClient ) )
+				m_vecBroadcastConns.push_back( m_Clients.Get( iClient ).m_hConn );
+		}
+		m_SendQueue.Broadcast( m_vecBroadcastConns.data(), (int)m_vecBroadcastConns.size(), game_server_list, vecList.data(), (uint32)vecList.size() );
+	}
+
+	void SendStringToAllClients( const char *str, HSteamNetConnection except = k_HSteamNetConnection_Invalid )
+	{
+		m_vecBroadcastConns.clear();
+		for ( int iClient = 0; iClient < m_Clients.GetSlotCount(); ++iClient )
+		{
+			if ( IsConnected( iClient ) && m_Clients.Get( iClient ).m_hConn != except )
+				m_vecBroadcastConns.push_back( m_Clients.Get( iClient ).m_hConn );
+		}
+		m_SendQueue.Broadcast( m_vecBroadcastConns.data(), (int)m_vecBroadcastConns.size(), chat_message, str, (uint32)strlen(str) );
+	}
+
+	bool ServerUpdate()
+	{
+		bool bDidWork = false;
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+
+		int nEndedMatches = m_GameServers.Update(usecNow);
+		if (nEndedMatches)
+		{
+			Printf("%i MATCHES RAN OUT OF TIME, THEIR GAME SERVERS ARE FREE AGAIN\n", nEndedMatches);
+			bDidWork = true;
+		}
+		bDidWork |= CheckGameServerHeartbeats(usecNow);
+
+		bDidWork |= PollShards();
+		if (m_usecResumeDeadline && usecNow >= m_usecResumeDeadline)
+		{
+			ExpireResumes(usecNow);
+			bDidWork = true;
+		}
+		bDidWork |= MatchSkillQueue(usecNow);
+		bDidWork |= BackfillGameServers(usecNow);
+		bDidWork |= StartReadyLobbies(usecNow);
+		bDidWork |= PrewarmGameServers(usecNow);
+		bDidWork |= UpdateCluster(usecNow);
+
+		// Doesn't count as work, nothing else is waiting on it
+		if (m_Snapshot.IsOpen() && usecNow >= m_usecNextSnapshot)
+		{
+			WriteSnapshot(usecNow);
+			m_usecNextSnapshot = usecNow + k_usecSnapshotInterval;
+		}
+
+		RconJob job;
+		while (m_RconPool.PopCompleted(job))
+		{
+			m_RconTimes[job.m_bSuccess ? 1 : 0].Record(job.m_usecCompleted - job.m_usecSubmitted);
+			OnGameServerSetUp(job);
+			bDidWork = true;
+		}
+
+		PlayerProfile profile;
+		bool bLoadedProfiles = false;
+		while (m_Ratings.PopLoaded(profile))
+		{
+			OnProfileLoaded(profile);
+			bLoadedProfiles = true;
+		}
+		if (bLoadedProfiles && !m_vecPendingResults.empty())
+			ApplyPendingResults();
+		return bDidWork | bLoadedProfiles;
+	}
+
+	// Looks up the profile of a player that just connected.  Their rating is
+	// the default one until it has loaded.
+	void LoadClientProfile(int iClient, uint64 steamID)
+	{
+		Client_t &client = m_Clients.Get(iClient);
+		client.m_steamID = steamID;
+		client.m_flRating = k_flDefaultRating;
+		if (!steamID)
+			return;
+		m_mapProfileClients[steamID] = iClient;
+		const PlayerProfile *pProfile = m_Ratings.Find(steamID);
+		m_Ratings.AddUser(steamID);
+		if (pProfile)
+			client.m_flRating = pProfile->m_flRating;
+	}
+
+	void OnProfileLoaded(const PlayerProfile &profile)
+	{
+		std::unordered_map< uint64, int >::iterator it = m_mapProfileClients.find(profile.m_steamID);
+		if (it == m_mapProfileClients.end())
+			return;
+		m_Clients.Get(it->second).m_flRating = profile.m_flRating;
+		DPrintf("PROFILE %llu LOADED, RATING %.0f\n", (unsigned long long)profile.m_steamID, profile.m_flRating);
+	}
+
+	void ForgetClientProfile(int iClient)
+	{
+		uint64 steamID = m_Clients.Get(iClient).m_steamID;
+		if (steamID)
+			m_Ratings.RemoveUser(steamID);
+		std::unordered_map< uint64, int >::iterator it = m_mapProfileClients.find(steamID);
+		if (it != m_mapProfileClients.end() && it->second == iClient)
+			m_mapProfileClients.erase(it);
+	}
+
+	// Rates every match whose players' profiles are all in memory.  The others
+	// have their profiles loading and are tried again once they're in.
+	void ApplyPendingResults()
+	{
+		std::vector< float > vecRatings;
+		for (size_t iResult = 0; iResult < m_vecPendingResults.size();)
+		{
+			const std::vector< uint64 > &vecPlacement = m_vecPendingResults[iResult];
+			bool bLoaded = true;
+			vecRatings.clear();
+			for (uint64 steamID: vecPlacement)
+			{
+				const PlayerProfile *pProfile = steamID ? m_Ratings.Find(steamID) : nullptr;
+				if (steamID && !pProfile)
+					bLoaded = false;
+				vecRatings.push_back(pProfile ? pProfile->m_flRating : k_flDefaultRating);
+			}
+			if (!bLoaded)
+			{
+				++iResult;
+				continue;
+			}
+
+			ApplyMatchResult(vecRatings.data(), (int)vecRatings.size());
+			int64 nNow = (int64)time(nullptr);
+			for (size_t i = 0; i < vecPlacement.size(); ++i)
+			{
+				// Guests play, but there's nowhere to keep their rating
+				if (!vecPlacement[i])
+					continue;
+				PlayerProfile profile = *m_Ratings.Find(vecPlacement[i]);
+				DPrintf("RATING OF %llu: %.0f -> %.0f\n", (unsigned long long)profile.m_steamID, profile.m_flRating, vecRatings[i]);
+				profile.m_flRating = vecRatings[i];
+				++profile.m_nMatches;
+				profile.m_nLastPlayed = nNow;
+				m_Ratings.Update(profile);
+
+				std::unordered_map< uint64, int >::iterator it = m_mapProfileClients.find(profile.m_steamID);
+				if (it != m_mapProfileClients.end())
+					m_Clients.Get(it->second).m_flRating = profile.m_flRating;
+			}
+			Printf("RATED A MATCH OF %i PLAYERS\n", (int)vecPlacement.size());
+
+			m_vecPendingResults[iResult] = m_vecPendingResults.back();
+			m_vecPendingResults.pop_back();
+		}
+	}
+
+	void PrintRatingStore()
+	{
+		if (!g_bTrustSteamIDs)
+			Printf("Steam IDs aren't trusted, profiles are only kept in memory\n");
+		else if (!m_Ratings.IsOpen())
+			Printf("No ratings database, profiles are only kept in memory\n");
+		Printf("Profiles in memory: %llu, waiting to be written: %llu\n", (unsigned long long)m_Ratings.GetNumCached(), (unsigned long long)m_Ratings.GetNumPendingWrites());
+		Printf("Profiles loaded: %llu, written: %llu in %llu transactions, database errors: %llu\n", (unsigned long long)m_Ratings.GetNumLoaded(), (unsigned long long)m_Ratings.GetNumWritten(), (unsigned long long)m_Ratings.GetNumTransactions(), (unsigned long long)m_Ratings.GetNumErrors());
+		Printf("Match results waiting for profiles to load: %i\n", (int)m_vecPendingResults.size());
+	}
+
+	// Brings the snapshot file up to date.  Only players who can resume are in
+	// it, along with the ones from the last run who haven't come back yet.
+	void WriteSnapshot(SteamNetworkingMicroseconds usecNow)
+	{
+		MatchmakerSnapshot &snapshot = m_SnapshotScratch;
+		snapshot.m_vecClients.clear();
+		snapshot.m_vecLobbies.clear();
+		snapshot.m_vecGameServers.clear();
+
+		for (int iClient = 0; iClient < m_Clients.GetSlotCount(); ++iClient)
+		{
+			if (!IsConnected(iClient) || !m_Clients.Get(iClient).m_nResumeToken)
+				continue;
+			const Client_t &client = m_Clients.Get(iClient);
+			SnapshotClient record;
+			record.m_nResumeToken = client.m_nResumeToken;
+			record.m_steamID = client.m_steamID;
+			memcpy(record.m_szNick, client.m_szNick, sizeof(record.m_szNick));
+			record.m_flRating = client.m_flRating;
+			record.m_hLobby = client.m_hLobby;
+			bool bSearching = IsSearching(iClient);
+			record.m_iSearchBucket = bSearching ? client.m_iSearchBucket : -1;
+			record.m_usecSearchStarted = bSearching ? client.m_usecSearchStarted : 0;
+			snapshot.m_vecClients.push_back(record);
+		}
+		for (const std::pair< const uint64, PendingResume > &pending: m_mapPendingResumes)
+			snapshot.m_vecClients.push_back(pending.second.m_record);
+
+		for (LobbyTable::iterator it = m_Lobbies.begin(); it != m_Lobbies.end(); ++it)
+		{
+			SnapshotLobby record;
+			record.m_hLobbyID = it->m_hLobbyID;
+			record.m_map = it->m_map;
+			record.m_bTeamDM = it->m_bTeamDM;
+			record.m_usecFilled = it->m_usecFilled;
+			snapshot.m_vecLobbies.push_back(record);
+		}
+
+		for (int iServer = 0; iServer < m_GameServers.Count(); ++iServer)
+		{
+			const GameServer &server = m_GameServers.Get(iServer);
+			SnapshotGameServer record;
+			record.m_addr = server.m_addr;
+			record.m_nCapacity = server.m_nCapacity;
+			record.m_eState = server.m_eState;
+			record.m_map = server.m_map;
+			record.m_bTeamDM = server.m_bTeamDM;
+			record.m_hLobby = server.m_hLobby;
+			record.m_usecMatchStarted = server.m_usecMatchStarted;
+			snapshot.m_vecGameServers.push_back(record);
+		}
+
+		bool bWritten = m_Snapshot.Write(snapshot, usecNow);
+		if (!bWritten && !m_bSnapshotFailed)
+			Log(log_warning, "Can't grow snapshot file %s, the snapshot is out of date until it can\n", g_pszSnapshot);
+		m_bSnapshotFailed = !bWritten;
+	}
+
+	// Brings back the game servers of the last run, and if it ended recently
+	// enough, its lobbies too.  Its players get k_usecResumeWindow to reconnect
+	// and pick up where they were with their resume tokens.
+	void RestoreSnapshot()
+	{
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		SteamNetworkingMicroseconds usecDowntime;
+		MatchmakerSnapshot snapshot;
+		if (!m_Snapshot.Load(snapshot, usecNow, usecDowntime))
+		{
+			Printf("NO SNAPSHOT TO RESTORE, STARTING FROM SCRATCH\n");
+			return;
+		}
+
+		for (const SnapshotGameServer &record: snapshot.m_vecGameServers)
+		{
+			int iServer = m_GameServers.AddServer(record.m_addr, record.m_nCapacity);
+			m_GameServers.Restore(iServer, record.m_eState, record.m_map, record.m_bTeamDM, record.m_hLobby, record.m_usecMatchStarted, usecNow);
+		}
+		Printf("RESTORED %i GAME SERVERS FROM A SNAPSHOT TAKEN %.1f s AGO\n", (int)snapshot.m_vecGameServers.size(), usecDowntime*1e-6);
+
+		if (usecDowntime > k_usecMaxSnapshotAge)
+		{
+			Printf("SNAPSHOT IS TOO OLD TO RESTORE %i PLAYERS, THEY WILL HAVE TO SEARCH AGAIN\n", (int)snapshot.m_vecClients.size());
+			return;
+		}
+
+		for (const SnapshotLobby &record: snapshot.m_vecLobbies)
+		{
+			Lobby lobby;
+			lobby.m_map = record.m_map;
+			lobby.m_bTeamDM = record.m_bTeamDM;
+			lobby.m_usecFilled = record.m_usecFilled;
+			m_Lobbies.Insert(record.m_hLobbyID, lobby);
+			ReserveLobby(record.m_hLobbyID, usecNow + k_usecResumeWindow);
+		}
+		for (const SnapshotClient &record: snapshot.m_vecClients)
+			AddPendingResume(record, usecNow + k_usecResumeWindow);
+		Printf("RESTORED %i LOBBIES AND %i PLAYERS, THEY HAVE %.0f s TO RECONNECT\n", (int)snapshot.m_vecLobbies.size(), (int)m_mapPendingResumes.size(), k_usecResumeWindow*1e-6);
+	}
+
+	void AddPendingResume(const SnapshotClient &record, SteamNetworkingMicroseconds usecExpires, int nFromNode = -1)
+	{
+		std::unordered_map< uint64, PendingResume >::iterator it = m_mapPendingResumes.find(record.m_nResumeToken);
+		if (it != m_mapPendingResumes.end())
+			ErasePendingResume(it);
+		PendingResume &pending = m_mapPendingResumes[record.m_nResumeToken];
+		pending.m_record = record;
+		pending.m_usecExpires = usecExpires;
+		pending.m_nFromNode = nFromNode;
+		if (nFromNode >= 0)
+			++m_mapNodeResumes[(uint16)nFromNode];
+		UpdateResumeDeadline(usecExpires);
+	}
+
+	std::unordered_map< uint64, PendingResume >::iterator ErasePendingResume(std::unordered_map< uint64, PendingResume >::iterator it)
+	{
+		if (it->second.m_nFromNode >= 0)
+		{
+			std::unordered_map< uint16, int >::iterator itNode = m_mapNodeResumes.find((uint16)it->second.m_nFromNode);
+			if (itNode != m_mapNodeResumes.end() && --itNode->second <= 0)
+				m_mapNodeResumes.erase(itNode);
+		}
+		return m_mapPendingResumes.erase(it);
+	}
+
+	int CountNodeResumes(uint16 nNodeID) const
+	{
+		std::unordered_map< uint16, int >::const_iterator it = m_mapNodeResumes.find(nNodeID);
+		return it == m_mapNodeResumes.end() ? 0 : it->second;
+	}
+
+	void ReserveLobby(HLobbyID lobbyID, SteamNetworkingMicroseconds usecExpires)
+	{
+		ReservedLobby reserved;
+		reserved.m_hLobby = lobbyID;
+		reserved.m_usecExpires = usecExpires;
+		m_vecReservedLobbies.push_back(reserved);
+		UpdateResumeDeadline(usecExpires);
+	}
+
+	void UpdateResumeDeadline(SteamNetworkingMicroseconds usecExpires)
+	{
+		if (!m_usecResumeDeadline || usecExpires < m_usecResumeDeadline)
+			m_usecResumeDeadline = usecExpires;
+	}
+
+	// Gives up on players of the last run, or handed to us by another node,
+	// that didn't show up in time.  Lobbies nobody came to are destroyed, and
+	// matched lobbies that came up short go back to the queue so the skill
+	// queue can fill the gaps.
+	void ExpireResumes(SteamNetworkingMicroseconds usecNow)
+	{
+		m_usecResumeDeadline = 0;
+		int nExpired = 0;
+		for (std::unordered_map< uint64, PendingResume >::iterator it = m_mapPendingResumes.begin(); it != m_mapPendingResumes.end();)
+		{
+			if (it->second.m_usecExpires > usecNow)
+			{
+				UpdateResumeDeadline(it->second.m_usecExpires);
+				++it;
+				continue;
+			}
+			it = ErasePendingResume(it);
+			++nExpired;
+		}
+		if (nExpired)
+			Printf("%i PLAYERS DIDN'T SHOW UP TO PICK UP WHERE THEY WERE\n", nExpired);
+
+		for (size_t i = 0; i < m_vecReservedLobbies.size();)
+		{
+			ReservedLobby reserved = m_vecReservedLobbies[i];
+			if (reserved.m_usecExpires > usecNow)
+			{
+				UpdateResumeDeadline(reserved.m_usecExpires);
+				++i;
+				continue;
+			}
+			m_vecReservedLobbies[i] = m_vecReservedLobbies.back();
+			m_vecReservedLobbies.pop_back();
+
+			HLobbyID lobbyID = reserved.m_hLobby;
+			Lobby *pLobby = m_Lobbies.Find(lobbyID);
+			if (!pLobby)
+				continue;
+			if (pLobby->m_nPlayers == 0)
+			{
+				Printf("DESTROYED LOBBY %u SINCE NOBODY CAME TO IT\n", lobbyID);
+				m_Lobbies.Destroy(lobbyID);
+				continue;
+			}
+			int iBucket = GetLobbyBucket(pLobby->m_map, pLobby->m_bTeamDM);
+			if (!pLobby->m_usecFilled || pLobby->m_bReady || pLobby->m_bStarting || pLobby->m_nPlayers >= iNumOfPlayersToStartGame || iBucket < 0)
+				continue;
+
+			Printf("LOBBY %u ENDED UP WITH %i OF %i PLAYERS, THEY ARE SEARCHING AGAIN\n", lobbyID, pLobby->m_nPlayers, iNumOfPlayersToStartGame);
+			std::vector< int > vecPlayers(pLobby->m_iPlayers, pLobby->m_iPlayers + pLobby->m_nPlayers);
+			for (int iClient: vecPlayers)
+			{
+				Client_t &client = m_Clients.Get(iClient);
+				SendStringToClient(client.m_hConn, "Not everybody made it to thy lobby.  Thou art searching for a match again.");
+				QueuePlayer(iClient, iBucket, client.m_usecSearchStarted ? client.m_usecSearchStarted : usecNow);
+			}
+		}
+	}
+
+	void PrintSnapshot()
+	{
+		if (!m_Snapshot.IsOpen())
+		{
+			Printf("No snapshot file, players have to search again after a restart\n");
+			return;
+		}
+		Printf("Snapshot file %s: %llu bytes, %llu snapshots written\n", g_pszSnapshot, (unsigned long long)m_Snapshot.GetFileSize(), (unsigned long long)m_Snapshot.GetNumWrites());
+		Printf("Bytes encoded: %llu, actually copied into the file: %llu\n", (unsigned long long)m_Snapshot.GetNumBytesEncoded(), (unsigned long long)m_Snapshot.GetNumBytesCopied());
+		if (m_usecResumeDeadline)
+			Printf("Waiting for %i players of the last run or from other nodes to connect, the first is given up on in %.0f s\n", (int)m_mapPendingResumes.size(), (m_usecResumeDeadline - SteamNetworkingUtils()->GetLocalTimestamp())*1e-6);
+	}
+
+	// Fills m_vecPingScores with how far each game server is from the lobby's
+	// players, either the worst of their pings or the average.  Players that
+	// didn't measure a server count as k_nUnreportedPingMS away from it, players
+	// that didn't measure anything aren't counted.  Returns false if nobody in
+	// the lobby measured anything.
+	bool ComputePingScores(const Lobby &lobby)
+	{
+		// Far enough that a server somebody measured is almost always better
+		static const int k_nUnreportedPingMS = 250;
+
+		int nServers = m_GameServers.Count();
+		m_vecPingScores.assign(nServers, 0);
+		int nReported = 0;
+		for (int i = 0; i < lobby.m_nPlayers; ++i)
+		{
+			int iClient = lobby.m_iPlayers[i];
+			if (iClient < 0 || iClient >= (int)m_vecClientPings.size() || m_vecClientPings[iClient].empty())
+				continue;
+
+			const std::vector< uint16 > &vecPings = m_vecClientPings[iClient];
+			++nReported;
+			for (int iServer = 0; iServer < nServers; ++iServer)
+			{
+				int nPing = iServer < (int)vecPings.size() && vecPings[iServer] != k_nPingUnknown ? vecPings[iServer] : k_nUnreportedPingMS;
+				if (m_bPickServerByWorstPing)
+					m_vecPingScores[iServer] = std::max(m_vecPingScores[iServer], nPing);
+				else
+					m_vecPingScores[iServer] += nPing;
+			}
+		}
+		if (!nReported)
+			return false;
+		if (!m_bPickServerByWorstPing)
+		{
+			for (int &nScore: m_vecPingScores)
+				nScore /= nReported;
+		}
+		return true;
+	}
+
+	// Finds a game server for a full lobby.  If it's already on the right map the
+	// players go straight there, otherwise the map and gamemode change is handed off
+	// to the RCON workers and the players are told where to connect in OnGameServerSetUp.
+	// Returns false if there is no free game server.
+	bool StartLobby(HLobbyID lobbyID, SteamNetworkingMicroseconds usecNow)
+	{
+		Lobby &lobby = m_Lobbies.FindOrCreate(lobbyID);
+		bool bHavePings = ComputePingScores(lobby);
+		bool bNeedsChangelevel;
+		int iServer = m_GameServers.Allocate(lobbyID, lobby.m_map, lobby.m_bTeamDM, lobby.m_nPlayers, bHavePings ? m_vecPingScores.data() : nullptr, usecNow, bNeedsChangelevel);
+		if (iServer < 0)
+			return false;
+		if (bHavePings)
+			Printf("GAME SERVER %s PICKED FOR LOBBY %u, %s PING %i ms\n", GameServerRegistry::FormatAddress(m_GameServers.Get(iServer).m_addr).c_str(), lobbyID, m_bPickServerByWorstPing ? "WORST" : "AVERAGE", m_vecPingScores[iServer]);
+
+		lobby.m_bReady = false;
+		lobby.m_usecServerAllocated = usecNow;
+		RecordStartStage(start_stage_wait_for_server, lobby.m_usecFilled, usecNow);
+		CountPrewarm(lobbyID, lobby, iServer, bNeedsChangelevel, usecNow);
+
+		Printf("ENOUTH PLAYERS TO START THE GAME IN A LOBBY: %u\n", lobbyID);
+		const GameServer &server = m_GameServers.Get(iServer);
+		if (!bNeedsChangelevel)
+		{
+			Printf("GAME SERVER %s IS ALREADY ON %s\n", GameServerRegistry::FormatAddress(server.m_addr).c_str(), ConvertMapToString(lobby.m_map).c_str());
+			m_GameServers.OnWarmedUp(iServer, usecNow);
+			lobby.m_usecServerReady = usecNow;
+			RecordStartStage(start_stage_server_setup, usecNow, usecNow);
+			SendPlayersToGameServer(lobbyID, iServer);
+			return true;
+		}
+
+		lobby.m_bStarting = true;
+		m_Lobbies.UpdateIndex(lobbyID, lobby);
+
+		StartingLobby starting;
+		starting.m_hLobby = lobbyID;
+		starting.m_iServer = iServer;
+		starting.m_usecStarted = usecNow;
+
+		// A server that sends heartbeats switches maps when we ask it to over its
+		// own connection, and tells us when it's done in its next heartbeat
+		if (server.m_hHeartbeatConn != k_HSteamNetConnection_Invalid)
+		{
+			LobbyData setup;
+			setup.m_hLobbyID = lobbyID;
+			setup.m_map = lobby.m_map;
+			setup.m_bTeamDM = lobby.m_bTeamDM;
+			if (SendWireMessage(server.m_hHeartbeatConn, setup, k_nSteamNetworkingSend_Reliable, game_server_setup, m_pInterface) == k_EResultOK)
+			{
+				m_vecHeartbeatSetups.push_back(starting);
+				return true;
+			}
+		}
+
+		std::vector< std::string > vecCommands;
+		GetSetupCommands(lobby.m_map, lobby.m_bTeamDM, vecCommands);
+		m_mapStartingLobbies[m_RconPool.Submit(server.m_addr, vecCommands)] = starting;
+		return true;
+	}
+
+	// Whether the server the lobby got was prewarmed for it.  A hit saves the
+	// time a changelevel takes, less whatever is left of the load if the
+	// server is still at it.
+	void CountPrewarm(HLobbyID lobbyID, const Lobby &lobby, int iServer, bool bNeedsChangelevel, SteamNetworkingMicroseconds usecNow)
+	{
+		const GameServer &server = m_GameServers.Get(iServer);
+		if (!server.m_usecPrewarmed)
+			return;
+		if (server.m_prewarmMap == lobby.m_map && server.m_bPrewarmTeamDM == lobby.m_bTeamDM)
+		{
+			SteamNetworkingMicroseconds usecSaved = m_ChangelevelTimes.GetAverage();
+			if (bNeedsChangelevel)
+				usecSaved = std::min(usecSaved, usecNow - server.m_usecPrewarmed);
+			++m_nPrewarmHits;
+			m_usecPrewarmSaved += usecSaved;
+			Printf("GAME SERVER %s WAS PREWARMED FOR LOBBY %u, SAVED ABOUT %.1f s\n", GameServerRegistry::FormatAddress(server.m_addr).c_str(), lobbyID, usecSaved*1e-6);
+		}
+		else
+		{
+			++m_nPrewarmMisses;
+		}
+		m_GameServers.ClearPrewarm(iServer);
+	}
+
+	// RCON commands that switch a game server to the map and gamemode
+	static void GetSetupCommands(HL2DM_Map map, char bTeamDM, std::vector< std::string > &vecCommands)
+	{
+		std::string set_tdm = "mp_teamplay ";
+		set_tdm.append(std::to_string(bTeamDM));
+		vecCommands.push_back(set_tdm);
+
+		std::string change_level = "changelevel ";
+		change_level.append(ConvertMapToString(map));
+		vecCommands.push_back(change_level);
+	}
+
+	void OnGameServerSetUp(const RconJob &job)
+	{
+		std::map<uint32, int>::iterator itPrewarm = m_mapPrewarmJobs.find(job.m_nJobID);
+		if (itPrewarm != m_mapPrewarmJobs.end())
+		{
+			int iServer = itPrewarm->second;
+			m_mapPrewarmJobs.erase(itPrewarm);
+			OnGameServerPrewarmed(iServer, job);
+			return;
+		}
+
+		std::map<uint32, StartingLobby>::iterator itStarting = m_mapStartingLobbies.find(job.m_nJobID);
+		if (itStarting == m_mapStartingLobbies.end())
+			return;
+		HLobbyID lobbyID = itStarting->second.m_hLobby;
+		int iServer = itStarting->second.m_iServer;
+		m_mapStartingLobbies.erase(itStarting);
+
+		if (!job.m_bSuccess)
+		{
+			Printf("FAILED TO SET UP GAME SERVER %s FOR LOBBY %u AFTER %i ATTEMPTS: %s\n", GameServerRegistry::FormatAddress(job.m_addr).c_str(), lobbyID, job.m_nAttempts, job.m_sError.c_str());
+		}
+		else
+		{
+			for (size_t i = 0; i < job.m_vecResponses.size(); ++i)
+				Printf("%s RESPONSE: %s\n", job.m_vecCommands[i].c_str(), job.m_vecResponses[i].c_str());
+			Printf("GAME SERVER SET UP IN %.1f ms\n", (job.m_usecCompleted - job.m_usecSubmitted)*1e-3);
+		}
+		OnGameServerReady(lobbyID, iServer, job.m_bSuccess);
+	}
+
+	// Game server finished setting up for the lobby, over RCON or its heartbeat
+	// connection, or gave up trying.  Sends the players over if it worked.
+	void OnGameServerReady(HLobbyID lobbyID, int iServer, bool bSuccess)
+	{
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		bool bReady = bSuccess;
+		if (!bSuccess)
+		{
+			m_GameServers.OnWarmUpFailed(iServer, usecNow);
+		}
+		else if (!m_GameServers.OnWarmedUp(iServer, usecNow))
+		{
+			Printf("GAME SERVER %s WAS ENDED WHILE WARMING UP FOR LOBBY %u\n", GameServerRegistry::FormatAddress(m_GameServers.Get(iServer).m_addr).c_str(), lobbyID);
+			bReady = false;
+		}
+
+		Lobby *pLobby = m_Lobbies.Find(lobbyID);
+		if (!pLobby)
+		{
+			Printf("LOBBY %u WAS DESTROYED BEFORE THE GAME SERVER WAS READY\n", lobbyID);
+			if (bReady)
+				m_GameServers.EndMatch(iServer, usecNow);
+			return;
+		}
+		Lobby &lobby = *pLobby;
+		lobby.m_bStarting = false;
+
+		if (!bReady)
+		{
+			// Try again, unless somebody left in the meantime and the lobby needs filling up again.
+			// It keeps its place in time so the wait for the next server counts from when it filled.
+			lobby.m_usecServerAllocated = 0;
+			m_Lobbies.UpdateIndex(lobbyID, lobby);
+			if (lobby.m_nPlayers >= iNumOfPlayersToStartGame)
+				QueueReadyLobby(lobbyID, lobby);
+			else
+				lobby.m_usecFilled = 0;
+			return;
+		}
+
+		lobby.m_usecServerReady = usecNow;
+		RecordStartStage(start_stage_server_setup, lobby.m_usecServerAllocated, usecNow);
+		m_ChangelevelTimes.Record(usecNow - lobby.m_usecServerAllocated);
+
+		SendPlayersToGameServer(lobbyID, iServer);
+	}
+
+	void SendPlayersToGameServer(HLobbyID lobbyID, int iServer)
+	{
+		Lobby &lobby = m_Lobbies.FindOrCreate(lobbyID);
+		std::string game_sip = GameServerRegistry::FormatAddress(m_GameServers.Get(iServer).m_addr);
+
+		// Remember who played so the result can be rated, and how good they
+		// are so players sent in later fit in
+		std::vector< uint64 > vecPlayers;
+		float flRatingTotal = 0.0f;
+		for (int i = 0; i < lobby.m_nPlayers; ++i)
+		{
+			int iClient = lobby.m_iPlayers[i];
+			if (!IsConnected(iClient))
+				continue;
+			Client_t &client = m_Clients.Get(iClient);
+			vecPlayers.push_back(client.m_steamID);
+			flRatingTotal += client.m_flRating;
+			client.m_hLobby = invalid_lobby;
+			SendTypedMessage(client.m_hConn, game_sip.c_str(), (uint32)game_sip.length(), k_nSteamNetworkingSend_Reliable, nullptr, message_start_game, m_pInterface);
+			Printf("PLAYER %s LEFT LOBBY: %u\n", client.m_szNick, lobbyID);
+		}
+		lobby.m_nPlayers = 0;
+		m_GameServers.SetPlayers(iServer, vecPlayers, vecPlayers.empty() ? -1.0f : flRatingTotal / vecPlayers.size());
+
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		RecordStartStage(start_stage_notify, lobby.m_usecServerReady, usecNow);
+		RecordStartStage(start_stage_total, lobby.m_usecFilled, usecNow);
+		Printf("LOBBY %u WENT FROM FULL TO CONNECTING IN %.1f ms\n", lobbyID, (usecNow - lobby.m_usecFilled)*1e-3);
+		Printf("DESTROYED LOBBY %u SINCE IT WAS EMPTY\n", lobbyID);
+		m_Lobbies.Destroy(lobbyID);
+		if (g_nDebugLevel >= k_nDebugLobbyDump)
+			PrintLobbyList();
+	}
+
+	// Gives up on game servers that stopped sending heartbeats, and on setups
+	// that never finished.  Returns true if there was anything to do.
+	bool CheckGameServerHeartbeats(SteamNetworkingMicroseconds usecNow)
+	{
+		m_vecDeadServers.clear();
+		m_GameServers.FindDeadServers(usecNow, m_vecDeadServers);
+		for (int iServer: m_vecDeadServers)
+			OnGameServerDead(iServer);
+		bool bDidWork = !m_vecDeadServers.empty();
+
+		for (size_t i = 0; i < m_vecHeartbeatSetups.size(); )
+		{
+			StartingLobby starting = m_vecHeartbeatSetups[i];
+			if (usecNow - starting.m_usecStarted < k_usecHeartbeatSetupTimeout)
+			{
+				++i;
+				continue;
+			}
+			m_vecHeartbeatSetups.erase(m_vecHeartbeatSetups.begin() + i);
+			Printf("GAME SERVER %s DIDN'T LOAD %s FOR LOBBY %u IN TIME\n", GameServerRegistry::FormatAddress(m_GameServers.Get(starting.m_iServer).m_addr).c_str(), ConvertMapToString(m_GameServers.Get(starting.m_iServer).m_map).c_str(), starting.m_hLobby);
+			OnGameServerReady(starting.m_hLobby, starting.m_iServer, false);
+			bDidWork = true;
+		}
+		return bDidWork;
+	}
+
+	// Returns false if the server isn't setting up for a lobby over its heartbeat connection
+	bool PopHeartbeatSetup(int iServer, StartingLobby &starting)
+	{
+		for (size_t i = 0; i < m_vecHeartbeatSetups.size(); ++i)
+		{
+			if (m_vecHeartbeatSetups[i].m_iServer != iServer)
+				continue;
+			starting = m_vecHeartbeatSetups[i];
+			m_vecHeartbeatSetups.erase(m_vecHeartbeatSetups.begin() + i);
+			return true;
+		}
+		return false;
+	}
+
+	// Heartbeats stopped or the connection closed.  The registry won't hand the
+	// server out again until it's back, whatever it was doing is written off.
+	void OnGameServerDead(int iServer)
+	{
+		const GameServer &server = m_GameServers.Get(iServer);
+		Printf("GAME SERVER %s STOPPED SENDING HEARTBEATS, IT GETS NO MATCHES UNTIL IT'S BACK\n", GameServerRegistry::FormatAddress(server.m_addr).c_str());
+
+		StartingLobby starting;
+		if (PopHeartbeatSetup(iServer, starting))
+			OnGameServerReady(starting.m_hLobby, iServer, false);
+		else if (server.m_hLobby != invalid_lobby && server.m_eState != game_server_warming)
+			m_GameServers.EndMatch(iServer, SteamNetworkingUtils()->GetLocalTimestamp());
+	}
+
+	void PrintGameServers()
+	{
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		Printf("Game servers:\n");
+		for (int i = 0; i < m_GameServers.Count(); ++i)
+		{
+			const GameServer &server = m_GameServers.Get(i);
+			Printf("%s: %s, capacity %i, map %s, team deathmatch %i, state changed %.0f s ago\n",
+				GameServerRegistry::FormatAddress(server.m_addr).c_str(),
+				ConvertGameServerStateToString(server.m_eState).c_str(),
+				server.m_nCapacity,
+				ConvertMapToString(server.m_map).c_str(),
+				(int)server.m_bTeamDM,
+				(usecNow - server.m_usecStateChanged)*1e-6);
+			if (server.m_bSendsHeartbeats)
+			{
+				const GameServerHeartbeat &heartbeat = server.m_heartbeat;
+				Printf("  %s heartbeat %.1f s ago: %i/%i players, %s, %i open slots (%i to backfill), frame time %.2f ms average, %.2f ms max\n",
+					server.m_bDead ? "DEAD, last" : "Last",
+					(usecNow - server.m_usecLastHeartbeat)*1e-6,
+					(int)heartbeat.m_nPlayers,
+					(int)heartbeat.m_nMaxPlayers,
+					ConvertGameServerPhaseToString(heartbeat.m_ePhase).c_str(),
+					(int)heartbeat.m_nOpenSlots,
+					m_GameServers.GetBackfillSlots(i, usecNow),
+					heartbeat.m_nFrameTimeAvg*0.01,
+					heartbeat.m_nFrameTimeMax*0.01);
+			}
+			for (size_t iPlayer = 0; iPlayer < server.m_vecPlayers.size(); ++iPlayer)
+			{
+				if (server.m_vecPlayers[iPlayer])
+					Printf("  Player %i: %llu\n", (int)iPlayer + 1, (unsigned long long)server.m_vecPlayers[iPlayer]);
+				else
+					Printf("  Player %i: guest\n", (int)iPlayer + 1);
+			}
+		}
+	}
+
+	// Parses "IP[:PORT]" at the start of pszArgs, returns a pointer just past it or nullptr
+	const char *ParseGameServerAddress(const char *pszArgs, srcon_addr &addr)
+	{
+		while (isspace(*pszArgs))
+			++pszArgs;
+		const char *pszEnd = pszArgs;
+		while (*pszEnd && !isspace(*pszEnd))
+			++pszEnd;
+		std::string sAddr(pszArgs, pszEnd - pszArgs);
+
+		SteamNetworkingIPAddr addrServer; addrServer.Clear();
+		if ( !addrServer.ParseString( sAddr.c_str() ) )
+		{
+			Printf( "Invalid GAME server address '%s'", sAddr.c_str() );
+			return nullptr;
+		}
+		if ( addrServer.m_port == 0 )
+			addrServer.m_port = 27015;
+
+		char szAddr[ SteamNetworkingIPAddr::k_cchMaxString ];
+		addrServer.ToString( szAddr, sizeof(szAddr), false );
+		addr.addr = szAddr;
+		addr.pass = "123";
+		addr.port = addrServer.m_port;
+		return pszEnd;
+	}
+
+	// Looks up a game server given on the console, prints a message if there is no such server
+	int FindGameServer(const char *pszArgs)
+	{
+		srcon_addr addr;
+		if (!ParseGameServerAddress(pszArgs, addr))
+			return -1;
+		int iServer = m_GameServers.FindServer(addr.addr, addr.port);
+		if (iServer < 0)
+			Printf("No game server %s\n", GameServerRegistry::FormatAddress(addr).c_str());
+		return iServer;
+	}
+
+	// Most messages we are willing to pull off the poll group in one call, and
+	// most calls per tick, so matchmaking gets a turn however much comes in
+	static const int k_nMaxMessagesPerBatch = 256;
+	static const int k_nMaxBatchesPerTick = 4;
+
+	// Messages over a client's limits are dropped before they are dispatched
+	RateLimiter m_RateLimiter;
+
+	typedef void (ChatServer::*MessageHandler_t)( int iClient, const MessageView &msg );
+	MessageHandler_t m_MessageHandlers[ num_message_types ];
+
+	// How many messages of each type we have received, plus ones we couldn't make sense of
+	uint64 m_nMessagesReceived[ num_message_types ];
+	uint64 m_nMessagesDropped;
+
+	void InitMessageHandlers()
+	{
+		for ( int i = 0; i < num_message_types; ++i )
+		{
+			m_MessageHandlers[ i ] = nullptr;
+			m_nMessagesReceived[ i ] = 0;
+		}
+		m_nMessagesDropped = 0;
+
+		m_MessageHandlers[ chat_message ]			= &ChatServer::OnChatMessage;
+		m_MessageHandlers[ request_lobby_list ]		= &ChatServer::OnRequestLobbyList;
+		m_MessageHandlers[ request_create_lobby ]	= &ChatServer::OnRequestCreateLobby;
+		m_MessageHandlers[ request_join_lobby ]		= &ChatServer::OnRequestJoinLobby;
+		m_MessageHandlers[ request_echo ]			= &ChatServer::OnRequestEcho;
+		m_MessageHandlers[ request_leave_lobby ]	= &ChatServer::OnRequestLeaveLobby;
+		m_MessageHandlers[ request_lobby_data ]		= &ChatServer::OnRequestLobbyData;
+		m_MessageHandlers[ lobby_data ]				= &ChatServer::OnLobbyData;
+		m_MessageHandlers[ request_find_match ]		= &ChatServer::OnRequestFindMatch;
+		m_MessageHandlers[ game_server_pings ]		= &ChatServer::OnGameServerPings;
+		m_MessageHandlers[ message_hello ]			= &ChatServer::OnHello;
+		m_MessageHandlers[ request_resume ]			= &ChatServer::OnRequestResume;
+	}
+
+	void PrintMessageCounts()
+	{
+		Printf("Messages received by type:\n");
+		for ( int i = 0; i < num_message_types; ++i )
+		{
+			if ( m_nMessagesReceived[ i ] )
+				Printf("%s: %llu\n", ConvertMessageTypeToString( (MessageType)i ).c_str(), (unsigned long long)m_nMessagesReceived[ i ]);
+		}
+		Printf("Dropped: %llu\n", (unsigned long long)m_nMessagesDropped);
+		uint64 nRateLimited = 0;
+		for ( int i = 0; i < num_message_types; ++i )
+			nRateLimited += m_RateLimiter.GetNumDropped( (MessageType)i );
+		Printf("Over the rate limits: %llu, clients disconnected for flooding: %llu\n", (unsigned long long)nRateLimited, (unsigned long long)m_RateLimiter.GetNumKicked());
+		Printf("Chat and notices: %llu queued, sent as %llu messages\n", (unsigned long long)m_SendQueue.GetNumQueued(), (unsigned long long)m_SendQueue.GetNumSent());
+	}
+
+	// Every counter and histogram we keep, for /stats and the stats endpoint.
+	// Connection quality is only asked of the library here, so nothing is
+	// spent on it unless somebody looks.
+	void BuildStatsPage( std::string &sPage )
+	{
+		static const char *s_pszStageNames[ num_start_stages ] = { "wait_for_server", "server_setup", "notify", "total" };
+		char szLabels[ 128 ];
+		StatsText stats;
+
+		for ( int i = 0; i < num_message_types; ++i )
+		{
+			snprintf( szLabels, sizeof(szLabels), "type=\"%s\"", ConvertMessageTypeToString( (MessageType)i ).c_str() );
+			stats.Counter( "mm_messages_received_total", szLabels, m_nMessagesReceived[ i ] );
+		}
+		stats.Counter( "mm_messages_dropped_total", nullptr, m_nMessagesDropped );
+		for ( int i = 0; i < num_message_types; ++i )
+		{
+			snprintf( szLabels, sizeof(szLabels), "type=\"%s\"", ConvertMessageTypeToString( (MessageType)i ).c_str() );
+			stats.Counter( "mm_messages_rate_limited_total", szLabels, m_RateLimiter.GetNumDropped( (MessageType)i ) );
+		}
+		stats.Counter( "mm_clients_kicked_for_flooding_total", nullptr, m_RateLimiter.GetNumKicked() );
+		stats.Counter( "mm_messages_queued_total", nullptr, m_SendQueue.GetNumQueued() );
+		stats.Counter( "mm_messages_sent_total", nullptr, m_SendQueue.GetNumSent() );
+
+		// Only results that actually happened, there are a lot of them
+		for ( int i = 0; i < k_nMaxSendFailureResult; ++i )
+		{
+			uint64 nFailures = GetNumSendFailures( (EResult)i );
+			if ( !nFailures )
+				continue;
+			snprintf( szLabels, sizeof(szLabels), "result=\"%d\"", i );
+			stats.Counter( "mm_send_failures_total", szLabels, nFailures );
+		}
+		for ( int i = 0; i <= num_message_types; ++i )
+		{
+			uint64 nFailures = GetNumSendFailures( (MessageType)i );
+			if ( !nFailures )
+				continue;
+			snprintf( szLabels, sizeof(szLabels), "type=\"%s\"", i < num_message_types ? ConvertMessageTypeToString( (MessageType)i ).c_str() : "unknown" );
+			stats.Counter( "mm_send_failures_by_type_total", szLabels, nFailures );
+		}
+
+		for ( int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket )
+		{
+			snprintf( szLabels, sizeof(szLabels), "map=\"%s\",team_dm=\"%d\"", ConvertMapToString( (HL2DM_Map)( iBucket / 2 ) ).c_str(), iBucket % 2 );
+			stats.Gauge( "mm_queue_waiting", szLabels, GetNumWaiting( iBucket ) );
+		}
+		for ( int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket )
+		{
+			const SkillQueue &queue = m_vecShards.empty() ? m_SkillQueue : m_vecShards[iBucket % m_vecShards.size()]->GetQueue();
+			snprintf( szLabels, sizeof(szLabels), "map=\"%s\",team_dm=\"%d\"", ConvertMapToString( (HL2DM_Map)( iBucket / 2 ) ).c_str(), iBucket % 2 );
+			stats.Summary( "mm_queue_time_seconds", szLabels, queue.GetQueueTimes( iBucket ).GetTimes() );
+		}
+		stats.Gauge( "mm_lobbies_waiting_for_server", nullptr, (double)m_queueReadyLobbies.size() );
+		for ( int i = 0; i < num_start_stages; ++i )
+		{
+			snprintf( szLabels, sizeof(szLabels), "stage=\"%s\"", s_pszStageNames[ i ] );
+			stats.Summary( "mm_lobby_start_seconds", szLabels, m_StartStageTimes[ i ] );
+		}
+		stats.Counter( "mm_players_backfilled_total", nullptr, m_nPlayersBackfilled );
+		stats.Summary( "mm_backfill_wait_seconds", nullptr, m_BackfillWaitTimes );
+		stats.Summary( "mm_rcon_setup_seconds", "result=\"failed\"", m_RconTimes[ 0 ] );
+		stats.Summary( "mm_rcon_setup_seconds", "result=\"ok\"", m_RconTimes[ 1 ] );
+
+		static const GameServerState s_eStates[] = { game_server_idle, game_server_warming, game_server_in_match, game_server_draining };
+		for ( GameServerState eState: s_eStates )
+		{
+			snprintf( szLabels, sizeof(szLabels), "state=\"%s\"", ConvertGameServerStateToString( eState ).c_str() );
+			stats.Gauge( "mm_game_servers", szLabels, m_GameServers.CountInState( eState ) );
+		}
+		int nBackfillSlots = 0;
+		for ( int iServer = 0; iServer < m_GameServers.Count(); ++iServer )
+			nBackfillSlots += m_GameServers.GetBackfillSlots( iServer, SteamNetworkingUtils()->GetLocalTimestamp() );
+		stats.Gauge( "mm_backfill_slots", nullptr, nBackfillSlots );
+		for ( int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket )
+		{
+			snprintf( szLabels, sizeof(szLabels), "map=\"%s\",team_dm=\"%d\"", ConvertMapToString( (HL2DM_Map)( iBucket / 2 ) ).c_str(), iBucket % 2 );
+			stats.Gauge( "mm_search_rate_per_second", szLabels, m_Demand.GetRate( iBucket, SteamNetworkingUtils()->GetLocalTimestamp() ) );
+		}
+		stats.Counter( "mm_prewarms_total", nullptr, m_nPrewarms );
+		stats.Counter( "mm_prewarm_hits_total", nullptr, m_nPrewarmHits );
+		stats.Counter( "mm_prewarm_misses_total", nullptr, m_nPrewarmMisses );
+		stats.Gauge( "mm_prewarm_saved_seconds", nullptr, m_usecPrewarmSaved*1e-6 );
+		stats.Summary( "mm_changelevel_seconds", nullptr, m_ChangelevelTimes );
+
+		// How the clients' connections are doing, right now
+		LatencyHistogram pings;
+		int nClients = 0;
+		double flQualityLocal = 0.0, flQualityRemote = 0.0;
+		float flWorstQualityLocal = 1.0f, flWorstQualityRemote = 1.0f;
+		double flInPacketsPerSec = 0.0, flOutPacketsPerSec = 0.0, flInBytesPerSec = 0.0, flOutBytesPerSec = 0.0;
+		uint64 cbPendingReliable = 0, cbPendingUnreliable = 0, cbSentUnacked = 0;
+		for ( int iClient = 0; iClient < m_Clients.GetSlotCount(); ++iClient )
+		{
+			if ( !IsConnected( iClient ) )
+				continue;
+			SteamNetConnectionRealTimeStatus_t status;
+			if ( m_pInterface->GetConnectionRealTimeStatus( m_Clients.Get( iClient ).m_hConn, &status, 0, nullptr ) != k_EResultOK )
+				continue;
+			++nClients;
+			if ( status.m_nPing >= 0 )
+				pings.Record( status.m_nPing * (SteamNetworkingMicroseconds)1000 );
+
+			// Negative until the library knows
+			if ( status.m_flConnectionQualityLocal >= 0.0f )
+			{
+				flQualityLocal += status.m_flConnectionQualityLocal;
+				flWorstQualityLocal = std::min( flWorstQualityLocal, status.m_flConnectionQualityLocal );
+			}
+			if ( status.m_flConnectionQualityRemote >= 0.0f )
+			{
+				flQualityRemote += status.m_flConnectionQualityRemote;
+				flWorstQualityRemote = std::min( flWorstQualityRemote, status.m_flConnectionQualityRemote );
+			}
+			flInPacketsPerSec += status.m_flInPacketsPerSec;
+			flOutPacketsPerSec += status.m_flOutPacketsPerSec;
+			flInBytesPerSec += status.m_flInBytesPerSec;
+			flOutBytesPerSec += status.m_flOutBytesPerSec;
+			cbPendingReliable += status.m_cbPendingReliable;
+			cbPendingUnreliable += status.m_cbPendingUnreliable;
+			cbSentUnacked += status.m_cbSentUnackedReliable;
+		}
+		stats.Gauge( "mm_clients", nullptr, nClients );
+		stats.Summary( "mm_client_ping_seconds", nullptr, pings );
+		stats.Gauge( "mm_client_quality_average", "side=\"local\"", nClients ? flQualityLocal / nClients : 1.0 );
+		stats.Gauge( "mm_client_quality_average", "side=\"remote\"", nClients ? flQualityRemote / nClients : 1.0 );
+		stats.Gauge( "mm_client_quality_worst", "side=\"local\"", flWorstQualityLocal );
+		stats.Gauge( "mm_client_quality_worst", "side=\"remote\"", flWorstQualityRemote );
+		stats.Gauge( "mm_client_packets_per_second", "direction=\"in\"", flInPacketsPerSec );
+		stats.Gauge( "mm_client_packets_per_second", "direction=\"out\"", flOutPacketsPerSec );
+		stats.Gauge( "mm_client_bytes_per_second", "direction=\"in\"", flInBytesPerSec );
+		stats.Gauge( "mm_client_bytes_per_second", "direction=\"out\"", flOutBytesPerSec );
+		stats.Gauge( "mm_client_pending_bytes", "reliable=\"1\"", (double)cbPendingReliable );
+		stats.Gauge( "mm_client_pending_bytes", "reliable=\"0\"", (double)cbPendingUnreliable );
+		stats.Gauge( "mm_client_unacked_bytes", nullptr, (double)cbSentUnacked );
+
+		if ( m_Federation.IsRunning() )
+		{
+			for ( const PeerNode &node: m_Federation.GetNodes() )
+			{
+				SteamNetConnectionRealTimeStatus_t status;
+				if ( !node.m_bLinked || m_pInterface->GetConnectionRealTimeStatus( node.m_hConn, &status, 0, nullptr ) != k_EResultOK )
+					continue;
+				snprintf( szLabels, sizeof(szLabels), "node=\"%u\"", node.m_summary.m_nNodeID );
+				stats.Gauge( "mm_peer_ping_seconds", szLabels, status.m_nPing * 1e-3 );
+			}
+			stats.Counter( "mm_handoffs_sent_total", nullptr, m_nHandoffsSent );
+			stats.Counter( "mm_handoffs_accepted_total", nullptr, m_nHandoffsAccepted );
+			stats.Counter( "mm_handoffs_refused_total", nullptr, m_nHandoffsRefused );
+			stats.Counter( "mm_handoffs_timed_out_total", nullptr, m_nHandoffsTimedOut );
+			stats.Counter( "mm_handoffs_received_total", nullptr, m_nHandoffsReceived );
+			stats.Counter( "mm_peer_bytes_sent_total", nullptr, m_Federation.GetNumBytesSent() );
+			stats.Counter( "mm_peer_bytes_received_total", nullptr, m_Federation.GetNumBytesReceived() );
+		}
+		stats.Counter( "mm_stats_scrapes_total", nullptr, m_StatsEndpoint.GetNumScrapes() );
+
+		sPage = stats.Get();
+	}
+
+	void PrintStats()
+	{
+		std::string sPage;
+		BuildStatsPage( sPage );
+
+		// A line at a time, Printf only takes so much
+		size_t nStart = 0;
+		while ( nStart < sPage.size() )
+		{
+			size_t nEnd = sPage.find( '\n', nStart );
+			if ( nEnd == std::string::npos )
+				nEnd = sPage.size();
+			Printf( "%s\n", sPage.substr( nStart, nEnd - nStart ).c_str() );
+			nStart = nEnd + 1;
+		}
+	}
+
+	// Returns true if at least one message was processed
+	bool PollIncomingMessages()
+	{
+		ISteamNetworkingMessage *pIncomingMsgs[ k_nMaxMessagesPerBatch ];
+		bool bGotMessages = false;
+
+		for ( int iBatch = 0; iBatch < k_nMaxBatchesPerTick && !g_bQuit; ++iBatch )
+		{
+			int numMsgs = m_pInterface->ReceiveMessagesOnPollGroup( m_hPollGroup, pIncomingMsgs, k_nMaxMessagesPerBatch );
+			if ( numMsgs == 0 )
+				break;
+			if ( numMsgs < 0 )
+				FatalError( "Error checking for messages" );
+			bGotMessages = true;
+
+			for ( int i = 0; i < numMsgs; ++i )
+			{
+				DispatchMessage( pIncomingMsgs[ i ] );
+
+				// We don't need this anymore.
+				pIncomingMsgs[ i ]->Release();
+			}
+
+			// Got less than we asked for, so there is nothing left to read
+			if ( numMsgs < k_nMaxMessagesPerBatch )
+				break;
+		}
+		return bGotMessages;
+	}
+
+	// Same for the heartbeat connections from game servers.  They only ever send
+	// hellos and heartbeats, everything else is dropped.
+	bool PollGameServerMessages()
+	{
+		ISteamNetworkingMessage *pIncomingMsgs[ k_nMaxMessagesPerBatch ];
+		bool bGotMessages = false;
+
+		while ( !g_bQuit )
+		{
+			int numMsgs = m_pInterface->ReceiveMessagesOnPollGroup( m_hGameServerPollGroup, pIncomingMsgs, k_nMaxMessagesPerBatch );
+			if ( numMsgs == 0 )
+				break;
+			if ( numMsgs < 0 )
+				FatalError( "Error checking for messages" );
+			bGotMessages = true;
+
+			for ( int i = 0; i < numMsgs; ++i )
+			{
+				MessageView msg( pIncomingMsgs[ i ] );
+				if ( msg.IsValid() && msg.m_eType == game_server_heartbeat )
+				{
+					++m_nMessagesReceived[ msg.m_eType ];
+					OnGameServerHeartbeat( msg );
+				}
+				else if ( msg.IsValid() && msg.m_eType == message_hello )
+				{
+					++m_nMessagesReceived[ msg.m_eType ];
+					OnGameServerHello( msg );
+				}
+				else
+				{
+					++m_nMessagesDropped;
+				}
+				pIncomingMsgs[ i ]->Release();
+			}
+
+			if ( numMsgs < k_nMaxMessagesPerBatch )
+				break;
+		}
+		return bGotMessages;
+	}
+
+	void DispatchMessage( ISteamNetworkingMessage *pIncomingMsg )
+	{
+		MessageView msg( pIncomingMsg );
+		if ( !msg.IsValid() )
+		{
+			++m_nMessagesDropped;
+			return;
+		}
+
+		// Clients we kicked may still have messages in the same batch
+		int iClient = m_Clients.Find( msg.m_hConn );
+		if ( !IsConnected( iClient ) )
+		{
+			++m_nMessagesDropped;
+			return;
+		}
+
+		if ( (unsigned)msg.m_eType >= (unsigned)num_message_types || !m_MessageHandlers[ msg.m_eType ] )
+		{
+			++m_nMessagesDropped;
+			return;
+		}
+
+		// Chat is the only payload that can be any length
+		if ( msg.m_eType == chat_message && msg.m_cbPayload > (uint32)k_cchMaxChatMessage )
+		{
+			DPrintf( "PLAYER %s SENT A CHAT MESSAGE OF %u BYTES\n", m_Clients.Get( iClient ).m_szNick, msg.m_cbPayload );
+			++m_nMessagesDropped;
+			return;
+		}
+
+		switch ( m_RateLimiter.Allow( iClient, msg.m_eType, SteamNetworkingUtils()->GetLocalTimestamp() ) )
+		{
+		case rate_limit_ok:
+			break;
+		case rate_limit_slow_down:
+			DPrintf( "PLAYER %s IS OVER THE LIMIT FOR %s\n", m_Clients.Get( iClient ).m_szNick, ConvertMessageTypeToString( msg.m_eType ).c_str() );
+			SendStringToClient( msg.m_hConn, "Thou speakest too quickly, some of thy words were lost." );
+			return;
+		case rate_limit_kick:
+			KickClient( iClient, "Flooding the server" );
+			return;
+		default:
+			return;
+		}
+
+		++m_nMessagesReceived[ msg.m_eType ];
+
+		// Handlers get a view of the payload right where it sits in the message
+		(this->*m_MessageHandlers[ msg.m_eType ])( iClient, msg );
+	}
+
+	void OnChatMessage( int iClient, const MessageView &msg )
+	{
+		char temp[ 1024 ];
+
+		// '\0'-terminate it to make it easier to parse
+		std::string sCmd = msg.ReadString();
+		const char *cmd = sCmd.c_str();
+
+		// Check for known commands.  None of this example code is secure or robust.
+		// Don't write a real server like this, please.
+
+		if (strncmp(cmd, "/nick", 5) == 0)
+		{
+			const char *nick = cmd + 5;
+			while (isspace(*nick))
+				++nick;
+
+			// Let everybody else know they changed their name
+			snprintf(temp, sizeof(temp), "%s shall henceforth be known as %s", m_Clients.Get(iClient).m_szNick, nick);
+			SendStringToAllClients(temp, msg.m_hConn);
+
+			// Respond to client
+			snprintf(temp, sizeof(temp), "Ye shall henceforth be known as %s", nick);
+			SendStringToClient(msg.m_hConn, temp);
+
+			// Actually change their name
+			SetClientNick(msg.m_hConn, nick);
+			return;
+		}
+
+		// Assume it's just a ordinary chat message, dispatch to everybody else
+		snprintf(temp, sizeof(temp), "%s: %s", m_Clients.Get(iClient).m_szNick, cmd);
+		SendStringToAllClients(temp, msg.m_hConn);
+	}
+
+	void OnRequestLobbyList( int /*iClient*/, const MessageView &msg )
+	{
+		if (m_Lobbies.empty())
+		{
+			SendOnlyMessageType(msg.m_hConn, k_nSteamNetworkingSend_Reliable, nullptr, message_no_suitable_lobbies, m_pInterface);
+		}
+		else
+		{
+			// Fill the IDs straight into the outgoing message
+			uint32 cbReply = (uint32)(WireFormat< HLobbyID >::k_cbSize * m_Lobbies.size());
+			SteamNetworkingMessage_t *pReply = AllocateTypedMessage(msg.m_hConn, cbReply, k_nSteamNetworkingSend_Reliable, lobby_list);
+			if (!pReply)
+				return;
+			WireWriter writer(GetTypedMessagePayload(pReply), cbReply);
+			for (LobbyTable::iterator it = m_Lobbies.begin(); it != m_Lobbies.end(); ++it)
+				WireFormat< HLobbyID >::Write(writer, it->m_hLobbyID);
+			SendAllocatedMessage(pReply, nullptr, m_pInterface);
+		}
+	}
+
+	void OnRequestCreateLobby( int iClient, const MessageView &msg )
+	{
+		// Out of their queue, wherever it is, before they get a lobby here
+		LeaveLobby(iClient);
+		RemovePlayerFromLobby(iClient);
+		HLobbyID temp_id = m_Lobbies.Create(invalid_map, -1);
+		m_Lobbies.Find(temp_id)->AddPlayer(iClient);
+		m_Lobbies.Find(temp_id)->m_iOwner = iClient;
+		m_Clients.Get(iClient).m_hLobby = temp_id;
+		SendWireMessage(msg.m_hConn, temp_id, k_nSteamNetworkingSend_Reliable, message_save_lobby_id_on_create, m_pInterface);
+		Printf("LOBBY %u CREATED\n", temp_id);
+		Printf("HOST %s JOINED LOBBY\n", m_Clients.Get(iClient).m_szNick);
+		PrintLobby(temp_id);
+	}
+
+	void OnRequestJoinLobby( int iClient, const MessageView &msg )
+	{
+		HLobbyID lobby_to_join;
+		if (!msg.Read(lobby_to_join))
+			return;
+		if (m_Clients.Get(iClient).m_hLobby != lobby_to_join)
+			LeaveLobby(iClient);
+		AddPlayerToLobby(iClient, lobby_to_join);
+	}
+
+	void OnRequestEcho( int /*iClient*/, const MessageView &msg )
+	{
+		HLobbyID lobby_to_join;
+		if (!msg.Read(lobby_to_join))
+			return;
+		SendWireMessage(msg.m_hConn, lobby_to_join, k_nSteamNetworkingSend_Reliable, message_echo, m_pInterface);
+		Printf("Echoed: %u\n", lobby_to_join);
+	}
+
+	void OnRequestLeaveLobby( int iClient, const MessageView &/*msg*/ )
+	{
+		LeaveLobby(iClient);
+	}
+
+	void OnRequestLobbyData( int iClient, const MessageView &msg )
+	{
+		HLobbyID lobby_id;
+		if (!msg.Read(lobby_id))
+			return;
+		const Lobby *pLobby = m_Lobbies.Find(lobby_id);
+		if (!pLobby)
+		{
+			DPrintf("PLAYER %s ASKED FOR LOBBY %u, WHICH DOESN'T EXIST\n", m_Clients.Get(iClient).m_szNick, lobby_id);
+			return;
+		}
+		LobbyData l_lobby_data;
+		l_lobby_data.m_hLobbyID = lobby_id;
+		l_lobby_data.m_bTeamDM = pLobby->m_bTeamDM;
+		l_lobby_data.m_map = pLobby->m_map;
+		SendWireMessage(msg.m_hConn, l_lobby_data, k_nSteamNetworkingSend_Reliable, lobby_data, m_pInterface, m_Clients.Get(iClient).m_nProtocolVersion);
+		Printf("LOBBY: %u METADATA WAS SENT\n", lobby_id);
+	}
+
+	// Only the lobby's owner may change its map and gamemode.  A lobby that
+	// lost its owner in a restart before it had a map takes one from any of
+	// its players.  Lobbies on their way to a game server keep theirs.
+	void OnLobbyData( int iClient, const MessageView &msg )
+	{
+		LobbyData l_lobby_data;
+		if (!msg.Read(l_lobby_data))
+			return;
+		Lobby *pLobby = m_Lobbies.Find(l_lobby_data.m_hLobbyID);
+		bool bAllowed = pLobby && !pLobby->m_bStarting && !pLobby->m_bReady &&
+			(pLobby->m_iOwner == iClient || (pLobby->m_iOwner < 0 && pLobby->m_map == invalid_map && pLobby->FindPlayer(iClient) >= 0));
+		if (!bAllowed)
+		{
+			Printf("PLAYER %s MAY NOT SET THE METADATA OF LOBBY %u\n", m_Clients.Get(iClient).m_szNick, l_lobby_data.m_hLobbyID);
+			return;
+		}
+		Lobby &lobby = *pLobby;
+		lobby.m_bTeamDM = l_lobby_data.m_bTeamDM;
+		lobby.m_map = l_lobby_data.m_map;
+		m_Lobbies.UpdateIndex(l_lobby_data.m_hLobbyID, lobby);
+		Printf("SET LOBBY: %u METADATA\n", l_lobby_data.m_hLobbyID);
+		PrintLobby(l_lobby_data.m_hLobbyID);
+
+		// It may have filled up before it had a map to start on
+		if (lobby.m_nPlayers >= iNumOfPlayersToStartGame && !lobby.m_bReady && !lobby.m_bStarting)
+			OnLobbyFull(l_lobby_data.m_hLobbyID, lobby);
+	}
+
+	void OnHello( int iClient, const MessageView &msg )
+	{
+		HelloData hello;
+		if (!msg.Read(hello))
+			return;
+
+		// Our answer tells them which versions we understand, a client we can't
+		// talk to sees that and disconnects by itself
+		Client_t &client = m_Clients.Get(iClient);
+		if (hello.m_nVersion < k_nMinProtocolVersion || hello.m_nMinVersion > k_nProtocolVersion)
+			Printf("PLAYER %s SPEAKS PROTOCOL VERSION %u, WE NEED %u TO %u\n", client.m_szNick, hello.m_nVersion, k_nMinProtocolVersion, k_nProtocolVersion);
+		else
+			client.m_nProtocolVersion = std::min(hello.m_nVersion, k_nProtocolVersion);
+		m_SendQueue.SetCanBatch(msg.m_hConn, client.m_nProtocolVersion >= 1);
+
+		HelloData reply;
+		reply.m_nVersion = k_nProtocolVersion;
+		reply.m_nMinVersion = k_nMinProtocolVersion;
+		SendWireMessage(msg.m_hConn, reply, k_nSteamNetworkingSend_Reliable, message_hello, m_pInterface);
+
+		// Lets them back into their lobby or queue if they lose us
+		if (client.m_nProtocolVersion >= 2)
+		{
+			do
+			{
+				client.m_nResumeToken = ((uint64)m_TokenSource() << 32) | m_TokenSource();
+			} while (!client.m_nResumeToken);
+			SendWireMessage(msg.m_hConn, client.m_nResumeToken, k_nSteamNetworkingSend_Reliable, message_resume_token, m_pInterface);
+		}
+	}
+
+	// Player of the last run reconnected after a restart, or another node sent them over
+	void OnRequestResume( int iClient, const MessageView &msg )
+	{
+		uint64 nToken;
+		if (!msg.Read(nToken))
+			return;
+
+		// Tokens only work once, and only for whoever they were handed out to
+		Client_t &client = m_Clients.Get(iClient);
+		std::unordered_map< uint64, PendingResume >::iterator it = m_mapPendingResumes.find(nToken);
+		uint32 nResult = resume_failed;
+		if (it == m_mapPendingResumes.end() || (it->second.m_record.m_steamID && it->second.m_record.m_steamID != client.m_steamID))
+		{
+			Printf("PLAYER %s HAS NOTHING TO RESUME\n", client.m_szNick);
+		}
+		else
+		{
+			SnapshotClient record = it->second.m_record;
+			ErasePendingResume(it);
+			client.m_nResumeToken = nToken;
+			SetClientNick(msg.m_hConn, record.m_szNick);
+
+			// Their profile may still be loading, and it would say the same thing
+			client.m_flRating = record.m_flRating;
+			client.m_iSearchBucket = record.m_iSearchBucket;
+			client.m_usecSearchStarted = record.m_usecSearchStarted;
+
+			nResult = resume_idle;
+			if (record.m_hLobby != invalid_lobby && m_Lobbies.Find(record.m_hLobby))
+			{
+				AddPlayerToLobby(iClient, record.m_hLobby);
+				if (client.m_hLobby == record.m_hLobby)
+					nResult = resume_lobby;
+			}
+			if (nResult == resume_idle && record.m_iSearchBucket >= 0)
+			{
+				QueuePlayer(iClient, record.m_iSearchBucket, record.m_usecSearchStarted);
+				nResult = resume_queued;
+			}
+			Printf("PLAYER %s RESUMED %s\n", client.m_szNick, nResult == resume_lobby ? "IN THEIR LOBBY" : nResult == resume_queued ? "SEARCHING" : "WITH NOTHING GOING ON");
+		}
+
+		SendWireMessage(msg.m_hConn, nResult, k_nSteamNetworkingSend_Reliable, message_resume_result, m_pInterface);
+		if (client.m_nResumeToken)
+			SendWireMessage(msg.m_hConn, client.m_nResumeToken, k_nSteamNetworkingSend_Reliable, message_resume_token, m_pInterface);
+	}
+
+	void OnGameServerHello( const MessageView &msg )
+	{
+		HelloData hello;
+		if (!msg.Read(hello))
+			return;
+		if (hello.m_nVersion < k_nMinProtocolVersion || hello.m_nMinVersion > k_nProtocolVersion)
+			Printf("GAME SERVER CONNECTION %u SPEAKS PROTOCOL VERSION %u, WE NEED %u TO %u\n", msg.m_hConn, hello.m_nVersion, k_nMinProtocolVersion, k_nProtocolVersion);
+
+		HelloData reply;
+		reply.m_nVersion = k_nProtocolVersion;
+		reply.m_nMinVersion = k_nMinProtocolVersion;
+		SendWireMessage(msg.m_hConn, reply, k_nSteamNetworkingSend_Reliable, message_hello, m_pInterface);
+	}
+
+	// The first heartbeat on a connection tells us which game server it is: the
+	// one added with /game_sip at the address it comes from and the port it reports
+	void OnGameServerHeartbeat( const MessageView &msg )
+	{
+		GameServerHeartbeat heartbeat;
+		if (!msg.Read(heartbeat))
+			return;
+
+		int iServer = m_GameServers.FindServerByHeartbeatConn(msg.m_hConn);
+		if (iServer < 0)
+		{
+			SteamNetConnectionInfo_t info;
+			if (!m_pInterface->GetConnectionInfo(msg.m_hConn, &info))
+				return;
+			char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+			info.m_addrRemote.ToString(szAddr, sizeof(szAddr), false);
+			iServer = m_GameServers.FindServer(szAddr, heartbeat.m_nPort);
+			if (iServer < 0)
+			{
+				Printf("HEARTBEAT FROM UNKNOWN GAME SERVER %s:%u, ADD IT WITH /game_sip\n", szAddr, heartbeat.m_nPort);
+				CloseGameServerConnection(msg.m_hConn, "Unknown game server");
+				return;
+			}
+
+			// A server that reconnected may still have its old connection hanging around
+			HSteamNetConnection hOldConn = m_GameServers.Get(iServer).m_hHeartbeatConn;
+			if (hOldConn != k_HSteamNetConnection_Invalid && hOldConn != msg.m_hConn)
+				CloseGameServerConnection(hOldConn, "Replaced by a new connection");
+			m_pInterface->SetConnectionName(msg.m_hConn, GameServerRegistry::FormatAddress(m_GameServers.Get(iServer).m_addr).c_str());
+			Printf("GAME SERVER %s IS SENDING HEARTBEATS\n", GameServerRegistry::FormatAddress(m_GameServers.Get(iServer).m_addr).c_str());
+		}
+
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		const GameServer &server = m_GameServers.Get(iServer);
+		if (server.m_bDead)
+			Printf("GAME SERVER %s IS BACK\n", GameServerRegistry::FormatAddress(server.m_addr).c_str());
+
+		StartingLobby starting;
+		switch (m_GameServers.OnHeartbeat(iServer, msg.m_hConn, heartbeat, usecNow))
+		{
+		case heartbeat_set_up:
+			if (!PopHeartbeatSetup(iServer, starting))
+				break;
+			Printf("GAME SERVER %s LOADED %s IN %.1f ms\n", GameServerRegistry::FormatAddress(server.m_addr).c_str(), ConvertMapToString(heartbeat.m_map).c_str(), (usecNow - starting.m_usecStarted)*1e-3);
+			OnGameServerReady(starting.m_hLobby, iServer, true);
+			break;
+
+		case heartbeat_match_over:
+			Printf("MATCH ON GAME SERVER %s IS OVER, IT'S %s\n", GameServerRegistry::FormatAddress(server.m_addr).c_str(), heartbeat.m_ePhase == game_phase_intermission ? "AT INTERMISSION" : "EMPTY");
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	void CloseGameServerConnection( HSteamNetConnection hConn, const char *pszReason )
+	{
+		m_vecGameServerConns.erase(std::remove(m_vecGameServerConns.begin(), m_vecGameServerConns.end(), hConn), m_vecGameServerConns.end());
+		m_pInterface->CloseConnection(hConn, 0, pszReason, false);
+	}
+
+	// Client measured the game servers we told them about
+	void OnGameServerPings( int iClient, const MessageView &msg )
+	{
+		if (iClient >= (int)m_vecClientPings.size())
+			m_vecClientPings.resize(iClient + 1);
+		std::vector< uint16 > &vecPings = m_vecClientPings[iClient];
+		vecPings.assign(m_GameServers.Count(), k_nPingUnknown);
+
+		GameServerPing ping;
+		for (uint32 i = 0; msg.ReadElement(i, ping); ++i)
+		{
+			SteamNetworkingIPAddr addr;
+			memcpy(addr.m_ipv6, ping.m_ipv6, sizeof(addr.m_ipv6));
+			char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+			addr.ToString(szAddr, sizeof(szAddr), false);
+			int iServer = m_GameServers.FindServer(szAddr, ping.m_nPort);
+			if (iServer >= 0)
+				vecPings[iServer] = ping.m_nPingMS;
+		}
+		DPrintf("PLAYER %s REPORTED PINGS TO %u GAME SERVERS\n", m_Clients.Get(iClient).m_szNick, msg.Count< GameServerPing >());
+	}
+
+	// Queues the player up for a match on the map and gamemode.  They get
+	// message_save_lobby_id once the skill queue has found them players to play with.
+	void OnRequestFindMatch( int iClient, const MessageView &msg )
+	{
+		FindMatchData find_data;
+		if (!msg.Read(find_data))
+			return;
+		int iBucket = GetLobbyBucket(find_data.m_map, find_data.m_bTeamDM);
+		if (iBucket < 0)
+		{
+			SendOnlyMessageType(msg.m_hConn, k_nSteamNetworkingSend_Reliable, nullptr, message_no_suitable_lobbies, m_pInterface);
+			return;
+		}
+
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		if (!HandOffNewSearch(iClient, iBucket, usecNow))
+		{
+			m_Demand.RecordSearches(iBucket, 1, usecNow);
+			QueuePlayer(iClient, iBucket, usecNow);
+		}
+	}
+
+	// Puts the player in the bucket's queue, taking them out of the last search
+	// or lobby they were in.  Their skill window widens from usecSearchStarted.
+	void QueuePlayer( int iClient, int iBucket, SteamNetworkingMicroseconds usecSearchStarted )
+	{
+		// They search here now, whatever node they were offered to gets nobody
+		Client_t &client = m_Clients.Get(iClient);
+		client.m_iSearchBucket = iBucket;
+		client.m_usecSearchStarted = usecSearchStarted;
+		client.m_nHandoff = 0;
+
+		if (!m_vecShards.empty())
+		{
+			// They are only ever queued once
+			if (client.m_iShard >= 0)
+				LeaveLobby(iClient);
+			else
+				RemovePlayerFromLobby(iClient);
+
+			ShardRequest request;
+			request.m_eType = ShardRequest::find_match;
+			request.m_hConn = client.m_hConn;
+			request.m_iClient = iClient;
+			request.m_data.m_map = (HL2DM_Map)(iBucket / 2);
+			request.m_data.m_bTeamDM = (char)(iBucket % 2);
+			request.m_flRating = client.m_flRating;
+			request.m_usecQueued = usecSearchStarted;
+			client.m_iShard = iBucket % (int)m_vecShards.size();
+			m_vecShards[client.m_iShard]->Submit(request);
+			return;
+		}
+
+		RemovePlayerFromLobby(iClient);
+		m_SkillQueue.Add(iBucket, iClient, client.m_hConn, client.m_flRating, usecSearchStarted);
+		DPrintf("PLAYER %s QUEUED WITH RATING %.0f\n", client.m_szNick, client.m_flRating);
+	}
+
+	// Everything the cluster needs doing this tick.  Returns true if anything happened.
+	bool UpdateCluster(SteamNetworkingMicroseconds usecNow)
+	{
+		if (!m_Federation.IsRunning())
+			return false;
+		bool bDidWork = m_Federation.Update(usecNow);
+
+		m_vecPeerHandoffs.clear();
+		m_vecPeerResults.clear();
+		bDidWork |= m_Federation.ReceiveMessages(usecNow, m_vecPeerHandoffs, m_vecPeerResults);
+		for (const PeerHandoff &handoff: m_vecPeerHandoffs)
+			OnPeerHandoff(handoff, usecNow);
+		for (const PeerHandoffResult &result: m_vecPeerResults)
+			OnPeerHandoffResult(result);
+		bDidWork |= ExpireHandoffs(usecNow);
+
+		// The summary doesn't count as work, only players actually moving does
+		if (usecNow >= m_usecNextPeerSummary)
+		{
+			m_usecNextPeerSummary = usecNow + k_usecPeerSummaryInterval;
+			SendPeerSummary();
+			bDidWork |= RebalanceQueues(usecNow);
+			bDidWork |= RebalanceLobbies(usecNow);
+		}
+		return bDidWork;
+	}
+
+	void SendPeerSummary()
+	{
+		PeerSummary &summary = m_PeerSummaryScratch;
+		summary.m_nClientPort = m_nClientPort;
+		summary.m_nClients = (uint32)m_Clients.Count();
+		for (int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket)
+			summary.m_nWaiting[iBucket] = (uint16)std::min(GetNumWaiting(iBucket), 0xFFFF);
+		summary.m_nReadyLobbies = (uint16)std::min((int)m_queueReadyLobbies.size(), 0xFFFF);
+
+		// Our game servers stay ours, the others only get to see them
+		summary.m_vecGameServers.clear();
+		for (int iServer = 0; iServer < m_GameServers.Count(); ++iServer)
+		{
+			const GameServer &server = m_GameServers.Get(iServer);
+			SteamNetworkingIPAddr addr;
+			if (!addr.ParseString(server.m_addr.addr.c_str()))
+				continue;
+			PeerGameServer record;
+			memcpy(record.m_ipv6, addr.m_ipv6, sizeof(record.m_ipv6));
+			record.m_nPort = (uint16)server.m_addr.port;
+			record.m_nCapacity = (uint8)std::min(server.m_nCapacity, 255);
+			record.m_eState = server.m_bDead ? game_server_draining : server.m_eState;
+			record.m_map = server.m_map;
+			record.m_bTeamDM = server.m_bTeamDM;
+			summary.m_vecGameServers.push_back(record);
+		}
+		m_Federation.BroadcastSummary(summary);
+	}
+
+	bool IsNodeUsable(const PeerNode &node, SteamNetworkingMicroseconds usecNow) const
+	{
+		return node.m_bLinked && usecNow - node.m_usecSummary < k_usecPeerSummaryMaxAge;
+	}
+
+	// The node with the most players searching in the bucket, if that's more
+	// than the nWaitingHere we have.  On a tie the players go to the node with
+	// the lower ID, so two nodes with as many don't keep swapping theirs.
+	// Returns -1 if there is no such node.
+	int FindBusierNode(int iBucket, int nWaitingHere, SteamNetworkingMicroseconds usecNow) const
+	{
+		int nBestNode = -1;
+		int nBestWaiting = 0;
+		for (const PeerNode &node: m_Federation.GetNodes())
+		{
+			if (!IsNodeUsable(node, usecNow))
+				continue;
+			int nWaiting = node.m_summary.m_nWaiting[iBucket];
+			uint16 nNodeID = node.m_summary.m_nNodeID;
+			if (nWaiting < nWaitingHere || (nWaiting == nWaitingHere && (nWaiting == 0 || nNodeID > m_Federation.GetNodeID())))
+				continue;
+			if (nBestNode < 0 || nWaiting > nBestWaiting || (nWaiting == nBestWaiting && nNodeID < nBestNode))
+			{
+				nBestNode = nNodeID;
+				nBestWaiting = nWaiting;
+			}
+		}
+		return nBestNode;
+	}
+
+	// The node with the most idle game servers that aren't already spoken for
+	// by its own full lobbies, or lobbies we are sending it.  -1 if none has any.
+	int FindNodeWithFreeServer(SteamNetworkingMicroseconds usecNow) const
+	{
+		int nBestNode = -1;
+		int nBestFree = 0;
+		for (const PeerNode &node: m_Federation.GetNodes())
+		{
+			if (!IsNodeUsable(node, usecNow))
+				continue;
+			int nFree = -(int)node.m_summary.m_nReadyLobbies;
+			for (const PeerGameServer &server: node.m_summary.m_vecGameServers)
+			{
+				if (server.m_eState == game_server_idle)
+					++nFree;
+			}
+			for (const std::pair< const uint32, Handoff > &pending: m_mapHandoffs)
+			{
+				if (pending.second.m_nNodeID == node.m_summary.m_nNodeID && pending.second.m_hLobby != invalid_lobby && pending.second.m_eState == handoff_waiting)
+					--nFree;
+			}
+			if (nFree > nBestFree)
+			{
+				nBestNode = node.m_summary.m_nNodeID;
+				nBestFree = nFree;
+			}
+		}
+		return nBestNode;
+	}
+
+	// Players can only be sent to a node that lets them resume there
+	bool CanHandOff(int iClient) const
+	{
+		if (!IsConnected(iClient))
+			return false;
+		const Client_t &client = m_Clients.Get(iClient);
+		return client.m_nProtocolVersion >= 3 && client.m_nResumeToken && !client.m_nHandoff;
+	}
+
+	// Offers the players, and their lobby if they have one, to another node.
+	// Returns false if the node can't be reached.
+	bool StartHandoff(uint16 nNodeID, int iBucket, HLobbyID lobbyID, const std::vector< int > &vecClients, SteamNetworkingMicroseconds usecNow)
+	{
+		const PeerNode *pNode = m_Federation.FindNode(nNodeID);
+		if (!pNode)
+			return false;
+
+		uint32 nHandoffID = m_nNextHandoffID++;
+		if (!m_nNextHandoffID)
+			m_nNextHandoffID = 1;
+		PeerHandoff handoff;
+		handoff.m_nHandoffID = nHandoffID;
+		handoff.m_nFromNode = m_Federation.GetNodeID();
+		handoff.m_iBucket = iBucket;
+		handoff.m_bLobby = lobbyID != invalid_lobby;
+		handoff.m_nFilledAgeMS = 0;
+		const Lobby *pLobby = m_Lobbies.Find(lobbyID);
+		if (pLobby && pLobby->m_usecFilled)
+			handoff.m_nFilledAgeMS = (uint32)((usecNow - pLobby->m_usecFilled) / 1000);
+		for (int iClient: vecClients)
 		{
-			ISteamNetworkingMessage *pIncomingMsg = nullptr;
-			int numMsgs = m_pInterface->ReceiveMessagesOnPollGroup( m_hPollGroup, &pIncomingMsg, 1 );
-			if ( numMsgs == 0 )
+			const Client_t &client = m_Clients.Get(iClient);
+			PeerPlayer player;
+			player.m_nResumeToken = client.m_nResumeToken;
+			player.m_steamID = client.m_steamID;
+			memcpy(player.m_szNick, client.m_szNick, sizeof(player.m_szNick));
+			player.m_flRating = client.m_flRating;
+			player.m_nSearchAgeMS = client.m_usecSearchStarted ? (uint32)((usecNow - client.m_usecSearchStarted) / 1000) : 0;
+			handoff.m_vecPlayers.push_back(player);
+		}
+		if (!m_Federation.SendHandoff(nNodeID, handoff))
+			return false;
+
+		Handoff &pending = m_mapHandoffs[nHandoffID];
+		pending.m_nNodeID = nNodeID;
+		pending.m_addrNode = pNode->m_addrClients;
+		pending.m_hLobby = lobbyID;
+		pending.m_iBucket = iBucket;
+		pending.m_usecSent = usecNow;
+		pending.m_eState = handoff_waiting;
+		pending.m_vecClients = vecClients;
+		for (int iClient: vecClients)
+			m_Clients.Get(iClient).m_nHandoff = nHandoffID;
+		++m_nHandoffsSent;
+		return true;
+	}
+
+	// Sends a player who just started searching straight to the node that has
+	// the most players in the bucket, if they wouldn't make a match here anyway.
+	// Returns true if they were offered to one.
+	bool HandOffNewSearch(int iClient, int iBucket, SteamNetworkingMicroseconds usecNow)
+	{
+		if (!m_Federation.IsRunning() || !CanHandOff(iClient) || m_Clients.Get(iClient).m_hLobby != invalid_lobby || IsSearching(iClient))
+			return false;
+		int nWaitingHere = GetNumWaiting(iBucket);
+		if (nWaitingHere + 1 >= iNumOfPlayersToStartGame)
+			return false;
+		int nNodeID = FindBusierNode(iBucket, nWaitingHere, usecNow);
+		if (nNodeID < 0)
+			return false;
+
+		Client_t &client = m_Clients.Get(iClient);
+		client.m_iSearchBucket = iBucket;
+		client.m_usecSearchStarted = usecNow;
+		m_vecHandoffClients[iBucket].assign(1, iClient);
+		if (!StartHandoff((uint16)nNodeID, iBucket, invalid_lobby, m_vecHandoffClients[iBucket], usecNow))
+			return false;
+		DPrintf("PLAYER %s OFFERED TO NODE %i, IT HAS MORE PLAYERS SEARCHING ON %s\n", client.m_szNick, nNodeID, ConvertMapToString((HL2DM_Map)(iBucket / 2)).c_str());
+		return true;
+	}
+
+	// Moves the players searching in buckets too thin to make a match here
+	// over to the node that has the most of them.  Returns true if any moved.
+	bool RebalanceQueues(SteamNetworkingMicroseconds usecNow)
+	{
+		int nTargetNodes[k_nNumLobbyBuckets];
+		bool bAny = false;
+		for (int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket)
+		{
+			nTargetNodes[iBucket] = -1;
+			m_vecHandoffClients[iBucket].clear();
+			int nWaiting = GetNumWaiting(iBucket);
+			if (nWaiting == 0 || nWaiting >= iNumOfPlayersToStartGame || usecNow < m_usecBucketHandoffAllowed[iBucket])
+				continue;
+			nTargetNodes[iBucket] = FindBusierNode(iBucket, nWaiting, usecNow);
+			bAny |= nTargetNodes[iBucket] >= 0;
+		}
+		if (!bAny)
+			return false;
+
+		for (int iClient = 0; iClient < m_Clients.GetSlotCount(); ++iClient)
+		{
+			if (!CanHandOff(iClient) || !IsSearching(iClient))
+				continue;
+			const Client_t &client = m_Clients.Get(iClient);
+			if (client.m_iSearchBucket < 0 || nTargetNodes[client.m_iSearchBucket] < 0 || usecNow - client.m_usecSearchStarted < k_usecHandoffMinWait)
+				continue;
+			m_vecHandoffClients[client.m_iSearchBucket].push_back(iClient);
+		}
+
+		bool bDidWork = false;
+		for (int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket)
+		{
+			std::vector< int > &vecClients = m_vecHandoffClients[iBucket];
+			if (vecClients.empty() || !StartHandoff((uint16)nTargetNodes[iBucket], iBucket, invalid_lobby, vecClients, usecNow))
+				continue;
+			for (int iClient: vecClients)
+				PullFromQueue(iClient);
+			m_usecBucketHandoffAllowed[iBucket] = usecNow + k_usecBucketHandoffCooldown;
+			Printf("%i PLAYERS SEARCHING ON %s, TEAM DEATHMATCH %i OFFERED TO NODE %i, IT HAS MORE OF THEM\n", (int)vecClients.size(), ConvertMapToString((HL2DM_Map)(iBucket / 2)).c_str(), iBucket % 2, nTargetNodes[iBucket]);
+			bDidWork = true;
+		}
+		return bDidWork;
+	}
+
+	// Full lobbies that have waited a while for a game server go to a node
+	// that has one free.  Returns true if any lobby was offered.
+	bool RebalanceLobbies(SteamNetworkingMicroseconds usecNow)
+	{
+		bool bDidWork = false;
+		for (HLobbyID lobbyID: m_queueReadyLobbies)
+		{
+			// Oldest first, once one is too fresh so are the rest
+			const Lobby *pLobby = m_Lobbies.Find(lobbyID);
+			if (!pLobby || !pLobby->m_bReady || pLobby->m_nPlayers < iNumOfPlayersToStartGame)
+				continue;
+			if (usecNow - pLobby->m_usecFilled < k_usecLobbyHandoffMinWait)
+				break;
+
+			bool bCanMove = true;
+			for (int i = 0; i < pLobby->m_nPlayers; ++i)
+				bCanMove = bCanMove && CanHandOff(pLobby->m_iPlayers[i]);
+			if (!bCanMove)
+				continue;
+			int nNodeID = FindNodeWithFreeServer(usecNow);
+			if (nNodeID < 0)
+				break;
+
+			std::vector< int > vecClients(pLobby->m_iPlayers, pLobby->m_iPlayers + pLobby->m_nPlayers);
+			if (!StartHandoff((uint16)nNodeID, GetLobbyBucket(pLobby->m_map, pLobby->m_bTeamDM), lobbyID, vecClients, usecNow))
+				continue;
+			Printf("LOBBY %u HAS WAITED %.1f s FOR A GAME SERVER, OFFERED TO NODE %i\n", lobbyID, (usecNow - pLobby->m_usecFilled)*1e-6, nNodeID);
+			bDidWork = true;
+		}
+		return bDidWork;
+	}
+
+	// Takes a searching player out of their queue for a handoff.  Shards answer
+	// later, in OnHandoffLeftQueue.
+	void PullFromQueue(int iClient)
+	{
+		if (m_Clients.Get(iClient).m_iShard < 0)
+			m_SkillQueue.Remove(iClient);
+		else
+			SubmitLeave(iClient);
+	}
+
+	// A shard answered the leave a handoff sent it for the player
+	void OnHandoffLeftQueue(int iClient, bool bWasQueued)
+	{
+		Client_t &client = m_Clients.Get(iClient);
+		if (!bWasQueued)
+		{
+			// The shard matched them before the leave got there, they play here after all
+			client.m_nHandoff = 0;
+			return;
+		}
+		if (client.m_nPendingLeaves > 0)
+			return;
+
+		std::unordered_map< uint32, Handoff >::iterator it = m_mapHandoffs.find(client.m_nHandoff);
+		if (it == m_mapHandoffs.end() || it->second.m_eState == handoff_refused)
+			ReturnFromHandoff(iClient);
+		else if (it->second.m_eState == handoff_accepted)
+			RedirectPlayer(iClient, it->second);
+	}
+
+	// The handoff didn't happen, searching players go back to the queue here
+	void ReturnFromHandoff(int iClient)
+	{
+		Client_t &client = m_Clients.Get(iClient);
+		client.m_nHandoff = 0;
+		if (client.m_hLobby == invalid_lobby && client.m_iSearchBucket >= 0)
+			QueuePlayer(iClient, client.m_iSearchBucket, client.m_usecSearchStarted);
+	}
+
+	// Sends the player over to the node that took them.  Their token only
+	// works over there now.
+	void RedirectPlayer(int iClient, const Handoff &handoff)
+	{
+		Client_t &client = m_Clients.Get(iClient);
+		RedirectData redirect;
+		memcpy(redirect.m_ipv6, handoff.m_addrNode.m_ipv6, sizeof(redirect.m_ipv6));
+		redirect.m_nPort = handoff.m_addrNode.m_port;
+		redirect.m_nResumeToken = client.m_nResumeToken;
+		SendWireMessage(client.m_hConn, redirect, k_nSteamNetworkingSend_Reliable, message_redirect, m_pInterface);
+		DPrintf("PLAYER %s SENT TO NODE %u\n", client.m_szNick, handoff.m_nNodeID);
+
+		client.m_nResumeToken = 0;
+		client.m_nHandoff = 0;
+		client.m_iSearchBucket = -1;
+		client.m_usecSearchStarted = 0;
+		++m_nPlayersHandedOff;
+	}
+
+	// Another node wants to send us players.  Their places are kept like those
+	// of players coming back after a restart, and the players resume them with
+	// the tokens they already have.
+	void OnPeerHandoff(const PeerHandoff &handoff, SteamNetworkingMicroseconds usecNow)
+	{
+		++m_nHandoffsReceived;
+		if (handoff.m_iBucket < 0 || handoff.m_iBucket >= k_nNumLobbyBuckets || (handoff.m_bLobby && (int)handoff.m_vecPlayers.size() > k_nMaxLobbyPlayers))
+		{
+			m_Federation.SendHandoffResult(handoff.m_nFromNode, handoff.m_nHandoffID, false);
+			return;
+		}
+
+		// A node gets to keep only so many places here at once, and none that
+		// would take over a place somebody else is already coming back to
+		bool bTaken = false;
+		for (const PeerPlayer &player: handoff.m_vecPlayers)
+			bTaken = bTaken || m_mapPendingResumes.count(player.m_nResumeToken) > 0;
+		if (bTaken || CountNodeResumes(handoff.m_nFromNode) + (int)handoff.m_vecPlayers.size() > k_nMaxPendingResumesPerNode)
+		{
+			Printf("REFUSED A HANDOFF OF %i PLAYERS FROM NODE %u, %s\n", (int)handoff.m_vecPlayers.size(), handoff.m_nFromNode,
+				bTaken ? "A TOKEN IS ALREADY WAITING TO RESUME" : "IT HAS TOO MANY PLAYERS WAITING TO COME OVER");
+			m_Federation.SendHandoffResult(handoff.m_nFromNode, handoff.m_nHandoffID, false);
+			return;
+		}
+
+		SteamNetworkingMicroseconds usecExpires = usecNow + k_usecHandoffArrivalWindow;
+		HLobbyID lobbyID = invalid_lobby;
+		if (handoff.m_bLobby)
+		{
+			lobbyID = m_Lobbies.Create((HL2DM_Map)(handoff.m_iBucket / 2), (char)(handoff.m_iBucket % 2));
+			m_Lobbies.Find(lobbyID)->m_usecFilled = usecNow - handoff.m_nFilledAgeMS * (SteamNetworkingMicroseconds)1000;
+			ReserveLobby(lobbyID, usecExpires);
+		}
+		for (const PeerPlayer &player: handoff.m_vecPlayers)
+		{
+			SnapshotClient record;
+			record.m_nResumeToken = player.m_nResumeToken;
+			record.m_steamID = player.m_steamID;
+			memcpy(record.m_szNick, player.m_szNick, sizeof(record.m_szNick));
+			record.m_flRating = player.m_flRating;
+			record.m_hLobby = lobbyID;
+			record.m_iSearchBucket = handoff.m_iBucket;
+			record.m_usecSearchStarted = usecNow - player.m_nSearchAgeMS * (SteamNetworkingMicroseconds)1000;
+			AddPendingResume(record, usecExpires, handoff.m_nFromNode);
+		}
+		if (!handoff.m_bLobby)
+			m_Demand.RecordSearches(handoff.m_iBucket, (int)handoff.m_vecPlayers.size(), usecNow);
+		m_Federation.SendHandoffResult(handoff.m_nFromNode, handoff.m_nHandoffID, true);
+		Printf("NODE %u SENT US %s OF %i PLAYERS ON %s, TEAM DEATHMATCH %i\n", handoff.m_nFromNode, handoff.m_bLobby ? "A LOBBY" : "A SEARCH", (int)handoff.m_vecPlayers.size(), ConvertMapToString((HL2DM_Map)(handoff.m_iBucket / 2)).c_str(), handoff.m_iBucket % 2);
+	}
+
+	void OnPeerHandoffResult(const PeerHandoffResult &result)
+	{
+		std::unordered_map< uint32, Handoff >::iterator it = m_mapHandoffs.find(result.m_nHandoffID);
+		if (it == m_mapHandoffs.end() || it->second.m_nNodeID != result.m_nFromNode || it->second.m_eState != handoff_waiting)
+			return;
+		Handoff &handoff = it->second;
+		handoff.m_eState = result.m_bAccepted ? handoff_accepted : handoff_refused;
+		if (result.m_bAccepted)
+			++m_nHandoffsAccepted;
+		else
+			++m_nHandoffsRefused;
+
+		if (handoff.m_hLobby != invalid_lobby)
+		{
+			FinishLobbyHandoff(result.m_nHandoffID, handoff);
+			m_mapHandoffs.erase(it);
+			return;
+		}
+
+		// Players whose shard hasn't answered yet are taken care of when it does
+		for (int iClient: handoff.m_vecClients)
+		{
+			if (!IsConnected(iClient) || m_Clients.Get(iClient).m_nHandoff != result.m_nHandoffID || m_Clients.Get(iClient).m_nPendingLeaves > 0)
+				continue;
+			if (result.m_bAccepted)
+				RedirectPlayer(iClient, handoff);
+			else
+				ReturnFromHandoff(iClient);
+		}
+	}
+
+	// The lobby only moves if it's still what we offered, otherwise it stays
+	// here and the place kept for it over there runs out
+	void FinishLobbyHandoff(uint32 nHandoffID, const Handoff &handoff)
+	{
+		Lobby *pLobby = m_Lobbies.Find(handoff.m_hLobby);
+		bool bIntact = pLobby && pLobby->m_bReady && !pLobby->m_bStarting && pLobby->m_nPlayers == (int)handoff.m_vecClients.size();
+		for (int iClient: handoff.m_vecClients)
+			bIntact = bIntact && IsConnected(iClient) && m_Clients.Get(iClient).m_nHandoff == nHandoffID && m_Clients.Get(iClient).m_hLobby == handoff.m_hLobby;
+		if (handoff.m_eState != handoff_accepted || !bIntact)
+		{
+			for (int iClient: handoff.m_vecClients)
+			{
+				if (IsConnected(iClient) && m_Clients.Get(iClient).m_nHandoff == nHandoffID)
+					m_Clients.Get(iClient).m_nHandoff = 0;
+			}
+			Printf("LOBBY %u STAYS HERE, NODE %u %s\n", handoff.m_hLobby, handoff.m_nNodeID, handoff.m_eState == handoff_accepted ? "TOOK IT AFTER IT CHANGED" : "HAS NO ROOM FOR IT");
+			return;
+		}
+
+		Printf("LOBBY %u MOVED TO NODE %u, IT HAS A FREE GAME SERVER\n", handoff.m_hLobby, handoff.m_nNodeID);
+		for (int iClient: handoff.m_vecClients)
+		{
+			m_Clients.Get(iClient).m_hLobby = invalid_lobby;
+			RedirectPlayer(iClient, handoff);
+		}
+		m_Lobbies.Destroy(handoff.m_hLobby);
+		++m_nLobbiesHandedOff;
+	}
+
+	// Nodes that don't answer in time get nobody.  Returns true if any handoff was dropped.
+	bool ExpireHandoffs(SteamNetworkingMicroseconds usecNow)
+	{
+		bool bDidWork = false;
+		for (std::unordered_map< uint32, Handoff >::iterator it = m_mapHandoffs.begin(); it != m_mapHandoffs.end();)
+		{
+			const Handoff &handoff = it->second;
+			if (usecNow - handoff.m_usecSent < k_usecHandoffTimeout)
+			{
+				++it;
+				continue;
+			}
+			if (handoff.m_eState == handoff_waiting)
+			{
+				Printf("NODE %u DIDN'T ANSWER A HANDOFF OF %i PLAYERS, THEY STAY HERE\n", handoff.m_nNodeID, (int)handoff.m_vecClients.size());
+				++m_nHandoffsTimedOut;
+				for (int iClient: handoff.m_vecClients)
+				{
+					if (IsConnected(iClient) && m_Clients.Get(iClient).m_nHandoff == it->first && m_Clients.Get(iClient).m_nPendingLeaves == 0)
+						ReturnFromHandoff(iClient);
+				}
+			}
+			it = m_mapHandoffs.erase(it);
+			bDidWork = true;
+		}
+		return bDidWork;
+	}
+
+	// Which node has the game server, -1 if none of them do
+	int FindGameServerNode(const srcon_addr &addr) const
+	{
+		SteamNetworkingIPAddr ip;
+		if (!ip.ParseString(addr.addr.c_str()))
+			return -1;
+		for (const PeerNode &node: m_Federation.GetNodes())
+		{
+			if (!node.m_bLinked)
+				continue;
+			for (const PeerGameServer &server: node.m_summary.m_vecGameServers)
+			{
+				if (server.m_nPort == addr.port && !memcmp(server.m_ipv6, ip.m_ipv6, sizeof(ip.m_ipv6)))
+					return node.m_summary.m_nNodeID;
+			}
+		}
+		return -1;
+	}
+
+	void PrintCluster()
+	{
+		if (!m_Federation.IsRunning())
+		{
+			Printf("Not part of a cluster\n");
+			return;
+		}
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		Printf("Node %u, other nodes link up on port %u\n", m_Federation.GetNodeID(), m_Federation.GetPort());
+		for (const PeerNode &node: m_Federation.GetNodes())
+		{
+			if (!node.m_bLinked)
+			{
+				Printf("Connection %u: not linked up yet\n", node.m_hConn);
+				continue;
+			}
+			const PeerSummary &summary = node.m_summary;
+			int nWaiting = 0;
+			for (int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket)
+				nWaiting += summary.m_nWaiting[iBucket];
+			char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+			node.m_addrClients.ToString(szAddr, sizeof(szAddr), true);
+			Printf("Node %u at %s: %u players, %i searching, %u lobbies waiting for a game server, last heard from %.1f s ago\n", summary.m_nNodeID, szAddr, summary.m_nClients, nWaiting, summary.m_nReadyLobbies, (usecNow - node.m_usecSummary)*1e-6);
+			for (const PeerGameServer &server: summary.m_vecGameServers)
+			{
+				SteamNetworkingIPAddr addr;
+				addr.SetIPv6(server.m_ipv6, server.m_nPort);
+				addr.ToString(szAddr, sizeof(szAddr), true);
+				Printf("  %s: %s, capacity %i, map %s, team deathmatch %i\n", szAddr, ConvertGameServerStateToString(server.m_eState).c_str(), (int)server.m_nCapacity, ConvertMapToString(server.m_map).c_str(), (int)server.m_bTeamDM);
+			}
+		}
+		Printf("Handoffs offered: %llu, taken: %llu, refused: %llu, unanswered: %llu, in flight: %i, received: %llu\n", (unsigned long long)m_nHandoffsSent, (unsigned long long)m_nHandoffsAccepted, (unsigned long long)m_nHandoffsRefused, (unsigned long long)m_nHandoffsTimedOut, (int)m_mapHandoffs.size(), (unsigned long long)m_nHandoffsReceived);
+		Printf("Players sent to other nodes: %llu, lobbies: %llu\n", (unsigned long long)m_nPlayersHandedOff, (unsigned long long)m_nLobbiesHandedOff);
+		Printf("Summaries received: %llu, bytes sent: %llu, received: %llu\n", (unsigned long long)m_Federation.GetNumSummariesReceived(), (unsigned long long)m_Federation.GetNumBytesSent(), (unsigned long long)m_Federation.GetNumBytesReceived());
+	}
+
+	void PrintRateLimits()
+	{
+		const RateLimit &total = m_RateLimiter.GetTotalLimit();
+		Printf("total: %.1f per second, bursts of %.0f\n", total.m_flPerSec, total.m_flBurst);
+		for ( int i = 0; i < num_message_types; ++i )
+		{
+			if ( !m_MessageHandlers[ i ] )
+				continue;
+			const RateLimit &limit = m_RateLimiter.GetLimit( (MessageType)i );
+			Printf("%s: %.1f per second, bursts of %.0f, %llu dropped\n", ConvertMessageTypeToString( (MessageType)i ).c_str(), limit.m_flPerSec, limit.m_flBurst, (unsigned long long)m_RateLimiter.GetNumDropped( (MessageType)i ));
+		}
+		Printf("Clients disconnected for flooding: %llu\n", (unsigned long long)m_RateLimiter.GetNumKicked());
+	}
+
+	// Returns true if there was any input to process
+	bool PollLocalUserInput()
+	{
+		std::string cmd;
+		bool bGotInput = false;
+		while ( !g_bQuit && LocalUserInput_GetNext( cmd ))
+		{
+			bGotInput = true;
+			if ( strcmp( cmd.c_str(), "/quit" ) == 0 )
+			{
+				g_bQuit = true;
+				Printf( "Shutting down server" );
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/num_s", 6) == 0)
+			{
+				const char *temp_num_s = cmd.c_str() + 6;
+				iNumOfPlayersToStartGame = (int)strtol(temp_num_s, nullptr, 10);
+				iNumOfPlayersToStartGame = std::max(1, std::min(iNumOfPlayersToStartGame, k_nMaxLobbyPlayers));
+				m_Lobbies.SetPlayersToStart(iNumOfPlayersToStartGame);
+				m_SkillQueue.SetPlayersPerMatch(iNumOfPlayersToStartGame);
+				for (std::unique_ptr< MatchmakingShard > &pShard: m_vecShards)
+					pShard->SetPlayersToStart(iNumOfPlayersToStartGame);
+				Printf("Number of players in a lobby requered for the game to start: %i\n", iNumOfPlayersToStartGame);
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/game_sip", 9) == 0)
+			{
+				// /game_sip IP[:PORT] [CAPACITY] [RCON PASSWORD]
+				srcon_addr addr_struct;
+				const char *temp_args = ParseGameServerAddress(cmd.c_str() + 9, addr_struct);
+				if (!temp_args)
+					break;
+
+				char *temp_end;
+				int nCapacity = (int)strtol(temp_args, &temp_end, 10);
+				if (temp_end == temp_args || nCapacity <= 0)
+					nCapacity = k_nDefaultGameServerCapacity;
+				temp_args = temp_end;
+				while (isspace(*temp_args))
+					++temp_args;
+				if (*temp_args)
+					addr_struct.pass = temp_args;
+
+				// Each game server belongs to one node, or two of them would hand it out at once
+				int nNodeID = FindGameServerNode(addr_struct);
+				if (nNodeID >= 0)
+				{
+					Printf("Game server %s:%i already belongs to node %i of the cluster\n", addr_struct.addr.c_str(), addr_struct.port, nNodeID);
+					break;
+				}
+
+				m_GameServers.AddServer(addr_struct, nCapacity);
+				Printf("Game Server IP: %s:%i, capacity %i\n", addr_struct.addr.c_str(), addr_struct.port, nCapacity);
+
+				// Everybody measures the new one too
+				SendGameServerListToAllClients();
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/server_pick", 12) == 0)
+			{
+				const char *temp_mode = cmd.c_str() + 12;
+				while (isspace(*temp_mode))
+					++temp_mode;
+				if (strncmp(temp_mode, "worst", 5) == 0)
+					m_bPickServerByWorstPing = true;
+				else if (strncmp(temp_mode, "average", 7) == 0)
+					m_bPickServerByWorstPing = false;
+				Printf("Game servers are picked by the %s ping of the lobby's players\n", m_bPickServerByWorstPing ? "worst" : "average");
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/print_servers", 14) == 0)
+			{
+				PrintGameServers();
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/drain_server", 13) == 0)
+			{
+				int iServer = FindGameServer(cmd.c_str() + 13);
+				if (iServer < 0)
+					break;
+				m_GameServers.Drain(iServer, SteamNetworkingUtils()->GetLocalTimestamp());
+				m_RconPool.ForgetServer(m_GameServers.Get(iServer).m_addr);
+				Printf("Game server %s won't get any new matches\n", GameServerRegistry::FormatAddress(m_GameServers.Get(iServer).m_addr).c_str());
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/end_match", 10) == 0)
+			{
+				int iServer = FindGameServer(cmd.c_str() + 10);
+				if (iServer < 0)
+					break;
+				if (!m_GameServers.RequestEndMatch(iServer, SteamNetworkingUtils()->GetLocalTimestamp()))
+				{
+					Printf("Game server %s is warming up, it will be free once that's done\n", GameServerRegistry::FormatAddress(m_GameServers.Get(iServer).m_addr).c_str());
+					break;
+				}
+				Printf("Game server %s is %s\n", GameServerRegistry::FormatAddress(m_GameServers.Get(iServer).m_addr).c_str(), ConvertGameServerStateToString(m_GameServers.Get(iServer).m_eState).c_str());
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/match_result", 13) == 0)
+			{
+				// /match_result IP[:PORT] PLAYER... with players numbered as in /print_servers, best placed first
+				srcon_addr addr;
+				const char *temp_args = ParseGameServerAddress(cmd.c_str() + 13, addr);
+				if (!temp_args)
+					break;
+				int iServer = m_GameServers.FindServer(addr.addr, addr.port);
+				if (iServer < 0)
+				{
+					Printf("No game server %s\n", GameServerRegistry::FormatAddress(addr).c_str());
+					break;
+				}
+				std::vector< uint64 > vecPlayers = m_GameServers.Get(iServer).m_vecPlayers;
+				std::vector< bool > vecPlaced(vecPlayers.size(), false);
+				std::vector< uint64 > vecPlacement;
+				bool bValid = true;
+				while (true)
+				{
+					char *temp_end;
+					long nPlayer = strtol(temp_args, &temp_end, 10);
+					if (temp_end == temp_args)
+						break;
+					temp_args = temp_end;
+					if (nPlayer < 1 || nPlayer > (long)vecPlayers.size() || vecPlaced[nPlayer - 1])
+					{
+						bValid = false;
+						break;
+					}
+					vecPlaced[nPlayer - 1] = true;
+					vecPlacement.push_back(vecPlayers[nPlayer - 1]);
+				}
+				if (!bValid || vecPlacement.size() < 2)
+				{
+					Printf("List at least two of the %i players of the last match on %s, best placed first, as numbered by /print_servers\n", (int)vecPlayers.size(), GameServerRegistry::FormatAddress(addr).c_str());
+					break;
+				}
+
+				// Each match is only rated once
+				m_GameServers.SetPlayers(iServer, std::vector< uint64 >(), m_GameServers.Get(iServer).m_flRating);
+				m_vecPendingResults.push_back(vecPlacement);
+				ApplyPendingResults();
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/print_ratings", 14) == 0)
+			{
+				PrintRatingStore();
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/match_length", 13) == 0)
+			{
+				const char *temp_length = cmd.c_str() + 13;
+				int nMinutes = (int)strtol(temp_length, nullptr, 10);
+				if (nMinutes <= 0)
+				{
+					Printf("Invalid match length, current value: %i minutes\n", (int)(m_GameServers.GetMatchLength() / (60 * 1000000LL)));
+					break;
+				}
+				m_GameServers.SetMatchLength(nMinutes * 60 * 1000000LL);
+				Printf("Game servers are freed up %i minutes after a match starts\n", nMinutes);
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/print_lobbies", 14) == 0)
+			{
+				PrintLobbyList();
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/rcon_timeout", 13) == 0)
+			{
+				const char *temp_timeout = cmd.c_str() + 13;
+				int nTimeout = (int)strtol(temp_timeout, nullptr, 10);
+				if (nTimeout <= 0)
+				{
+					Printf("Invalid RCON timeout\n");
+					break;
+				}
+				m_RconPool.SetTimeout(nTimeout);
+				Printf("RCON connect timeout: %i s, commands get %i s to be answered\n", nTimeout, (int)(k_usecRconResponseTimeout / 1000000));
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/rcon_retries", 13) == 0)
+			{
+				const char *temp_retries = cmd.c_str() + 13;
+				int nRetries = (int)strtol(temp_retries, nullptr, 10);
+				if (nRetries < 0)
+				{
+					Printf("Invalid number of RCON retries\n");
+					break;
+				}
+				m_RconPool.SetMaxRetries(nRetries);
+				Printf("RCON commands will be retried %i times\n", nRetries);
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/print_start_times", 18) == 0)
+			{
+				PrintStartStageTimes();
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/skill_window", 13) == 0)
+			{
+				// /skill_window INITIAL GROWTH_PER_SECOND
+				const char *temp_args = cmd.c_str() + 13;
+				char *temp_end;
+				float flInitial = strtof(temp_args, &temp_end);
+				bool bValid = temp_end != temp_args;
+				temp_args = temp_end;
+				float flGrowth = strtof(temp_args, &temp_end);
+				bValid = bValid && temp_end != temp_args && flInitial >= 0.0f && flGrowth >= 0.0f;
+				if (!bValid)
+				{
+					Printf("Invalid skill window, current value: %.0f rating points, widening by %.0f per second\n", m_SkillQueue.GetInitialWindow(), m_SkillQueue.GetWindowGrowth());
+					break;
+				}
+				m_SkillQueue.SetWindow(flInitial, flGrowth);
+				for (std::unique_ptr< MatchmakingShard > &pShard: m_vecShards)
+					pShard->SetSkillWindow(flInitial, flGrowth);
+				Printf("Players are matched with others within %.0f rating points, widening by %.0f per second of waiting\n", flInitial, flGrowth);
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/print_queue", 12) == 0)
+			{
+				PrintQueueTimes();
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/print_shards", 13) == 0)
+			{
+				PrintShards();
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/rate_limit", 11) == 0)
+			{
+				// /rate_limit MESSAGE_TYPE|total PER_SECOND BURST
+				const char *temp_args = cmd.c_str() + 11;
+				while (isspace(*temp_args))
+					++temp_args;
+				const char *temp_end = temp_args;
+				while (*temp_end && !isspace(*temp_end))
+					++temp_end;
+				std::string sType(temp_args, temp_end - temp_args);
+				char *temp_num_end;
+				float flPerSec = strtof(temp_end, &temp_num_end);
+				bool bValid = temp_num_end != temp_end;
+				temp_end = temp_num_end;
+				float flBurst = strtof(temp_end, &temp_num_end);
+				bValid = bValid && temp_num_end != temp_end && flPerSec > 0.0f && flBurst >= 1.0f;
+
+				int iType = -1;
+				for (int i = 0; i < num_message_types; ++i)
+				{
+					if (m_MessageHandlers[i] && sType == ConvertMessageTypeToString((MessageType)i))
+						iType = i;
+				}
+				if (!bValid || (iType < 0 && sType != "total"))
+				{
+					PrintRateLimits();
+					break;
+				}
+				RateLimit limit = { flPerSec, flBurst };
+				if (iType < 0)
+					m_RateLimiter.SetTotalLimit(limit);
+				else
+					m_RateLimiter.SetLimit((MessageType)iType, limit);
+				Printf("Clients may send %s at %.1f per second, in bursts of %.0f\n", sType.c_str(), flPerSec, flBurst);
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/print_snapshot", 15) == 0)
+			{
+				PrintSnapshot();
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/print_cluster", 14) == 0)
+			{
+				PrintCluster();
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/print_msg_counts", 17) == 0)
+			{
+				PrintMessageCounts();
 				break;
-			if ( numMsgs < 0 )
-				FatalError( "Error checking for messages" );
-			assert( numMsgs == 1 && pIncomingMsg );
-			auto itClient = m_mapClients.find( pIncomingMsg->m_conn );
-			assert( itClient != m_mapClients.end() );
+			}
+			if (strncmp(cmd.c_str(), "/backfill", 9) == 0)
+			{
+				const char *temp_backfill = cmd.c_str() + 9;
+				while (isspace(*temp_backfill))
+					++temp_backfill;
+				if (*temp_backfill)
+					m_bBackfill = atoi(temp_backfill) != 0;
+				Printf("Backfill is %s, %llu players sent into running matches, waited median %.1f s, max %.1f s\n", m_bBackfill ? "on" : "off", (unsigned long long)m_nPlayersBackfilled, m_BackfillWaitTimes.GetPercentile(0.5f)*1e-6, m_BackfillWaitTimes.GetMax()*1e-6);
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/prewarm", 8) == 0)
+			{
+				const char *temp_prewarm = cmd.c_str() + 8;
+				while (isspace(*temp_prewarm))
+					++temp_prewarm;
+				if (*temp_prewarm)
+					m_bPrewarm = atoi(temp_prewarm) != 0;
+				PrintPrewarm();
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/stats", 6) == 0)
+			{
+				PrintStats();
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/log_level", 10) == 0)
+			{
+				const char *temp_level = cmd.c_str() + 10;
+				while (isspace(*temp_level))
+					++temp_level;
+				LogLevel eLevel = ConvertStringToLogLevel(temp_level);
+				if (eLevel == num_log_levels)
+				{
+					Printf("Invalid log level, use debug, info, warning or error.  Current level: %s\n", ConvertLogLevelToString(g_Log.GetLevel()).c_str());
+					break;
+				}
+				g_Log.SetLevel(eLevel);
+				Printf("Log level: %s\n", ConvertLogLevelToString(eLevel).c_str());
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/debug", 6) == 0)
+			{
+				const char *temp_level = cmd.c_str() + 6;
+				char *temp_end;
+				int nLevel = (int)strtol(temp_level, &temp_end, 10);
+				if (temp_end == temp_level || nLevel < 0)
+				{
+					Printf("Invalid debug level, current value: %i\n", g_nDebugLevel);
+					break;
+				}
+				g_nDebugLevel = nLevel;
+				Printf("Debug level: %i\n", g_nDebugLevel);
+				break;
+			}
+			if (strncmp(cmd.c_str(), "/max_tick", 9) == 0)
+			{
+				const char *temp_max_tick = cmd.c_str() + 9;
+				int nMaxTick = (int)strtol(temp_max_tick, nullptr, 10);
+				if (nMaxTick <= 0)
+				{
+					Printf("Invalid max tick, current value: %i ms\n", g_nMaxTickMS);
+					break;
+				}
+				g_nMaxTickMS = nMaxTick;
+				Printf("Maximum time the server sleeps when idle: %i ms\n", g_nMaxTickMS);
+				break;
+			}
+
+			Printf( "Possible commands:\n'/quit' (shutdown the server)\n'/num_s' (number of players in a lobby required to start the game)\n'/game_sip' (add a game server: IP [capacity] [rcon password])\n'/print_servers' (print all of the game servers)\n'/server_pick' (pick game servers by the worst or the average ping of a lobby's players)\n'/drain_server' (stop giving a game server new matches)\n'/end_match' (mark the match on a game server as over)\n'/match_result' (rate the last match on a game server: IP, then its players from best to worst)\n'/print_ratings' (print what the player ratings database is doing)\n'/match_length' (minutes after which a game server is assumed to be free again)\n'/print_lobbies' (print all of the lobbies)\n'/rcon_timeout' (seconds to wait for a game server to accept an RCON connection, commands get 30 s to be answered)\n'/rcon_retries' (how many times to retry failed RCON commands)\n'/print_start_times' (print how long full lobbies take to get onto a game server)\n'/skill_window' (rating difference players accept right away, and how much it widens per second of waiting)\n'/print_queue' (print how long players wait in the matchmaking queue)\n'/print_shards' (print what each matchmaking shard thread is doing)\n'/print_msg_counts' (print how many messages of each type were received)\n'/backfill' (1 sends searching players into free slots of running matches, 0 turns it off, no arguments prints how many were sent)\n'/prewarm' (1 switches idle game servers to the maps lobbies are about to fill up on, 0 turns it off, no arguments prints the forecast and the hit rate)\n'/stats' (print every counter and latency histogram, as the stats endpoint serves them)\n'/print_snapshot' (print what the restart snapshot file is doing)\n'/print_cluster' (print the other matchmaking servers of the cluster, their queues and game servers)\n'/rate_limit' (messages per second and burst size clients may send, by message type or in total, no arguments prints them)\n'/max_tick' (maximum time in ms the server sleeps when idle)\n'/debug' (1 prints every lobby whenever a player leaves one, 0 turns it off)\n'/log_level' (debug, info, warning or error)" );
+		}
+		return bGotInput;
+	}
+
+	void RemoveClient( int iClient )
+	{
+		// Hold on to their slot until every shard is done with it
+		Client_t &client = m_Clients.Get( iClient );
+		ForgetClientProfile( iClient );
+		m_SendQueue.SetCanBatch( client.m_hConn, false );
+		LeaveLobby( iClient );
+		if ( client.m_nPendingLeaves > 0 )
+			client.m_bDisconnected = true;
+		else
+			m_Clients.Remove( iClient );
+	}
+
+	// Closing a connection ourselves doesn't call us back, so they are cleaned up right here
+	void KickClient( int iClient, const char *pszReason )
+	{
+		HSteamNetConnection hConn = m_Clients.Get( iClient ).m_hConn;
+		Printf( "DISCONNECTED PLAYER %s: %s\n", m_Clients.Get( iClient ).m_szNick, pszReason );
+		RemoveClient( iClient );
+		m_pInterface->CloseConnection( hConn, 0, pszReason, false );
+	}
+
+	void SetClientNick( HSteamNetConnection hConn, const char *nick )
+	{
+
+		// Remember their nick
+		int iClient = m_Clients.Find(hConn);
+		if (iClient < 0)
+			return;
+		m_Clients.Get(iClient).SetNick(nick);
+
+		// Set the connection name, too, which is useful for debugging
+		m_pInterface->SetConnectionName( hConn, nick );
+	}
 
-			std::string sCmd;
-			const char *cmd;
-			if (DetermineMessageType(pIncomingMsg) == chat_message)
+	void OnGameServerConnectionStatusChanged( SteamNetConnectionStatusChangedCallback_t *pInfo )
+	{
+		switch ( pInfo->m_info.m_eState )
+		{
+			case k_ESteamNetworkingConnectionState_ClosedByPeer:
+			case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
 			{
-				// '\0'-terminate it to make it easier to parse
-				void *temp_str = nullptr;
-				RemoveFirstByte(&temp_str, pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-				sCmd.assign((char*)temp_str, pIncomingMsg->m_cbSize - 1);
-				delete temp_str;
-				cmd = sCmd.c_str();
+				Printf( "Game server connection %s closed, reason %d: %s\n", pInfo->m_info.m_szConnectionDescription, pInfo->m_info.m_eEndReason, pInfo->m_info.m_szEndDebug );
+				int iServer = m_GameServers.OnHeartbeatConnClosed( pInfo->m_hConn );
+				if ( iServer >= 0 )
+					OnGameServerDead( iServer );
+				CloseGameServerConnection( pInfo->m_hConn, nullptr );
+				break;
+			}
+
+			case k_ESteamNetworkingConnectionState_Connecting:
+				Printf( "Game server connection request from %s", pInfo->m_info.m_szConnectionDescription );
+				if ( m_pInterface->AcceptConnection( pInfo->m_hConn ) != k_EResultOK || !m_pInterface->SetConnectionPollGroup( pInfo->m_hConn, m_hGameServerPollGroup ) )
+				{
+					m_pInterface->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
+					Printf( "Can't accept game server connection.  (It was already closed?)" );
+					break;
+				}
+				m_vecGameServerConns.push_back( pInfo->m_hConn );
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	void OnSteamNetConnectionStatusChanged( SteamNetConnectionStatusChangedCallback_t *pInfo )
+	{
+		char temp[1024];
 
-				// Check for known commands.  None of this example code is secure or robust.
-				// Don't write a real server like this, please.
+		// So do the other nodes of the cluster
+		if ( m_Federation.OnConnectionStatusChanged( pInfo ) )
+			return;
+
+		// Game servers have a listen socket of their own
+		if ( pInfo->m_info.m_hListenSocket != k_HSteamListenSocket_Invalid && pInfo->m_info.m_hListenSocket == m_hGameServerListenSock )
+		{
+			OnGameServerConnectionStatusChanged( pInfo );
+			return;
+		}
+
+		// What's the state of the connection?
+		switch ( pInfo->m_info.m_eState )
+		{
+			case k_ESteamNetworkingConnectionState_None:
+				// NOTE: We will get callbacks here when we destroy connections.  You can ignore these.
+				break;
 
-				if (strncmp(cmd, "/nick", 5) == 0)
+			case k_ESteamNetworkingConnectionState_ClosedByPeer:
+			case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+			{
+				// Ignore if they were not previously connected.  (If they disconnected
+				// before we accepted the connection.)
+				if ( pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connected )
 				{
-					const char *nick = cmd + 5;
-					while (isspace(*nick))
-						++nick;
 
-					// Let everybody else know they changed their name
-					sprintf(temp, "%s shall henceforth be known as %s", itClient->second.m_sNick.c_str(), nick);
-					SendStringToAllClients(temp, itClient->first);
+					// Locate the client.  Note that it should have been found, because
+					// clients we disconnect ourselves never get a callback, and connection
+					// change callbacks are dispatched in queue order.
+					int iClient = m_Clients.Find( pInfo->m_hConn );
+					assert( iClient >= 0 );
+					Client_t &client = m_Clients.Get( iClient );
+
+					// Select appropriate log messages
+					const char *pszDebugLogAction;
+					if ( pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ProblemDetectedLocally )
+					{
+						pszDebugLogAction = "problem detected locally";
+						snprintf( temp, sizeof(temp), "Alas, %s hath fallen into shadow.  (%s)", client.m_szNick, pInfo->m_info.m_szEndDebug );
+					}
+					else
+					{
+						// Note that here we could check the reason code to see if
+						// it was a "usual" connection or an "unusual" one.
+						pszDebugLogAction = "closed by peer";
+						snprintf( temp, sizeof(temp), "%s hath departed", client.m_szNick );
+					}
+
+					// Spew something to our own log.  Note that because we put their nick
+					// as the connection description, it will show up, along with their
+					// transport-specific data (e.g. their IP address)
+					Printf( "Connection %s %s, reason %d: %s\n",
+						pInfo->m_info.m_szConnectionDescription,
+						pszDebugLogAction,
+						pInfo->m_info.m_eEndReason,
+						pInfo->m_info.m_szEndDebug
+					);
 
-					// Respond to client
-					sprintf(temp, "Ye shall henceforth be known as %s", nick);
-					SendStringToClient(itClient->first, temp);
+					RemoveClient( iClient );
 
-					// Actually change their name
-					SetClientNick(itClient->first, nick);
-					continue;
+					// Send a message so everybody else knows what happened
+					SendStringToAllClients( temp );
+				}
+				else
+				{
+					assert( pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connecting );
 				}
 
-				// Assume it's just a ordinary chat message, dispatch to everybody else
-				sprintf(temp, "%s: %s", itClient->second.m_sNick.c_str(), cmd);
-				SendStringToAllClients(temp, itClient->first);
+				// Clean up the connection.  This is important!
+				// The connection is "closed" in the network sense, but
+				// it has not been destroyed.  We must close it on our end, too
+				// to finish up.  The reason information do not matter in this case,
+				// and we cannot linger because it's already closed on the other end,
+				// so we just pass 0's.
+				m_pInterface->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
+				break;
 			}
-			if (DetermineMessageType(pIncomingMsg) == request_lobby_list)
+
+			case k_ESteamNetworkingConnectionState_Connecting:
 			{
-				if (m_mapLobbies.empty())
+				// This must be a new connection
+				assert( m_Clients.Find( pInfo->m_hConn ) < 0 );
+
+				Printf( "Connection request from %s", pInfo->m_info.m_szConnectionDescription );
+
+				// A client is attempting to connect
+				// Try to accept the connection.
+				if ( m_pInterface->AcceptConnection( pInfo->m_hConn ) != k_EResultOK )
+				{
+					// This could fail.  If the remote host tried to connect, but then
+					// disconnected, the connection may already be half closed.  Just
+					// destroy whatever we have on our side.
+					m_pInterface->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
+					Printf( "Can't accept connection.  (It was already closed?)" );
+					break;
+				}
+
+				// Assign the poll group
+				if ( !m_pInterface->SetConnectionPollGroup( pInfo->m_hConn, m_hPollGroup ) )
+				{
+					m_pInterface->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
+					Printf( "Failed to set poll group?" );
+					break;
+				}
+
+				// Generate a random nick.  A random temporary nick
+				// is really dumb and not how you would write a real chat server.
+				// You would want them to have some sort of signon message,
+				// and you would keep their client in a state of limbo (connected,
+				// but not logged on) until them.  I'm trying to keep this example
+				// code really simple.
+				char nick[ 64 ];
+				sprintf( nick, "HL2_DM_Player%d", 10000 + ( rand() % 100000 ) );
+
+				// Send them a welcome message
+				snprintf( temp, sizeof(temp), "Welcome, stranger.  Thou art known to us for now as '%s'; upon thine command '/nick' we shall know thee otherwise.", nick ); 
+				SendStringToClient( pInfo->m_hConn, temp ); 
+
+				// Also send them a list of everybody who is already connected
+				if ( m_Clients.Empty() )
 				{
-					SendOnlyMessageType(pIncomingMsg->m_conn, k_nSteamNetworkingSend_Reliable, nullptr, message_no_suitable_lobbies, m_pInterface);
+					SendStringToClient( pInfo->m_hConn, "Thou art utterly alone." ); 
 				}
 				else
 				{
-					HLobbyID* array_LobbyIDs = new HLobbyID[m_mapLobbies.size()];
-					int i = 0;
-					for (std::map<HLobbyID, Lobby>::iterator it = m_mapLobbies.begin(); it != m_mapLobbies.end(); ++it)
+					snprintf( temp, sizeof(temp), "%d companions greet you:", m_Clients.Count() ); 
+					for ( int iClient = 0; iClient < m_Clients.GetSlotCount(); ++iClient )
 					{
-						array_LobbyIDs[i] = it->first;
-						i++;
+						if ( IsConnected( iClient ) )
+							SendStringToClient( pInfo->m_hConn, m_Clients.Get( iClient ).m_szNick ); 
 					}
-					SendTypedMessage(pIncomingMsg->m_conn, array_LobbyIDs, (uint32)(sizeof(HLobbyID)*m_mapLobbies.size()), k_nSteamNetworkingSend_Reliable, nullptr, lobby_list, m_pInterface);
-					delete[] array_LobbyIDs;
 				}
+
+				// Let everybody else know who they are for now
+				snprintf( temp, sizeof(temp), "Hark!  A stranger hath joined this merry host.  For now we shall call them '%s'", nick ); 
+				SendStringToAllClients( temp, pInfo->m_hConn ); 
+
+				// Add them to the client list.  Clients that run through Steam tell us
+				// their Steam ID, which is what their profile is stored under.
+				int iClient = m_Clients.Add( pInfo->m_hConn );
+				m_RateLimiter.Reset( iClient, SteamNetworkingUtils()->GetLocalTimestamp() );
+				SetClientNick( pInfo->m_hConn, nick );
+				LoadClientProfile( iClient, pInfo->m_info.m_identityRemote.GetSteamID64() );
+
+				// Until they measure the game servers we don't know where they are
+				if ( iClient < (int)m_vecClientPings.size() )
+					m_vecClientPings[ iClient ].clear();
+				SendGameServerList( pInfo->m_hConn );
+				break;
+			}
+
+			case k_ESteamNetworkingConnectionState_Connected:
+				// We will get a callback immediately after accepting the connection.
+				// Since we are the server, we can ignore this, it's not news to us.
+				break;
+
+			default:
+				// Silences -Wswitch
+				break;
+		}
+	}
+
+	static ChatServer *s_pCallbackInstance;
+	static void SteamNetConnectionStatusChangedCallback( SteamNetConnectionStatusChangedCallback_t *pInfo )
+	{
+		s_pCallbackInstance->OnSteamNetConnectionStatusChanged( pInfo );
+	}
+	
+	void RunCallBacks()
+	{
+		s_pCallbackInstance = this;
+		m_pInterface->RunCallbacks();
+	}
+};
+
+ChatServer *ChatServer::s_pCallbackInstance = nullptr;
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// ChatClient
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class ChatClient
+{
+public:
+	void Run( const SteamNetworkingIPAddr &serverAddr )
+	{
+		// Select instance to use.  For now we'll always use the default.
+		m_pInterface = SteamNetworkingSockets();
+
+		// Start connecting
+		char szAddr[ SteamNetworkingIPAddr::k_cchMaxString ];
+		serverAddr.ToString( szAddr, sizeof(szAddr), true );
+		Printf( "Connecting to chat server at %s", szAddr );
+		SteamNetworkingConfigValue_t opt;
+		opt.SetPtr( k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback );
+		//opt.SetInt32(k_ESteamNetworkingConfig_IP_AllowWithoutAuth, 1);
+		//opt.SetInt32(k_ESteamNetworkingConfig_Unencrypted, 3);
+		m_hConnection = m_pInterface->ConnectByIPAddress( serverAddr, 1, &opt );
+		if ( m_hConnection == k_HSteamNetConnection_Invalid )
+			FatalError( "Failed to create connection" );
+
+		IdleBackoff idle( g_MainLoopWakeup );
+		while ( !g_bQuit )
+		{
+			bool bDidWork = PollIncomingMessages();
+			RunCallBacks();
+			bDidWork |= PollLocalUserInput();
+			idle.Update( bDidWork );
+		}
+	}
+private:
+
+	HSteamNetConnection m_hConnection;
+	ISteamNetworkingSockets *m_pInterface;
+
+	bool PollIncomingMessages()
+	{
+		bool bGotMessages = false;
+		while ( !g_bQuit )
+		{
+			ISteamNetworkingMessage *pIncomingMsg = nullptr;
+			int numMsgs = m_pInterface->ReceiveMessagesOnConnection( m_hConnection, &pIncomingMsg, 1 );
+			if ( numMsgs == 0 )
+				break;
+			if ( numMsgs < 0 )
+				FatalError( "Error checking for messages" );
+			bGotMessages = true;
+
+			MessageView msg( pIncomingMsg );
+			if ( msg.m_eType == message_batch )
+			{
+				uint32 nOffset = 0;
+				const uint8 *pData;
+				uint32 cbData;
+				while ( ReadBatchedMessage( msg, nOffset, pData, cbData ) )
+					OnMessage( MessageView( msg.m_hConn, pData, cbData ) );
 			}
-			if (DetermineMessageType(pIncomingMsg) == request_create_lobby)
-			{
-				Lobby temp_lobby;
-				Player temp_player;
-				temp_player.m_Client = m_mapClients.find(pIncomingMsg->m_conn)->second;
-				temp_lobby.m_mapPlayers.insert(std::pair<HSteamNetConnection, Player>(pIncomingMsg->m_conn, temp_player));
-				srand((unsigned int)time(0));
-				HLobbyID temp_id = rand();
-				m_mapLobbies.insert(std::pair<HLobbyID, Lobby>(temp_id, temp_lobby));
-				SendTypedMessage(pIncomingMsg->m_conn, &temp_id, sizeof(temp_id), k_nSteamNetworkingSend_Reliable, nullptr, message_save_lobby_id_on_create, m_pInterface);
-				Printf("LOBBY %u CREATED\n", temp_id);
-				Printf("HOST %s JOINED LOBBY\n", m_mapClients[pIncomingMsg->m_conn].m_sNick.c_str());
-				PrintLobby(temp_id);
-			}
-			if (DetermineMessageType(pIncomingMsg) == request_join_lobby)
-			{
-				void* temp_lobbyid;
-				RemoveFirstByte(&temp_lobbyid, pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-				HLobbyID lobby_to_join = *(HLobbyID*)temp_lobbyid;
-				delete temp_lobbyid;
-				Player temp_player;
-				temp_player.m_Client = m_mapClients.find(pIncomingMsg->m_conn)->second;
-				m_mapLobbies[lobby_to_join].m_mapPlayers.insert(std::pair<HSteamNetConnection, Player>(pIncomingMsg->m_conn, temp_player));
-				SendTypedMessage(pIncomingMsg->m_conn, &lobby_to_join, sizeof(lobby_to_join), k_nSteamNetworkingSend_Reliable, nullptr, message_save_lobby_id, m_pInterface);
-				Printf("PLAYER %s JOINED LOBBY\n", m_mapClients[pIncomingMsg->m_conn].m_sNick.c_str());
-				PrintLobby(lobby_to_join);
-				if(m_mapLobbies[lobby_to_join].m_mapPlayers.size() == iNumOfPlayersToStartGame)
-					m_hFullLobby = lobby_to_join;
-			}
-			if (DetermineMessageType(pIncomingMsg) == request_echo)
-			{
-				void* temp_lobbyid;
-				RemoveFirstByte(&temp_lobbyid, pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-				HLobbyID lobby_to_join = *(HLobbyID*)temp_lobbyid;
-				delete temp_lobbyid;
-				SendTypedMessage(pIncomingMsg->m_conn, &lobby_to_join, sizeof(lobby_to_join), k_nSteamNetworkingSend_Reliable, nullptr, message_echo, m_pInterface);
-				Printf("Echoed: %u\n", lobby_to_join);
-			}
-			if (DetermineMessageType(pIncomingMsg) == request_leave_lobby)
-			{
-				RemovePlayerFromLobby(pIncomingMsg->m_conn);
-			}
-			if (DetermineMessageType(pIncomingMsg) == request_lobby_data)
-			{
-				void* temp_lobbyid;
-				RemoveFirstByte(&temp_lobbyid, pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-				HLobbyID lobby_id = *(HLobbyID*)temp_lobbyid;
-				delete temp_lobbyid;
-				LobbyData l_lobby_data;
-				l_lobby_data.m_hLobbyID = lobby_id;
-				l_lobby_data.m_bTeamDM = m_mapLobbies[lobby_id].m_bTeamDM;
-				l_lobby_data.m_map = m_mapLobbies[lobby_id].m_map;
-				SendTypedMessage(pIncomingMsg->m_conn, &l_lobby_data, sizeof(l_lobby_data), k_nSteamNetworkingSend_Reliable, nullptr, lobby_data, m_pInterface);
-				Printf("LOBBY: %u METADATA WAS SENT\n", lobby_id);
-			}
-			if (DetermineMessageType(pIncomingMsg) == lobby_data)
-			{
-				void* temp_lobby_data;
-				RemoveFirstByte(&temp_lobby_data, pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-				LobbyData l_lobby_data = *(LobbyData*)temp_lobby_data;
-				delete temp_lobby_data;
-				m_mapLobbies[l_lobby_data.m_hLobbyID].m_bTeamDM = l_lobby_data.m_bTeamDM;
-				m_mapLobbies[l_lobby_data.m_hLobbyID].m_map = l_lobby_data.m_map;
-				Printf("SET LOBBY: %u METADATA\n", l_lobby_data.m_hLobbyID);
-				PrintLobby(l_lobby_data.m_hLobbyID);
-			}
-			
+			else
+			{
+				OnMessage( msg );
+			}
+
 			// We don't need this anymore.
 			pIncomingMsg->Release();
 		}
+		return bGotMessages;
+	}
+
+	void OnMessage( const MessageView &msg )
+	{
+		if (msg.m_eType == chat_message)
+		{
+			// Just echo anything we get from the server
+			fwrite(msg.GetString(), 1, msg.GetStringLength(), stdout);
+			fputc('\n', stdout);
+		}
 	}
 
-	void PollLocalUserInput()
+	bool PollLocalUserInput()
 	{
 		std::string cmd;
+		bool bGotInput = false;
 		while ( !g_bQuit && LocalUserInput_GetNext( cmd ))
 		{
+			bGotInput = true;
+
+			// Check for known commands
 			if ( strcmp( cmd.c_str(), "/quit" ) == 0 )
 			{
 				g_bQuit = true;
-				Printf( "Shutting down server" );
-				break;
-			}
-			if (strncmp(cmd.c_str(), "/num_s", 6) == 0)
-			{
-				const char *temp_num_s = cmd.c_str() + 6;
-				iNumOfPlayersToStartGame = (int)strtol(temp_num_s, nullptr, 10);
-				Printf("Number of players in a lobby requered for the game to start: %i\n", iNumOfPlayersToStartGame);
-				break;
-			}
-			if (strncmp(cmd.c_str(), "/game_sip", 9) == 0)
-			{
-				const char *temp_game_sip = cmd.c_str() + 9;
-				while (isspace(*temp_game_sip))
-					++temp_game_sip;
-				
-				SteamNetworkingIPAddr addrServer; addrServer.Clear();
-				
-				if ( addrServer.IsIPv6AllZeros() )
-				{
-					if ( !addrServer.ParseString( temp_game_sip ) )
-					{
-						Printf( "Invalid GAME server address '%s'", temp_game_sip );
-						break;
-					}
-					if ( addrServer.m_port == 0 )
-						addrServer.m_port = 27015;
-				}
-				
-				char szAddr[ SteamNetworkingIPAddr::k_cchMaxString ];
-				addrServer.ToString( szAddr, sizeof(szAddr), false );
-				srcon_addr addr_struct;
-				addr_struct.addr = szAddr;
-				addr_struct.pass = "123";
-				addr_struct.port = addrServer.m_port;
-				
-				m_vGameServers.push_back(addr_struct);
-				Printf("Game Server IP: %s:%i\n", m_vGameServers.front().addr.c_str(), m_vGameServers.front().port);
+				Printf( "Disconnecting from chat server" );
+
+				// Close the connection gracefully.
+				// We use linger mode to ask for any remaining reliable data
+				// to be flushed out.  But remember this is an application
+				// protocol on UDP.  See ShutdownSteamDatagramConnectionSockets
+				m_pInterface->CloseConnection( m_hConnection, 0, "Goodbye", true );
 				break;
 			}
-			if (strncmp(cmd.c_str(), "/print_lobbies", 14) == 0)
+
+			// Anything else, just send it to the server and let them parse it
+			if (cmd.length() > (size_t)k_cchMaxChatMessage)
 			{
-				PrintLobbyList();
-				break;
+				Printf("Too long, the server only takes %d characters\n", k_cchMaxChatMessage);
+				continue;
 			}
-
-			Printf( "Possible commands:\n'/quit' (shutdown the server)\n'/num_s' (number of players in a lobby required to start the game)\n'/game_sip' (IP of the game server)\n'/print_lobbies' (print all of the lobbies)" );
+			SendTypedMessage(m_hConnection, cmd.c_str(), (uint32)cmd.length(), k_nSteamNetworkingSend_Reliable, nullptr, chat_message, m_pInterface);
 		}
-	}
-
-	void SetClientNick( HSteamNetConnection hConn, const char *nick )
-	{
-
-		// Remember their nick
-		m_mapClients[hConn].m_sNick = nick;
-
-		// Set the connection name, too, which is useful for debugging
-		m_pInterface->SetConnectionName( hConn, nick );
+		return bGotInput;
 	}
 
 	void OnSteamNetConnectionStatusChanged( SteamNetConnectionStatusChangedCallback_t *pInfo )
 	{
-		char temp[1024];
+		assert( pInfo->m_hConn == m_hConnection || m_hConnection == k_HSteamNetConnection_Invalid );
 
 		// What's the state of the connection?
 		switch ( pInfo->m_info.m_eState )
@@ -634,51 +4556,23 @@ private:
 			case k_ESteamNetworkingConnectionState_ClosedByPeer:
 			case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
 			{
-				// Ignore if they were not previously connected.  (If they disconnected
-				// before we accepted the connection.)
-				if ( pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connected )
-				{
-
-					// Locate the client.  Note that it should have been found, because this
-					// is the only codepath where we remove clients (except on shutdown),
-					// and connection change callbacks are dispatched in queue order.
-					auto itClient = m_mapClients.find( pInfo->m_hConn );
-					assert( itClient != m_mapClients.end() );
-
-					// Select appropriate log messages
-					const char *pszDebugLogAction;
-					if ( pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ProblemDetectedLocally )
-					{
-						pszDebugLogAction = "problem detected locally";
-						sprintf( temp, "Alas, %s hath fallen into shadow.  (%s)", itClient->second.m_sNick.c_str(), pInfo->m_info.m_szEndDebug );
-					}
-					else
-					{
-						// Note that here we could check the reason code to see if
-						// it was a "usual" connection or an "unusual" one.
-						pszDebugLogAction = "closed by peer";
-						sprintf( temp, "%s hath departed", itClient->second.m_sNick.c_str() );
-					}
-
-					// Spew something to our own log.  Note that because we put their nick
-					// as the connection description, it will show up, along with their
-					// transport-specific data (e.g. their IP address)
-					Printf( "Connection %s %s, reason %d: %s\n",
-						pInfo->m_info.m_szConnectionDescription,
-						pszDebugLogAction,
-						pInfo->m_info.m_eEndReason,
-						pInfo->m_info.m_szEndDebug
-					);
-
-					RemovePlayerFromLobby(pInfo->m_hConn);
-					m_mapClients.erase( itClient );
+				g_bQuit = true;
 
-					// Send a message so everybody else knows what happened
-					SendStringToAllClients( temp );
+				// Print an appropriate message
+				if ( pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connecting )
+				{
+					// Note: we could distinguish between a timeout, a rejected connection,
+					// or some other transport problem.
+					Printf( "We sought the remote host, yet our efforts were met with defeat.  (%s)", pInfo->m_info.m_szEndDebug );
+				}
+				else if ( pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ProblemDetectedLocally )
+				{
+					Printf( "Alas, troubles beset us; we have lost contact with the host.  (%s)", pInfo->m_info.m_szEndDebug );
 				}
 				else
 				{
-					assert( pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connecting );
+					// NOTE: We could check the reason code for a normal disconnection
+					Printf( "The host hath bidden us farewell.  (%s)", pInfo->m_info.m_szEndDebug );
 				}
 
 				// Clean up the connection.  This is important!
@@ -688,247 +4582,580 @@ private:
 				// and we cannot linger because it's already closed on the other end,
 				// so we just pass 0's.
 				m_pInterface->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
+				m_hConnection = k_HSteamNetConnection_Invalid;
 				break;
 			}
 
 			case k_ESteamNetworkingConnectionState_Connecting:
+				// We will get this callback when we start connecting.
+				// We can ignore this.
+				break;
+
+			case k_ESteamNetworkingConnectionState_Connected:
+				Printf( "Connected to server OK" );
+				break;
+
+			default:
+				// Silences -Wswitch
+				break;
+		}
+	}
+
+	static ChatClient *s_pCallbackInstance;
+	static void SteamNetConnectionStatusChangedCallback( SteamNetConnectionStatusChangedCallback_t *pInfo )
+	{
+		s_pCallbackInstance->OnSteamNetConnectionStatusChanged( pInfo );
+	}
+
+	void RunCallBacks()
+	{
+		s_pCallbackInstance = this;
+		m_pInterface->RunCallbacks();
+	}
+};
+
+ChatClient *ChatClient::s_pCallbackInstance = nullptr;
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// LoadGenerator
+//
+// Headless stand-in for a crowd of players, for benchmarking the server.
+// Every simulated client connects, picks a nick, searches for a match on a
+// random map and gamemode, and then either waits to be sent to a game
+// server or changes its mind and leaves the lobby.  Either way it
+// disconnects afterwards.  Clients arrive at random at the given average
+// rate, seeded so two runs with the same options do the same thing.
+//
+// Players are only ever sent to a game server if the server has one, so
+// without any the start game numbers stay empty and clients give up after
+// --wait seconds.
+//
+// Given the addresses of several nodes of a cluster, clients take turns
+// connecting to each of them, and follow the redirects the nodes send when
+// they move players between each other.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+struct LoadGenOptions
+{
+	LoadGenOptions()
+	{
+		m_nClients = 1000;
+		m_flRate = 100.0f;
+		m_nCancelPercent = 20;
+		m_nWaitSec = 30;
+		m_nDurationSec = 0;
+		m_nSeed = 1;
+		m_nServerPID = 0;
+	}
+
+	int m_nClients;			// how many clients to run through in total
+	float m_flRate;			// average new clients per second
+	int m_nCancelPercent;	// chance a client leaves the queue or its lobby instead of waiting
+	int m_nWaitSec;			// how long a client waits for a game server before giving up
+	int m_nDurationSec;		// stop after this long even if clients are still running, 0 for no limit
+	int m_nSeed;
+	int m_nServerPID;		// server process to measure CPU time of, 0 for none
+};
+
+// Total user and system CPU time of a process, false if we can't tell
+static bool GetProcessCPUTime( int nPID, double &flSeconds )
+{
+#ifdef __linux__
+	char szPath[ 64 ];
+	sprintf( szPath, "/proc/%d/stat", nPID );
+	FILE *f = fopen( szPath, "r" );
+	if ( !f )
+		return false;
+	char szStat[ 1024 ];
+	size_t cbStat = fread( szStat, 1, sizeof(szStat) - 1, f );
+	fclose( f );
+	szStat[ cbStat ] = '\0';
+
+	// The process name can have spaces in it, the fields we want come after its closing parenthesis
+	const char *pszFields = strrchr( szStat, ')' );
+	unsigned long long nUserTicks, nSystemTicks;
+	if ( !pszFields || sscanf( pszFields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &nUserTicks, &nSystemTicks ) != 2 )
+		return false;
+	flSeconds = (double)( nUserTicks + nSystemTicks ) / sysconf( _SC_CLK_TCK );
+	return true;
+#else
+	return false;
+#endif
+}
+
+class LoadGenerator
+{
+public:
+	void Run( const std::vector< SteamNetworkingIPAddr > &vecServers, const LoadGenOptions &options )
+	{
+		m_pInterface = SteamNetworkingSockets();
+		m_vecServers = vecServers;
+		m_options = options;
+		m_rand.seed( options.m_nSeed );
+		m_nLaunched = 0;
+		m_nActive = 0;
+		m_nRedirects = 0;
+		memset( m_nCounts, 0, sizeof(m_nCounts) );
+
+		m_hPollGroup = m_pInterface->CreatePollGroup();
+		if ( m_hPollGroup == k_HSteamNetPollGroup_Invalid )
+			FatalError( "Failed to create poll group" );
+
+		char szAddr[ SteamNetworkingIPAddr::k_cchMaxString ];
+		vecServers.front().ToString( szAddr, sizeof(szAddr), true );
+		if ( vecServers.size() > 1 )
+			Printf( "Running %d clients against %d servers starting with %s, %.1f per second\n", options.m_nClients, (int)vecServers.size(), szAddr, options.m_flRate );
+		else
+			Printf( "Running %d clients against %s, %.1f per second\n", options.m_nClients, szAddr, options.m_flRate );
+
+		double flServerCPUStart = 0.0;
+		bool bServerCPU = options.m_nServerPID > 0 && GetProcessCPUTime( options.m_nServerPID, flServerCPUStart );
+		if ( options.m_nServerPID > 0 && !bServerCPU )
+			Printf( "Can't read CPU time of process %d, server CPU won't be reported\n", options.m_nServerPID );
+		clock_t clockStart = clock();
+
+		SteamNetworkingMicroseconds usecStart = SteamNetworkingUtils()->GetLocalTimestamp();
+		SteamNetworkingMicroseconds usecEnd = options.m_nDurationSec > 0 ? usecStart + options.m_nDurationSec * 1000000LL : 0;
+		m_usecNextArrival = usecStart;
+
+		IdleBackoff idle( g_MainLoopWakeup );
+		while ( !g_bQuit )
+		{
+			SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+			if ( usecEnd && usecNow >= usecEnd )
 			{
-				// This must be a new connection
-				assert( m_mapClients.find( pInfo->m_hConn ) == m_mapClients.end() );
+				Printf( "Time is up, disconnecting %d clients that are still running\n", m_nActive );
+				break;
+			}
+			if ( m_nLaunched == options.m_nClients && m_nActive == 0 )
+				break;
 
-				Printf( "Connection request from %s", pInfo->m_info.m_szConnectionDescription );
+			bool bDidWork = LaunchClients( usecNow );
+			bDidWork |= PollIncomingMessages();
+			RunCallBacks();
+			bDidWork |= RunTimers( usecNow );
+			bDidWork |= PollLocalUserInput();
+			idle.Update( bDidWork );
+		}
 
-				// A client is attempting to connect
-				// Try to accept the connection.
-				if ( m_pInterface->AcceptConnection( pInfo->m_hConn ) != k_EResultOK )
+		SteamNetworkingMicroseconds usecElapsed = SteamNetworkingUtils()->GetLocalTimestamp() - usecStart;
+		double flServerCPUEnd;
+		bServerCPU = bServerCPU && GetProcessCPUTime( options.m_nServerPID, flServerCPUEnd );
+		double flLoadGenCPU = (double)( clock() - clockStart ) / CLOCKS_PER_SEC;
+
+		for ( SimClient &client: m_vecClients )
+		{
+			if ( client.m_hConn != k_HSteamNetConnection_Invalid )
+				Disconnect( client, "Load test over" );
+		}
+		m_pInterface->DestroyPollGroup( m_hPollGroup );
+		m_hPollGroup = k_HSteamNetPollGroup_Invalid;
+
+		PrintReport( usecElapsed );
+		if ( bServerCPU )
+			Printf( "Server CPU: %.2f s, %.1f%% of one core\n", flServerCPUEnd - flServerCPUStart, ( flServerCPUEnd - flServerCPUStart ) * 1e8 / usecElapsed );
+		Printf( "Load generator CPU: %.2f s, %.1f%% of one core\n", flLoadGenCPU, flLoadGenCPU * 1e8 / usecElapsed );
+	}
+
+private:
+	enum SimState
+	{
+		sim_connecting,
+		sim_searching,		// find match sent, waiting for a lobby
+		sim_in_lobby,		// waiting for a game server
+		sim_done
+	};
+
+	enum SimOutcome
+	{
+		outcome_started,	// got sent to a game server
+		outcome_cancelled,	// left the lobby on purpose
+		outcome_timed_out,	// gave up waiting for a game server
+		outcome_failed,		// couldn't connect, got dropped, or the server refused the search
+		num_outcomes
+	};
+
+	struct SimClient
+	{
+		HSteamNetConnection m_hConn;
+		SimState m_eState;
+		bool m_bCancel;
+		bool m_bMoving;		// redirected to another node, resuming there
+		uint64 m_nResumeToken;
+		SteamNetworkingMicroseconds m_usecConnectStarted;
+		SteamNetworkingMicroseconds m_usecFindSent;
+	};
+
+	// Something a client wants to do later, soonest first
+	struct SimTimer
+	{
+		SteamNetworkingMicroseconds m_usecWhen;
+		int m_iClient;
+		SimState m_eState;	// only fires if the client is still in this state
+		bool operator<( const SimTimer &other ) const { return m_usecWhen > other.m_usecWhen; }
+	};
+
+	ISteamNetworkingSockets *m_pInterface;
+	HSteamNetPollGroup m_hPollGroup;
+	std::vector< SteamNetworkingIPAddr > m_vecServers;
+	LoadGenOptions m_options;
+	std::mt19937 m_rand;
+
+	std::vector< SimClient > m_vecClients;
+	FlatHashMap< int > m_mapConnections;
+	std::priority_queue< SimTimer > m_queueTimers;
+	SteamNetworkingMicroseconds m_usecNextArrival;
+	int m_nLaunched;
+	int m_nActive;
+	int m_nRedirects;
+	int m_nCounts[ num_outcomes ];
+
+	// Microseconds from starting to connect to being connected, from sending
+	// find match to getting a lobby, and from sending find match to being sent
+	// to a game server
+	std::vector< SteamNetworkingMicroseconds > m_vecConnectTimes;
+	std::vector< SteamNetworkingMicroseconds > m_vecJoinTimes;
+	std::vector< SteamNetworkingMicroseconds > m_vecStartTimes;
+
+	float RandomFloat()
+	{
+		return std::uniform_real_distribution< float >( 0.0f, 1.0f )( m_rand );
+	}
+
+	bool LaunchClients( SteamNetworkingMicroseconds usecNow )
+	{
+		bool bDidWork = false;
+		while ( m_nLaunched < m_options.m_nClients && usecNow >= m_usecNextArrival )
+		{
+			// Exponential gaps between arrivals
+			float flGap = -logf( 1.0f - RandomFloat() * 0.999999f ) / m_options.m_flRate;
+			m_usecNextArrival += (SteamNetworkingMicroseconds)( flGap * 1e6f );
+			bDidWork = true;
+
+			// Every node of a cluster gets its share
+			const SteamNetworkingIPAddr &serverAddr = m_vecServers[ m_nLaunched % m_vecServers.size() ];
+			++m_nLaunched;
+
+			SimClient client;
+			client.m_eState = sim_connecting;
+			client.m_bCancel = (int)( m_rand() % 100 ) < m_options.m_nCancelPercent;
+			client.m_bMoving = false;
+			client.m_nResumeToken = 0;
+			client.m_usecConnectStarted = usecNow;
+			client.m_usecFindSent = 0;
+			client.m_hConn = Connect( serverAddr );
+			if ( client.m_hConn == k_HSteamNetConnection_Invalid )
+			{
+				++m_nCounts[ outcome_failed ];
+				continue;
+			}
+
+			int iClient = (int)m_vecClients.size();
+			m_vecClients.push_back( client );
+			m_mapConnections.Insert( client.m_hConn, iClient );
+			++m_nActive;
+		}
+		return bDidWork;
+	}
+
+	HSteamNetConnection Connect( const SteamNetworkingIPAddr &serverAddr )
+	{
+		SteamNetworkingConfigValue_t opt;
+		opt.SetPtr( k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback );
+		HSteamNetConnection hConn = m_pInterface->ConnectByIPAddress( serverAddr, 1, &opt );
+		if ( hConn != k_HSteamNetConnection_Invalid )
+			m_pInterface->SetConnectionPollGroup( hConn, m_hPollGroup );
+		return hConn;
+	}
+
+	bool PollIncomingMessages()
+	{
+		ISteamNetworkingMessage *pIncomingMsgs[ 256 ];
+		bool bGotMessages = false;
+		while ( !g_bQuit )
+		{
+			int numMsgs = m_pInterface->ReceiveMessagesOnPollGroup( m_hPollGroup, pIncomingMsgs, 256 );
+			if ( numMsgs == 0 )
+				break;
+			if ( numMsgs < 0 )
+				FatalError( "Error checking for messages" );
+			bGotMessages = true;
+
+			SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+			for ( int i = 0; i < numMsgs; ++i )
+			{
+				MessageView msg( pIncomingMsgs[ i ] );
+				int *piClient = m_mapConnections.Find( msg.m_hConn );
+				if ( piClient && msg.m_eType == message_batch )
 				{
-					// This could fail.  If the remote host tried to connect, but then
-					// disconnected, the connection may already be half closed.  Just
-					// destroy whatever we have on our side.
-					m_pInterface->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
-					Printf( "Can't accept connection.  (It was already closed?)" );
-					break;
+					uint32 nOffset = 0;
+					const uint8 *pData;
+					uint32 cbData;
+					while ( ReadBatchedMessage( msg, nOffset, pData, cbData ) )
+						OnMessage( m_vecClients[ *piClient ], *piClient, MessageView( msg.m_hConn, pData, cbData ), usecNow );
 				}
-
-				// Assign the poll group
-				if ( !m_pInterface->SetConnectionPollGroup( pInfo->m_hConn, m_hPollGroup ) )
+				else if ( piClient && msg.IsValid() )
 				{
-					m_pInterface->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
-					Printf( "Failed to set poll group?" );
-					break;
+					OnMessage( m_vecClients[ *piClient ], *piClient, msg, usecNow );
 				}
+				pIncomingMsgs[ i ]->Release();
+			}
+		}
+		return bGotMessages;
+	}
 
-				// Generate a random nick.  A random temporary nick
-				// is really dumb and not how you would write a real chat server.
-				// You would want them to have some sort of signon message,
-				// and you would keep their client in a state of limbo (connected,
-				// but not logged on) until them.  I'm trying to keep this example
-				// code really simple.
-				char nick[ 64 ];
-				sprintf( nick, "HL2_DM_Player%d", 10000 + ( rand() % 100000 ) );
+	void OnMessage( SimClient &client, int iClient, const MessageView &msg, SteamNetworkingMicroseconds usecNow )
+	{
+		switch ( msg.m_eType )
+		{
+			case message_save_lobby_id:
+				if ( client.m_eState != sim_searching )
+					break;
+				m_vecJoinTimes.push_back( usecNow - client.m_usecFindSent );
+				client.m_eState = sim_in_lobby;
+				AddTimer( iClient, sim_in_lobby, client.m_bCancel ? usecNow + (SteamNetworkingMicroseconds)( RandomFloat() * 2e6f ) : usecNow + m_options.m_nWaitSec * 1000000LL );
+				break;
 
-				// Send them a welcome message
-				sprintf( temp, "Welcome, stranger.  Thou art known to us for now as '%s'; upon thine command '/nick' we shall know thee otherwise.", nick ); 
-				SendStringToClient( pInfo->m_hConn, temp ); 
+			case message_start_game:
+				// Straight from the queue if a running match had room
+				if ( client.m_eState != sim_in_lobby && client.m_eState != sim_searching )
+					break;
+				m_vecStartTimes.push_back( usecNow - client.m_usecFindSent );
+				Finish( client, outcome_started, client.m_eState == sim_searching ? "Joining a match in progress" : "Off to the game server" );
+				break;
 
-				// Also send them a list of everybody who is already connected
-				if ( m_mapClients.empty() )
-				{
-					SendStringToClient( pInfo->m_hConn, "Thou art utterly alone." ); 
-				}
-				else
+			case message_no_suitable_lobbies:
+				if ( client.m_eState == sim_searching )
+					Finish( client, outcome_failed, "Search refused" );
+				break;
+
+			case message_redirect:
+			{
+				// Another node of the cluster has our place now, we pick it up over there
+				RedirectData redirect;
+				if ( client.m_eState == sim_done || !msg.Read( redirect ) )
+					break;
+				SteamNetworkingIPAddr addr;
+				addr.SetIPv6( redirect.m_ipv6, redirect.m_nPort );
+				client.m_nResumeToken = redirect.m_nResumeToken;
+				m_mapConnections.Remove( client.m_hConn );
+				m_pInterface->CloseConnection( client.m_hConn, 0, "Moving to another node", false );
+				client.m_hConn = Connect( addr );
+				if ( client.m_hConn == k_HSteamNetConnection_Invalid )
 				{
-					sprintf( temp, "%d companions greet you:", (int)m_mapClients.size() ); 
-					for ( auto &c: m_mapClients )
-						SendStringToClient( pInfo->m_hConn, c.second.m_sNick.c_str() ); 
+					Finish( client, outcome_failed, nullptr );
+					break;
 				}
+				m_mapConnections.Insert( client.m_hConn, iClient );
+				client.m_bMoving = true;
+				++m_nRedirects;
+				break;
+			}
 
-				// Let everybody else know who they are for now
-				sprintf( temp, "Hark!  A stranger hath joined this merry host.  For now we shall call them '%s'", nick ); 
-				SendStringToAllClients( temp, pInfo->m_hConn ); 
-
-				// Add them to the client list, using std::map wacky syntax
-				m_mapClients[ pInfo->m_hConn ];
-				SetClientNick( pInfo->m_hConn, nick );
+			case message_resume_result:
+			{
+				uint32 nResult;
+				if ( !client.m_bMoving || !msg.Read( nResult ) )
+					break;
+				client.m_bMoving = false;
+				if ( nResult != resume_lobby && nResult != resume_queued )
+					Finish( client, outcome_failed, "Lost our place" );
 				break;
 			}
 
-			case k_ESteamNetworkingConnectionState_Connected:
-				// We will get a callback immediately after accepting the connection.
-				// Since we are the server, we can ignore this, it's not news to us.
+			case game_server_list:
+			{
+				// Pretend to be somewhere between next door and the other side of
+				// the world from each server, so the server has pings to pick by
+				std::vector< GameServerPing > vecPings( msg.Count< GameServerPing >() );
+				for ( uint32 i = 0; i < vecPings.size(); ++i )
+				{
+					msg.ReadElement( i, vecPings[ i ] );
+					vecPings[ i ].m_nPingMS = (uint16)( 10 + RandomFloat() * 190 );
+				}
+				if ( !vecPings.empty() )
+					SendWireArray( client.m_hConn, vecPings.data(), (uint32)vecPings.size(), k_nSteamNetworkingSend_Reliable, game_server_pings, m_pInterface );
 				break;
+			}
 
 			default:
-				// Silences -Wswitch
+				// Chat and everything else is of no interest to us
 				break;
 		}
 	}
 
-	static ChatServer *s_pCallbackInstance;
-	static void SteamNetConnectionStatusChangedCallback( SteamNetConnectionStatusChangedCallback_t *pInfo )
+	void AddTimer( int iClient, SimState eState, SteamNetworkingMicroseconds usecWhen )
 	{
-		s_pCallbackInstance->OnSteamNetConnectionStatusChanged( pInfo );
+		SimTimer timer;
+		timer.m_usecWhen = usecWhen;
+		timer.m_iClient = iClient;
+		timer.m_eState = eState;
+		m_queueTimers.push( timer );
 	}
-	
-	void RunCallBacks()
+
+	bool RunTimers( SteamNetworkingMicroseconds usecNow )
 	{
-		s_pCallbackInstance = this;
-		m_pInterface->RunCallbacks();
+		bool bDidWork = false;
+		while ( !m_queueTimers.empty() && m_queueTimers.top().m_usecWhen <= usecNow )
+		{
+			SimTimer timer = m_queueTimers.top();
+			m_queueTimers.pop();
+			SimClient &client = m_vecClients[ timer.m_iClient ];
+			if ( client.m_eState != timer.m_eState )
+				continue;
+			bDidWork = true;
+
+			if ( client.m_bCancel )
+			{
+				SendOnlyMessageType( client.m_hConn, k_nSteamNetworkingSend_Reliable, nullptr, request_leave_lobby, m_pInterface );
+				Finish( client, outcome_cancelled, "Changed my mind" );
+			}
+			else
+			{
+				Finish( client, outcome_timed_out, "Tired of waiting" );
+			}
+		}
+		return bDidWork;
 	}
-};
 
-ChatServer *ChatServer::s_pCallbackInstance = nullptr;
+	void OnConnected( SimClient &client, SteamNetworkingMicroseconds usecNow )
+	{
+		m_vecConnectTimes.push_back( usecNow - client.m_usecConnectStarted );
 
-/////////////////////////////////////////////////////////////////////////////
-//
-// ChatClient
-//
-/////////////////////////////////////////////////////////////////////////////
+		// Built along with the server, so we don't wait for its hello before talking
+		HelloData hello;
+		hello.m_nVersion = k_nProtocolVersion;
+		hello.m_nMinVersion = k_nMinProtocolVersion;
+		SendWireMessage( client.m_hConn, hello, k_nSteamNetworkingSend_Reliable, message_hello, m_pInterface );
 
-class ChatClient
-{
-public:
-	void Run( const SteamNetworkingIPAddr &serverAddr )
-	{
-		// Select instance to use.  For now we'll always use the default.
-		m_pInterface = SteamNetworkingSockets();
+		char szNick[ 64 ];
+		sprintf( szNick, "/nick LoadGen%d", (int)( &client - &m_vecClients[0] ) );
+		SendTypedMessage( client.m_hConn, szNick, (uint32)strlen( szNick ), k_nSteamNetworkingSend_Reliable, nullptr, chat_message, m_pInterface );
 
-		// Start connecting
-		char szAddr[ SteamNetworkingIPAddr::k_cchMaxString ];
-		serverAddr.ToString( szAddr, sizeof(szAddr), true );
-		Printf( "Connecting to chat server at %s", szAddr );
-		SteamNetworkingConfigValue_t opt;
-		opt.SetPtr( k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback );
-		//opt.SetInt32(k_ESteamNetworkingConfig_IP_AllowWithoutAuth, 1);
-		//opt.SetInt32(k_ESteamNetworkingConfig_Unencrypted, 3);
-		m_hConnection = m_pInterface->ConnectByIPAddress( serverAddr, 1, &opt );
-		if ( m_hConnection == k_HSteamNetConnection_Invalid )
-			FatalError( "Failed to create connection" );
+		FindMatchData find_data;
+		find_data.m_map = (HL2DM_Map)( m_rand() % invalid_map );
+		find_data.m_bTeamDM = (char)( m_rand() % 2 );
+		client.m_usecFindSent = SteamNetworkingUtils()->GetLocalTimestamp();
+		SendWireMessage( client.m_hConn, find_data, k_nSteamNetworkingSend_Reliable, request_find_match, m_pInterface );
+		client.m_eState = sim_searching;
 
-		while ( !g_bQuit )
-		{
-			PollIncomingMessages();
-			RunCallBacks();
-			PollLocalUserInput();
-			std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
-		}
+		// Players waiting in the queue can give up too
+		int iClient = (int)( &client - &m_vecClients[0] );
+		AddTimer( iClient, sim_searching, client.m_bCancel ? usecNow + (SteamNetworkingMicroseconds)( RandomFloat() * 2e6f ) : usecNow + m_options.m_nWaitSec * 1000000LL );
 	}
-private:
 
-	HSteamNetConnection m_hConnection;
-	ISteamNetworkingSockets *m_pInterface;
+	// Picks up our place on the node we were redirected to
+	void OnMoved( SimClient &client )
+	{
+		HelloData hello;
+		hello.m_nVersion = k_nProtocolVersion;
+		hello.m_nMinVersion = k_nMinProtocolVersion;
+		SendWireMessage( client.m_hConn, hello, k_nSteamNetworkingSend_Reliable, message_hello, m_pInterface );
+		SendWireMessage( client.m_hConn, client.m_nResumeToken, k_nSteamNetworkingSend_Reliable, request_resume, m_pInterface );
+	}
 
-	void PollIncomingMessages()
+	void Finish( SimClient &client, SimOutcome eOutcome, const char *pszReason )
 	{
-		while ( !g_bQuit )
-		{
-			ISteamNetworkingMessage *pIncomingMsg = nullptr;
-			int numMsgs = m_pInterface->ReceiveMessagesOnConnection( m_hConnection, &pIncomingMsg, 1 );
-			if ( numMsgs == 0 )
-				break;
-			if ( numMsgs < 0 )
-				FatalError( "Error checking for messages" );
+		if ( client.m_eState == sim_done )
+			return;
+		++m_nCounts[ eOutcome ];
+		--m_nActive;
+		client.m_eState = sim_done;
+		Disconnect( client, pszReason );
+	}
 
-			if (DetermineMessageType(pIncomingMsg) == chat_message)
-			{
-				void* temp_str;
-				RemoveFirstByte(&temp_str, pIncomingMsg->m_pData, pIncomingMsg->m_cbSize);
-				// Just echo anything we get from the server
-				fwrite(temp_str, 1, pIncomingMsg->m_cbSize - 1, stdout);
-				fputc('\n', stdout);
-				delete temp_str;
-			}
+	void Disconnect( SimClient &client, const char *pszReason )
+	{
+		if ( client.m_hConn == k_HSteamNetConnection_Invalid )
+			return;
+		m_mapConnections.Remove( client.m_hConn );
+		m_pInterface->CloseConnection( client.m_hConn, 0, pszReason, true );
+		client.m_hConn = k_HSteamNetConnection_Invalid;
+	}
 
-			// We don't need this anymore.
-			pIncomingMsg->Release();
+	void PrintLatencies( const char *pszName, std::vector< SteamNetworkingMicroseconds > &vecTimes )
+	{
+		if ( vecTimes.empty() )
+		{
+			Printf( "%s: no samples\n", pszName );
+			return;
 		}
+		std::sort( vecTimes.begin(), vecTimes.end() );
+		size_t n = vecTimes.size();
+		Printf( "%s: %d samples, p50 %.2f ms, p99 %.2f ms, p999 %.2f ms, max %.2f ms\n", pszName, (int)n,
+			vecTimes[ n * 50 / 100 ] * 1e-3,
+			vecTimes[ n * 99 / 100 ] * 1e-3,
+			vecTimes[ n * 999 / 1000 ] * 1e-3,
+			vecTimes[ n - 1 ] * 1e-3 );
 	}
 
-	void PollLocalUserInput()
+	void PrintReport( SteamNetworkingMicroseconds usecElapsed )
+	{
+		Printf( "Ran %d clients in %.1f s: %d sent to a game server, %d cancelled, %d timed out, %d failed, %d unfinished\n",
+			m_nLaunched, usecElapsed * 1e-6,
+			m_nCounts[ outcome_started ], m_nCounts[ outcome_cancelled ], m_nCounts[ outcome_timed_out ], m_nCounts[ outcome_failed ], m_nActive );
+		if ( m_nRedirects )
+			Printf( "Redirected to another node of the cluster: %d\n", m_nRedirects );
+		PrintLatencies( "Connect", m_vecConnectTimes );
+		PrintLatencies( "Lobby join", m_vecJoinTimes );
+		PrintLatencies( "Start game", m_vecStartTimes );
+	}
+
+	bool PollLocalUserInput()
 	{
 		std::string cmd;
+		bool bGotInput = false;
 		while ( !g_bQuit && LocalUserInput_GetNext( cmd ))
 		{
-
-			// Check for known commands
+			bGotInput = true;
 			if ( strcmp( cmd.c_str(), "/quit" ) == 0 )
 			{
 				g_bQuit = true;
-				Printf( "Disconnecting from chat server" );
-
-				// Close the connection gracefully.
-				// We use linger mode to ask for any remaining reliable data
-				// to be flushed out.  But remember this is an application
-				// protocol on UDP.  See ShutdownSteamDatagramConnectionSockets
-				m_pInterface->CloseConnection( m_hConnection, 0, "Goodbye", true );
+				Printf( "Stopping load test" );
 				break;
 			}
-
-			// Anything else, just send it to the server and let them parse it
-			SendTypedMessage(m_hConnection, cmd.c_str(), (uint32)cmd.length(), k_nSteamNetworkingSend_Reliable, nullptr, chat_message, m_pInterface);
+			Printf( "Possible commands:\n'/quit' (stop the load test and print the results)" );
 		}
+		return bGotInput;
 	}
 
 	void OnSteamNetConnectionStatusChanged( SteamNetConnectionStatusChangedCallback_t *pInfo )
 	{
-		assert( pInfo->m_hConn == m_hConnection || m_hConnection == k_HSteamNetConnection_Invalid );
+		int *piClient = m_mapConnections.Find( pInfo->m_hConn );
+		if ( !piClient )
+			return;
+		SimClient &client = m_vecClients[ *piClient ];
 
-		// What's the state of the connection?
 		switch ( pInfo->m_info.m_eState )
 		{
-			case k_ESteamNetworkingConnectionState_None:
-				// NOTE: We will get callbacks here when we destroy connections.  You can ignore these.
-				break;
-
 			case k_ESteamNetworkingConnectionState_ClosedByPeer:
 			case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
-			{
-				g_bQuit = true;
-
-				// Print an appropriate message
-				if ( pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connecting )
-				{
-					// Note: we could distinguish between a timeout, a rejected connection,
-					// or some other transport problem.
-					Printf( "We sought the remote host, yet our efforts were met with defeat.  (%s)", pInfo->m_info.m_szEndDebug );
-				}
-				else if ( pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ProblemDetectedLocally )
-				{
-					Printf( "Alas, troubles beset us; we have lost contact with the host.  (%s)", pInfo->m_info.m_szEndDebug );
-				}
-				else
+				if ( client.m_eState != sim_done )
 				{
-					// NOTE: We could check the reason code for a normal disconnection
-					Printf( "The host hath bidden us farewell.  (%s)", pInfo->m_info.m_szEndDebug );
+					++m_nCounts[ outcome_failed ];
+					--m_nActive;
+					client.m_eState = sim_done;
 				}
-
-				// Clean up the connection.  This is important!
-				// The connection is "closed" in the network sense, but
-				// it has not been destroyed.  We must close it on our end, too
-				// to finish up.  The reason information do not matter in this case,
-				// and we cannot linger because it's already closed on the other end,
-				// so we just pass 0's.
+				m_mapConnections.Remove( pInfo->m_hConn );
 				m_pInterface->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
-				m_hConnection = k_HSteamNetConnection_Invalid;
-				break;
-			}
-
-			case k_ESteamNetworkingConnectionState_Connecting:
-				// We will get this callback when we start connecting.
-				// We can ignore this.
+				client.m_hConn = k_HSteamNetConnection_Invalid;
 				break;
 
 			case k_ESteamNetworkingConnectionState_Connected:
-				Printf( "Connected to server OK" );
+				if ( client.m_eState == sim_connecting )
+					OnConnected( client, SteamNetworkingUtils()->GetLocalTimestamp() );
+				else if ( client.m_bMoving )
+					OnMoved( client );
 				break;
 
 			default:
-				// Silences -Wswitch
 				break;
 		}
 	}
 
-	static ChatClient *s_pCallbackInstance;
+	static LoadGenerator *s_pCallbackInstance;
 	static void SteamNetConnectionStatusChangedCallback( SteamNetConnectionStatusChangedCallback_t *pInfo )
 	{
 		s_pCallbackInstance->OnSteamNetConnectionStatusChanged( pInfo );
@@ -941,9 +5168,12 @@ private:
 	}
 };
 
-ChatClient *ChatClient::s_pCallbackInstance = nullptr;
+LoadGenerator *LoadGenerator::s_pCallbackInstance = nullptr;
 
 const uint16 DEFAULT_SERVER_PORT = 27055;
+const uint16 DEFAULT_GAME_SERVER_PORT = 27056;
+const uint16 DEFAULT_PEER_PORT = 27057;
+const uint16 DEFAULT_STATS_PORT = 27058;
 
 void PrintUsageAndExit( int rc = 1 )
 {
@@ -951,7 +5181,13 @@ void PrintUsageAndExit( int rc = 1 )
 	printf(
 R"usage(Usage:
     mm_server client SERVER_ADDR
-    mm_server server [--port PORT]
+    mm_server loadgen SERVER_ADDR... [--clients N] [--rate PER_SEC] [--cancel PERCENT]
+                                  [--wait SEC] [--duration SEC] [--seed N] [--server-pid PID]
+    mm_server server [--port PORT] [--gs-port PORT] [--max-tick MS] [--shards N] [--debug LEVEL]
+                     [--log-file PATH] [--log-size MB] [--log-level LEVEL]
+                     [--db PATH] [--trust-steam-ids] [--snapshot PATH]
+                     [--node-id N] [--peer-port PORT] [--peer ADDR]...
+                     [--stats-port PORT]
 )usage"
 	);
 	fflush(stdout);
@@ -962,18 +5198,31 @@ int main( int argc, const char *argv[] )
 {
 	bool bServer = false;
 	bool bClient = false;
+	bool bLoadGen = false;
 	int nPort = DEFAULT_SERVER_PORT;
+	int nGameServerPort = DEFAULT_GAME_SERVER_PORT;
+	int nPeerPort = DEFAULT_PEER_PORT;
+	int nStatsPort = DEFAULT_STATS_PORT;
 	SteamNetworkingIPAddr addrServer; addrServer.Clear();
+	std::vector< SteamNetworkingIPAddr > vecLoadGenServers;
+	LoadGenOptions loadGenOptions;
+	const char *pszLogFile = nullptr;
+	int nLogFileMB = 100;
 
 	for ( int i = 1 ; i < argc ; ++i )
 	{
-		if ( !bClient && !bServer )
+		if ( !bClient && !bServer && !bLoadGen )
 		{
 			if ( !strcmp( argv[i], "client" ) )
 			{
 				bClient = true;
 				continue;
 			}
+			if ( !strcmp( argv[i], "loadgen" ) )
+			{
+				bLoadGen = true;
+				continue;
+			}
 			if ( !strcmp( argv[i], "server" ) )
 			{
 				bServer = true;
@@ -990,8 +5239,203 @@ int main( int argc, const char *argv[] )
 				FatalError( "Invalid port %d", nPort );
 			continue;
 		}
+		if ( !strcmp( argv[i], "--gs-port" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+			nGameServerPort = atoi( argv[i] );
+			if ( nGameServerPort <= 0 || nGameServerPort > 65535 )
+				FatalError( "Invalid port %d", nGameServerPort );
+			continue;
+		}
+		if ( !strcmp( argv[i], "--peer-port" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+			nPeerPort = atoi( argv[i] );
+			if ( nPeerPort <= 0 || nPeerPort > 65535 )
+				FatalError( "Invalid port %d", nPeerPort );
+			continue;
+		}
+		if ( !strcmp( argv[i], "--stats-port" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+
+			// 0 turns the stats endpoint off
+			nStatsPort = atoi( argv[i] );
+			if ( nStatsPort < 0 || nStatsPort > 65535 )
+				FatalError( "Invalid port %d", nStatsPort );
+			continue;
+		}
+		if ( !strcmp( argv[i], "--node-id" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+			int nNodeID = atoi( argv[i] );
+			if ( nNodeID < 0 || nNodeID > 65535 )
+				FatalError( "Invalid node ID %d", nNodeID );
+			g_nNodeID = (uint16)nNodeID;
+			continue;
+		}
+		if ( !strcmp( argv[i], "--peer" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+			SteamNetworkingIPAddr addrPeer; addrPeer.Clear();
+			if ( !addrPeer.ParseString( argv[i] ) )
+				FatalError( "Invalid peer address '%s'", argv[i] );
+			if ( addrPeer.m_port == 0 )
+				addrPeer.m_port = DEFAULT_PEER_PORT;
+			g_vecPeers.push_back( addrPeer );
+			continue;
+		}
+		if ( !strcmp( argv[i], "--shards" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+			g_nShards = atoi( argv[i] );
+			if ( g_nShards < 0 )
+				FatalError( "Invalid number of shards %d", g_nShards );
+			continue;
+		}
+		if ( !strcmp( argv[i], "--debug" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+			g_nDebugLevel = atoi( argv[i] );
+			continue;
+		}
+		if ( !strcmp( argv[i], "--log-file" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+			pszLogFile = argv[i];
+			continue;
+		}
+		if ( !strcmp( argv[i], "--log-size" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+			nLogFileMB = atoi( argv[i] );
+			if ( nLogFileMB < 0 )
+				FatalError( "Invalid log file size %d", nLogFileMB );
+			continue;
+		}
+		if ( !strcmp( argv[i], "--log-level" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+			LogLevel eLevel = ConvertStringToLogLevel( argv[i] );
+			if ( eLevel == num_log_levels )
+				FatalError( "Invalid log level '%s'", argv[i] );
+			g_Log.SetLevel( eLevel );
+			continue;
+		}
+		if ( !strcmp( argv[i], "--db" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+			g_pszDatabase = argv[i];
+			continue;
+		}
+		if ( !strcmp( argv[i], "--trust-steam-ids" ) )
+		{
+			g_bTrustSteamIDs = true;
+			continue;
+		}
+		if ( !strcmp( argv[i], "--snapshot" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+			g_pszSnapshot = argv[i];
+			continue;
+		}
+		if ( !strcmp( argv[i], "--max-tick" ) )
+		{
+			++i;
+			if ( i >= argc )
+				PrintUsageAndExit();
+			g_nMaxTickMS = atoi( argv[i] );
+			if ( g_nMaxTickMS <= 0 )
+				FatalError( "Invalid max tick %d", g_nMaxTickMS );
+			continue;
+		}
+
+		if ( bLoadGen && i + 1 < argc )
+		{
+			if ( !strcmp( argv[i], "--clients" ) )
+			{
+				loadGenOptions.m_nClients = atoi( argv[++i] );
+				if ( loadGenOptions.m_nClients <= 0 )
+					FatalError( "Invalid number of clients %d", loadGenOptions.m_nClients );
+				continue;
+			}
+			if ( !strcmp( argv[i], "--rate" ) )
+			{
+				loadGenOptions.m_flRate = (float)atof( argv[++i] );
+				if ( loadGenOptions.m_flRate <= 0.0f )
+					FatalError( "Invalid arrival rate %s", argv[i] );
+				continue;
+			}
+			if ( !strcmp( argv[i], "--cancel" ) )
+			{
+				loadGenOptions.m_nCancelPercent = atoi( argv[++i] );
+				if ( loadGenOptions.m_nCancelPercent < 0 || loadGenOptions.m_nCancelPercent > 100 )
+					FatalError( "Invalid cancel percentage %d", loadGenOptions.m_nCancelPercent );
+				continue;
+			}
+			if ( !strcmp( argv[i], "--wait" ) )
+			{
+				loadGenOptions.m_nWaitSec = atoi( argv[++i] );
+				if ( loadGenOptions.m_nWaitSec <= 0 )
+					FatalError( "Invalid wait %d", loadGenOptions.m_nWaitSec );
+				continue;
+			}
+			if ( !strcmp( argv[i], "--duration" ) )
+			{
+				loadGenOptions.m_nDurationSec = atoi( argv[++i] );
+				if ( loadGenOptions.m_nDurationSec < 0 )
+					FatalError( "Invalid duration %d", loadGenOptions.m_nDurationSec );
+				continue;
+			}
+			if ( !strcmp( argv[i], "--seed" ) )
+			{
+				loadGenOptions.m_nSeed = atoi( argv[++i] );
+				continue;
+			}
+			if ( !strcmp( argv[i], "--server-pid" ) )
+			{
+				loadGenOptions.m_nServerPID = atoi( argv[++i] );
+				continue;
+			}
+		}
 
-		// Anything else, must be server address to connect to
+		// Anything else, must be server address to connect to.  The load
+		// generator spreads its clients over every node of a cluster.
+		if ( bLoadGen )
+		{
+			SteamNetworkingIPAddr addrNode; addrNode.Clear();
+			if ( !addrNode.ParseString( argv[i] ) )
+				FatalError( "Invalid server address '%s'", argv[i] );
+			if ( addrNode.m_port == 0 )
+				addrNode.m_port = DEFAULT_SERVER_PORT;
+			vecLoadGenServers.push_back( addrNode );
+			addrServer = vecLoadGenServers.front();
+			continue;
+		}
 		if ( bClient && addrServer.IsIPv6AllZeros() )
 		{
 			if ( !addrServer.ParseString( argv[i] ) )
@@ -1004,9 +5448,12 @@ int main( int argc, const char *argv[] )
 		PrintUsageAndExit();
 	}
 
-	if ( bClient == bServer || ( bClient && addrServer.IsIPv6AllZeros() ) )
+	if ( (int)bClient + (int)bServer + (int)bLoadGen != 1 || ( !bServer && addrServer.IsIPv6AllZeros() ) )
 		PrintUsageAndExit();
 
+	if ( pszLogFile && !g_Log.SetFile( pszLogFile, (size_t)nLogFileMB * 1024 * 1024 ) )
+		FatalError( "Can't open log file '%s'", pszLogFile );
+
 	// Create client and server sockets
 	InitSteamDatagramConnectionSockets();
 	LocalUserInput_Init();
@@ -1016,10 +5463,15 @@ int main( int argc, const char *argv[] )
 		ChatClient client;
 		client.Run( addrServer );
 	}
+	else if ( bLoadGen )
+	{
+		LoadGenerator loadGen;
+		loadGen.Run( vecLoadGenServers, loadGenOptions );
+	}
 	else
 	{
 		ChatServer server;
-		server.Run( (uint16)nPort );
+		server.Run( (uint16)nPort, (uint16)nGameServerPort, (uint16)nPeerPort, (uint16)nStatsPort );
 	}
 
 	ShutdownSteamDatagramConnectionSockets();
@@ -1027,5 +5479,6 @@ int main( int argc, const char *argv[] )
 	// Ug, why is there no simple solution for portable, non-blocking console user input?
 	// Just nuke the process
 	LocalUserInput_Kill();
+	g_Log.Stop();
 	NukeProcess(0);
 }
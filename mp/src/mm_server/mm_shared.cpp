@@ -7,18 +7,70 @@
 #include "cbase.h"
 #include "mm_shared.h"
 #include <steam/steamnetworkingsockets.h>
+#include <steam/isteamnetworkingutils.h>
 
 int iNumOfPlayersToStartGame = 2;
 
+SteamNetworkingMessage_t *AllocateTypedMessage(HSteamNetConnection hConn, uint32 cbPayload, int nSendFlags, MessageType eType)
+{
+	SteamNetworkingMessage_t *pMessage = SteamNetworkingUtils()->AllocateMessage(cbPayload + 1);
+	if (!pMessage)
+		return nullptr;
+	pMessage->m_conn = hConn;
+	pMessage->m_nFlags = nSendFlags;
+	*(uint8*)pMessage->m_pData = (uint8)eType;
+	return pMessage;
+}
+
+void *GetTypedMessagePayload(SteamNetworkingMessage_t *pMessage)
+{
+	return (uint8*)pMessage->m_pData + 1;
+}
+
+static FnSendFailed s_fnSendFailed = nullptr;
+
+void SetSendFailedHook(FnSendFailed fnHook)
+{
+	s_fnSendFailed = fnHook;
+}
+
+void ReportSendFailure(HSteamNetConnection hConn, MessageType eType, EResult eResult)
+{
+	if (s_fnSendFailed)
+		s_fnSendFailed(hConn, eType, eResult);
+}
+
+MessageType GetOutgoingMessageType(const SteamNetworkingMessage_t *pMessage)
+{
+	return pMessage->m_cbSize > 0 ? (MessageType)*(const uint8*)pMessage->m_pData : num_message_types;
+}
+
+EResult SendAllocatedMessage(SteamNetworkingMessage_t *pMessage, int64 *pOutMessageNumber, ISteamNetworkingSockets* pInterface)
+{
+	// SendMessages takes ownership of the message whether it succeeds or not,
+	// so whatever the hook wants from it has to be read now
+	HSteamNetConnection hConn = pMessage->m_conn;
+	MessageType eType = GetOutgoingMessageType(pMessage);
+	int64 nResult;
+	pInterface->SendMessages(1, &pMessage, &nResult);
+	if (nResult < 0)
+	{
+		ReportSendFailure(hConn, eType, (EResult)-nResult);
+		return (EResult)-nResult;
+	}
+	if (pOutMessageNumber)
+		*pOutMessageNumber = nResult;
+	return k_EResultOK;
+}
+
 EResult SendTypedMessage(HSteamNetConnection hConn, const void *pData, uint32 cbData, int nSendFlags, int64 *pOutMessageNumber, MessageType eType, ISteamNetworkingSockets* pInterface)
 {
-	void* typed_message = (void*) ::operator new (cbData + 1);
-	memcpy(typed_message, &eType, 1);
+	SteamNetworkingMessage_t *pMessage = AllocateTypedMessage(hConn, cbData, nSendFlags, eType);
+	if (!pMessage)
+		return k_EResultFail;
 	if (cbData != 0)
-		memcpy((uint8*)typed_message + 1, pData, cbData);
-	EResult res = pInterface->SendMessageToConnection(hConn, typed_message, cbData + 1, nSendFlags, pOutMessageNumber);
-	delete typed_message;
-	return res;
+		memcpy(GetTypedMessagePayload(pMessage), pData, cbData);
+	return SendAllocatedMessage(pMessage, pOutMessageNumber, pInterface);
 }
 
 EResult SendOnlyMessageType(HSteamNetConnection hConn, int nSendFlags, int64 *pOutMessageNumber, MessageType eType, ISteamNetworkingSockets* pInterface)
@@ -33,21 +85,157 @@ MessageType DetermineMessageType(ISteamNetworkingMessage* pMessage)
 	return type;
 }
 
-void* RemoveFirstByte(void **Destination, const void *pData, uint32 cbData)
+MessageView::MessageView(ISteamNetworkingMessage *pMessage)
+{
+	m_hConn = pMessage->m_conn;
+	if (pMessage->m_cbSize < 1)
+	{
+		m_eType = num_message_types;
+		m_pPayload = nullptr;
+		m_cbPayload = 0;
+		return;
+	}
+	m_eType = DetermineMessageType(pMessage);
+	m_pPayload = (const uint8*)pMessage->m_pData + 1;
+	m_cbPayload = (uint32)pMessage->m_cbSize - 1;
+}
+
+MessageView::MessageView(HSteamNetConnection hConn, const uint8 *pData, uint32 cbData)
+{
+	m_hConn = hConn;
+	if (cbData < 1)
+	{
+		m_eType = num_message_types;
+		m_pPayload = nullptr;
+		m_cbPayload = 0;
+		return;
+	}
+	m_eType = (MessageType)pData[0];
+	m_pPayload = pData + 1;
+	m_cbPayload = cbData - 1;
+}
+
+bool ReadBatchedMessage(const MessageView &batch, uint32 &nOffset, const uint8 *&pData, uint32 &cbData)
+{
+	uint16 cbMessage;
+	if (batch.m_eType != message_batch || nOffset + sizeof(cbMessage) > batch.m_cbPayload)
+		return false;
+	memcpy(&cbMessage, batch.m_pPayload + nOffset, sizeof(cbMessage));
+	nOffset += sizeof(cbMessage);
+	if (nOffset + cbMessage > batch.m_cbPayload)
+		return false;
+	pData = batch.m_pPayload + nOffset;
+	cbData = cbMessage;
+	nOffset += cbMessage;
+	return true;
+}
+
+// Maps and gamemodes go out as they are, checking whether they make sense for
+// the message is up to whoever handles it.  Reading only rules out values no
+// version of the protocol could have sent.
+static bool ReadMap(WireReader &reader, HL2DM_Map &map)
+{
+	uint32 nMap;
+	if (!reader.ReadUint32(nMap) || nMap > (uint32)invalid_map)
+		return false;
+	map = (HL2DM_Map)nMap;
+	return true;
+}
+
+static bool ReadTeamDM(WireReader &reader, char &bTeamDM)
+{
+	uint8 nTeamDM;
+	if (!reader.ReadUint8(nTeamDM))
+		return false;
+	bTeamDM = (char)(int8)nTeamDM;
+	return bTeamDM >= -1 && bTeamDM <= 1;
+}
+
+void WireFormat< LobbyData >::Write(WireWriter &writer, const LobbyData &data)
+{
+	writer.WriteUint32(data.m_hLobbyID);
+	writer.WriteUint32((uint32)data.m_map);
+	writer.WriteUint8((uint8)data.m_bTeamDM);
+}
+
+bool WireFormat< LobbyData >::Read(WireReader &reader, LobbyData &data)
+{
+	return reader.ReadUint32(data.m_hLobbyID) && ReadMap(reader, data.m_map) && ReadTeamDM(reader, data.m_bTeamDM);
+}
+
+void WireFormat< FindMatchData >::Write(WireWriter &writer, const FindMatchData &data)
+{
+	writer.WriteUint32((uint32)data.m_map);
+	writer.WriteUint8((uint8)data.m_bTeamDM);
+}
+
+bool WireFormat< FindMatchData >::Read(WireReader &reader, FindMatchData &data)
+{
+	return ReadMap(reader, data.m_map) && ReadTeamDM(reader, data.m_bTeamDM);
+}
+
+void WireFormat< GameServerPing >::Write(WireWriter &writer, const GameServerPing &ping)
 {
-	*Destination = (void*) ::operator new (cbData - 1);
-	memcpy(*Destination, (uint8*)pData + 1, cbData - 1);
-	return *Destination;
+	writer.WriteBytes(ping.m_ipv6, sizeof(ping.m_ipv6));
+	writer.WriteUint16(ping.m_nPort);
+	writer.WriteUint16(ping.m_nPingMS);
 }
 
-std::string ReceiveString(const void *pData, uint32 cbData)
+bool WireFormat< GameServerPing >::Read(WireReader &reader, GameServerPing &ping)
 {
-	std::string res;
-	void *temp_str = nullptr;
-	RemoveFirstByte(&temp_str, pData, cbData);
-	res.assign((char*)temp_str, cbData - 1);
-	delete temp_str;
-	return res;
+	return reader.ReadBytes(ping.m_ipv6, sizeof(ping.m_ipv6)) && reader.ReadUint16(ping.m_nPort) && reader.ReadUint16(ping.m_nPingMS);
+}
+
+void WireFormat< HelloData >::Write(WireWriter &writer, const HelloData &hello)
+{
+	writer.WriteUint16(hello.m_nVersion);
+	writer.WriteUint16(hello.m_nMinVersion);
+}
+
+bool WireFormat< HelloData >::Read(WireReader &reader, HelloData &hello)
+{
+	return reader.ReadUint16(hello.m_nVersion) && reader.ReadUint16(hello.m_nMinVersion);
+}
+
+void WireFormat< RedirectData >::Write(WireWriter &writer, const RedirectData &redirect)
+{
+	writer.WriteBytes(redirect.m_ipv6, sizeof(redirect.m_ipv6));
+	writer.WriteUint16(redirect.m_nPort);
+	writer.WriteUint64(redirect.m_nResumeToken);
+}
+
+bool WireFormat< RedirectData >::Read(WireReader &reader, RedirectData &redirect)
+{
+	return reader.ReadBytes(redirect.m_ipv6, sizeof(redirect.m_ipv6)) && reader.ReadUint16(redirect.m_nPort) && reader.ReadUint64(redirect.m_nResumeToken);
+}
+
+void WireFormat< GameServerHeartbeat >::Write(WireWriter &writer, const GameServerHeartbeat &heartbeat)
+{
+	writer.WriteUint16(heartbeat.m_nPort);
+	writer.WriteUint8(heartbeat.m_nPlayers);
+	writer.WriteUint8(heartbeat.m_nMaxPlayers);
+	writer.WriteUint32((uint32)heartbeat.m_map);
+	writer.WriteUint8((uint8)heartbeat.m_bTeamDM);
+	writer.WriteUint8((uint8)heartbeat.m_ePhase);
+	writer.WriteUint32(heartbeat.m_hLobby);
+	writer.WriteUint16(heartbeat.m_nFrameTimeAvg);
+	writer.WriteUint16(heartbeat.m_nFrameTimeMax);
+	writer.WriteUint8(heartbeat.m_nOpenSlots);
+}
+
+bool WireFormat< GameServerHeartbeat >::Read(WireReader &reader, GameServerHeartbeat &heartbeat)
+{
+	uint8 nPhase;
+	if (!reader.ReadUint16(heartbeat.m_nPort) || !reader.ReadUint8(heartbeat.m_nPlayers) || !reader.ReadUint8(heartbeat.m_nMaxPlayers) ||
+		!ReadMap(reader, heartbeat.m_map) || !ReadTeamDM(reader, heartbeat.m_bTeamDM) || !reader.ReadUint8(nPhase) || nPhase >= num_game_phases)
+		return false;
+	heartbeat.m_ePhase = (GameServerPhase)nPhase;
+	if (!reader.ReadUint32(heartbeat.m_hLobby) || !reader.ReadUint16(heartbeat.m_nFrameTimeAvg) || !reader.ReadUint16(heartbeat.m_nFrameTimeMax))
+		return false;
+
+	// Game servers from before backfill stop here
+	heartbeat.m_nOpenSlots = 0;
+	return reader.GetBytesLeft() == 0 || reader.ReadUint8(heartbeat.m_nOpenSlots);
 }
 
 std::string ConvertMapToString(HL2DM_Map map)
@@ -76,3 +264,78 @@ std::string ConvertMapToString(HL2DM_Map map)
 		return "";
 	}
 }
+
+HL2DM_Map ConvertStringToMap(const char *pszMap)
+{
+	for (int i = 0; i < invalid_map; ++i)
+	{
+		if (ConvertMapToString((HL2DM_Map)i) == pszMap)
+			return (HL2DM_Map)i;
+	}
+	return invalid_map;
+}
+
+std::string ConvertMessageTypeToString(MessageType type)
+{
+	switch (type)
+	{
+	case chat_message:
+		return "chat_message";
+	case request_lobby_list:
+		return "request_lobby_list";
+	case lobby_list:
+		return "lobby_list";
+	case lobby_data:
+		return "lobby_data";
+	case request_create_lobby:
+		return "request_create_lobby";
+	case request_join_lobby:
+		return "request_join_lobby";
+	case request_leave_lobby:
+		return "request_leave_lobby";
+	case request_lobby_data:
+		return "request_lobby_data";
+	case message_save_lobby_id:
+		return "message_save_lobby_id";
+	case message_save_lobby_id_on_create:
+		return "message_save_lobby_id_on_create";
+	case message_no_suitable_lobbies:
+		return "message_no_suitable_lobbies";
+	case message_start_game:
+		return "message_start_game";
+	case request_echo:
+		return "request_echo";
+	case message_echo:
+		return "message_echo";
+	case request_find_match:
+		return "request_find_match";
+	case message_batch:
+		return "message_batch";
+	case game_server_list:
+		return "game_server_list";
+	case game_server_pings:
+		return "game_server_pings";
+	case message_hello:
+		return "message_hello";
+	case game_server_heartbeat:
+		return "game_server_heartbeat";
+	case game_server_setup:
+		return "game_server_setup";
+	case message_resume_token:
+		return "message_resume_token";
+	case request_resume:
+		return "request_resume";
+	case message_resume_result:
+		return "message_resume_result";
+	case message_redirect:
+		return "message_redirect";
+	case peer_summary:
+		return "peer_summary";
+	case peer_handoff:
+		return "peer_handoff";
+	case peer_handoff_result:
+		return "peer_handoff_result";
+	default:
+		return "<unknown message>";
+	}
+}
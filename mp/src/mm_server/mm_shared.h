@@ -11,14 +11,15 @@
 #endif
 
 #include <steam/steamnetworkingsockets.h>
+#include <string.h>
 #include <string>
-#include <map>
 
 /// Handle used to identify a lobby.
 typedef uint32 HLobbyID;
 
 #define invalid_lobby (HLobbyID)-1
 
+/// Message types go over the wire as a single byte, new ones only ever go at the end
 enum MessageType
 {
 	chat_message,
@@ -34,7 +35,22 @@ enum MessageType
 	message_no_suitable_lobbies,
 	message_start_game,
 	request_echo,
-	message_echo
+	message_echo,
+	request_find_match,
+	message_batch,
+	game_server_list,
+	game_server_pings,
+	message_hello,
+	game_server_heartbeat,
+	game_server_setup,
+	message_resume_token,
+	request_resume,
+	message_resume_result,
+	message_redirect,
+	peer_summary,
+	peer_handoff,
+	peer_handoff_result,
+	num_message_types
 };
 
 enum HL2DM_Map
@@ -50,16 +66,89 @@ enum HL2DM_Map
 	invalid_map
 };
 
+/// Longer nicks are cut off
+const int k_cchMaxNick = 32;
+
+/// Longest chat message the server takes, as much as the game's console
+/// hands over.  Longer ones are dropped.
+const int k_cchMaxChatMessage = 256;
+
 struct Client_t
 {
-	std::string m_sNick;
+	Client_t()
+	{
+		m_hConn = k_HSteamNetConnection_Invalid;
+		m_szNick[0] = '\0';
+		m_iShard = -1;
+		m_hLobby = invalid_lobby;
+		m_nPendingLeaves = 0;
+		m_bDisconnected = false;
+		m_steamID = 0;
+		m_flRating = 0.0f;
+		m_nProtocolVersion = 0;
+		m_nResumeToken = 0;
+		m_iSearchBucket = -1;
+		m_usecSearchStarted = 0;
+		m_nHandoff = 0;
+	}
+
+	void SetNick(const char *pszNick)
+	{
+		strncpy(m_szNick, pszNick, k_cchMaxNick - 1);
+		m_szNick[k_cchMaxNick - 1] = '\0';
+	}
+
+	HSteamNetConnection m_hConn;
+	char m_szNick[k_cchMaxNick];
+
+	// Matchmaking shard holding the lobby they searched for, -1 if none.  Server only.
+	int m_iShard;
+
+	// Lobby they are in on the main thread, invalid_lobby if none.  Server only.
+	HLobbyID m_hLobby;
+
+	// Leave requests sent to shards that haven't been answered yet
+	int m_nPendingLeaves;
+
+	// Gone, but a shard may still have them in a lobby so the slot isn't reused yet
+	bool m_bDisconnected;
+
+	// Steam ID their profile is stored under, 0 for guests.  Server only.
+	uint64 m_steamID;
+
+	// Skill rating, the default one until their profile has loaded.  Server only.
+	float m_flRating;
+
+	// Protocol version we talk to them in, 0 until they say hello.  Server only.
+	uint16 m_nProtocolVersion;
+
+	// Secret they get back their lobby or queue place with if they lose the
+	// connection, 0 if they don't have one.  Server only.
+	uint64 m_nResumeToken;
+
+	// Bucket of their last search and when they started it, kept so a search
+	// can be picked up again after a restart.  Server only.
+	int m_iSearchBucket;
+	SteamNetworkingMicroseconds m_usecSearchStarted;
+
+	// Handoff to another node of the cluster they are part of, 0 if none.  Server only.
+	uint32 m_nHandoff;
 };
 
-struct Player
+/// Most players a lobby can hold
+const int k_nMaxLobbyPlayers = 32;
+
+/// Lobbies are grouped into buckets by map and gamemode so that a search
+/// only has to look at lobbies it could actually join.
+const int k_nNumLobbyBuckets = invalid_map * 2;
+
+/// Returns -1 for lobbies that don't have their map and gamemode set yet
+inline int GetLobbyBucket(HL2DM_Map map, char bTeamDM)
 {
-	Client_t m_Client;
-	bool m_bEnemy;
-};
+	if (map < 0 || map >= invalid_map || (bTeamDM != 0 && bTeamDM != 1))
+		return -1;
+	return map * 2 + bTeamDM;
+}
 
 struct Lobby
 {
@@ -67,10 +156,75 @@ struct Lobby
 	{
 		m_map = invalid_map;
 		m_bTeamDM = -1;
+		m_hLobbyID = invalid_lobby;
+		m_nPlayers = 0;
+		m_iOwner = -1;
+		m_iBucket = -1;
+		m_iOpenSlot = -1;
+		m_bStarting = false;
+		m_bReady = false;
+		m_usecFilled = 0;
+		m_usecServerAllocated = 0;
+		m_usecServerReady = 0;
+	}
+
+	/// Returns false if they are already in here or there is no room
+	bool AddPlayer(int iClient)
+	{
+		if (m_nPlayers >= k_nMaxLobbyPlayers || FindPlayer(iClient) >= 0)
+			return false;
+		m_iPlayers[m_nPlayers++] = iClient;
+		return true;
 	}
-	std::map< HSteamNetConnection, Player > m_mapPlayers;
+
+	bool RemovePlayer(int iClient)
+	{
+		int i = FindPlayer(iClient);
+		if (i < 0)
+			return false;
+		m_iPlayers[i] = m_iPlayers[--m_nPlayers];
+		if (iClient == m_iOwner)
+			m_iOwner = m_nPlayers > 0 ? m_iPlayers[0] : -1;
+		return true;
+	}
+
+	int FindPlayer(int iClient) const
+	{
+		for (int i = 0; i < m_nPlayers; ++i)
+		{
+			if (m_iPlayers[i] == iClient)
+				return i;
+		}
+		return -1;
+	}
+
+	HLobbyID m_hLobbyID;
+
+	// Indices into the server's client table
+	int m_iPlayers[k_nMaxLobbyPlayers];
+	int m_nPlayers;
+
+	// Player who picks the map and gamemode, handed on if they leave.  -1 for
+	// lobbies the matchmaker put together.
+	int m_iOwner;
+
 	HL2DM_Map m_map;
 	char m_bTeamDM;
+
+	// Full and waiting on a game server, nobody else may join
+	bool m_bStarting;
+
+	// In the server's queue of full lobbies waiting for a game server
+	bool m_bReady;
+
+	// When the lobby got through each step of starting a match, 0 if it hasn't yet
+	SteamNetworkingMicroseconds m_usecFilled;
+	SteamNetworkingMicroseconds m_usecServerAllocated;
+	SteamNetworkingMicroseconds m_usecServerReady;
+
+	// Where the lobby sits in the server's open lobby index, -1 if it's not in there
+	int m_iBucket;
+	int m_iOpenSlot;
 };
 
 struct LobbyData
@@ -80,11 +234,380 @@ struct LobbyData
 	char m_bTeamDM;
 };
 
+/// Payload of request_find_match.  The server answers with message_save_lobby_id
+/// once it has matched the player up with others and put them all in a lobby.
+struct FindMatchData
+{
+	HL2DM_Map m_map;
+	char m_bTeamDM;
+};
+
+/// Protocol version this build speaks, and the oldest one it still understands.
+/// Version 0 is what clients sent before there were versions: the same fields,
+/// but as raw structs with their padding.  Version 2 added resume tokens,
+/// version 3 redirects to other matchmaking servers of a cluster.
+const uint16 k_nProtocolVersion = 3;
+const uint16 k_nMinProtocolVersion = 0;
+
+/// Payload of message_hello.  Clients send it as soon as they are connected and
+/// the server answers with its own, after that both sides talk in the lower of
+/// the two versions.  Peers that never say hello are version 0.
+struct HelloData
+{
+	uint16 m_nVersion;
+	uint16 m_nMinVersion;
+};
+
+/// The server answers a version 2 hello with message_resume_token, a uint64 the
+/// client keeps.  If the connection drops, say because the server restarted,
+/// the client reconnects and sends it back as request_resume to get its lobby
+/// or its place in the queue back.  The server answers with
+/// message_resume_result, a uint32 ResumeResult, and a new message_resume_token.
+enum ResumeResult
+{
+	resume_failed,		// unknown or expired token, search again if you were searching
+	resume_lobby,		// back in the lobby, message_save_lobby_id is on its way
+	resume_queued,		// back in the queue, the wait so far still counts
+	resume_idle			// token was good, but there was nothing to get back
+};
+
+/// Payload of message_redirect.  Matchmaking servers of a cluster move players
+/// to whichever of them has the players or game servers to match them with.
+/// The client closes its connection, connects to the address and sends the
+/// token as request_resume, just like after losing the connection, and picks
+/// up its search or lobby there.  Only sent to clients of version 3 or later.
+struct RedirectData
+{
+	uint8 m_ipv6[16];
+	uint16 m_nPort;
+	uint64 m_nResumeToken;
+};
+
+/// Ping of a game server nobody has measured, or that didn't answer
+const uint16 k_nPingUnknown = 0xFFFF;
+
+/// game_server_list is an array of these, sent to clients when they connect and
+/// whenever a game server is added.  Clients measure how far away each one is
+/// and send the same array back as game_server_pings, ideally before searching
+/// for a match, so the server can pick the game server closest to everybody.
+struct GameServerPing
+{
+	uint8 m_ipv6[16];	// IPv4 servers are mapped, like SteamNetworkingIPAddr does it
+	uint16 m_nPort;
+	uint16 m_nPingMS;	// k_nPingUnknown in game_server_list
+};
+
+/// Where the match on a game server is at, as its heartbeat reports it
+enum GameServerPhase
+{
+	game_phase_waiting,			// nobody is playing on it
+	game_phase_playing,
+	game_phase_intermission,	// the match is over and the scoreboard is up
+	num_game_phases
+};
+
+/// Game servers running the mod connect to the matchmaking server's game
+/// server port, say hello and then send one of these every few seconds as
+/// game_server_heartbeat, and right away whenever a level has loaded.  The
+/// matchmaking server answers nothing, but it may send game_server_setup with
+/// a LobbyData to switch the server to the lobby's map and gamemode, which
+/// saves it the RCON round trips.  Heartbeats report that lobby once its map
+/// has loaded.
+struct GameServerHeartbeat
+{
+	uint16 m_nPort;				// port players connect to
+	uint8 m_nPlayers;			// humans only
+	uint8 m_nMaxPlayers;
+	HL2DM_Map m_map;			// invalid_map if it's not a map we match on
+	char m_bTeamDM;
+	GameServerPhase m_ePhase;
+	HLobbyID m_hLobby;			// last lobby it was set up for, invalid_lobby if none
+	uint16 m_nFrameTimeAvg;		// game frame time since the last heartbeat, in 1/100 ms
+	uint16 m_nFrameTimeMax;
+	uint8 m_nOpenSlots;			// players it takes into the match that's on, 0 from servers that don't backfill
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// WireWriter / WireReader
+//
+// Payloads are written field by field in little endian, never as structs, so
+// they don't depend on padding or on which compiler built the other side.
+// Both work on a buffer somebody else owns: nothing is allocated, and every
+// read checks that it stays inside the payload.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class WireWriter
+{
+public:
+	WireWriter(void *pBuffer, uint32 cbBuffer) : m_pBuffer((uint8*)pBuffer), m_cbBuffer(cbBuffer), m_cbWritten(0), m_bOverflow(false) {}
+
+	void WriteUint8(uint8 nValue) { uint8 *p = Reserve(1); if (p) p[0] = nValue; }
+	void WriteUint16(uint16 nValue) { uint8 *p = Reserve(2); if (p) { p[0] = (uint8)nValue; p[1] = (uint8)(nValue >> 8); } }
+	void WriteUint32(uint32 nValue) { uint8 *p = Reserve(4); if (p) { for (int i = 0; i < 4; ++i) p[i] = (uint8)(nValue >> (i * 8)); } }
+	void WriteUint64(uint64 nValue) { WriteUint32((uint32)nValue); WriteUint32((uint32)(nValue >> 32)); }
+	void WriteBytes(const void *pData, uint32 cbData) { uint8 *p = Reserve(cbData); if (p) memcpy(p, pData, cbData); }
+
+	/// Zeroes whatever is left of the buffer
+	void PadToEnd() { memset(m_pBuffer + m_cbWritten, 0, m_cbBuffer - m_cbWritten); m_cbWritten = m_cbBuffer; }
+
+	uint32 GetBytesWritten() const { return m_cbWritten; }
+	bool IsOverflowed() const { return m_bOverflow; }
+
+private:
+	uint8 *Reserve(uint32 cbData)
+	{
+		if (m_bOverflow || cbData > m_cbBuffer - m_cbWritten)
+		{
+			m_bOverflow = true;
+			return nullptr;
+		}
+		uint8 *p = m_pBuffer + m_cbWritten;
+		m_cbWritten += cbData;
+		return p;
+	}
+
+	uint8 *m_pBuffer;
+	uint32 m_cbBuffer;
+	uint32 m_cbWritten;
+	bool m_bOverflow;
+};
+
+class WireReader
+{
+public:
+	WireReader(const void *pData, uint32 cbData) : m_pData((const uint8*)pData), m_cbData(cbData), m_cbRead(0) {}
+
+	bool ReadUint8(uint8 &nValue) { const uint8 *p = Consume(1); if (!p) return false; nValue = p[0]; return true; }
+	bool ReadUint16(uint16 &nValue) { const uint8 *p = Consume(2); if (!p) return false; nValue = (uint16)(p[0] | (p[1] << 8)); return true; }
+	bool ReadUint32(uint32 &nValue)
+	{
+		const uint8 *p = Consume(4);
+		if (!p)
+			return false;
+		nValue = (uint32)p[0] | ((uint32)p[1] << 8) | ((uint32)p[2] << 16) | ((uint32)p[3] << 24);
+		return true;
+	}
+	bool ReadUint64(uint64 &nValue)
+	{
+		uint32 nLow, nHigh;
+		if (!ReadUint32(nLow) || !ReadUint32(nHigh))
+			return false;
+		nValue = (uint64)nLow | ((uint64)nHigh << 32);
+		return true;
+	}
+	bool ReadBytes(void *pOut, uint32 cbData) { const uint8 *p = Consume(cbData); if (!p) return false; memcpy(pOut, p, cbData); return true; }
+
+	uint32 GetBytesLeft() const { return m_cbData - m_cbRead; }
+
+private:
+	const uint8 *Consume(uint32 cbData)
+	{
+		if (cbData > m_cbData - m_cbRead)
+			return nullptr;
+		const uint8 *p = m_pData + m_cbRead;
+		m_cbRead += cbData;
+		return p;
+	}
+
+	const uint8 *m_pData;
+	uint32 m_cbData;
+	uint32 m_cbRead;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// WireFormat
+//
+// The schema: how every payload type is laid out on the wire.  k_cbSize is
+// the size of the current encoding, k_cbLegacySize what a version 0 peer
+// expects, the struct with its padding.  Encodings only ever grow by adding
+// fields at the end, and Read ignores anything past the fields it knows, so
+// a newer peer's messages read fine here and a version 0 message is just the
+// current one with padding on the end.  Read also rejects values that are out
+// of range instead of handing them on.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+template< typename T > struct WireFormat;
+
+template<> struct WireFormat< uint32 >
+{
+	enum { k_cbSize = 4, k_cbLegacySize = 4 };
+	static void Write(WireWriter &writer, const uint32 &nValue) { writer.WriteUint32(nValue); }
+	static bool Read(WireReader &reader, uint32 &nValue) { return reader.ReadUint32(nValue); }
+};
+
+template<> struct WireFormat< uint64 >
+{
+	enum { k_cbSize = 8, k_cbLegacySize = 8 };
+	static void Write(WireWriter &writer, const uint64 &nValue) { writer.WriteUint64(nValue); }
+	static bool Read(WireReader &reader, uint64 &nValue) { return reader.ReadUint64(nValue); }
+};
+
+template<> struct WireFormat< LobbyData >
+{
+	// lobby ID, map, team DM
+	enum { k_cbSize = 9, k_cbLegacySize = 12 };
+	static void Write(WireWriter &writer, const LobbyData &data);
+	static bool Read(WireReader &reader, LobbyData &data);
+};
+
+template<> struct WireFormat< FindMatchData >
+{
+	// map, team DM
+	enum { k_cbSize = 5, k_cbLegacySize = 8 };
+	static void Write(WireWriter &writer, const FindMatchData &data);
+	static bool Read(WireReader &reader, FindMatchData &data);
+};
+
+template<> struct WireFormat< GameServerPing >
+{
+	// IPv6 address, port, ping
+	enum { k_cbSize = 20, k_cbLegacySize = 20 };
+	static void Write(WireWriter &writer, const GameServerPing &ping);
+	static bool Read(WireReader &reader, GameServerPing &ping);
+};
+
+template<> struct WireFormat< HelloData >
+{
+	// version, oldest version understood
+	enum { k_cbSize = 4, k_cbLegacySize = 4 };
+	static void Write(WireWriter &writer, const HelloData &hello);
+	static bool Read(WireReader &reader, HelloData &hello);
+};
+
+template<> struct WireFormat< RedirectData >
+{
+	// IPv6 address, port, resume token
+	enum { k_cbSize = 26, k_cbLegacySize = 26 };
+	static void Write(WireWriter &writer, const RedirectData &redirect);
+	static bool Read(WireReader &reader, RedirectData &redirect);
+};
+
+template<> struct WireFormat< GameServerHeartbeat >
+{
+	// port, players, max players, map, team DM, phase, lobby ID, frame time average and max, open slots
+	enum { k_cbSize = 19, k_cbLegacySize = 19 };
+	static void Write(WireWriter &writer, const GameServerHeartbeat &heartbeat);
+	static bool Read(WireReader &reader, GameServerHeartbeat &heartbeat);
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Message framing
+//
+// Every message on the wire is a single MessageType byte followed by the
+// payload.  Outgoing messages are built straight into a buffer we get from
+// SteamNetworkingUtils()->AllocateMessage and handed over with SendMessages,
+// so the library takes ownership of it without copying it again.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+/// Allocates a message addressed to hConn with room for cbPayload bytes after the
+/// type byte, which is already filled in.  Write the payload with GetTypedMessagePayload
+/// and send it with SendAllocatedMessage (or Release() it if you change your mind).
+SteamNetworkingMessage_t *AllocateTypedMessage(HSteamNetConnection hConn, uint32 cbPayload, int nSendFlags, MessageType eType);
+void *GetTypedMessagePayload(SteamNetworkingMessage_t *pMessage);
+EResult SendAllocatedMessage(SteamNetworkingMessage_t *pMessage, int64 *pOutMessageNumber, ISteamNetworkingSockets* pInterface);
+
+/// Told about every message the library refused to send, with the type byte
+/// it started with.  Null unless somebody wants to count them.
+typedef void (*FnSendFailed)(HSteamNetConnection hConn, MessageType eType, EResult eResult);
+void SetSendFailedHook(FnSendFailed fnHook);
+void ReportSendFailure(HSteamNetConnection hConn, MessageType eType, EResult eResult);
+
+/// The type byte of an outgoing message, to remember before SendMessages takes it
+MessageType GetOutgoingMessageType(const SteamNetworkingMessage_t *pMessage);
+
 EResult SendTypedMessage(HSteamNetConnection hConn, const void *pData, uint32 cbData, int nSendFlags, int64 *pOutMessageNumber, MessageType eType, ISteamNetworkingSockets* pInterface);
 EResult SendOnlyMessageType(HSteamNetConnection hConn, int nSendFlags, int64 *pOutMessageNumber, MessageType eType, ISteamNetworkingSockets* pInterface);
 MessageType DetermineMessageType(ISteamNetworkingMessage* pMessage);
-void* RemoveFirstByte(void **Destination, const void *pData, uint32 cbData);
-std::string ReceiveString(const void *pData, uint32 cbData);
+
+/// Encodes data straight into the message the library sends, in the format
+/// a peer of nPeerVersion understands
+template< typename T >
+EResult SendWireMessage(HSteamNetConnection hConn, const T &data, int nSendFlags, MessageType eType, ISteamNetworkingSockets* pInterface, uint16 nPeerVersion = k_nProtocolVersion)
+{
+	uint32 cbPayload = nPeerVersion >= 1 ? (uint32)WireFormat< T >::k_cbSize : (uint32)WireFormat< T >::k_cbLegacySize;
+	SteamNetworkingMessage_t *pMessage = AllocateTypedMessage(hConn, cbPayload, nSendFlags, eType);
+	if (!pMessage)
+		return k_EResultFail;
+	WireWriter writer(GetTypedMessagePayload(pMessage), cbPayload);
+	WireFormat< T >::Write(writer, data);
+	writer.PadToEnd();
+	return SendAllocatedMessage(pMessage, nullptr, pInterface);
+}
+
+/// Same for a payload that is an array of T
+template< typename T >
+EResult SendWireArray(HSteamNetConnection hConn, const T *pData, uint32 nCount, int nSendFlags, MessageType eType, ISteamNetworkingSockets* pInterface)
+{
+	SteamNetworkingMessage_t *pMessage = AllocateTypedMessage(hConn, nCount * WireFormat< T >::k_cbSize, nSendFlags, eType);
+	if (!pMessage)
+		return k_EResultFail;
+	WireWriter writer(GetTypedMessagePayload(pMessage), nCount * WireFormat< T >::k_cbSize);
+	for (uint32 i = 0; i < nCount; ++i)
+		WireFormat< T >::Write(writer, pData[i]);
+	return SendAllocatedMessage(pMessage, nullptr, pInterface);
+}
+
+/// Typed view over a received message.  Points straight into the message's
+/// own buffer, so it's only good until the message is released.
+struct MessageView
+{
+	MessageView(ISteamNetworkingMessage *pMessage);
+
+	/// View over a message that came in as part of a message_batch
+	MessageView(HSteamNetConnection hConn, const uint8 *pData, uint32 cbData);
+
+	bool IsValid() const { return m_pPayload != nullptr; }
+
+	/// Decodes a payload of type T.  Fails if the message is too short or holds
+	/// values out of range, anything after the fields we know is ignored.
+	template< typename T >
+	bool Read(T &out) const
+	{
+		WireReader reader(m_pPayload, m_cbPayload);
+		return WireFormat< T >::Read(reader, out);
+	}
+
+	/// Decodes element i of a payload that is an array of T
+	template< typename T >
+	bool ReadElement(uint32 i, T &out) const
+	{
+		if (((uint64)i + 1) * WireFormat< T >::k_cbSize > m_cbPayload)
+			return false;
+		WireReader reader(m_pPayload + i * WireFormat< T >::k_cbSize, WireFormat< T >::k_cbSize);
+		return WireFormat< T >::Read(reader, out);
+	}
+
+	template< typename T >
+	uint32 Count() const
+	{
+		return m_cbPayload / WireFormat< T >::k_cbSize;
+	}
+
+	const char *GetString() const { return (const char *)m_pPayload; }
+	int GetStringLength() const { return (int)m_cbPayload; }
+	std::string ReadString() const { return std::string(GetString(), m_cbPayload); }
+
+	HSteamNetConnection m_hConn;
+	MessageType m_eType;
+	const uint8 *m_pPayload;
+	uint32 m_cbPayload;
+};
+
+/// message_batch carries several small messages to the same connection, each one
+/// a 16 bit length followed by the message itself, type byte and all.  Call this
+/// with nOffset = 0 to get the first one, it returns false once there are no more.
+bool ReadBatchedMessage(const MessageView &batch, uint32 &nOffset, const uint8 *&pData, uint32 &cbData);
+
 std::string ConvertMapToString(HL2DM_Map map);
 
+/// invalid_map if it's none of ours
+HL2DM_Map ConvertStringToMap(const char *pszMap);
+std::string ConvertMessageTypeToString(MessageType type);
+
 #endif
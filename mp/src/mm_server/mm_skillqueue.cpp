@@ -0,0 +1,276 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Matchmaking queue that groups players of similar skill
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_skillqueue.h"
+#include <algorithm>
+#include <cmath>
+
+// How often the queue is matched.  Players that arrive in between are
+// matched together with everybody else who is waiting.
+static const int k_nQueueTickMS = 50;
+
+QueueTimeHistogram::QueueTimeHistogram()
+{
+	m_nTotalSpread = 0;
+}
+
+void QueueTimeHistogram::Add( SteamNetworkingMicroseconds usecWaited, float flRatingSpread )
+{
+	// Only the owning thread writes, readers just need to see whole values
+	m_Times.Record( usecWaited );
+	m_nTotalSpread.store( m_nTotalSpread.load( std::memory_order_relaxed ) + (uint64)( flRatingSpread + 0.5f ), std::memory_order_relaxed );
+}
+
+float QueueTimeHistogram::GetAverageSpread() const
+{
+	uint64 nCount = m_Times.GetCount();
+	return nCount ? (float)m_nTotalSpread / nCount : 0.0f;
+}
+
+SkillQueue::SkillQueue()
+{
+	m_nNextTicket = 1;
+	m_nPlayersPerMatch = 2;
+	m_flInitialWindow = 100.0f;
+	m_flWindowGrowth = 25.0f;
+	m_usecNextMatch = 0;
+	for ( int i = 0; i < k_nNumLobbyBuckets; ++i )
+		m_nWaiting[ i ] = 0;
+}
+
+void SkillQueue::SetWindow( float flInitial, float flGrowthPerSec )
+{
+	m_flInitialWindow = flInitial;
+	m_flWindowGrowth = flGrowthPerSec;
+}
+
+void SkillQueue::Add( int iBucket, int iClient, HSteamNetConnection hConn, float flRating, SteamNetworkingMicroseconds usecNow )
+{
+	Remove( iClient );
+
+	QueueTicket ticket;
+	ticket.m_nTicket = m_nNextTicket++;
+	ticket.m_iBucket = iBucket;
+	m_mapTickets.Insert( iClient, ticket );
+
+	QueuedPlayer player;
+	player.m_iClient = iClient;
+	player.m_hConn = hConn;
+	player.m_flRating = flRating;
+	player.m_usecQueued = usecNow;
+	player.m_nTicket = ticket.m_nTicket;
+	m_vecQueued[ iBucket ].push_back( player );
+	++m_nWaiting[ iBucket ];
+}
+
+bool SkillQueue::Remove( int iClient )
+{
+	QueueTicket *pTicket = m_mapTickets.Find( iClient );
+	if ( !pTicket )
+		return false;
+
+	// The entry itself stays behind until the bucket is matched next
+	--m_nWaiting[ pTicket->m_iBucket ];
+	m_mapTickets.Remove( iClient );
+	return true;
+}
+
+int SkillQueue::Match( SteamNetworkingMicroseconds usecNow, std::vector< SkillMatch > &vecMatches )
+{
+	if ( usecNow < m_usecNextMatch )
+		return 0;
+	m_usecNextMatch = usecNow + k_nQueueTickMS * 1000;
+
+	size_t nMatchesBefore = vecMatches.size();
+	for ( int iBucket = 0; iBucket < k_nNumLobbyBuckets; ++iBucket )
+	{
+		if ( (int)m_vecQueued[ iBucket ].size() >= m_nPlayersPerMatch )
+			MatchBucket( iBucket, usecNow, vecMatches );
+	}
+	return (int)( vecMatches.size() - nMatchesBefore );
+}
+
+void SkillQueue::MatchBucket( int iBucket, SteamNetworkingMicroseconds usecNow, std::vector< SkillMatch > &vecMatches )
+{
+	std::vector< QueuedPlayer > &vecQueued = m_vecQueued[ iBucket ];
+	int nPlayersPerMatch = std::max( 1, std::min( m_nPlayersPerMatch, k_nMaxLobbyPlayers ) );
+	DropRemoved( iBucket );
+
+	int nQueued = (int)vecQueued.size();
+	if ( nQueued < nPlayersPerMatch )
+		return;
+
+	std::sort( vecQueued.begin(), vecQueued.end(), []( const QueuedPlayer &a, const QueuedPlayer &b ) {
+		return a.m_flRating < b.m_flRating;
+	} );
+
+	// Players still unmatched form a linked list in rating order, so finding
+	// someone's closest unmatched neighbours never walks over matched players
+	m_vecPrev.resize( nQueued );
+	m_vecNext.resize( nQueued );
+	m_vecWindows.resize( nQueued );
+	m_vecMatched.assign( nQueued, false );
+	m_vecOrder.resize( nQueued );
+	for ( int i = 0; i < nQueued; ++i )
+	{
+		m_vecPrev[ i ] = i - 1;
+		m_vecNext[ i ] = i + 1 < nQueued ? i + 1 : -1;
+		m_vecWindows[ i ] = m_flInitialWindow + m_flWindowGrowth * ( usecNow - vecQueued[ i ].m_usecQueued ) * 1e-6f;
+		m_vecOrder[ i ] = i;
+	}
+
+	// Longest waiting first
+	std::sort( m_vecOrder.begin(), m_vecOrder.end(), [&vecQueued]( int a, int b ) {
+		return vecQueued[ a ].m_usecQueued < vecQueued[ b ].m_usecQueued;
+	} );
+
+	int iLeft[ k_nMaxLobbyPlayers ];
+	int iRight[ k_nMaxLobbyPlayers ];
+	int nRemaining = nQueued;
+	for ( int iAnchor: m_vecOrder )
+	{
+		if ( nRemaining < nPlayersPerMatch )
+			break;
+		if ( m_vecMatched[ iAnchor ] )
+			continue;
+
+		// Closest unmatched neighbours on either side, nearest first
+		int nLeft = 0, nRight = 0;
+		for ( int i = m_vecPrev[ iAnchor ]; i >= 0 && nLeft < nPlayersPerMatch - 1; i = m_vecPrev[ i ] )
+			iLeft[ nLeft++ ] = i;
+		for ( int i = m_vecNext[ iAnchor ]; i >= 0 && nRight < nPlayersPerMatch - 1; i = m_vecNext[ i ] )
+			iRight[ nRight++ ] = i;
+
+		// Of the runs of players that include the anchor, take the tightest one
+		int nBestRight = -1;
+		float flBestSpread = 0.0f;
+		for ( int nTakeRight = std::max( 0, nPlayersPerMatch - 1 - nLeft ); nTakeRight <= std::min( nPlayersPerMatch - 1, nRight ); ++nTakeRight )
+		{
+			int nTakeLeft = nPlayersPerMatch - 1 - nTakeRight;
+			int iLowest = nTakeLeft ? iLeft[ nTakeLeft - 1 ] : iAnchor;
+			int iHighest = nTakeRight ? iRight[ nTakeRight - 1 ] : iAnchor;
+			float flSpread = vecQueued[ iHighest ].m_flRating - vecQueued[ iLowest ].m_flRating;
+			if ( nBestRight < 0 || flSpread < flBestSpread )
+			{
+				nBestRight = nTakeRight;
+				flBestSpread = flSpread;
+			}
+		}
+		if ( nBestRight < 0 )
+			continue;
+
+		// Everybody in the group has to be happy with it
+		SkillMatch match;
+		match.m_iBucket = iBucket;
+		match.m_nPlayers = 0;
+		int nBestLeft = nPlayersPerMatch - 1 - nBestRight;
+		float flMinWindow = m_vecWindows[ iAnchor ];
+		for ( int i = 0; i < nBestLeft; ++i )
+			flMinWindow = std::min( flMinWindow, m_vecWindows[ iLeft[ i ] ] );
+		for ( int i = 0; i < nBestRight; ++i )
+			flMinWindow = std::min( flMinWindow, m_vecWindows[ iRight[ i ] ] );
+		if ( flBestSpread > flMinWindow )
+			continue;
+
+		for ( int i = nBestLeft - 1; i >= 0; --i )
+			match.m_players[ match.m_nPlayers++ ] = vecQueued[ iLeft[ i ] ];
+		match.m_players[ match.m_nPlayers++ ] = vecQueued[ iAnchor ];
+		for ( int i = 0; i < nBestRight; ++i )
+			match.m_players[ match.m_nPlayers++ ] = vecQueued[ iRight[ i ] ];
+
+		int iFirst = nBestLeft ? iLeft[ nBestLeft - 1 ] : iAnchor;
+		int iLast = nBestRight ? iRight[ nBestRight - 1 ] : iAnchor;
+		int iBefore = m_vecPrev[ iFirst ];
+		int iAfter = m_vecNext[ iLast ];
+		if ( iBefore >= 0 )
+			m_vecNext[ iBefore ] = iAfter;
+		if ( iAfter >= 0 )
+			m_vecPrev[ iAfter ] = iBefore;
+
+		for ( int i = 0; i < match.m_nPlayers; ++i )
+		{
+			const QueuedPlayer &player = match.m_players[ i ];
+			m_QueueTimes[ iBucket ].Add( usecNow - player.m_usecQueued, flBestSpread );
+			m_mapTickets.Remove( player.m_iClient );
+		}
+		for ( int i = iFirst; i <= iLast; ++i )
+			m_vecMatched[ i ] = true;
+		nRemaining -= nPlayersPerMatch;
+		m_nWaiting[ iBucket ] -= nPlayersPerMatch;
+		vecMatches.push_back( match );
+	}
+
+	// Keep whoever is left for next time
+	size_t nKept = 0;
+	for ( int i = 0; i < nQueued; ++i )
+	{
+		if ( !m_vecMatched[ i ] )
+			vecQueued[ nKept++ ] = vecQueued[ i ];
+	}
+	vecQueued.resize( nKept );
+}
+
+// Drops whoever left since the bucket was last looked at
+void SkillQueue::DropRemoved( int iBucket )
+{
+	std::vector< QueuedPlayer > &vecQueued = m_vecQueued[ iBucket ];
+	size_t nKept = 0;
+	for ( size_t i = 0; i < vecQueued.size(); ++i )
+	{
+		const QueueTicket *pTicket = m_mapTickets.Find( vecQueued[ i ].m_iClient );
+		if ( pTicket && pTicket->m_nTicket == vecQueued[ i ].m_nTicket )
+			vecQueued[ nKept++ ] = vecQueued[ i ];
+	}
+	vecQueued.resize( nKept );
+}
+
+int SkillQueue::Backfill( int iBucket, float flRating, int nSlots, SteamNetworkingMicroseconds usecNow, SkillMatch &match )
+{
+	match.m_iBucket = iBucket;
+	match.m_nPlayers = 0;
+	nSlots = std::min( nSlots, k_nMaxLobbyPlayers );
+	if ( nSlots <= 0 || m_nWaiting[ iBucket ] <= 0 )
+		return 0;
+
+	std::vector< QueuedPlayer > &vecQueued = m_vecQueued[ iBucket ];
+	DropRemoved( iBucket );
+
+	// Whoever has waited longest goes first, if the match is close enough to
+	// their own rating for how long they have waited.  New matches come first,
+	// only players who have been through a match pass without one are taken.
+	m_vecOrder.clear();
+	for ( int i = 0; i < (int)vecQueued.size(); ++i )
+	{
+		const QueuedPlayer &player = vecQueued[ i ];
+		if ( usecNow - player.m_usecQueued < k_nQueueTickMS * 1000 )
+			continue;
+		float flWindow = m_flInitialWindow + m_flWindowGrowth * ( usecNow - player.m_usecQueued ) * 1e-6f;
+		if ( flRating < 0.0f || fabsf( player.m_flRating - flRating ) <= flWindow )
+			m_vecOrder.push_back( i );
+	}
+	if ( (int)m_vecOrder.size() > nSlots )
+	{
+		std::partial_sort( m_vecOrder.begin(), m_vecOrder.begin() + nSlots, m_vecOrder.end(), [&vecQueued]( int a, int b ) {
+			return vecQueued[ a ].m_usecQueued < vecQueued[ b ].m_usecQueued;
+		} );
+		m_vecOrder.resize( nSlots );
+	}
+	if ( m_vecOrder.empty() )
+		return 0;
+
+	for ( int i: m_vecOrder )
+	{
+		const QueuedPlayer &player = vecQueued[ i ];
+		match.m_players[ match.m_nPlayers++ ] = player;
+		m_QueueTimes[ iBucket ].Add( usecNow - player.m_usecQueued, flRating < 0.0f ? 0.0f : fabsf( player.m_flRating - flRating ) );
+		m_mapTickets.Remove( player.m_iClient );
+	}
+	m_nWaiting[ iBucket ] -= match.m_nPlayers;
+
+	// The entries go on the next look at the bucket, like after Remove
+	return match.m_nPlayers;
+}
@@ -0,0 +1,147 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Matchmaking queue that groups players of similar skill
+//
+//=============================================================================
+
+#ifndef MM_SKILLQUEUE_H
+#define MM_SKILLQUEUE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <vector>
+#include <atomic>
+#include "mm_shared.h"
+#include "mm_flat_map.h"
+#include "mm_metrics.h"
+
+struct QueuedPlayer
+{
+	int m_iClient;
+	HSteamNetConnection m_hConn;
+	float m_flRating;
+	SteamNetworkingMicroseconds m_usecQueued;
+	uint32 m_nTicket;
+};
+
+/// Players the queue decided should play together
+struct SkillMatch
+{
+	int m_iBucket;
+	int m_nPlayers;
+	QueuedPlayer m_players[ k_nMaxLobbyPlayers ];
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// QueueTimeHistogram
+//
+// How long players waited before they were matched, and how far apart the
+// ratings of the players they were matched with were.  Written by the thread
+// that owns the queue, and safe to read from any other thread.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class QueueTimeHistogram
+{
+public:
+	QueueTimeHistogram();
+
+	void Add( SteamNetworkingMicroseconds usecWaited, float flRatingSpread );
+
+	uint32 GetCount() const { return (uint32)m_Times.GetCount(); }
+	SteamNetworkingMicroseconds GetMax() const { return m_Times.GetMax(); }
+	float GetAverageSpread() const;
+
+	/// Upper bound on the time the given fraction of players waited at most
+	SteamNetworkingMicroseconds GetPercentile( float flFraction ) const { return m_Times.GetPercentile( flFraction ); }
+
+	const LatencyHistogram &GetTimes() const { return m_Times; }
+
+private:
+	LatencyHistogram m_Times;
+	std::atomic< uint64 > m_nTotalSpread;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// SkillQueue
+//
+// Players searching for a match wait here, by map and gamemode bucket,
+// instead of dropping into the first lobby that has room.  Every
+// k_nQueueTickMS all of them are matched in one go: starting with whoever
+// has waited longest, each player is grouped with the neighbours closest to
+// their rating, as long as the spread of the group fits in every member's
+// window.  Windows start narrow and widen the longer a player waits, so
+// busy buckets make close matches and quiet ones still get people playing.
+// Not thread safe, every queue belongs to exactly one thread.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class SkillQueue
+{
+public:
+	SkillQueue();
+
+	void SetPlayersPerMatch( int nPlayers ) { m_nPlayersPerMatch = nPlayers; }
+
+	/// Rating difference accepted right away, and how much it widens per second waited
+	void SetWindow( float flInitial, float flGrowthPerSec );
+	float GetInitialWindow() const { return m_flInitialWindow; }
+	float GetWindowGrowth() const { return m_flWindowGrowth; }
+
+	/// Puts the player in the bucket's queue, taking them out of any queue they were in
+	void Add( int iBucket, int iClient, HSteamNetConnection hConn, float flRating, SteamNetworkingMicroseconds usecNow );
+
+	/// Returns false if they weren't queued
+	bool Remove( int iClient );
+	bool IsQueued( int iClient ) const { return m_mapTickets.Find( iClient ) != nullptr; }
+
+	/// Forms every match it can and appends them to vecMatches.  Only does
+	/// anything once every k_nQueueTickMS.  Returns the number of matches.
+	int Match( SteamNetworkingMicroseconds usecNow, std::vector< SkillMatch > &vecMatches );
+
+	/// Takes up to nSlots players out of the bucket for a match that's already
+	/// on, longest waiting first, as long as flRating is in their window.  A
+	/// negative flRating takes anybody.  Returns the number of players put in
+	/// match.  Call after Match, so players who can make a match of their own
+	/// get one.
+	int Backfill( int iBucket, float flRating, int nSlots, SteamNetworkingMicroseconds usecNow, SkillMatch &match );
+
+	int GetNumWaiting( int iBucket ) const { return m_nWaiting[ iBucket ]; }
+	const QueueTimeHistogram &GetQueueTimes( int iBucket ) const { return m_QueueTimes[ iBucket ]; }
+
+private:
+	void MatchBucket( int iBucket, SteamNetworkingMicroseconds usecNow, std::vector< SkillMatch > &vecMatches );
+	void DropRemoved( int iBucket );
+
+	std::vector< QueuedPlayer > m_vecQueued[ k_nNumLobbyBuckets ];
+
+	// Ticket of each queued player's latest Add.  Entries whose ticket doesn't
+	// match any more were removed and are dropped on the next Match.
+	struct QueueTicket
+	{
+		uint32 m_nTicket;
+		int m_iBucket;
+	};
+	FlatHashMap< QueueTicket > m_mapTickets;
+	uint32 m_nNextTicket;
+
+	int m_nPlayersPerMatch;
+	float m_flInitialWindow;
+	float m_flWindowGrowth;
+	SteamNetworkingMicroseconds m_usecNextMatch;
+
+	std::atomic< int > m_nWaiting[ k_nNumLobbyBuckets ];
+	QueueTimeHistogram m_QueueTimes[ k_nNumLobbyBuckets ];
+
+	// Scratch space for MatchBucket
+	std::vector< int > m_vecOrder;
+	std::vector< int > m_vecPrev;
+	std::vector< int > m_vecNext;
+	std::vector< float > m_vecWindows;
+	std::vector< bool > m_vecMatched;
+};
+
+#endif
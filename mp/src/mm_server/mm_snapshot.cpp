@@ -0,0 +1,394 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Snapshots of the matchmaker's state, for restarts
+//
+//=============================================================================
+
+#include "cbase.h"
+#include "mm_snapshot.h"
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+static const uint32 k_nSnapshotMagic = 0x4E534D4D;	// "MMSN"
+static const uint32 k_nSnapshotVersion = 1;
+
+// Magic, version, sequence, wall clock time, record counts, padding, and the
+// sequence again in the last 4 bytes
+static const uint32 k_cbHeader = 64;
+static const uint32 k_nSequenceOffset = 8;
+static const uint32 k_nSequenceEndOffset = k_cbHeader - 4;
+
+// Fixed size strings, always '\0' terminated
+static const uint32 k_cbAddress = SteamNetworkingIPAddr::k_cchMaxString;
+static const uint32 k_cbPassword = 64;
+
+// Token, Steam ID, nick, rating, lobby, search bucket, search time
+static const uint32 k_cbClientRecord = 8 + 8 + k_cchMaxNick + 4 + 4 + 4 + 8;
+
+// ID, map, team DM, filled time
+static const uint32 k_cbLobbyRecord = 4 + 4 + 1 + 8;
+
+// Address, port, password, capacity, state, map, team DM, lobby, match time
+static const uint32 k_cbGameServerRecord = k_cbAddress + 2 + k_cbPassword + 4 + 1 + 4 + 1 + 4 + 8;
+
+// Unchanged data is found and skipped in blocks of this size
+static const size_t k_cbCompareBlock = 64;
+
+// Room for a few hundred players to start with, it doubles when it runs out
+static const size_t k_cbInitialFile = 64 * 1024;
+
+static uint64 GetWallClockMS()
+{
+	return (uint64)std::chrono::duration_cast< std::chrono::milliseconds >( std::chrono::system_clock::now().time_since_epoch() ).count();
+}
+
+static void WriteFixedString( WireWriter &writer, const char *psz, uint32 cbField )
+{
+	char buf[ 256 ];
+	memset( buf, 0, cbField );
+	strncpy( buf, psz, cbField - 1 );
+	writer.WriteBytes( buf, cbField );
+}
+
+static bool ReadFixedString( WireReader &reader, char *pszOut, uint32 cbField )
+{
+	if ( !reader.ReadBytes( pszOut, cbField ) )
+		return false;
+	pszOut[ cbField - 1 ] = '\0';
+	return true;
+}
+
+// Times are wall clock ms, 0 for something that never happened.  Writing
+// them goes through the same offset every time, so a time that didn't change
+// is written the same way and its record doesn't have to be copied again.
+static void WriteTime( WireWriter &writer, SteamNetworkingMicroseconds usecWhen, int64 nWallClockOffsetMS )
+{
+	writer.WriteUint64( usecWhen ? (uint64)( nWallClockOffsetMS + usecWhen / 1000 ) : 0 );
+}
+
+static bool ReadTime( WireReader &reader, SteamNetworkingMicroseconds &usecWhen, uint64 nNowMS, SteamNetworkingMicroseconds usecNow )
+{
+	uint64 nWhenMS;
+	if ( !reader.ReadUint64( nWhenMS ) )
+		return false;
+	usecWhen = nWhenMS ? usecNow - ( (int64)nNowMS - (int64)nWhenMS ) * 1000 : 0;
+	return true;
+}
+
+static void WriteFloat( WireWriter &writer, float flValue )
+{
+	uint32 nBits;
+	memcpy( &nBits, &flValue, sizeof(nBits) );
+	writer.WriteUint32( nBits );
+}
+
+static bool ReadFloat( WireReader &reader, float &flValue )
+{
+	uint32 nBits;
+	if ( !reader.ReadUint32( nBits ) )
+		return false;
+	memcpy( &flValue, &nBits, sizeof(flValue) );
+	return true;
+}
+
+static bool ReadMapAndTeamDM( WireReader &reader, HL2DM_Map &map, char &bTeamDM )
+{
+	uint32 nMap;
+	uint8 nTeamDM;
+	if ( !reader.ReadUint32( nMap ) || nMap > (uint32)invalid_map || !reader.ReadUint8( nTeamDM ) )
+		return false;
+	map = (HL2DM_Map)nMap;
+	bTeamDM = (char)nTeamDM;
+	return bTeamDM == -1 || bTeamDM == 0 || bTeamDM == 1;
+}
+
+SnapshotFile::SnapshotFile()
+{
+#ifdef _WIN32
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hMapping = nullptr;
+#else
+	m_nFD = -1;
+#endif
+	m_pMapped = nullptr;
+	m_cbMapped = 0;
+	m_nSequence = 0;
+	m_nWallClockOffsetMS = 0;
+	m_nWrites = 0;
+	m_nBytesEncoded = 0;
+	m_nBytesCopied = 0;
+}
+
+SnapshotFile::~SnapshotFile()
+{
+	Close();
+}
+
+bool SnapshotFile::Open( const char *pszPath, std::string &sError )
+{
+	Close();
+	size_t cbFile = 0;
+#ifdef _WIN32
+	m_hFile = CreateFileA( pszPath, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr );
+	if ( m_hFile == INVALID_HANDLE_VALUE )
+	{
+		sError = "can't open file, error " + std::to_string( GetLastError() );
+		return false;
+	}
+	LARGE_INTEGER size;
+	if ( GetFileSizeEx( (HANDLE)m_hFile, &size ) )
+		cbFile = (size_t)size.QuadPart;
+#else
+	m_nFD = open( pszPath, O_RDWR | O_CREAT | O_CLOEXEC, 0600 );
+	if ( m_nFD < 0 )
+	{
+		sError = strerror( errno );
+		return false;
+	}
+	struct stat st;
+	if ( fstat( m_nFD, &st ) == 0 )
+		cbFile = (size_t)st.st_size;
+#endif
+
+	if ( !Map( std::max( cbFile, k_cbInitialFile ) ) )
+	{
+		sError = "can't map file";
+		Close();
+		return false;
+	}
+
+	// Carry on from the last run's sequence, so a write we cut off never matches
+	uint32 nMagic = 0, nSequence = 0;
+	WireReader( m_pMapped, k_cbHeader ).ReadUint32( nMagic );
+	WireReader( m_pMapped + k_nSequenceEndOffset, 4 ).ReadUint32( nSequence );
+	m_nSequence = nMagic == k_nSnapshotMagic ? nSequence : 0;
+	return true;
+}
+
+void SnapshotFile::Close()
+{
+	if ( m_pMapped )
+	{
+#ifdef _WIN32
+		FlushViewOfFile( m_pMapped, m_cbMapped );
+		FlushFileBuffers( (HANDLE)m_hFile );
+#else
+		msync( m_pMapped, m_cbMapped, MS_SYNC );
+#endif
+	}
+	Unmap();
+#ifdef _WIN32
+	if ( m_hFile != INVALID_HANDLE_VALUE )
+		CloseHandle( (HANDLE)m_hFile );
+	m_hFile = INVALID_HANDLE_VALUE;
+#else
+	if ( m_nFD >= 0 )
+		close( m_nFD );
+	m_nFD = -1;
+#endif
+}
+
+bool SnapshotFile::Map( size_t cbFile )
+{
+	Unmap();
+#ifdef _WIN32
+	m_hMapping = CreateFileMappingA( (HANDLE)m_hFile, nullptr, PAGE_READWRITE, (DWORD)( (uint64)cbFile >> 32 ), (DWORD)cbFile, nullptr );
+	if ( !m_hMapping )
+		return false;
+	m_pMapped = (uint8*)MapViewOfFile( (HANDLE)m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, cbFile );
+	if ( !m_pMapped )
+		return false;
+#else
+	struct stat st;
+	if ( fstat( m_nFD, &st ) != 0 )
+		return false;
+	if ( (size_t)st.st_size < cbFile && ftruncate( m_nFD, (off_t)cbFile ) != 0 )
+		return false;
+	void *pMapped = mmap( nullptr, cbFile, PROT_READ | PROT_WRITE, MAP_SHARED, m_nFD, 0 );
+	if ( pMapped == MAP_FAILED )
+		return false;
+	m_pMapped = (uint8*)pMapped;
+#endif
+	m_cbMapped = cbFile;
+	return true;
+}
+
+void SnapshotFile::Unmap()
+{
+#ifdef _WIN32
+	if ( m_pMapped )
+		UnmapViewOfFile( m_pMapped );
+	if ( m_hMapping )
+		CloseHandle( (HANDLE)m_hMapping );
+	m_hMapping = nullptr;
+#else
+	if ( m_pMapped )
+		munmap( m_pMapped, m_cbMapped );
+#endif
+	m_pMapped = nullptr;
+	m_cbMapped = 0;
+}
+
+bool SnapshotFile::Load( MatchmakerSnapshot &snapshot, SteamNetworkingMicroseconds usecNow, SteamNetworkingMicroseconds &usecDowntime )
+{
+	snapshot.m_vecClients.clear();
+	snapshot.m_vecLobbies.clear();
+	snapshot.m_vecGameServers.clear();
+	if ( !m_pMapped )
+		return false;
+
+	WireReader header( m_pMapped, k_cbHeader );
+	uint32 nMagic, nVersion, nSequence, nSequenceEnd, nClients, nLobbies, nGameServers;
+	uint64 nWallClockMS;
+	if ( !header.ReadUint32( nMagic ) || !header.ReadUint32( nVersion ) || !header.ReadUint32( nSequence ) || !header.ReadUint64( nWallClockMS ) ||
+		!header.ReadUint32( nClients ) || !header.ReadUint32( nLobbies ) || !header.ReadUint32( nGameServers ) )
+		return false;
+	if ( !WireReader( m_pMapped + k_nSequenceEndOffset, 4 ).ReadUint32( nSequenceEnd ) )
+		return false;
+	if ( nMagic != k_nSnapshotMagic || nVersion != k_nSnapshotVersion || nSequence != nSequenceEnd )
+		return false;
+	uint64 cbRecords = (uint64)nClients * k_cbClientRecord + (uint64)nLobbies * k_cbLobbyRecord + (uint64)nGameServers * k_cbGameServerRecord;
+	if ( k_cbHeader + cbRecords > m_cbMapped )
+		return false;
+
+	uint64 nNowMS = GetWallClockMS();
+	usecDowntime = nNowMS > nWallClockMS ? (SteamNetworkingMicroseconds)( nNowMS - nWallClockMS ) * 1000 : 0;
+
+	WireReader reader( m_pMapped + k_cbHeader, (uint32)cbRecords );
+	for ( uint32 i = 0; i < nClients; ++i )
+	{
+		SnapshotClient client;
+		uint32 nBucket;
+		if ( !reader.ReadUint64( client.m_nResumeToken ) || !reader.ReadUint64( client.m_steamID ) || !ReadFixedString( reader, client.m_szNick, k_cchMaxNick ) ||
+			!ReadFloat( reader, client.m_flRating ) || !reader.ReadUint32( client.m_hLobby ) || !reader.ReadUint32( nBucket ) ||
+			!ReadTime( reader, client.m_usecSearchStarted, nNowMS, usecNow ) )
+			return false;
+		client.m_iSearchBucket = (int)nBucket;
+		if ( client.m_iSearchBucket < -1 || client.m_iSearchBucket >= k_nNumLobbyBuckets )
+			return false;
+		snapshot.m_vecClients.push_back( client );
+	}
+	for ( uint32 i = 0; i < nLobbies; ++i )
+	{
+		SnapshotLobby lobby;
+		if ( !reader.ReadUint32( lobby.m_hLobbyID ) || !ReadMapAndTeamDM( reader, lobby.m_map, lobby.m_bTeamDM ) || !ReadTime( reader, lobby.m_usecFilled, nNowMS, usecNow ) )
+			return false;
+		snapshot.m_vecLobbies.push_back( lobby );
+	}
+	for ( uint32 i = 0; i < nGameServers; ++i )
+	{
+		SnapshotGameServer server;
+		char szAddr[ k_cbAddress ];
+		char szPass[ k_cbPassword ];
+		uint16 nPort;
+		uint32 nCapacity;
+		uint8 nState;
+		if ( !ReadFixedString( reader, szAddr, k_cbAddress ) || !reader.ReadUint16( nPort ) || !ReadFixedString( reader, szPass, k_cbPassword ) ||
+			!reader.ReadUint32( nCapacity ) || !reader.ReadUint8( nState ) || nState > game_server_draining ||
+			!ReadMapAndTeamDM( reader, server.m_map, server.m_bTeamDM ) || !reader.ReadUint32( server.m_hLobby ) ||
+			!ReadTime( reader, server.m_usecMatchStarted, nNowMS, usecNow ) )
+			return false;
+		server.m_addr.addr = szAddr;
+		server.m_addr.port = nPort;
+		server.m_addr.pass = szPass;
+		server.m_nCapacity = (int)nCapacity;
+		server.m_eState = (GameServerState)nState;
+		snapshot.m_vecGameServers.push_back( server );
+	}
+	return true;
+}
+
+bool SnapshotFile::Write( const MatchmakerSnapshot &snapshot, SteamNetworkingMicroseconds usecNow )
+{
+	if ( !m_pMapped )
+		return false;
+	if ( !m_nWallClockOffsetMS )
+		m_nWallClockOffsetMS = (int64)GetWallClockMS() - usecNow / 1000;
+
+	size_t cbRecords = snapshot.m_vecClients.size() * k_cbClientRecord + snapshot.m_vecLobbies.size() * k_cbLobbyRecord + snapshot.m_vecGameServers.size() * k_cbGameServerRecord;
+	if ( k_cbHeader + cbRecords > m_cbMapped && !Map( std::max( k_cbHeader + cbRecords, m_cbMapped * 2 ) ) )
+		return false;
+
+	m_vecScratch.resize( cbRecords );
+	WireWriter writer( m_vecScratch.data(), (uint32)cbRecords );
+	for ( const SnapshotClient &client: snapshot.m_vecClients )
+	{
+		writer.WriteUint64( client.m_nResumeToken );
+		writer.WriteUint64( client.m_steamID );
+		WriteFixedString( writer, client.m_szNick, k_cchMaxNick );
+		WriteFloat( writer, client.m_flRating );
+		writer.WriteUint32( client.m_hLobby );
+		writer.WriteUint32( (uint32)client.m_iSearchBucket );
+		WriteTime( writer, client.m_usecSearchStarted, m_nWallClockOffsetMS );
+	}
+	for ( const SnapshotLobby &lobby: snapshot.m_vecLobbies )
+	{
+		writer.WriteUint32( lobby.m_hLobbyID );
+		writer.WriteUint32( (uint32)lobby.m_map );
+		writer.WriteUint8( (uint8)lobby.m_bTeamDM );
+		WriteTime( writer, lobby.m_usecFilled, m_nWallClockOffsetMS );
+	}
+	for ( const SnapshotGameServer &server: snapshot.m_vecGameServers )
+	{
+		WriteFixedString( writer, server.m_addr.addr.c_str(), k_cbAddress );
+		writer.WriteUint16( (uint16)server.m_addr.port );
+		WriteFixedString( writer, server.m_addr.pass.c_str(), k_cbPassword );
+		writer.WriteUint32( (uint32)server.m_nCapacity );
+		writer.WriteUint8( (uint8)server.m_eState );
+		writer.WriteUint32( (uint32)server.m_map );
+		writer.WriteUint8( (uint8)server.m_bTeamDM );
+		writer.WriteUint32( server.m_hLobby );
+		WriteTime( writer, server.m_usecMatchStarted, m_nWallClockOffsetMS );
+	}
+
+	uint8 header[ k_cbHeader ];
+	WireWriter headerWriter( header, k_cbHeader );
+	++m_nSequence;
+	headerWriter.WriteUint32( k_nSnapshotMagic );
+	headerWriter.WriteUint32( k_nSnapshotVersion );
+	headerWriter.WriteUint32( m_nSequence );
+	headerWriter.WriteUint64( (uint64)( m_nWallClockOffsetMS + usecNow / 1000 ) );
+	headerWriter.WriteUint32( (uint32)snapshot.m_vecClients.size() );
+	headerWriter.WriteUint32( (uint32)snapshot.m_vecLobbies.size() );
+	headerWriter.WriteUint32( (uint32)snapshot.m_vecGameServers.size() );
+	headerWriter.PadToEnd();
+	WireWriter( header + k_nSequenceEndOffset, 4 ).WriteUint32( m_nSequence );
+
+	// The new sequence goes in front before anything else changes and at the
+	// end once everything has, so a half written snapshot never matches.
+	// Nobody else reads the mapping while we run, the stores only have to
+	// stay in order as far as the compiler is concerned.
+	memcpy( m_pMapped + k_nSequenceOffset, header + k_nSequenceOffset, 4 );
+	std::atomic_signal_fence( std::memory_order_seq_cst );
+
+	uint8 *pRecords = m_pMapped + k_cbHeader;
+	for ( size_t iBlock = 0; iBlock < cbRecords; iBlock += k_cbCompareBlock )
+	{
+		size_t cbBlock = std::min( k_cbCompareBlock, cbRecords - iBlock );
+		if ( memcmp( pRecords + iBlock, m_vecScratch.data() + iBlock, cbBlock ) == 0 )
+			continue;
+		memcpy( pRecords + iBlock, m_vecScratch.data() + iBlock, cbBlock );
+		m_nBytesCopied += cbBlock;
+	}
+	std::atomic_signal_fence( std::memory_order_seq_cst );
+
+	memcpy( m_pMapped, header, k_nSequenceEndOffset );
+	std::atomic_signal_fence( std::memory_order_seq_cst );
+	memcpy( m_pMapped + k_nSequenceEndOffset, header + k_nSequenceEndOffset, 4 );
+
+	++m_nWrites;
+	m_nBytesEncoded += k_cbHeader + cbRecords;
+	return true;
+}
@@ -0,0 +1,129 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Snapshots of the matchmaker's state, for restarts
+//
+//=============================================================================
+
+#ifndef MM_SNAPSHOT_H
+#define MM_SNAPSHOT_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <steam/steamnetworkingtypes.h>
+#include <string>
+#include <vector>
+#include "mm_shared.h"
+#include "mm_gameservers.h"
+
+// Times below are local timestamps, 0 if it never happened.  The file keeps
+// them as wall clock time, and Load turns them back into timestamps of the
+// new process, so the time the server was down counts as time waited.
+
+/// A connected player, or one that hasn't come back since the last restart
+struct SnapshotClient
+{
+	uint64 m_nResumeToken;
+	uint64 m_steamID;
+	char m_szNick[ k_cchMaxNick ];
+	float m_flRating;
+	HLobbyID m_hLobby;			// invalid_lobby if they weren't in one
+	int m_iSearchBucket;		// -1 if they weren't searching
+	SteamNetworkingMicroseconds m_usecSearchStarted;
+};
+
+struct SnapshotLobby
+{
+	HLobbyID m_hLobbyID;
+	HL2DM_Map m_map;
+	char m_bTeamDM;
+	SteamNetworkingMicroseconds m_usecFilled;
+};
+
+struct SnapshotGameServer
+{
+	srcon_addr m_addr;
+	int m_nCapacity;
+	GameServerState m_eState;
+	HL2DM_Map m_map;
+	char m_bTeamDM;
+	HLobbyID m_hLobby;
+	SteamNetworkingMicroseconds m_usecMatchStarted;
+};
+
+struct MatchmakerSnapshot
+{
+	std::vector< SnapshotClient > m_vecClients;
+	std::vector< SnapshotLobby > m_vecLobbies;
+	std::vector< SnapshotGameServer > m_vecGameServers;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// SnapshotFile
+//
+// The state lives in a memory mapped file as fixed size records, so a
+// snapshot costs no system calls at all: Write encodes everything into a
+// scratch buffer and copies over only the blocks that differ from what is
+// already mapped, which between two snapshots a few hundred ms apart is
+// mostly nothing.  Once the stores are done the data is in the page cache,
+// where it survives the process crashing or being killed.  Only Close waits
+// for it to reach the disk.
+//
+// The header carries a sequence number at either end of each write, so a
+// snapshot that was cut off halfway is recognised and ignored.  The file has
+// RCON passwords in it and is created readable by its owner only.  Main
+// thread only.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+class SnapshotFile
+{
+public:
+	SnapshotFile();
+	~SnapshotFile();
+
+	/// Opens or creates the file, leaving whatever is in it for Load
+	bool Open( const char *pszPath, std::string &sError );
+
+	/// Syncs the last snapshot to disk and unmaps the file
+	void Close();
+	bool IsOpen() const { return m_pMapped != nullptr; }
+
+	/// Reads the last snapshot in the file.  usecDowntime is how long ago it
+	/// was written.  Returns false if there is none, or it's damaged.
+	bool Load( MatchmakerSnapshot &snapshot, SteamNetworkingMicroseconds usecNow, SteamNetworkingMicroseconds &usecDowntime );
+
+	/// Replaces the snapshot in the file.  Returns false if the file couldn't
+	/// grow to fit it.
+	bool Write( const MatchmakerSnapshot &snapshot, SteamNetworkingMicroseconds usecNow );
+
+	uint64 GetNumWrites() const { return m_nWrites; }
+	uint64 GetNumBytesEncoded() const { return m_nBytesEncoded; }
+	uint64 GetNumBytesCopied() const { return m_nBytesCopied; }
+	size_t GetFileSize() const { return m_cbMapped; }
+
+private:
+	bool Map( size_t cbFile );
+	void Unmap();
+
+#ifdef _WIN32
+	void *m_hFile;
+	void *m_hMapping;
+#else
+	int m_nFD;
+#endif
+	uint8 *m_pMapped;
+	size_t m_cbMapped;
+	uint32 m_nSequence;
+
+	// Wall clock time in ms at local timestamp 0
+	int64 m_nWallClockOffsetMS;
+	std::vector< uint8 > m_vecScratch;
+
+	uint64 m_nWrites;
+	uint64 m_nBytesEncoded;
+	uint64 m_nBytesCopied;
+};
+
+#endif
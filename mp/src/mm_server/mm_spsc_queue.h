@@ -0,0 +1,83 @@
+//====== Copyright Buster Bunny, All rights reserved. ====================
+//
+// Purpose:		Lock-free single producer, single consumer queue
+//
+//=============================================================================
+
+#ifndef MM_SPSC_QUEUE_H
+#define MM_SPSC_QUEUE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// SPSCQueue
+//
+// Fixed size ring buffer for handing items from exactly one thread to exactly
+// one other thread without taking a lock.  Push fails when the ring is full,
+// it's up to the producer to hold on to the item and try again later.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+template< typename T >
+class SPSCQueue
+{
+public:
+	/// nCapacity is rounded up to a power of two
+	explicit SPSCQueue( size_t nCapacity )
+	{
+		size_t nSize = 1;
+		while ( nSize < nCapacity )
+			nSize <<= 1;
+		m_vecItems.resize( nSize );
+		m_nMask = nSize - 1;
+		m_nHead.store( 0, std::memory_order_relaxed );
+		m_nTail.store( 0, std::memory_order_relaxed );
+	}
+
+	/// Producer thread only
+	bool Push( const T &item )
+	{
+		size_t nTail = m_nTail.load( std::memory_order_relaxed );
+		if ( nTail - m_nHead.load( std::memory_order_acquire ) > m_nMask )
+			return false;
+		m_vecItems[ nTail & m_nMask ] = item;
+		m_nTail.store( nTail + 1, std::memory_order_release );
+		return true;
+	}
+
+	/// Consumer thread only
+	bool Pop( T &item )
+	{
+		size_t nHead = m_nHead.load( std::memory_order_relaxed );
+		if ( nHead == m_nTail.load( std::memory_order_acquire ) )
+			return false;
+		item = m_vecItems[ nHead & m_nMask ];
+		m_nHead.store( nHead + 1, std::memory_order_release );
+		return true;
+	}
+
+	/// Only a hint when called from the producer
+	bool Empty() const
+	{
+		return m_nHead.load( std::memory_order_acquire ) == m_nTail.load( std::memory_order_acquire );
+	}
+
+private:
+	std::vector< T > m_vecItems;
+	size_t m_nMask;
+
+	// Kept on separate cache lines so the two threads don't fight over them
+	char m_pad0[ 64 ];
+	std::atomic< size_t > m_nHead;
+	char m_pad1[ 64 ];
+	std::atomic< size_t > m_nTail;
+	char m_pad2[ 64 ];
+};
+
+#endif